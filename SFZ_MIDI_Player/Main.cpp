@@ -8,10 +8,32 @@
 #include <SampleSource.hpp>
 #include <AudioLoadManager.hpp>
 #include <MemoryPool.hpp>
+#include <SampleCache.hpp>
+#include <FileHandleCache.hpp>
+#include <InstrumentCache.hpp>
+#include <SongCache.hpp>
+#include <NoteEventList.hpp>
 #include <AudioStreamRenderer.hpp>
 #include <Program.hpp>
+#include <Benchmark.hpp>
 
-#ifndef DEBUG_MODE
+#if defined(BENCHMARK_MODE)
+
+void Main()
+{
+	Console << U"";
+
+	MemoryPool::i(MemoryPool::ReadFile).setCapacity(16ull << 20);
+	MemoryPool::i(MemoryPool::RenderAudio).setCapacity(4ull << 20);
+
+	RunBenchmarks();
+
+	while (System::Update())
+	{
+	}
+}
+
+#elif !defined(DEBUG_MODE)
 
 void Main()
 {
@@ -31,6 +53,22 @@ void Main()
 
 	MemoryPool::i(MemoryPool::ReadFile).setCapacity(16ull << 20);
 	MemoryPool::i(MemoryPool::RenderAudio).setCapacity(4ull << 20);
+	FileHandleCache::i().setCapacity(256);
+
+	// ノートの多いMIDIでは、これを超えたイベントを退避ファイルに追い出す
+	NoteEventSpill::i().setup(U"cache/spill/", 512ull << 20);
+
+#ifdef USE_SAMPLE_CACHE
+	SampleCache::i().setup(U"cache/samples/", 4ull << 30);
+#endif
+
+#ifdef USE_INSTRUMENT_CACHE
+	InstrumentCache::i().setup(U"cache/instruments/");
+#endif
+
+#ifdef USE_SONG_CACHE
+	SongCache::i().setup(U"cache/songs/");
+#endif
 
 	SamplePlayer player{ keyboardArea };
 	player.loadSoundSet(U"default.toml");
@@ -49,15 +87,65 @@ void Main()
 	Graphics::SetVSyncEnabled(false);
 	bool isMute = false;
 
+	// MIDIを読み込み中で、先頭の区間が揃うのを待っている
+	bool isWaitingForStart = false;
+
+	// 再生を始めるまでに登録しておく長さ
+	const int64 startMarginSampleCount = Wave::DefaultSampleRate * 3;
+
+	// 読み込んだMIDIファイルを監視し、書き換えられたら変わった音源だけを登録し直す
+	FilePath midiPath;
+	DirectoryWatcher midiWatcher;
+
+	// 書き出し中のファイルを読まないように、最後の変更からしばらく待ってから読み込む
+	Stopwatch midiChangedTimer;
+	const int64 midiReloadDelayMillisec = 300;
+
+	// MIDIを読み込み直したとき、再生位置からこのサンプル数より先のバッファだけを描画し直す
+	const int64 reloadMarginSampleCount = Wave::DefaultSampleRate / 4;
+
+	// 上下キーで変える再生速度の幅
+	const double playbackRateStep = 0.1;
+	const double minPlaybackRate = 0.5;
+	const double maxPlaybackRate = 2.0;
+
 	auto& renderer = AudioStreamRenderer::i();
 
+	// 読み込み直しが終わっていたら、鳴り方が変わるところから先だけを描画し直す（再生位置はそのまま）
+	const auto takeMidiReload = [&]()
+	{
+		Optional<int64> changedFrom;
+		if (player.takeMidiReload(midiData, changedFrom) && changedFrom)
+		{
+			const int64 discardFrom = Max(changedFrom.value() - static_cast<int64>(MemoryPool::UnitBlockSampleLength), static_cast<int64>(audioStream->m_pos) + reloadMarginSampleCount);
+			renderer.discardFrom(discardFrom);
+		}
+	};
+
 	auto renderUpdate = [&]()
 	{
 		const size_t bufferSampleCount = Wave::DefaultSampleRate;
 
+		// サウンドセットを差し替えたとき、再生位置からこのサンプル数より先のバッファを描画し直す
+		const int64 swapMarginSampleCount = Wave::DefaultSampleRate / 4;
+
 		while (!renderer.isFinish())
 		{
-			while (renderer.isPlaying() && !(renderer.bufferBeginSample() <= static_cast<int64>(audioStream->m_pos) && static_cast<int64>(audioStream->m_pos + bufferSampleCount) < renderer.bufferEndSample()))
+			// 描画するブロックの合間に差し替えるので、1つのブロックに新旧の音源が混ざることはない
+			if (player.applyPendingSoundSet())
+			{
+				renderer.discardFrom(static_cast<int64>(audioStream->m_pos) + swapMarginSampleCount);
+			}
+
+			// 再生速度を変えたところから先は、ノートの位置が変わるので描画し直す
+			const int64 rateChangeFrom = static_cast<int64>(audioStream->m_pos) + swapMarginSampleCount;
+			if (player.applyPendingPlaybackRate(rateChangeFrom))
+			{
+				renderer.discardFrom(rateChangeFrom);
+			}
+
+			// MIDIを読み込み中は、イベントの登録が済んだところまでしか描画しない
+			while (renderer.isPlaying() && renderer.bufferEndSample() + static_cast<int64>(MemoryPool::UnitBlockSampleLength) <= player.renderableUntil() && !(renderer.bufferBeginSample() <= static_cast<int64>(audioStream->m_pos) && static_cast<int64>(audioStream->m_pos + bufferSampleCount) < renderer.bufferEndSample()))
 			{
 				//Console << U"bufferBeginSample: " << renderer.bufferBeginSample() << U", currentPosSample: " << pianoRoll.currentPosSample() << U", bufferEndSample: " << renderer.bufferEndSample();
 				renderer.update(player);
@@ -80,6 +168,8 @@ void Main()
 		}
 #endif
 
+		player.updateSoundSetLoading();
+
 		if (KeyM.down())
 		{
 			isMute = !isMute;
@@ -97,39 +187,61 @@ void Main()
 				renderer.pause();
 				audioStream->reset();
 
-				midiData = LoadMidi(filepath.path);
-				player.loadMidiData(midiData.value());
-				renderer.playRestart();
-				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				// 先頭から少しずつ読み込み、最初の数秒が揃ったところで再生を始める
+				midiData.reset();
+				isWaitingForStart = player.loadMidiStream(filepath.path);
+				if (!isWaitingForStart)
+				{
+					Print << U"MIDIファイルの読み込みに失敗しました";
+				}
 
-				pianoRoll.playRestart();
-				audio.play();
+				midiPath = FileSystem::FullPath(filepath.path);
+				midiWatcher = DirectoryWatcher{ FileSystem::ParentPath(midiPath) };
+				midiChangedTimer.reset();
 			}
 			else if (U"toml" == FileSystem::Extension(filepath.path))
 			{
-				const bool isPlaying = pianoRoll.isPlaying();
-				if (isPlaying)
-				{
-					audio.pause();
-					pianoRoll.pause();
-				}
+				// イベントは読み込み中のサウンドセットにも登録するので、MIDIを最後まで読み込んでおく
+				player.waitMidiStream();
+				player.takeMidiChunks(midiData);
+				player.waitMidiReload();
+				takeMidiReload();
+
+				// 再生を止めずにバックグラウンドで読み込み、描画スレッドで差し替える
+				player.loadSoundSetAsync(filepath.path, midiData);
+			}
+		}
 
-				player.loadSoundSet(filepath.path);
-				if (midiData)
-				{
-					player.loadMidiData(midiData.value());
-				}
-				renderer.clearBuffer();
-				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		player.takeMidiChunks(midiData);
 
-				if (isPlaying)
-				{
-					pianoRoll.resume();
-					audio.play();
-				}
+		for (const auto& change : midiWatcher.retrieveChanges())
+		{
+			if (change.action != FileAction::Removed && NormalizePath(change.path) == NormalizePath(midiPath))
+			{
+				midiChangedTimer.restart();
 			}
 		}
 
+		// 前のMIDIを最後まで読み込み、前の読み込み直しも終わってからバックグラウンドで比べる（それまではタイマーを止めずに待つ）
+		if (midiChangedTimer.isRunning() && midiReloadDelayMillisec <= midiChangedTimer.ms() && midiData
+			&& player.reloadMidiAsync(midiPath, midiData.value()))
+		{
+			midiChangedTimer.reset();
+		}
+
+		takeMidiReload();
+
+		if (isWaitingForStart && (startMarginSampleCount <= player.renderableUntil() || !player.isStreamingMidi()))
+		{
+			isWaitingForStart = false;
+
+			renderer.playRestart();
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+			pianoRoll.playRestart();
+			audio.play();
+		}
+
 		if (KeySpace.down())
 		{
 			if (pianoRoll.isPlaying())
@@ -144,10 +256,19 @@ void Main()
 			}
 		}
 
+		if (KeyUp.down() || KeyDown.down())
+		{
+			const double step = KeyUp.down() ? playbackRateStep : -playbackRateStep;
+			const double rate = Clamp(Math::Round((player.playbackRate() + step) / playbackRateStep) * playbackRateStep, minPlaybackRate, maxPlaybackRate);
+			player.setPlaybackRate(rate);
+			Window::SetTitle(U"再生速度：{:.0f} %"_fmt(rate * 100));
+		}
+
 		if (KeyHome.down())
 		{
 			audio.pause();
 			audioStream->reset();
+			player.restartPlaybackTime();
 			renderer.playRestart();
 			AudioLoadManager::i().debugLog(U"---------------------");
 			std::this_thread::sleep_for(std::chrono::milliseconds(100));
@@ -158,7 +279,7 @@ void Main()
 
 		if (midiData)
 		{
-			pianoRoll.updateTick(midiData.value());
+			pianoRoll.updateTick(midiData.value(), player.toSongSeconds(pianoRoll.playbackSeconds()));
 		}
 
 #ifdef LAYOUT_HORIZONTAL
@@ -184,6 +305,8 @@ void Main()
 
 	AudioStreamRenderer::i().finish();
 	audioRenderThread.join();
+
+	SampleCache::i().finish();
 }
 
 #else
@@ -13,7 +13,23 @@ public:
 		return obj;
 	}
 
-	size_t load(FilePathView path);
+	// 複数のスレッドから同時に呼ばれてもよい
+	// preset は以前に読み込んだときのヘッダ情報で、ファイルの形式が一致すればヘッダの読み込みを省略する
+	size_t load(FilePathView path, const Optional<SampleInfo>& preset = none);
+
+	// beginIndex 以降に登録されたサンプルのヘッダを並列に読み込む
+	void probeHeaders(size_t beginIndex, std::atomic<size_t>& probedCount);
+
+	size_t readerCount() const;
+
+	// 同じ内容のサンプルファイルを1つの読み込み先にまとめる（サイズが一致したときだけ中身のハッシュを比較する）
+	// 既定では USE_SAMPLE_DEDUPLICATION が定義されているときだけ有効
+	void setContentDeduplication(bool enabled) { m_contentDeduplication = enabled; }
+
+	// 重複をまとめたことで読み込まずに済んだファイルの合計サイズ
+	uint64 deduplicatedBytes() const { return m_deduplicatedBytes; }
+
+	size_t deduplicatedCount() const { return m_deduplicatedCount; }
 
 	void markBlocks();
 
@@ -39,13 +55,51 @@ private:
 
 	AudioLoadManager()
 	{
+#ifdef USE_SAMPLE_DEDUPLICATION
+		m_contentDeduplication = true;
+#endif
+
 #ifdef DEVELOPMENT
 		m_debugLog = TextWriter(U"debug/audioDebugLog.txt");
 #endif
 	}
 
-	Array<std::unique_ptr<AudioLoaderBase>> m_waveReaders;
-	Array<String> m_paths;
+	// 読み込んだファイルのパスは m_paths に1つだけ持ち、読み込み先や SampleFile からは参照する
+	FilePathView internPath(FilePathView path);
+
+	struct SampleFile
+	{
+		FilePathView path;
+		int64 size = 0;
+		Optional<uint64> contentHash;
+	};
+
+	// 同じサイズのファイルのうち、中身が path と一致するもの（ロックを取らずに呼び、ファイルの読み込み中は他のスレッドを止めない）
+	Optional<size_t> findSameContent(FilePathView path, int64 size);
+
+	// 再生中に別のスレッドでサンプルを追加しても既存の要素が動かないように、固定長のチャンクに分けて持つ
+	// 要素を書き込んでから m_readerCount を進めるので、m_readerCount 未満のインデックスはロックなしで読める
+	static constexpr size_t ReaderChunkSize = 4096;
+	static constexpr size_t MaxReaderChunks = 1024;
+
+	void addReader(std::unique_ptr<AudioLoaderBase> reader);
+
+	std::array<std::unique_ptr<std::unique_ptr<AudioLoaderBase>[]>, MaxReaderChunks> m_waveReaders;
+	std::atomic<size_t> m_readerCount = 0;
+	std::deque<FilePath> m_paths;
+	Array<SampleFile> m_sampleFiles;
+
+	// 正規化したパス -> reader のインデックス
+	HashTable<String, size_t> m_pathIndex;
+
+	// ファイルサイズ -> そのサイズを持つ reader のインデックス
+	HashTable<int64, Array<size_t>> m_indicesBySize;
+
+	std::atomic<bool> m_contentDeduplication = false;
+	uint64 m_deduplicatedBytes = 0;
+	size_t m_deduplicatedCount = 0;
+
+	mutable std::mutex m_mutex;
 	bool m_isPause = false;
 	bool m_isFinish = false;
 
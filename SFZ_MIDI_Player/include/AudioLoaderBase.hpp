@@ -1,6 +1,24 @@
 ﻿#pragma once
 #include <Siv3D.hpp>
 
+enum class SampleContainer : uint8
+{
+	Wave,
+	Flac,
+};
+
+// サンプルファイルのヘッダから読み取れる情報（音源のキャッシュに保存され、次回はヘッダを読まずに使われる）
+struct SampleInfo
+{
+	SampleContainer container = SampleContainer::Wave;
+	uint16 channels = 0;
+	uint16 bitsPerSample = 0;
+	uint32 sampleRate = 0;
+	uint64 lengthSample = 0;
+	uint64 dataSizeOfBytes = 0;
+	int64 dataOffset = 0;
+};
+
 class AudioLoaderBase
 {
 public:
@@ -15,6 +33,11 @@ public:
 
 	virtual size_t lengthSample() const = 0;
 
+	// ヘッダの読み込みは初回アクセス時まで遅延されるので、先に済ませておきたい場合に呼ぶ
+	virtual void probe() const = 0;
+
+	virtual SampleInfo sampleInfo() const = 0;
+
 	virtual void use(size_t beginSampleIndex, size_t sampleCount) = 0;
 
 	virtual void markUnused() = 0;
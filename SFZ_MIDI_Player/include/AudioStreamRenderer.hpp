@@ -35,6 +35,9 @@ public:
 
 	void freePastSample(int64 sampleIndex);
 
+	// sampleIndex を含むブロックの次のブロックから先を捨てて、次の update() でそこから描画し直す
+	void discardFrom(int64 sampleIndex);
+
 	WaveSample getSample(int64 index) const;
 
 	void lock() const;
@@ -48,6 +51,13 @@ private:
 
 	MemoryBlockList m_writeBlocks;
 
+	// update() はロックの外でここに描画してから、ロックを取ってブロックにコピーする
+	Array<float> m_renderLeft;
+	Array<float> m_renderRight;
+
+	// ブロックを捨てるたびに進める（描画中に捨てられた区間は書き込まない）
+	uint64 m_discardCount = 0;
+
 	int64 m_bufferBeginSample = 0;
 	bool m_isFinished = false;
 	bool m_isPlaying = false;
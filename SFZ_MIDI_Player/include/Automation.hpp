@@ -0,0 +1,200 @@
+﻿#pragma once
+#include <Siv3D.hpp>
+
+class TrackData;
+class TempoMap;
+class AutomationSet;
+
+// 再生速度を変えたときの、曲の位置（サンプル）と再生位置の対応
+// 速度を変えた位置で区切り、区間ごとに一定の速度で進む（テンポマップの区間ごとのテンポを倍率で変えたのと同じ）
+class PlaybackTimeMap
+{
+public:
+
+	struct Segment
+	{
+		// 区間の先頭の、曲の位置と再生位置
+		int64 songPos;
+		int64 playPos;
+
+		// 再生位置1サンプルで進む曲のサンプル数
+		double rate;
+
+		// 区間の先頭での、チャンネルごとの AutomationSet::warpedPosition()（再生時間で数える）
+		std::array<double, 16> warped = {};
+	};
+
+	explicit PlaybackTimeMap(double rate = 1.0);
+
+	// 再生位置 playPos から先の速度を rate にする（playPos より後の区間は捨てる）
+	// 区間の先頭の warped は automation から求めておく
+	void setRate(int64 playPos, double rate, const AutomationSet& automation);
+
+	// ピッチベンドが変わったときに、各区間の先頭の warped を数え直す
+	void updateWarped(const AutomationSet& automation);
+
+	double rate() const { return m_segments.back().rate; }
+
+	// 曲の全体を等倍で再生する
+	bool isIdentity() const { return m_segments.size() == 1 && m_segments.front().rate == 1.0; }
+
+	size_t size() const { return m_segments.size(); }
+
+	const Segment& segment(size_t index) const { return m_segments[index]; }
+
+	// playPos を含む区間の番号
+	size_t indexAt(int64 playPos) const;
+
+	int64 toPlayback(int64 songPos) const;
+
+	int64 toSong(int64 playPos) const;
+
+private:
+
+	// 先頭は常に位置 0
+	Array<Segment> m_segments;
+
+	void updateWarped(const AutomationSet& automation, size_t index);
+};
+
+// 値の変化を位置（サンプル）順に持つレーン。値は次の変化まで一定
+class AutomationLane
+{
+public:
+
+	explicit AutomationLane(float defaultValue);
+
+	void clear();
+
+	// 最後の変化以降の位置にだけ追加できる
+	void add(int64 timePos, float value);
+
+	size_t size() const { return m_timePos.size(); }
+
+	int64 timePos(size_t index) const { return m_timePos[index]; }
+
+	float value(size_t index) const { return m_values[index]; }
+
+	// timePos での値の番号
+	size_t indexAt(int64 timePos) const;
+
+	float valueAt(int64 timePos) const { return m_values[indexAt(timePos)]; }
+
+private:
+
+	float m_defaultValue;
+
+	// 先頭は常に位置 0 の初期値
+	Array<int64> m_timePos;
+	Array<float> m_values;
+};
+
+// ブロック内でパラメータが一定の区間
+struct AutomationSegment
+{
+	// ブロックの先頭からの位置
+	int64 begin;
+
+	float gainLeft;
+	float gainRight;
+
+	// ピッチベンドによる再生速度の倍率
+	float pitchRatio;
+
+	// 区間の先頭での、ピッチベンドを考慮した経過サンプル数
+	double warpedBegin;
+};
+
+class AutomationSet;
+
+// 描画する1ブロック分のパラメータ（ブロックごとに AutomationSet::prepareBlock() で作る）
+struct BlockAutomation
+{
+	struct Channel
+	{
+		Array<AutomationSegment> segments;
+
+		// ブロック内でピッチベンドがかかっているか
+		bool hasPitchBend = false;
+
+		float maxPitchRatio = 1.0f;
+
+		// ブロックの先頭から offset の位置を含む区間
+		size_t segmentIndexAt(int64 offset) const;
+
+		// ブロックの先頭から offset の位置での、ピッチベンドを考慮した経過サンプル数
+		double warpedAt(int64 offset) const;
+	};
+
+	const AutomationSet* automation = nullptr;
+
+	// 位置はすべて再生位置で表す
+	const PlaybackTimeMap* timeMap = nullptr;
+
+	std::array<Channel, 16> channels;
+
+	// 再生位置 timePos での、ピッチベンドを考慮した経過サンプル数
+	double warpedPosition(uint8 channel, int64 timePos) const;
+};
+
+// チャンネルごとのコントローラー（CC7/10/11/64、ピッチベンド）の変化
+class AutomationSet
+{
+public:
+
+	// 離鍵位置までのコントローラーがまだ揃っていない
+	static constexpr int64 PendingRelease = -1;
+
+	AutomationSet();
+
+	void clear();
+
+	// tracks のうち [tickBegin, tickEnd) のコントロールチェンジとピッチベンドを追加する
+	// 前回までに追加したものより後のイベントだけを渡す（tickEnd より前は揃ったものとして扱い、UINT32_MAX なら曲の最後まで揃ったものとする）
+	void append(const Array<TrackData>& tracks, uint32 tickBegin, uint32 tickEnd, const TempoMap& tempoMap);
+
+	// サステインペダルで延ばした離鍵位置
+	// 最後まで踏まれたままなら INT64_MAX、まだ決められない場合は PendingRelease
+	int64 sustainedRelease(uint8 channel, int64 releaseTimePos) const;
+
+	// ピッチベンドを考慮した、先頭からの経過サンプル数
+	double warpedPosition(uint8 channel, int64 timePos) const;
+
+	// 再生位置 playPos での warpedPosition（再生速度を変えた区間では、経過サンプル数を再生時間で数える）
+	double warpedPosition(uint8 channel, int64 playPos, const PlaybackTimeMap& timeMap) const;
+
+	// [startPos, startPos + sampleCount) は再生位置。各レーンは曲の位置で持っているので timeMap で変換する
+	void prepareBlock(int64 startPos, int64 sampleCount, const PlaybackTimeMap& timeMap, BlockAutomation& block) const;
+
+private:
+
+	struct Channel
+	{
+		AutomationLane volume{ 100.0f };
+		AutomationLane pan{ 64.0f };
+		AutomationLane expression{ 127.0f };
+
+		// 再生速度の倍率
+		AutomationLane pitch{ 1.0f };
+
+		// pitch の変化点ごとの warpedPosition
+		Array<double> warped = { 0.0 };
+
+		// ペダルを踏んだ位置と離した位置
+		Array<std::pair<int64, int64>> sustains;
+
+		// ピッチベンドの幅（RPN 0 で変えられる）
+		double bendRange = 2.0;
+		uint8 rpnMsb = 127;
+		uint8 rpnLsb = 127;
+
+		void addPitch(int64 timePos, float ratio);
+	};
+
+	void addEvent(int64 timePos, uint8 status, uint8 data1, uint8 data2);
+
+	std::array<Channel, 16> m_channels;
+
+	// ここより前のイベントは揃っている
+	int64 m_completedUntil = 0;
+};
@@ -0,0 +1,6 @@
+﻿#pragma once
+#include <Siv3D.hpp>
+
+// 合成したデータで読み込み処理の時間を計測し、結果をコンソールに出力する
+// Config.hpp で BENCHMARK_MODE を定義したときに Main から呼ばれる
+void RunBenchmarks();
@@ -4,4 +4,25 @@
 
 //#define DEBUG_MODE
 
+// MIDIの読み込み内容を debug/ 以下にログ出力する（大きなファイルでは非常に遅くなる）
+//#define MIDI_DEBUG_LOG
+
+// SFZのプリプロセス結果を debug/preprocessed/ 以下に書き出す（読み込みが遅くなる）
+//#define SFZ_DEBUG_DUMP
+
+// 合成データで読み込み時間を計測する（通常の画面は起動しない）
+//#define BENCHMARK_MODE
+
 #define LAYOUT_HORIZONTAL
+
+// 同じ内容のサンプルファイルを1つにまとめる（サイズが同じファイルは中身をすべて読んで比べるので、読み込みが遅くなる）
+//#define USE_SAMPLE_DEDUPLICATION
+
+// flacをデコード済みのwavとしてディスクにキャッシュする
+#define USE_SAMPLE_CACHE
+
+// 解析済みの音源をバイナリでディスクにキャッシュする
+#define USE_INSTRUMENT_CACHE
+
+// MIDIごとに組み立てたイベントをディスクにキャッシュする
+#define USE_SONG_CACHE
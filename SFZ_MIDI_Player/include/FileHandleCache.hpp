@@ -0,0 +1,61 @@
+﻿#pragma once
+#include <Siv3D.hpp>
+
+// サンプルファイルの開いたハンドルを使い回すためのキャッシュ
+// 開いているファイル数が上限を超えたら最も長く使われていないものから閉じる
+// 読み込みはファイル位置を持たない（pread相当）ので、同じハンドルを複数のスレッドから使ってよい
+class FileHandleCache
+{
+public:
+
+	static FileHandleCache& i()
+	{
+		static FileHandleCache obj;
+		return obj;
+	}
+
+	// 読み込みのたびにパスをハッシュしないように、ローダーは最初に受け取ったIDで読む
+	using FileId = uint32;
+
+	void setCapacity(size_t maxOpenFiles);
+
+	// 同じパスには同じIDを返す（ファイルはまだ開かない）
+	FileId registerFile(FilePathView path);
+
+	// offset から最大 size バイト読み込み、読み込めたバイト数を返す
+	int64 read(FileId id, int64 offset, void* dst, int64 size);
+
+	int64 fileSize(FileId id);
+
+	size_t openCount() const;
+
+private:
+
+	class Handle;
+
+	FileHandleCache() = default;
+
+	std::shared_ptr<Handle> acquire(FileId id);
+
+	void evict();
+
+	struct Entry
+	{
+		FilePath path;
+
+		// 閉じられている間は nullptr
+		std::shared_ptr<Handle> handle;
+
+		std::list<FileId>::iterator lruPos;
+	};
+
+	// FileId で引くので、読み込みのたびにパスのコピーやハッシュは発生しない
+	Array<Entry> m_entries;
+	HashTable<FilePath, FileId> m_ids;
+
+	// 先頭ほど最近使われたハンドル
+	std::list<FileId> m_lruList;
+	size_t m_capacity = 256;
+
+	mutable std::mutex m_mutex;
+};
@@ -8,7 +8,8 @@ class FlacLoader : public AudioLoaderBase
 {
 public:
 
-	FlacLoader(FilePathView path, size_t debugId);
+	// preset が与えられた場合、デコードを始めるまでヘッダを読まずにその値を使う
+	FlacLoader(FilePathView path, size_t debugId, const Optional<SampleInfo>& preset = none);
 
 	virtual ~FlacLoader() = default;
 
@@ -20,6 +21,10 @@ public:
 
 	size_t lengthSample() const override;
 
+	void probe() const override;
+
+	SampleInfo sampleInfo() const override;
+
 	void use(size_t beginSampleIndex, size_t sampleCount) override;
 
 	void markUnused() override;
@@ -32,5 +37,14 @@ private:
 
 	void init();
 
+	void ensureInit() const;
+
+	void ensureHeader() const;
+
 	std::unique_ptr<FlacDecoder> m_flacDecoder;
+	Optional<SampleInfo> m_preset;
+	mutable std::once_flag m_initFlag;
 };
+
+// flacファイルを全てデコードし、16bit 2ch のwavファイルとして書き出す
+bool TranscodeFlacToWave(FilePathView flacPath, FilePathView wavePath);
@@ -0,0 +1,75 @@
+﻿#pragma once
+#include <Siv3D.hpp>
+#include "SFZLoader.hpp"
+#include "AudioLoaderBase.hpp"
+#include "Utility.hpp"
+
+// sfzを解析し、各リージョンのサンプルとキーの割り当てまで解決した音源
+struct CompiledInstrument
+{
+	struct Sample
+	{
+		FilePath path;
+		FileStamp stamp;
+		Optional<SampleInfo> info;
+	};
+
+	struct Dependency
+	{
+		FilePath path;
+		FileStamp stamp;
+	};
+
+	Array<RegionSetting> regions;
+
+	// regions と同じ並びで samples のインデックスを持つ（オシレータの場合は none）
+	Array<Optional<uint32>> regionSamples;
+
+	Array<Sample> samples;
+
+	// MIDIキーごとに、そのキーで鳴る regions のインデックスをsfzに書かれた順に持つ
+	std::array<Array<uint32>, 128> keyRegions;
+
+	// sfz本体と #include したファイル、見つからなかったサンプル（MissingFileStamp）
+	Array<Dependency> dependencies;
+
+	// 更新を調べるファイル（dependencies とサンプル）
+	Array<std::pair<FilePath, FileStamp>> files() const;
+};
+
+// sfzを読み込んで CompiledInstrument を作る（サンプルのヘッダ情報はまだ持たない）
+CompiledInstrument CompileInstrument(FilePathView sfzPath);
+
+// AudioLoadManager に登録済みのサンプルからヘッダ情報を埋める
+void ResolveSampleInfos(CompiledInstrument& instrument);
+
+// CompiledInstrument をバイナリで保存しておき、次回以降はsfzの解析を省略する
+// sfz本体、#include したファイル、サンプルのいずれかが更新されていたら無効になる
+class InstrumentCache
+{
+public:
+
+	static InstrumentCache& i()
+	{
+		static InstrumentCache obj;
+		return obj;
+	}
+
+	// setup() が呼ばれるまではキャッシュは無効
+	void setup(FilePathView directory);
+
+	bool isEnabled() const { return m_isEnabled; }
+
+	Optional<CompiledInstrument> load(FilePathView sfzPath) const;
+
+	void save(FilePathView sfzPath, const CompiledInstrument& instrument) const;
+
+private:
+
+	InstrumentCache() = default;
+
+	FilePath cacheFilePath(FilePathView sfzPath) const;
+
+	bool m_isEnabled = false;
+	FilePath m_directory;
+};
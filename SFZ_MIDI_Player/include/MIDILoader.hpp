@@ -224,18 +224,199 @@ struct Note
 	uint8 ch;
 };
 
-class TrackData
+// 列ごとの配列を持つコンテナを、要素の値を返しながら順に辿る
+template<class List>
+class ColumnIterator
 {
 public:
 
-	TrackData(const Array<MidiCode>& operations) : m_operations(operations)
+	ColumnIterator(const List& list, size_t index) : m_list(&list), m_index(index) {}
+
+	auto operator*() const { return (*m_list)[m_index]; }
+
+	ColumnIterator& operator++()
 	{
-		init();
+		++m_index;
+		return *this;
 	}
 
-	void init();
+	bool operator==(const ColumnIterator& other) const { return m_index == other.m_index; }
+
+	bool operator!=(const ColumnIterator& other) const { return m_index != other.m_index; }
+
+private:
+
+	const List* m_list;
+	size_t m_index;
+};
+
+// ノートを列ごとの配列で持つ（要素は Note の値として取り出す）
+class NoteList
+{
+public:
+
+	size_t size() const { return m_ticks.size(); }
+
+	bool isEmpty() const { return m_ticks.isEmpty(); }
+
+	Note operator[](size_t index) const
+	{
+		return Note{ m_beginSec[index], m_endSec[index], m_ticks[index], m_gates[index], m_keys[index], m_velocities[index], m_channels[index] };
+	}
+
+	ColumnIterator<NoteList> begin() const { return { *this, 0 }; }
+
+	ColumnIterator<NoteList> end() const { return { *this, size() }; }
+
+	uint32 tick(size_t index) const { return m_ticks[index]; }
+
+	uint32 gate(size_t index) const { return m_gates[index]; }
+
+	uint8 key(size_t index) const { return m_keys[index]; }
+
+	// gate は releaseNote で確定する
+	size_t pressNote(uint32 tick, uint8 key, uint8 velocity, uint8 ch);
+
+	void releaseNote(size_t index, uint32 tick);
+
+	void setSeconds(size_t index, double beginSec, double endSec);
+
+	// 離されなかったノートを取り除く
+	void removeUnreleased();
+
+	// tick より前に始まるノートの数（ノートは開始 tick 順に並んでいる）
+	size_t countBefore(uint32 tick) const;
+
+	// 先頭から count 個のノートを取り出す
+	NoteList takeFront(size_t count);
+
+	void append(NoteList&& other);
+
+	void reserve(size_t noteCount);
+
+	void shrinkToFit();
+
+	size_t memoryUsage() const;
+
+private:
+
+	// releaseNote されていないノートの gate
+	static constexpr uint32 UnreleasedGate = UINT32_MAX;
+
+	Array<uint32> m_ticks;
+	Array<uint32> m_gates;
+	Array<uint8> m_keys;
+	Array<uint8> m_velocities;
+	Array<uint8> m_channels;
+	Array<double> m_beginSec;
+	Array<double> m_endSec;
+};
+
+// ノート以外のチャンネルイベント（ステータスバイトとデータバイトそのまま）
+struct ChannelEvent
+{
+	uint32 tick;
+	uint8 status;
+	uint8 data1;
+	uint8 data2;
+
+	MidiEventType type() const;
+
+	uint8 channel() const { return status & 0x0F; }
+};
+
+// チャンネルイベントを列ごとの配列で持つ
+class ChannelEventList
+{
+public:
+
+	size_t size() const { return m_ticks.size(); }
+
+	bool isEmpty() const { return m_ticks.isEmpty(); }
+
+	ChannelEvent operator[](size_t index) const
+	{
+		return ChannelEvent{ m_ticks[index], m_status[index], m_data1[index], m_data2[index] };
+	}
+
+	ColumnIterator<ChannelEventList> begin() const { return { *this, 0 }; }
+
+	ColumnIterator<ChannelEventList> end() const { return { *this, size() }; }
+
+	void push_back(const ChannelEvent& event)
+	{
+		m_ticks.push_back(event.tick);
+		m_status.push_back(event.status);
+		m_data1.push_back(event.data1);
+		m_data2.push_back(event.data2);
+	}
+
+	size_t countBefore(uint32 tick) const;
+
+	ChannelEventList takeFront(size_t count);
+
+	void append(ChannelEventList&& other);
+
+	void shrinkToFit();
+
+	size_t memoryUsage() const;
+
+private:
+
+	Array<uint32> m_ticks;
+	Array<uint8> m_status;
+	Array<uint8> m_data1;
+	Array<uint8> m_data2;
+};
+
+struct TempoEvent
+{
+	uint32 tick;
+	double bpm;
+};
+
+struct MetreEvent
+{
+	uint32 tick;
+	MetreData metre;
+};
+
+class TrackData
+{
+public:
+
+	TrackData() = default;
+
+	TrackData(const Array<MidiCode>& operations);
+
+	// 読み込み中に tick 順でイベントを追加する
+	void addChannelEvent(uint32 tick, uint8 status, uint8 data1, uint8 data2);
+
+	void addTempo(uint32 tick, double bpm);
+
+	void addMetre(uint32 tick, const MetreData& metre);
+
+	// 全てのイベントを追加し終えたら呼ぶ
+	void finish(uint32 endTick);
+
+	void reserveNotes(size_t noteCount) { m_notes.reserve(noteCount); }
+
+	bool isFinished() const { return m_isFinished; }
+
+	// 押されたままのノートのうち、最も早く始まったものの tick
+	Optional<uint32> firstPendingTick() const;
+
+	// tick より前のノートとイベントを取り出す（tick より前に始まったノートは全て離されている必要がある）
+	TrackData takeBefore(uint32 tick);
+
+	// 続きのノートとイベントを後ろに追加する
+	void append(TrackData&& other);
+
+	const NoteList& notes() const { return m_notes; }
 
-	const Array<Note>& notes() const { return m_notes; }
+	const ChannelEventList& channelEvents() const { return m_channelEvents; }
+
+	const Array<TempoEvent>& tempos() const { return m_tempos; }
 
 	void outputLog(TextWriter& writer) const;
 
@@ -245,16 +426,35 @@ public:
 
 	bool isPercussionTrack() const { return m_channel == 9; }
 
+	uint32 endTick() const { return m_endTick; }
+
+	size_t memoryUsage() const;
+
 private:
 
 	friend class MidiData;
+	friend class MidiStreamReader;
+
+	NoteList m_notes;
+
+	ChannelEventList m_channelEvents;
+
+	Array<TempoEvent> m_tempos;
 
-	Array<Note> m_notes;
+	Array<MetreEvent> m_metres;
 
-	Array<MidiCode> m_operations;
+	// チャンネルとキーごとに押されたままのノートの番号+1（0なら押されていない）
+	// 1つのトラックに複数のチャンネルが混ざっていても、別のチャンネルの同じキーで離さないようにする
+	std::array<uint32, 16 * 128> m_pendingNotes = {};
 
+	uint32 m_endTick = 0;
+	bool m_isFinished = false;
+
+	// 表示用に、最後のプログラムチェンジを持っておく（ノートを鳴らす音源は ProgramTimeline で引く）
 	uint8 m_channel = 0;
 	uint8 m_program = 0;
+
+	void releasePendingNote(uint8 ch, uint8 key, uint32 tick);
 };
 
 struct Beat
@@ -275,19 +475,147 @@ struct Measure
 	void outputLog(TextWriter& writer) const;
 };
 
+// テンポ変更ごとの区間表
+// 各区間の開始tickと開始秒を累積で持っておき、tick <-> 秒 の変換を二分探索で行う
+class TempoMap
+{
+public:
+
+	struct Segment
+	{
+		int64 tick;
+		double seconds;
+		double secondsPerTick;
+	};
+
+	// 昇順（に近い順）に並んだ入力を変換するときに、前回の区間から探し始める
+	class Cursor
+	{
+	public:
+
+		explicit Cursor(const TempoMap& tempoMap) : m_tempoMap(&tempoMap) {}
+
+		double ticksToSeconds(double tick);
+
+		double secondsToTicks(double seconds);
+
+	private:
+
+		const TempoMap* m_tempoMap;
+		size_t m_index = 0;
+	};
+
+	TempoMap() : TempoMap({}, 480) {}
+
+	// tick -> BPM
+	TempoMap(const std::map<int64, double>& bpmSetEvents, uint16 resolution);
+
+	double ticksToSeconds(double tick) const;
+
+	double secondsToTicks(double seconds) const;
+
+	Cursor cursor() const { return Cursor(*this); }
+
+	// 最後のテンポ変更以降のテンポ変更を追加する
+	void append(int64 tick, double bpm);
+
+	// notes の beginSec と endSec をまとめて計算する
+	void assignSeconds(NoteList& notes) const;
+
+	const Array<Segment>& segments() const { return m_segments; }
+
+private:
+
+	size_t findByTick(double tick) const;
+
+	size_t findBySeconds(double seconds) const;
+
+	// 先頭は常に tick 0 から始まる（最初のテンポ変更までは120BPM）
+	Array<Segment> m_segments;
+
+	double m_ticksPerBeat = 480;
+};
+
+// MIDIで音を鳴らす音源（メロディはプログラム番号ごと、ドラムは1つ）
+struct ProgramUsage
+{
+	std::array<bool, 128> melodies = {};
+	bool hasPercussion = false;
+};
+
+// チャンネルごとのプログラムチェンジの表（プログラムチェンジはトラックをまたいでチャンネル全体に効く）
+class ProgramTimeline
+{
+public:
+
+	static constexpr uint8 PercussionChannel = 9;
+
+	// tick 順（に近い順）に引くときに、前回の位置から探し始める
+	class Cursor
+	{
+	public:
+
+		explicit Cursor(const ProgramTimeline& timeline) : m_timeline(&timeline) {}
+
+		uint8 programAt(uint8 channel, uint32 tick);
+
+	private:
+
+		const ProgramTimeline* m_timeline;
+
+		// チャンネルごとの、tick までに効いているプログラムチェンジの数
+		std::array<size_t, 16> m_counts = {};
+	};
+
+	void clear();
+
+	// tracks のうち [tickBegin, tickEnd) のプログラムチェンジを追加する
+	// 前回までに追加したものより後のイベントだけを渡す
+	void append(const Array<TrackData>& tracks, uint32 tickBegin, uint32 tickEnd);
+
+	// tick で鳴らすプログラム（同じ tick のプログラムチェンジは効いているものとする）
+	uint8 programAt(uint8 channel, uint32 tick) const;
+
+	Cursor cursor() const { return Cursor(*this); }
+
+	// tracks のノートを鳴らすのに使う音源（追加済みのプログラムチェンジで引く）
+	ProgramUsage usage(const Array<TrackData>& tracks) const;
+
+private:
+
+	struct Change
+	{
+		uint32 tick;
+		uint8 program;
+	};
+
+	size_t countUntil(uint8 channel, uint32 tick) const;
+
+	std::array<Array<Change>, 16> m_changes;
+};
+
 class MidiData
 {
 public:
 
-	MidiData(const Array<TrackData>& tracks, uint16 resolution) :
-		m_tracks(tracks),
-		m_resolution(resolution)
+	MidiData(Array<TrackData> tracks, uint16 resolution) :
+		m_resolution(resolution),
+		m_tracks(std::move(tracks))
 	{
 		init();
 	}
 
+	// 少しずつ読み込むときの空のデータ
+	explicit MidiData(uint16 resolution) :
+		m_resolution(resolution),
+		m_tempoMap({}, resolution)
+	{}
+
 	void init();
 
+	// MidiStreamReader で読み進めた分を追加する（ノートの秒数は計算済みのものを使う）
+	void append(Array<TrackData>&& tracks);
+
 	const Array<TrackData>& notes() const { return m_tracks; }
 
 	Array<Measure> getMeasures() const;
@@ -304,11 +632,19 @@ public:
 
 	double secondsToTicks2(double seconds) const;
 
+	size_t noteCount() const;
+
+	size_t memoryUsage() const;
+
+	const TempoMap& tempoMap() const { return m_tempoMap; }
+
 private:
 
 	// tick -> BPM
 	std::map<int64, double> BPMSetEvents() const;
 
+	void updateMeasures();
+
 	bool intersects(uint32 range0begin, uint32 range0end, uint32 range1begin, uint32 range1end) const;
 
 	struct MeasureInfo
@@ -323,7 +659,45 @@ private:
 
 	Array<MeasureInfo> m_measures;
 
-	std::map<int64, double> m_bpmSetEvents;
+	TempoMap m_tempoMap;
+};
+
+// MIDIファイルを先頭から時間順に少しずつ読む（読み込みながら再生を始めるため）
+// 開いた時点ではチャンクの境界しか読まないので、ファイルの大きさによらずすぐに読み始められる
+class MidiStreamReader
+{
+public:
+
+	MidiStreamReader();
+
+	~MidiStreamReader();
+
+	bool open(FilePathView path);
+
+	uint16 resolution() const;
+
+	// 最後まで取り出し終えたか
+	bool isFinished() const;
+
+	// ここより前に始まるノートは取り出し済み
+	uint32 emittedTick() const;
+
+	// 取り出し済みの位置から seconds 秒後の tick（まだ読んでいないテンポ変更は考慮しない）
+	uint32 tickAfter(double seconds) const;
+
+	// 読み込んだところまでのテンポマップ
+	const TempoMap& tempoMap() const;
+
+	// tickEnd より前に始まるノートを、全て離されるところまで読み進めてトラックごとに取り出す
+	// 取り出したノートは秒数まで計算してある
+	// 全てのトラックを読み終えた場合は残りを全て取り出す。読み込みに失敗した場合は none
+	Optional<Array<TrackData>> readUntil(uint32 tickEnd);
+
+private:
+
+	struct State;
+
+	std::unique_ptr<State> m_state;
 };
 
 Optional<MidiData> LoadMidi(FilePathView path);
@@ -19,7 +19,7 @@ public:
 	// returns [beginDataPtr, actualSizeOfBytes]
 	std::pair<uint8*, size_t> getWriteBuffer(size_t beginDataPos, size_t expectSizeOfBytes) const;
 
-	bool isAllocatedBlock(uint32 blockIndex);
+	bool isAllocatedBlock(uint32 blockIndex) const;
 
 	// return [(blockIndex, isAllocated)]
 	Array<std::pair<uint32, bool>> blockIndices(size_t beginDataPos, size_t sizeOfBytes);
@@ -40,6 +40,9 @@ public:
 
 	std::tuple<uint32, uint32, uint32> freePreviousBlockIndex(uint32 blockIndex);
 
+	// blockIndex 以降のブロックを解放して、解放した数を返す
+	uint32 freeFollowingBlockIndex(uint32 blockIndex);
+
 private:
 
 	struct BlockInfo
@@ -0,0 +1,205 @@
+﻿#pragma once
+#include <Siv3D.hpp>
+
+// 1つのノートの発音イベント（ノートの数だけ作られるので小さく詰めておく）
+// サンプル位置は32bit（48kHzで約24時間分）
+struct NoteEvent
+{
+	static constexpr uint32 NoDisableTime = UINT32_MAX;
+
+	// サステインペダルが離されるまで離鍵位置が決まらない
+	static constexpr uint32 SustainedRelease = UINT32_MAX - 1;
+
+	uint32 pressTimePos;
+	uint32 releaseTimePos;
+
+	// off_byで止められる位置
+	uint32 disableTimePos = NoDisableTime;
+
+	int16 attackIndex;
+	int16 releaseIndex;
+	uint8 velocity;
+
+	// コントローラーを引くMIDIチャンネル
+	uint8 channel;
+
+	NoteEvent() = delete;
+	NoteEvent(int64 attackIndex, int64 releaseIndex, int64 pressTimePos, int64 releaseTimePos, uint8 velocity, uint8 channel) :
+		pressTimePos(static_cast<uint32>(pressTimePos)),
+		releaseTimePos(static_cast<uint32>(releaseTimePos)),
+		attackIndex(static_cast<int16>(attackIndex)),
+		releaseIndex(static_cast<int16>(releaseIndex)),
+		velocity(velocity),
+		channel(channel)
+	{}
+
+	bool isDisabled() const { return disableTimePos != NoDisableTime; }
+};
+
+static_assert(sizeof(NoteEvent) == 20);
+static_assert(std::is_trivially_copyable_v<NoteEvent>);
+
+class NoteSpillWriter;
+
+// 退避ファイル1つ分（参照するチャンクが無くなったらファイルごと消す）
+// 曲のキャッシュファイルも同じようにマップして読むが、こちらは消さない
+class NoteSpillSegment
+{
+public:
+
+	NoteSpillSegment(FilePathView path, bool isTemporary = true);
+
+	~NoteSpillSegment();
+
+	bool isOpen() const { return m_memory.data != nullptr; }
+
+	const NoteEvent* data(size_t offsetOfBytes) const { return std::bit_cast<const NoteEvent*>(m_memory.data + offsetOfBytes); }
+
+	const uint8* bytes() const { return std::bit_cast<const uint8*>(m_memory.data); }
+
+	size_t size() const { return m_memory.size; }
+
+private:
+
+	FilePath m_path;
+	bool m_isTemporary;
+	MemoryMappedFileView m_file;
+	MemoryMappedFileView::MappedMemory m_memory;
+};
+
+// AudioKey のイベント列
+// 一定数ごとのチャンクに分けて持ち、確定して書き換えられなくなったチャンクは
+// メモリマップした退避ファイルに追い出せる（読むときはOSが必要な部分だけを読み込む）
+class NoteEventList
+{
+public:
+
+	static constexpr size_t ChunkShift = 12;
+	static constexpr size_t ChunkSize = size_t(1) << ChunkShift;
+
+	size_t size() const { return m_size; }
+
+	bool empty() const { return m_size == 0; }
+
+	const NoteEvent& operator[](size_t index) const
+	{
+		return m_chunks[index >> ChunkShift].data()[index & (ChunkSize - 1)];
+	}
+
+	// 退避済みのチャンクは書き換えられない
+	NoteEvent& operator[](size_t index)
+	{
+		auto& chunk = m_chunks[index >> ChunkShift];
+		assert(!chunk.spilled);
+		return chunk.events[index & (ChunkSize - 1)];
+	}
+
+	const NoteEvent& back() const { return (*this)[m_size - 1]; }
+
+	void push_back(const NoteEvent& noteEvent);
+
+	// マップしたファイル上の count 個のイベントで置き換える（埋まらない最後のチャンクだけはメモリにコピーする）
+	void assignMapped(const NoteEvent* events, size_t count, const std::shared_ptr<const NoteSpillSegment>& segment);
+
+	// チャンクごとに連続したイベントを渡す
+	template<class Func>
+	void forEachSpan(Func func) const
+	{
+		for (size_t chunkIndex = 0; chunkIndex < m_chunks.size(); ++chunkIndex)
+		{
+			func(m_chunks[chunkIndex].data(), Min(ChunkSize, m_size - (chunkIndex << ChunkShift)));
+		}
+	}
+
+	void clear();
+
+	// pressTimePos が pos より後の最初のイベント
+	size_t upperBound(int64 pos) const;
+
+	// 先頭から frozenCount 個のうち、releaseTimePos が frozenBefore より前のものだけで埋まったチャンクを退避する
+	void spill(size_t frozenCount, int64 frozenBefore, NoteSpillWriter& writer);
+
+	// メモリ上にあるイベントのバイト数
+	size_t residentBytes() const;
+
+	size_t spilledBytes() const;
+
+private:
+
+	friend class NoteSpillWriter;
+
+	struct Chunk
+	{
+		Array<NoteEvent> events;
+
+		const NoteEvent* spilled = nullptr;
+		std::shared_ptr<const NoteSpillSegment> segment;
+
+		const NoteEvent* data() const { return spilled ? spilled : events.data(); }
+	};
+
+	Array<Chunk> m_chunks;
+
+	size_t m_size = 0;
+
+	// ここより前のチャンクは調べ済み（全て退避済みか、退避できないものを含まない）
+	size_t m_spillCheckedChunks = 0;
+};
+
+// 予算を超えたイベントを退避ファイルに書き出す
+// add() で集めたチャンクは finish() でファイルをマップしてから差し替える
+class NoteSpillWriter
+{
+public:
+
+	// swapMutex を渡すと、書き出しはロックの外で行い、チャンクを差し替える間だけロックする
+	explicit NoteSpillWriter(std::mutex* swapMutex = nullptr);
+
+	~NoteSpillWriter();
+
+	void add(NoteEventList::Chunk& chunk);
+
+	// 書き出したバイト数
+	size_t finish();
+
+private:
+
+	FilePath m_path;
+	BinaryWriter m_writer;
+
+	std::mutex* m_swapMutex;
+
+	Array<std::pair<NoteEventList::Chunk*, size_t>> m_chunks;
+	size_t m_sizeOfBytes = 0;
+};
+
+// 退避ファイルの置き場所と、メモリ上に置いておくイベントの上限
+class NoteEventSpill
+{
+public:
+
+	static NoteEventSpill& i()
+	{
+		static NoteEventSpill obj;
+		return obj;
+	}
+
+	// setup() が呼ばれるまでは退避しない
+	void setup(FilePathView directory, uint64 budgetOfBytes);
+
+	bool isEnabled() const { return m_isEnabled; }
+
+	uint64 budget() const { return m_budgetOfBytes; }
+
+	FilePath nextFilePath();
+
+private:
+
+	NoteEventSpill() = default;
+
+	bool m_isEnabled = false;
+	FilePath m_directory;
+	uint64 m_budgetOfBytes = 0;
+
+	std::atomic<uint64> m_fileCount = 0;
+};
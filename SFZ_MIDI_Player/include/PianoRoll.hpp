@@ -17,7 +17,8 @@ public:
 
 	void drawHorizontal(int keyMin, int keyMax, const Optional<MidiData>& midiData) const;
 
-	void updateTick(const MidiData& midiData);
+	// 再生速度を変えているときは、再生した秒数を曲の秒数に直して渡す
+	void updateTick(const MidiData& midiData, double songSeconds);
 
 	void playRestart();
 
@@ -31,7 +32,11 @@ public:
 
 	double currentTick() const { return m_currentTick; }
 
-	double currentSeconds() const { return m_watch.sF(); }
+	// 再生を始めてからの秒数
+	double playbackSeconds() const { return m_watch.sF(); }
+
+	// 曲の先頭からの秒数
+	double currentSeconds() const { return m_currentSeconds; }
 
 	int64 currentPosSample() const { return static_cast<int64>(currentSeconds() * Wave::DefaultSampleRate); }
 
@@ -46,6 +51,7 @@ private:
 
 	double m_lastTick = 0;
 	double m_currentTick = 0;
+	double m_currentSeconds = 0;
 	Stopwatch m_watch;
 
 	double m_unitLength = 8;
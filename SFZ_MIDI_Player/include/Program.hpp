@@ -1,13 +1,18 @@
 ﻿#pragma once
 #include <Siv3D.hpp>
+#include "SampleSource.hpp"
 
-struct SfzData;
+struct CompiledInstrument;
 class PianoRoll;
 class TrackData;
+struct Note;
 class MidiData;
-struct KeyDownEvent;
-struct NoteEvent;
-class AudioKey;
+class NoteSpillWriter;
+class AutomationSet;
+struct BlockAutomation;
+
+// リージョンのテーブルを組み立てる（できたテーブルは複数のProgramで共有してよい）
+std::shared_ptr<const Instrument> BuildInstrument(const CompiledInstrument& instrument, float masterVolume);
 
 class Program
 {
@@ -15,29 +20,127 @@ public:
 
 	Program() = default;
 
-	void loadProgram(const SfzData& sfzData, float volume);
+	void loadProgram(const CompiledInstrument& instrument, float volume);
+
+	void loadProgram(const std::shared_ptr<const Instrument>& instrument);
+
+	// 音源を手放して、組み立てる前の状態に戻す（登録済みのイベントも捨てる）
+	void unloadProgram();
+
+	bool isLoaded() const { return m_instrument != nullptr; }
+
+	const std::shared_ptr<const Instrument>& instrument() const { return m_instrument; }
 
 	void clearEvent();
 
-	void addKeyDownEvents(const MidiData& midiData, const TrackData& trackData);
+	void addKeyDownEvents(const TrackData& trackData);
+
+	// trackData のノートのうち [beginIndex, endIndex) だけを登録する
+	// automation を渡すと、サステインペダルで離鍵を延ばす
+	void addKeyDownEvents(const TrackData& trackData, size_t beginIndex, size_t endIndex, const AutomationSet* automation = nullptr);
+
+	// ノートを1つ登録する（トラックの途中で音源が変わるときは、ノートごとに振り分けて呼ぶ）
+	void addKeyDownEvent(const Note& note, const AutomationSet* automation = nullptr);
+
+	// ペダルが離されるのを待っていたノートの離鍵位置を決める（コントローラーを追加するたびに呼ぶ）
+	void resolveSustain(const AutomationSet& automation);
 
 	void sortKeyDownEvents();
 
-	Array<std::pair<uint8, NoteEvent>> addEvents(const MidiData& midiData, const TrackData& trackData);
+	// 時刻順にキースイッチの状態を更新しながら、各キーダウンのリージョンを決めてイベントを組み立てる
+	// キースイッチの状態は clearEvent() まで引き継ぐので、時間順の区間ごとに分けて呼んでもよい
+	// 戻り値は組み立てたイベントの数
+	// compileEvents() から calculateOffTime() までは組み立て中のイベントだけを書き換えるので、描画中でもロックせずに呼んでよい
+	size_t compileEvents();
 
 	void sortEvent();
 
 	void deleteDuplicate();
 
+	// off_by で止める位置を決めて、処理し終えたキーダウンを捨てる
 	void calculateOffTime();
 
-	void getSamples(float* left, float* right, int64 startPos, int64 sampleCount);
+	// calculateOffTime() までに組み立てたイベントを AudioKey に移し、描画に使えるようにする（描画スレッドと取り合うのはここだけ）
+	void publishEvents();
+
+	void getSamples(float* left, float* right, int64 startPos, int64 sampleCount, const BlockAutomation& automation);
+
+	// もう書き換えられないイベントを退避ファイルに書き出す
+	void spillEvents(NoteSpillWriter& writer);
+
+	// keyIndex のキーのイベント（曲のキャッシュに書き出す）
+	const NoteEventList& keyEvents(uint8 keyIndex) const { return m_audioKeys[keyIndex].noteEvents(); }
+
+	// 曲のキャッシュから読んだイベントをそのまま持つ（clearEvent() の後に呼ぶ）
+	void loadKeyEvents(uint8 keyIndex, const NoteEvent* events, size_t count, const std::shared_ptr<const NoteSpillSegment>& segment);
+
+	// メモリ上にあるイベントのバイト数
+	size_t residentEventBytes() const;
+
+	size_t spilledEventBytes() const;
+
+	// リージョンのテーブルが使っているメモリ
+	size_t memoryUsage() const;
+
+	// キーごとにリージョンをコピーして持った場合のメモリ（比較用）
+	size_t perKeyCopyMemoryUsage() const;
 
 private:
 
-	const NoteEvent& addEvent(uint8 key, uint8 velocity, int64 pressTimePos, int64 releaseTimePos, const Array<KeyDownEvent>& history);
+	// off_byで止められる可能性のあるノート
+	struct OffByVictim
+	{
+		uint8 keyIndex;
+		uint32 eventIndex;
+		int8 key;
+		uint32 offBy;
+		int64 pressTimePos;
+	};
+
+	// サステインペダルが離されるのを待っているノート
+	struct PendingSustain
+	{
+		uint8 keyIndex;
+		uint8 channel;
+		uint32 pressTimePos;
+		uint32 releaseTimePos;
+	};
+
+	std::shared_ptr<const Instrument> m_instrument;
 
 	Array<AudioKey> m_audioKeys;
 
+	KeySwitchState m_keySwitch;
+
 	Array<KeyDownEvent> m_keyDownEvents;
+
+	// 次に登録するノートはここ以降に始まる（ここより前に離されたノートは off_by で止められることはない）
+	int64 m_compiledUntil = 0;
+
+	// off_byグループ -> まだ止められていない発音中のノート（前の区間から引き継ぐ）
+	HashTable<uint32, Array<OffByVictim>> m_activeVictims;
+
+	Array<PendingSustain> m_pendingSustains;
+
+	// 確定済みのイベントに publishEvents() で書き込む off_by の停止位置
+	struct PendingDisable
+	{
+		uint8 keyIndex;
+		uint32 eventIndex;
+		uint32 disableTimePos;
+	};
+
+	// キーごとの組み立て中のイベント（描画スレッドは読まない）
+	Array<Array<NoteEvent>> m_stagedEvents;
+
+	Array<PendingDisable> m_pendingDisables;
+
+	// keyIndex のキーの eventIndex 番目のイベント（確定済みのイベントに続けて組み立て中のイベントを数える）
+	const NoteEvent& eventAt(uint8 keyIndex, uint32 eventIndex) const;
+
+	// 止められる可能性のあるノートの離鍵位置（ペダルで後から延びることがあるので、イベントから読む）
+	int64 releaseTimePos(const OffByVictim& victim) const;
+
+	// 組み立て中のイベントがあるキーだけを処理する（イベントが多ければ並列に処理する）
+	void forEachCompilingKey(const std::function<void(AudioKey&, Array<NoteEvent>&)>& func);
 };
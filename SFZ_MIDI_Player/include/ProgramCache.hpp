@@ -0,0 +1,56 @@
+﻿#pragma once
+#include <Siv3D.hpp>
+#include "Utility.hpp"
+
+struct CompiledInstrument;
+struct Instrument;
+
+// 組み立て済みの音源を保持して、サウンドセットを読み直したときに変更のない音源を使い回す
+// sfzのパスと音量が一致し、sfz本体・#include したファイル・サンプルのいずれも更新されていなければ再利用する
+class ProgramCache
+{
+public:
+
+	static ProgramCache& i()
+	{
+		static ProgramCache obj;
+		return obj;
+	}
+
+	// どのサウンドセットからも使われていない音源をいくつまで残すか
+	void setCapacity(size_t maxUnusedInstruments);
+
+	// 複数のスレッドから同時に呼ばれてもよい
+	// usedFiles を渡すと、見つかった音源の組み立てに使ったファイルを返す
+	std::shared_ptr<const Instrument> find(FilePathView sfzPath, float volume, Array<std::pair<FilePath, FileStamp>>* usedFiles = nullptr);
+
+	void store(FilePathView sfzPath, float volume, const CompiledInstrument& compiled, const std::shared_ptr<const Instrument>& instrument);
+
+	// 使われていない音源を古いものから捨てて capacity に収める
+	void trim();
+
+	size_t size() const;
+
+private:
+
+	ProgramCache() = default;
+
+	struct Entry
+	{
+		std::shared_ptr<const Instrument> instrument;
+
+		// sfz本体、#include したファイル、サンプル
+		Array<std::pair<FilePath, FileStamp>> files;
+
+		uint64 lastUsed = 0;
+	};
+
+	static String MakeKey(FilePathView sfzPath, float volume);
+
+	HashTable<String, Entry> m_entries;
+
+	size_t m_capacity = 64;
+	uint64 m_useCounter = 0;
+
+	mutable std::mutex m_mutex;
+};
@@ -69,6 +69,9 @@ struct SfzData
 {
 	String dir;
 	Array<RegionSetting> data;
+
+	// #include で読み込んだファイル
+	Array<FilePath> includes;
 };
 
 SfzData LoadSfz(FilePathView sfzPath);
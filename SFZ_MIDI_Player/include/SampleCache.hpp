@@ -0,0 +1,80 @@
+﻿#pragma once
+#include <Siv3D.hpp>
+#include "Utility.hpp"
+
+// 圧縮された音源（flac）をバックグラウンドで16bit 2chのwavに変換してディスクに保存しておくキャッシュ
+// 変換が済んだものは次回以降 AudioLoadManager から WaveLoader で読み込まれる
+class SampleCache
+{
+public:
+
+	static SampleCache& i()
+	{
+		static SampleCache obj;
+		return obj;
+	}
+
+	// setup() が呼ばれるまではキャッシュは無効
+	void setup(FilePathView directory, uint64 capacityOfBytes);
+
+	void finish();
+
+	bool isEnabled() const { return m_isEnabled; }
+
+	// 有効なキャッシュがあればそのパスを返す
+	// 無い場合は none を返し、バックグラウンドでの変換を予約する
+	Optional<FilePath> request(FilePathView sourcePath);
+
+	uint64 totalSizeOfBytes() const;
+
+private:
+
+	SampleCache() = default;
+
+	~SampleCache();
+
+	struct Entry
+	{
+		FilePath sourcePath;
+		FileStamp sourceStamp;
+		uint64 sizeOfBytes = 0;
+		uint64 lastAccess = 0;
+	};
+
+	FilePath cacheFilePath(StringView fileName) const;
+
+	void loadIndex();
+
+	void saveIndex() const;
+
+	// インデックスに無いファイル（保存する前に落ちた場合や、変換の途中のもの）を削除する
+	void removeUnlistedFiles();
+
+	void workerLoop();
+
+	void transcode(const FilePath& sourcePath);
+
+	void evict();
+
+	void removeEntry(const String& fileName);
+
+	bool m_isEnabled = false;
+	FilePath m_directory;
+	uint64 m_capacityOfBytes = 0;
+
+	// key: キャッシュファイル名
+	HashTable<String, Entry> m_entries;
+
+	// 今回の実行中に使われているキャッシュは削除しない
+	HashSet<String> m_pinned;
+
+	uint64 m_accessCount = 0;
+
+	std::deque<FilePath> m_queue;
+	HashSet<String> m_queuedFiles;
+	bool m_isFinish = false;
+
+	std::thread m_worker;
+	mutable std::mutex m_mutex;
+	std::condition_variable m_condition;
+};
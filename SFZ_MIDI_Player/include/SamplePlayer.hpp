@@ -9,6 +9,13 @@ struct KeyDownEvent;
 struct NoteEvent;
 class AudioKey;
 class Program;
+struct SoundSet;
+struct SoundSetLoadProgress;
+struct MidiStreamLoad;
+struct MidiReload;
+struct ProgramUsage;
+class PlaybackTimeMap;
+class AutomationSet;
 
 class SamplePlayer
 {
@@ -20,8 +27,27 @@ public:
 		m_area(area)
 	{}
 
+	~SamplePlayer();
+
+	// 読み込みが終わるまで待って差し替える
+	// TOMLに書かれた音源の一覧だけを読み、音源はMIDIを読み込んだときに使うものだけを組み立てる
 	void loadSoundSet(FilePathView soundSetTomlPath);
 
+	// usage で鳴らす音源は先に組み立てておく
+	void loadSoundSet(FilePathView soundSetTomlPath, const ProgramUsage& usage);
+
+	// バックグラウンドで読み込み、読み込み中は今のサウンドセットで再生を続ける
+	// 読み込みが終わったら applyPendingSoundSet() で差し替える
+	void loadSoundSetAsync(FilePathView soundSetTomlPath, const Optional<MidiData>& midiData);
+
+	bool isLoadingSoundSet() const;
+
+	// メインスレッドから毎フレーム呼ぶ（進捗の表示と、完了した読み込みの後始末）
+	void updateSoundSetLoading();
+
+	// 読み込みが終わったサウンドセットがあれば差し替える（描画スレッドがブロックの合間に呼ぶ）
+	bool applyPendingSoundSet();
+
 	int octaveCount() const;
 	double octaveHeight() const;
 	double unitHeight() const;
@@ -40,18 +66,99 @@ public:
 
 	void drawHorizontal(const PianoRoll& pianoroll, const Optional<MidiData>& midiData) const;
 
-	Array<std::pair<uint8, NoteEvent>> loadMidiData(const MidiData& midiData);
+	// 戻り値は登録したイベントの数
+	size_t loadMidiData(const MidiData& midiData);
+
+	// MIDIファイルが書き換えられたとき、バックグラウンドで読み込み直して previous からノートの変わった音源だけを登録し直す
+	// サウンドセットやMIDIを読み込み中のときは始めずに false を返すので、後でもう一度呼ぶ
+	bool reloadMidiAsync(FilePathView midiPath, const MidiData& previous);
+
+	bool isReloadingMidi() const { return m_midiReloadTask.valid(); }
+
+	// 読み込み直しが終わっていれば midiData を差し替えて true を返す（メインスレッドから毎フレーム呼ぶ）
+	// changedFrom は鳴り方が変わる最初の再生位置（変化が無ければ none）
+	bool takeMidiReload(Optional<MidiData>& midiData, Optional<int64>& changedFrom);
+
+	// 読み込み直しが終わるまで待つ（結果は takeMidiReload() で受け取る）
+	void waitMidiReload();
+
+	// MIDIを先頭から少しずつ読み込みながら、バックグラウンドでイベントを登録していく
+	// renderableUntil() までは登録が済んでいるので、先頭の数秒が揃えば再生を始められる
+	bool loadMidiStream(FilePathView midiPath);
+
+	bool isStreamingMidi() const;
+
+	// この再生位置より前のイベントは登録済み（読み込み中でなければ INT64_MAX）
+	int64 renderableUntil() const;
+
+	// 読み込んだ分を midiData に追加する（メインスレッドから毎フレーム呼ぶ）
+	bool takeMidiChunks(Optional<MidiData>& midiData);
+
+	void cancelMidiStream();
+
+	// 最後まで読み込むのを待つ（読み込んだ分は takeMidiChunks() で受け取る）
+	void waitMidiStream();
+
+	// 再生速度（曲の進む速さの倍率）を変える。音の高さは変えずに、ノートを鳴らす位置だけを詰めたり延ばしたりする
+	// 描画スレッドが applyPendingPlaybackRate() で反映するまでは今の速度で描画する
+	void setPlaybackRate(double rate);
+
+	double playbackRate() const { return m_playbackRate; }
+
+	// 変えた再生速度を、fromPos を含むブロックの次のブロックから反映する（描画スレッドがブロックの合間に呼ぶ）
+	// 反映したら true を返すので、fromPos より先に描画したバッファを捨てる
+	bool applyPendingPlaybackRate(int64 fromPos);
+
+	// 先頭から再生し直すときに呼び、曲の全体を今の速度で再生する
+	void restartPlaybackTime();
+
+	// 再生を始めてからの秒数を、曲の秒数に直す
+	double toSongSeconds(double playbackSeconds) const;
 
 	void getSamples(float* left, float* right, int64 startPos, int64 sampleCount);
 
 private:
 
-	Program* refProgram(const TrackData& trackData);
+	std::shared_ptr<const PlaybackTimeMap> timeMap() const;
+
+	int64 toPlaybackPos(int64 songPos) const;
+
+	// コントローラーが変わったときに、速度を変えた区間の先頭の経過サンプル数を数え直す（soundSet の eventMutex を取った状態で呼ぶ）
+	void updateTimeMapWarped(const AutomationSet& automation);
+
+	void waitSoundSetLoading();
+
+	void finishSoundSetLoading();
+
+	// previous からノートの変わった音源だけを登録し直す。戻り値は鳴り方が変わる最初の再生位置（変化が無ければ none）
+	// サウンドセットの読み込みが終わっている状態で、ワーカーから呼ぶ
+	Optional<int64> updateMidiData(const MidiData& previous, const MidiData& current, SoundSetLoadProgress& progress);
+
+
+	std::atomic<std::shared_ptr<SoundSet>> m_soundSet;
+	std::atomic<std::shared_ptr<SoundSet>> m_pendingSoundSet;
+
+	// m_soundSet を差し替えるときと、再生中でないときにイベントを登録し直すときに取る
+	// 再生中に登録し直した音源は、組み立て終えてから差し込むときだけ取る
+	std::mutex m_swapMutex;
+
+	std::future<void> m_loadingTask;
+	std::shared_ptr<SoundSetLoadProgress> m_loadProgress;
+	String m_titleBeforeLoading;
+	Stopwatch m_loadingTimer;
+
+	std::shared_ptr<MidiStreamLoad> m_midiStream;
+	std::future<void> m_streamTask;
+	// 曲の位置で持つ
+	std::atomic<int64> m_renderableUntil = INT64_MAX;
 
-	Array<Program> m_soundSet;
-	Array<Program> m_drumKit;
+	std::shared_ptr<MidiReload> m_midiReload;
+	std::future<void> m_midiReloadTask;
 
-	Array<uint8> m_programChangeNumberToSoundSetIndex;
+	// 曲の位置と再生位置の対応（速度を変えるたびに作り直して差し替える。nullptr なら等倍）
+	std::atomic<std::shared_ptr<const PlaybackTimeMap>> m_timeMap;
+	std::mutex m_timeMapMutex;
+	std::atomic<double> m_playbackRate = 1.0;
 
 	RectF m_area;
 
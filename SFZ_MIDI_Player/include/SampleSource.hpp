@@ -1,38 +1,35 @@
 ﻿#pragma once
 #include <Siv3D.hpp>
 #include "SFZLoader.hpp"
+#include "NoteEventList.hpp"
+
+struct BlockAutomation;
+class PlaybackTimeMap;
 
 struct KeyDownEvent
 {
+	uint32 pressTimePos;
+	uint32 releaseTimePos = 0;
+
+	// compileEventsで決定する
+	int16 attackIndex = -1;
+
 	int8 key;
-	int64 pressTimePos;
 	uint8 velocity;
+	uint8 channel = 0;
 
 	KeyDownEvent() = delete;
 	KeyDownEvent(int8 key, int64 pressTimePos, uint8 velocity) :
+		pressTimePos(static_cast<uint32>(pressTimePos)),
 		key(key),
-		pressTimePos(pressTimePos),
 		velocity(velocity)
 	{}
-};
-
-struct NoteEvent
-{
-	int64 attackIndex;
-	int64 releaseIndex;
-	int64 pressTimePos;
-	int64 releaseTimePos;
-	uint8 velocity;
-
-	Optional<int64> disableTimePos;
-
-	NoteEvent() = delete;
-	NoteEvent(int64 attackIndex, int64 releaseIndex, int64 pressTimePos, int64 releaseTimePos, uint8 velocity) :
-		attackIndex(attackIndex),
-		releaseIndex(releaseIndex),
-		pressTimePos(pressTimePos),
-		releaseTimePos(releaseTimePos),
-		velocity(velocity)
+	KeyDownEvent(int8 key, int64 pressTimePos, int64 releaseTimePos, uint8 velocity, uint8 channel = 0) :
+		pressTimePos(static_cast<uint32>(pressTimePos)),
+		releaseTimePos(static_cast<uint32>(releaseTimePos)),
+		key(key),
+		velocity(velocity),
+		channel(channel)
 	{}
 };
 
@@ -78,6 +75,40 @@ private:
 
 class AudioLoaderBase;
 
+// sw_lokey, sw_hikey, sw_default の組ごとに、直前に押されたキースイッチを保持する
+class KeySwitchState
+{
+public:
+
+	// 同じ組が登録済みならそのインデックスを返す
+	uint32 addRange(int8 lokey, int8 hikey, Optional<int8> defaultKey);
+
+	void clear();
+
+	// 全ての組を sw_default の状態に戻す
+	void reset();
+
+	void press(int8 key);
+
+	// 範囲内のキーがまだ押されておらず sw_default もない場合は -1
+	int8 current(uint32 rangeIndex) const { return m_current[rangeIndex]; }
+
+	size_t rangeCount() const { return m_ranges.size(); }
+
+private:
+
+	struct Range
+	{
+		int8 lokey;
+		int8 hikey;
+		int8 defaultKey;
+	};
+
+	Array<Range> m_ranges;
+
+	Array<int8> m_current;
+};
+
 enum class OscillatorType
 {
 	Sine,
@@ -88,19 +119,31 @@ enum class OscillatorType
 	Silence,
 };
 
+// キーに割り当てたリージョン（キーごとに違うのはピッチだけなので、リージョン本体はInstrumentに1つだけ持つ）
+struct KeyRegion
+{
+	uint32 regionIndex;
+
+	// 再生速度（1 == 元のピッチ）
+	float speed;
+
+	// オシレータの周波数
+	float frequency;
+};
+
 // 1つのソース音源に対応
 struct AudioSource
 {
 public:
 
-	AudioSource(float amplitude, const Envelope& envelope, uint8 lovel, uint8 hivel, int32 tune);
+	AudioSource(float amplitude, const Envelope& envelope, uint8 lovel, uint8 hivel);
 
 	void setWaveIndex(size_t index)
 	{
 		m_index = index;
 	}
 
-	void setOscillator(OscillatorType oscillatorType, float frequency);
+	void setOscillator(OscillatorType oscillatorType);
 
 	void setSwitch(int8 swLokey, int8 swHikey, int8 swLast, int8 swDefault);
 
@@ -113,21 +156,27 @@ public:
 		return m_lovel <= velocity && velocity <= m_hivel;
 	}
 
-	bool isValidSwLast(int64 pressTimePos, const Array<KeyDownEvent>& history) const;
+	// sw_* が揃っている場合は範囲を登録して、そのインデックスを返す
+	Optional<uint32> registerSwitch(KeySwitchState& state);
+
+	bool isValidSwitch(const KeySwitchState& state) const;
+
+	const Optional<uint32>& switchRange() const { return m_swRange; }
 
 	void setRtDecay(float rtDecay);
 
 	size_t sampleRate() const;
 
-	size_t lengthSample() const;
+	size_t lengthSample(const KeyRegion& keyRegion) const;
 
-	float getSpeed() const;
+	WaveSample getSample(int64 index, const KeyRegion& keyRegion) const;
 
-	WaveSample getSample(int64 index) const;
+	// ピッチベンドで読む位置が小数になるとき用（終わりより先は無音）
+	WaveSample getSample(double index, const KeyRegion& keyRegion) const;
 
 	const Envelope& envelope() const { return m_envelope; }
 
-	void use(size_t beginSampleIndex, size_t sampleCount);
+	void use(size_t beginSampleIndex, size_t sampleCount) const;
 
 	bool isOscillator() const { return m_oscillatorType.has_value(); }
 
@@ -135,22 +184,22 @@ public:
 	uint32 offBy() const { return m_offBy; }
 	float disableFadeSeconds() const { return m_disableFadeSeconds; }
 
-	double noteDuration(const NoteEvent& noteEvent) const;
+	double noteDuration(const NoteEvent& noteEvent, const KeyRegion& keyRegion) const;
 	bool isOneShot() const { return m_loopMode && m_loopMode.value() == LoopMode::OneShot; }
 
 private:
 
 	Optional<OscillatorType> m_oscillatorType;
-	float m_frequency;
 	size_t m_index;
 
 	const AudioLoaderBase& getReader() const;
-	AudioLoaderBase& getReader();
+
+	WaveSample getOscillatorSample(double index, const KeyRegion& keyRegion) const;
+
+	float decayedAmplitude(double index) const;
 
 	float m_amplitude;
 
-	int32 m_tune;// 100 == 1 semitone
-	float m_speed = 1;
 	Optional<float> m_rtDecay;
 
 	uint8 m_lovel;
@@ -163,56 +212,124 @@ private:
 	Optional<int8> m_swHikey;
 	Optional<int8> m_swLast;
 	Optional<int8> m_swDefault;
+	Optional<uint32> m_swRange;
 
 	uint32 m_group = 0;
 	uint32 m_offBy = 0;
 	float m_disableFadeSeconds = 0;
 };
 
+// 1つのsfzから作られたリージョンのテーブル
+struct Instrument
+{
+	Array<AudioSource> regions;
+
+	// MIDIキーごとに鳴らすリージョン（sfzに書かれた順）
+	std::array<Array<KeyRegion>, 128> attackRegions;
+	std::array<Array<KeyRegion>, 128> releaseRegions;
+
+	// attackリージョンが参照するキースイッチの範囲
+	KeySwitchState keySwitch;
+
+	size_t keyRegionCount() const;
+
+	size_t memoryUsage() const;
+};
+
 // 1つのキーから鳴らされるAudioSourceをまとめたもの
 class AudioKey
 {
 public:
 
-	void init(int8 key);
-
-	void addAttackKey(const AudioSource& source);
-
-	void addReleaseKey(const AudioSource& source);
+	// instrument は呼び出し側が保持し続ける
+	void init(int8 key, const Instrument* instrument);
 
 	bool hasAttackKey() const;
 
-	const NoteEvent& addEvent(uint8 velocity, int64 pressTimePos, int64 releaseTimePos, const Array<KeyDownEvent>& history);
+	// ベロシティ→リージョンの表を作る
+	void compile();
+
+	NoteEvent makeEvent(int64 attackIndex, uint8 velocity, int64 pressTimePos, int64 releaseTimePos, uint8 channel) const;
 
 	void clearEvent();
 
-	int64 getAttackIndex(uint8 velocity, int64 pressTimePos, const Array<KeyDownEvent>& history) const;
+	int64 getAttackIndex(uint8 velocity, const KeySwitchState& state) const;
 
 	const AudioSource& getAttackKey(int64 attackIndex) const;
 
+	const KeyRegion& getAttackRegion(int64 attackIndex) const;
+
 	int64 getReleaseIndex(uint8 velocity) const;
 
 	void debugPrint() const;
 
-	void sortEvent();
+	// 確定済みのイベントの後に追加する events から、直前のノートと近すぎるものを取り除く
+	void deleteDuplicate(Array<NoteEvent>& events) const;
+
+	// 組み立て終えたイベントを追加して確定する（MIDIを少しずつ読み込むとき、前の区間のイベントを並べ替えないように）
+	void appendEvents(const Array<NoteEvent>& events);
+
+	void commitEvents() { m_committedCount = m_noteEvents.size(); }
 
-	void deleteDuplicate();
+	size_t committedEventCount() const { return m_committedCount; }
 
-	void getSamples(float* left, float* right, int64 startPos, int64 sampleCount);
+	// 曲のキャッシュから読んだイベントを、確定済みのイベントとしてそのまま使う
+	void loadEvents(const NoteEvent* events, size_t count, const std::shared_ptr<const NoteSpillSegment>& segment)
+	{
+		m_noteEvents.assignMapped(events, count, segment);
+		commitEvents();
+	}
+
+	// 確定済みで frozenBefore より前に離されたイベントを退避する
+	void spillEvents(int64 frozenBefore, NoteSpillWriter& writer) { m_noteEvents.spill(m_committedCount, frozenBefore, writer); }
+
+	void getSamples(float* left, float* right, int64 startPos, int64 sampleCount, const BlockAutomation& automation);
 
-	Array<NoteEvent>& noteEvents() { return m_noteEvents; }
+	NoteEventList& noteEvents() { return m_noteEvents; }
+
+	const NoteEventList& noteEvents() const { return m_noteEvents; }
 
 private:
 
 	const static int64 BlendSampleCount = 100;
+	// キャッシュのキーに詰められるキースイッチ範囲の数
+	const static size_t MaxTableSwitchRanges = 8;
+
+	using VelocityTable = std::array<int32, 128>;
+
 	int8 noteKey;
-	Array<AudioSource> attackKeys;
-	Array<AudioSource> releaseKeys;
-	Array<NoteEvent> m_noteEvents;
+	const Instrument* m_instrument = nullptr;
+	NoteEventList m_noteEvents;
+	size_t m_committedCount = 0;
+
+	// 描画中のブロックの再生速度（等倍なら nullptr）。イベントは曲の位置のまま持ち、読むときに再生位置に直す
+	const PlaybackTimeMap* m_timeMap = nullptr;
+
+	const Array<KeyRegion>& attackKeys() const;
+
+	const Array<KeyRegion>& releaseKeys() const;
+
+	const AudioSource& source(const KeyRegion& keyRegion) const { return m_instrument->regions[keyRegion.regionIndex]; }
+
+	// attackKeysが参照するキースイッチ範囲
+	Array<uint32> m_switchRanges;
+	// キースイッチの状態 -> ベロシティごとのattackIndex
+	mutable HashTable<uint64, VelocityTable> m_attackTables;
+	VelocityTable m_releaseTable;
+
+	VelocityTable makeAttackTable(const KeySwitchState& state) const;
+
+	int64 findAttackIndex(uint8 velocity, const KeySwitchState& state) const;
+
+	// 再生位置に直したイベント
+	NoteEvent event(int64 noteIndex) const;
+
+	// 再生位置で pressTimePos が timePos より後の最初のイベント
+	size_t upperBound(int64 timePos) const;
 
-	void render(float* left, float* right, int64 startPos, int64 sampleCount, int64 noteIndex);
+	void render(float* left, float* right, int64 startPos, int64 sampleCount, int64 noteIndex, const BlockAutomation& automation);
 
-	void renderRelease(float* left, float* right, int64 startPos, int64 sampleCount, int64 noteIndex);
+	void renderRelease(float* left, float* right, int64 startPos, int64 sampleCount, int64 noteIndex, const BlockAutomation& automation);
 
 	int64 getWriteIndexHead(int64 startPos, int64 noteIndex) const;
 
@@ -0,0 +1,88 @@
+﻿#pragma once
+#include <Siv3D.hpp>
+#include "NoteEventList.hpp"
+#include "Utility.hpp"
+
+// 組み立てたイベントを曲ごとにファイルに保存しておき、同じMIDIを同じサウンドセットで開き直したときは組み立てを省略する
+// MIDIファイルのハッシュとサウンドセットの指紋が一致し、使った音源のファイルが更新されていなければ使える
+class SongCache
+{
+public:
+
+	// イベントを持つ音源1つ分
+	struct ProgramRecord
+	{
+		bool isDrum = false;
+
+		// melodies または drumKit のインデックス
+		uint32 index = 0;
+
+		// 音源の組み立てに使ったファイル
+		Array<std::pair<FilePath, FileStamp>> files;
+	};
+
+	// 書き出すキー1つ分のイベント
+	struct KeyEvents
+	{
+		uint32 programRecordIndex;
+		uint8 keyIndex;
+		const NoteEventList* events;
+	};
+
+	// 読み込んだキー1つ分のイベント（segment にマップしたファイルを指す）
+	struct MappedKeyEvents
+	{
+		uint32 programRecordIndex;
+		uint8 keyIndex;
+		const NoteEvent* events;
+		size_t count;
+	};
+
+	// キャッシュのファイル名に使う（同じMIDIファイルの古いキャッシュを見つけられるように、パスとファイルの状態を分けて持つ）
+	struct MidiKey
+	{
+		// 正規化したパスのハッシュ
+		uint64 pathHash = 0;
+
+		// パスとサイズ・更新日時から作るハッシュ
+		uint64 fileHash = 0;
+	};
+
+	struct Timeline
+	{
+		std::shared_ptr<const NoteSpillSegment> segment;
+		Array<ProgramRecord> programs;
+		Array<MappedKeyEvents> keys;
+	};
+
+	static SongCache& i()
+	{
+		static SongCache obj;
+		return obj;
+	}
+
+	// setup() が呼ばれるまではキャッシュは無効
+	void setup(FilePathView directory);
+
+	bool isEnabled() const { return m_isEnabled; }
+
+	// MIDIファイルのパスとサイズ・更新日時から作るハッシュ（大きなMIDIでも中身を読まずに済むように）
+	static Optional<MidiKey> HashMidiFile(FilePathView midiPath);
+
+	// 見つからないか、形式や指紋が違うか、音源のファイルが更新されていれば none
+	Optional<Timeline> load(const MidiKey& midiKey, uint64 soundSetFingerprint) const;
+
+	// 同じパスの更新前のMIDIのキャッシュは消す
+	void save(const MidiKey& midiKey, uint64 soundSetFingerprint, const Array<ProgramRecord>& programs, const Array<KeyEvents>& keys) const;
+
+private:
+
+	SongCache() = default;
+
+	FilePath cacheFilePath(const MidiKey& midiKey) const;
+
+	void removeOutdatedFiles(const MidiKey& midiKey) const;
+
+	bool m_isEnabled = false;
+	FilePath m_directory;
+};
@@ -0,0 +1,68 @@
+﻿#pragma once
+#include <Siv3D.hpp>
+
+// 音源やMIDIの読み込みを並列に処理するためのスレッドプール
+class TaskPool
+{
+public:
+
+	static TaskPool& i()
+	{
+		static TaskPool obj;
+		return obj;
+	}
+
+	size_t concurrency() const { return m_workers.size(); }
+
+	template<class Func>
+	auto submit(Func&& func) -> std::future<std::invoke_result_t<Func>>
+	{
+		using Result = std::invoke_result_t<Func>;
+
+		auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Func>(func));
+		auto future = task->get_future();
+
+		{
+			std::lock_guard lock(m_mutex);
+			m_tasks.emplace_back([task] { (*task)(); });
+		}
+		m_condition.notify_one();
+
+		return future;
+	}
+
+	// [0, count) を並列に処理する。呼び出し元のスレッドも処理に参加する
+	void parallelFor(size_t count, const std::function<void(size_t)>& func);
+
+	// 待っている間もキューに積まれたタスクを処理する（ワーカーから呼ばれた場合のデッドロックを避けるため）
+	template<class T>
+	T wait(std::future<T>& future)
+	{
+		while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		{
+			if (!runPendingTask())
+			{
+				future.wait_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		return future.get();
+	}
+
+private:
+
+	TaskPool();
+
+	~TaskPool();
+
+	bool runPendingTask();
+
+	void workerLoop();
+
+	Array<std::thread> m_workers;
+	std::deque<std::function<void()>> m_tasks;
+	bool m_isFinish = false;
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+};
@@ -21,42 +21,148 @@ inline std::pair<RectType, RectType> SplitLeftRight(const RectType& rect, double
 	);
 }
 
-inline uint8 ReadByte(BinaryReader& reader)
+// キャッシュのファイル名やキーの計算に使う（実行をまたいで同じ値になる必要がある）
+constexpr uint64 FNV1a(const uint8* data, size_t size, uint64 hash = 14695981039346656037ull)
 {
-	uint8 byte[1] = {};
-	reader.read(byte, 1);
-	return byte[0];
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
 }
 
-template<typename T>
-inline T ReadBytes(BinaryReader& reader)
+constexpr uint64 FNV1a(std::string_view str, uint64 hash = 14695981039346656037ull)
 {
-	uint8 bytes[sizeof(T)] = {};
-	reader.read(bytes, sizeof(T));
-	T value = 0;
-	for (size_t i = 0; i < sizeof(T); i++)
+	for (const char c : str)
 	{
-		value += (bytes[i] << ((sizeof(T) - i - 1) * 8));
+		hash ^= static_cast<uint8>(c);
+		hash *= 1099511628211ull;
 	}
-	return value;
+	return hash;
+}
+
+inline uint64 FNV1a(StringView str, uint64 hash = 14695981039346656037ull)
+{
+	return FNV1a(std::bit_cast<const uint8*>(str.data()), str.size() * sizeof(char32), hash);
 }
 
-inline std::string ReadText(BinaryReader& reader)
+// 同じファイルを指すパスが同じ文字列になるようにする（Windowsでは大文字小文字を区別しない）
+inline String NormalizePath(FilePathView path)
 {
-	const uint8 length = ReadBytes<uint8>(reader);
-	Array<char> chars(length + 1ull, '\0');
-	reader.read(chars.data(), length);
-	return std::string(chars.data());
+#if SIV3D_PLATFORM(WINDOWS)
+	return FileSystem::FullPath(path).replaced(U'\\', U'/').lowercased();
+#else
+	return FileSystem::FullPath(path).replaced(U'\\', U'/');
+#endif
 }
 
-inline uint32 GetTick(const Array<uint8>& tickBytes)
+// ファイルが更新されたかどうかをサイズと更新日時で判定する
+struct FileStamp
 {
-	uint32 value = 0;
-	for (size_t i = 0; i < tickBytes.size(); i++)
+	int64 size = 0;
+	int64 writeTime = 0;
+
+	bool operator==(const FileStamp&) const = default;
+};
+
+inline Optional<FileStamp> GetFileStamp(FilePathView path)
+{
+	const auto writeTime = FileSystem::WriteTime(path);
+	if (!FileSystem::IsFile(path) || !writeTime)
 	{
-		value += ((tickBytes[i] & 0x7F) << ((tickBytes.size() - i - 1) * 7));
+		return none;
 	}
-	return value;
+
+	const auto& t = writeTime.value();
+	const int64 packedTime = ((((((int64{ t.year } * 13 + t.month) * 32 + t.day) * 24 + t.hour) * 60 + t.minute) * 60 + t.second) * 1000) + t.milliseconds;
+
+	return FileStamp{ FileSystem::FileSize(path), packedTime };
+}
+
+// 存在しなかったファイルの FileStamp（後から作られたら更新されたとみなす）
+inline constexpr FileStamp MissingFileStamp{ -1, 0 };
+
+inline FileStamp GetFileStampOrMissing(FilePathView path)
+{
+	return GetFileStamp(path).value_or(MissingFileStamp);
+}
+
+// キャッシュファイルの読み書き
+inline void WriteString(BinaryWriter& writer, StringView str)
+{
+	const auto utf8 = Unicode::ToUTF8(str);
+	writer.write(static_cast<uint32>(utf8.size()));
+	writer.write(utf8.data(), utf8.size());
+}
+
+inline void WriteStamp(BinaryWriter& writer, const FileStamp& stamp)
+{
+	writer.write(stamp.size);
+	writer.write(stamp.writeTime);
+}
+
+// メモリマップしたキャッシュファイルを先頭から読む（範囲外を読もうとしたら以降は失敗扱い）
+class CacheReader
+{
+public:
+
+	CacheReader(const uint8* data, size_t size) :
+		m_data(data),
+		m_size(size)
+	{}
+
+	bool isValid() const { return m_isValid; }
+
+	template<class T>
+	T read()
+	{
+		T value = {};
+		if (m_isValid && sizeof(T) <= m_size - m_pos)
+		{
+			std::memcpy(&value, m_data + m_pos, sizeof(T));
+			m_pos += sizeof(T);
+		}
+		else
+		{
+			m_isValid = false;
+		}
+		return value;
+	}
+
+	String readString()
+	{
+		const auto length = read<uint32>();
+		if (!m_isValid || m_size - m_pos < length)
+		{
+			m_isValid = false;
+			return U"";
+		}
+
+		const auto str = Unicode::FromUTF8(std::string_view(std::bit_cast<const char*>(m_data + m_pos), length));
+		m_pos += length;
+		return str;
+	}
+
+	FileStamp readStamp()
+	{
+		FileStamp stamp;
+		stamp.size = read<int64>();
+		stamp.writeTime = read<int64>();
+		return stamp;
+	}
+
+private:
+
+	const uint8* m_data;
+	size_t m_size;
+	size_t m_pos = 0;
+	bool m_isValid = true;
+};
+
+inline bool IsUpToDate(FilePathView path, const FileStamp& stamp)
+{
+	return GetFileStampOrMissing(path) == stamp;
 }
 
 inline void DrawDotLine(const Line& line, double unitLength, double interval, double thickness, const Color color)
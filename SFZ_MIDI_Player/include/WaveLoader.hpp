@@ -2,22 +2,28 @@
 #include <Siv3D.hpp>
 #include "AudioLoaderBase.hpp"
 #include "MemoryBlockList.hpp"
+#include "FileHandleCache.hpp"
 
 class WaveLoader : public AudioLoaderBase
 {
 public:
 
-	WaveLoader(FilePathView path, size_t debugId);
+	// preset が与えられた場合はヘッダを読まずにその値を使う
+	WaveLoader(FilePathView path, size_t debugId, const Optional<SampleInfo>& preset = none);
 
 	virtual ~WaveLoader() = default;
 
-	size_t size() const override { return m_dataSizeOfBytes; }
+	size_t size() const override { ensureInit(); return m_dataSizeOfBytes; }
 
-	size_t sampleRate() const override { return m_sampleRate; }
+	size_t sampleRate() const override { ensureInit(); return m_sampleRate; }
 
-	float sampleRateInv() const override { return m_sampleRateInv; }
+	float sampleRateInv() const override { ensureInit(); return m_sampleRateInv; }
 
-	size_t lengthSample() const override { return m_lengthSample; }
+	size_t lengthSample() const override { ensureInit(); return m_lengthSample; }
+
+	void probe() const override { ensureInit(); }
+
+	SampleInfo sampleInfo() const override;
 
 	void use(size_t beginSampleIndex, size_t sampleCount) override;
 
@@ -27,6 +33,11 @@ public:
 
 	WaveSample getSample(int64 index) const override;
 
+	// 16bit 2ch のwavヘッダを書き込む（dataチャンクの中身が CanonicalDataOffset から始まるようにJUNKチャンクで埋める）
+	static void WriteCanonicalHeader(BinaryWriter& writer, uint32 sampleRate, uint64 lengthSample);
+
+	static const int64 CanonicalDataOffset;
+
 private:
 
 	struct WaveFileFormat
@@ -41,10 +52,15 @@ private:
 
 	void init();
 
+	void applyInfo(const SampleInfo& info);
+
+	void ensureInit() const;
+
 	void readBlock(size_t beginSampleIndex, size_t sampleCount);
 
-	BinaryReader m_waveReader;
-	FilePath m_filePath;
+	// FileHandleCache に登録したファイル
+	FileHandleCache::FileId m_fileId;
+	mutable std::once_flag m_initFlag;
 
 	WaveFileFormat m_format = {};
 	int64 m_dataBeginPos = 0;
@@ -2,25 +2,192 @@
 #include <AudioLoadManager.hpp>
 #include <WaveLoader.hpp>
 #include <FlacLoader.hpp>
+#include <SampleCache.hpp>
+#include <TaskPool.hpp>
+#include <Utility.hpp>
 
-size_t AudioLoadManager::load(FilePathView path)
+namespace
 {
-	for (auto [i, wavePath] : Indexed(m_paths))
+	Optional<uint64> HashFileContent(FilePathView path)
 	{
-		if (wavePath == path)
+		BinaryReader reader(path);
+		if (!reader)
 		{
-			return i;
+			return none;
 		}
+
+		Array<uint8> buffer(1 << 16);
+		uint64 hash = FNV1a(nullptr, 0);
+
+		for (;;)
+		{
+			const auto readBytes = reader.read(buffer.data(), static_cast<int64>(buffer.size()));
+			if (readBytes <= 0)
+			{
+				break;
+			}
+
+			hash = FNV1a(buffer.data(), static_cast<size_t>(readBytes), hash);
+		}
+
+		return hash;
+	}
+
+	// ハッシュが衝突していても別のサンプルを鳴らさないように、最後は中身を比べる
+	bool IsSameFileContent(FilePathView path1, FilePathView path2)
+	{
+		BinaryReader reader1(path1);
+		BinaryReader reader2(path2);
+		if (!reader1 || !reader2 || reader1.size() != reader2.size())
+		{
+			return false;
+		}
+
+		Array<uint8> buffer1(1 << 16);
+		Array<uint8> buffer2(1 << 16);
+
+		for (;;)
+		{
+			const auto readBytes1 = reader1.read(buffer1.data(), static_cast<int64>(buffer1.size()));
+			const auto readBytes2 = reader2.read(buffer2.data(), static_cast<int64>(buffer2.size()));
+			if (readBytes1 != readBytes2)
+			{
+				return false;
+			}
+
+			if (readBytes1 <= 0)
+			{
+				return true;
+			}
+
+			if (std::memcmp(buffer1.data(), buffer2.data(), static_cast<size_t>(readBytes1)) != 0)
+			{
+				return false;
+			}
+		}
+	}
+}
+
+Optional<size_t> AudioLoadManager::findSameContent(FilePathView path, int64 size)
+{
+	// 候補だけをロックして取り出す（パスは m_paths にあるので、ロックを離しても動かない）
+	Array<std::pair<size_t, SampleFile>> candidates;
+	{
+		std::lock_guard lock(m_mutex);
+
+		auto it = m_indicesBySize.find(size);
+		if (it == m_indicesBySize.end())
+		{
+			return none;
+		}
+
+		for (auto index : it->second)
+		{
+			candidates.emplace_back(index, m_sampleFiles[index]);
+		}
+	}
+
+	const auto contentHash = HashFileContent(path);
+	if (!contentHash)
+	{
+		return none;
+	}
+
+	for (auto& [index, sampleFile] : candidates)
+	{
+		if (!sampleFile.contentHash)
+		{
+			sampleFile.contentHash = HashFileContent(sampleFile.path);
+
+			std::lock_guard lock(m_mutex);
+			m_sampleFiles[index].contentHash = sampleFile.contentHash;
+		}
+
+		if (sampleFile.contentHash == contentHash && IsSameFileContent(path, sampleFile.path))
+		{
+			return index;
+		}
+	}
+
+	return none;
+}
+
+FilePathView AudioLoadManager::internPath(FilePathView path)
+{
+	m_paths.emplace_back(path);
+	return m_paths.back();
+}
+
+size_t AudioLoadManager::load(FilePathView path, const Optional<SampleInfo>& preset)
+{
+	auto normalizedPath = NormalizePath(path);
+	const auto fileSize = FileSystem::FileSize(path);
+
+	// 中身の比較はロックの外で行う（その間に同じサイズのファイルが追加されたら、まとめずに別々に読む）
+	Optional<size_t> sameIndex;
+	if (m_contentDeduplication)
+	{
+		{
+			std::lock_guard lock(m_mutex);
+			if (auto it = m_pathIndex.find(normalizedPath); it != m_pathIndex.end())
+			{
+				return it->second;
+			}
+		}
+
+		sameIndex = findSameContent(path, fileSize);
+	}
+
+	std::lock_guard lock(m_mutex);
+
+	if (auto it = m_pathIndex.find(normalizedPath); it != m_pathIndex.end())
+	{
+		return it->second;
 	}
 
-	const auto i = m_paths.size();
+	if (sameIndex)
+	{
+		m_pathIndex.emplace(std::move(normalizedPath), sameIndex.value());
+		m_deduplicatedBytes += fileSize;
+		++m_deduplicatedCount;
+		return sameIndex.value();
+	}
+
+	const auto i = m_readerCount.load();
+
+	if (MaxReaderChunks * ReaderChunkSize <= i)
+	{
+		Console << U"error 読み込めるサンプル数の上限を超えました\"" << path << U"\"";
+
+		return std::numeric_limits<size_t>::max();
+	}
+
+	const auto presetFor = [&](SampleContainer container) -> Optional<SampleInfo>
+	{
+		if (preset && preset->container == container)
+		{
+			return preset;
+		}
+		return none;
+	};
+
 	if (FileSystem::Extension(path) == U"wav")
 	{
-		m_waveReaders.push_back(std::make_unique<WaveLoader>(path, i));
+		path = internPath(path);
+		addReader(std::make_unique<WaveLoader>(path, i, presetFor(SampleContainer::Wave)));
 	}
 	else if (FileSystem::Extension(path) == U"flac")
 	{
-		m_waveReaders.push_back(std::make_unique<FlacLoader>(path, i));
+		// 変換済みのキャッシュがあればデコードせずにwavとして読む
+		path = internPath(path);
+		if (auto cachePath = SampleCache::i().request(path))
+		{
+			addReader(std::make_unique<WaveLoader>(internPath(cachePath.value()), i, presetFor(SampleContainer::Wave)));
+		}
+		else
+		{
+			addReader(std::make_unique<FlacLoader>(path, i, presetFor(SampleContainer::Flac)));
+		}
 	}
 	else
 	{
@@ -29,35 +196,72 @@ size_t AudioLoadManager::load(FilePathView path)
 		return std::numeric_limits<size_t>::max();
 	}
 
-	m_paths.emplace_back(path);
+	m_sampleFiles.push_back(SampleFile{ path, fileSize, none });
+	m_indicesBySize[fileSize].push_back(i);
+	m_pathIndex.emplace(std::move(normalizedPath), i);
 
 	return i;
 }
 
+void AudioLoadManager::probeHeaders(size_t beginIndex, std::atomic<size_t>& probedCount)
+{
+	const size_t endIndex = readerCount();
+	if (endIndex <= beginIndex)
+	{
+		return;
+	}
+
+	TaskPool::i().parallelFor(endIndex - beginIndex, [&](size_t i)
+		{
+			reader(beginIndex + i).probe();
+			++probedCount;
+		});
+}
+
+void AudioLoadManager::addReader(std::unique_ptr<AudioLoaderBase> reader)
+{
+	const size_t index = m_readerCount.load();
+	auto& chunk = m_waveReaders[index / ReaderChunkSize];
+	if (!chunk)
+	{
+		chunk = std::make_unique<std::unique_ptr<AudioLoaderBase>[]>(ReaderChunkSize);
+	}
+
+	chunk[index % ReaderChunkSize] = std::move(reader);
+	m_readerCount.store(index + 1, std::memory_order_release);
+}
+
+size_t AudioLoadManager::readerCount() const
+{
+	return m_readerCount.load(std::memory_order_acquire);
+}
+
 void AudioLoadManager::markBlocks()
 {
-	for (auto& reader : m_waveReaders)
+	const size_t count = readerCount();
+	for (size_t i = 0; i < count; ++i)
 	{
-		reader->markUnused();
+		reader(i).markUnused();
 	}
 }
 
 void AudioLoadManager::freeUnusedBlocks()
 {
-	for (auto& reader : m_waveReaders)
+	const size_t count = readerCount();
+	for (size_t i = 0; i < count; ++i)
 	{
-		reader->freeUnusedBlocks();
+		reader(i).freeUnusedBlocks();
 	}
 }
 
 const AudioLoaderBase& AudioLoadManager::reader(size_t index) const
 {
-	return *m_waveReaders[index];
+	return *m_waveReaders[index / ReaderChunkSize][index % ReaderChunkSize];
 }
 
 AudioLoaderBase& AudioLoadManager::reader(size_t index)
 {
-	return *m_waveReaders[index];
+	return *m_waveReaders[index / ReaderChunkSize][index % ReaderChunkSize];
 }
 
 void AudioLoadManager::debugLog([[maybe_unused]] const String& str)
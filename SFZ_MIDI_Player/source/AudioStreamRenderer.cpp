@@ -8,7 +8,9 @@
 #include <Program.hpp>
 
 AudioStreamRenderer::AudioStreamRenderer() :
-	m_writeBlocks(0, MemoryPool::RenderAudio)
+	m_writeBlocks(0, MemoryPool::RenderAudio),
+	m_renderLeft(MemoryPool::UnitBlockSampleLength),
+	m_renderRight(MemoryPool::UnitBlockSampleLength)
 {
 }
 
@@ -36,6 +38,7 @@ void AudioStreamRenderer::clearBuffer()
 {
 	lock();
 	m_writeBlocks.deallocate();
+	++m_discardCount;
 	unlock();
 }
 
@@ -43,6 +46,7 @@ void AudioStreamRenderer::playRestart()
 {
 	lock();
 	m_writeBlocks.deallocate();
+	++m_discardCount;
 	m_isPlaying = true;
 	m_bufferBeginSample = 0;
 	unlock();
@@ -64,15 +68,27 @@ void AudioStreamRenderer::update(SamplePlayer& samplePlayer)
 	AudioLoadManager::i().markBlocks();
 
 	lock();
-	const auto block = static_cast<uint32>(bufferEndSample() / MemoryPool::UnitBlockSampleLength);
+	const int64 beginSample = bufferEndSample();
+	const uint64 discardCount = m_discardCount;
+	unlock();
 
-	const auto leftIndex = 2 * block;
-	const auto rightIndex = leftIndex + 1;
-	//Console << U"allocate " << leftIndex << U", " << rightIndex;
-	auto left = m_writeBlocks.allocateSingleBlock(leftIndex);
-	auto right = m_writeBlocks.allocateSingleBlock(rightIndex);
-	samplePlayer.getSamples(std::bit_cast<float*>(left), std::bit_cast<float*>(right), bufferEndSample(), MemoryPool::UnitBlockSampleLength);
+	// 描画には時間がかかるので、その間も音声スレッドが getSample() で読めるようにロックの外で行う
+	samplePlayer.getSamples(m_renderLeft.data(), m_renderRight.data(), beginSample, MemoryPool::UnitBlockSampleLength);
 
+	lock();
+	// 描画している間に捨てられた場合は、次の update() で描画し直す
+	if (discardCount == m_discardCount && beginSample == bufferEndSample())
+	{
+		const auto block = static_cast<uint32>(beginSample / MemoryPool::UnitBlockSampleLength);
+
+		const auto leftIndex = 2 * block;
+		const auto rightIndex = leftIndex + 1;
+		//Console << U"allocate " << leftIndex << U", " << rightIndex;
+		auto left = m_writeBlocks.allocateSingleBlock(leftIndex);
+		auto right = m_writeBlocks.allocateSingleBlock(rightIndex);
+		std::memcpy(left, m_renderLeft.data(), MemoryPool::UnitBlockSampleLength * sizeof(float));
+		std::memcpy(right, m_renderRight.data(), MemoryPool::UnitBlockSampleLength * sizeof(float));
+	}
 	unlock();
 
 	AudioLoadManager::i().freeUnusedBlocks();
@@ -95,6 +111,20 @@ void AudioStreamRenderer::freePastSample(int64 sampleIndex)
 	unlock();
 }
 
+void AudioStreamRenderer::discardFrom(int64 sampleIndex)
+{
+	const auto block = static_cast<uint32>(sampleIndex / MemoryPool::UnitBlockSampleLength) + 1;
+
+	lock();
+	if (block * MemoryPool::UnitBlockSampleLength < bufferEndSample())
+	{
+		m_writeBlocks.freeFollowingBlockIndex(2 * block);
+		++m_discardCount;
+		m_bufferBeginSample = Min(m_bufferBeginSample, static_cast<int64>(block) * MemoryPool::UnitBlockSampleLength);
+	}
+	unlock();
+}
+
 WaveSample AudioStreamRenderer::getSample(int64 index) const
 {
 	const auto block = static_cast<uint32>(index / MemoryPool::UnitBlockSampleLength);
@@ -105,6 +135,12 @@ WaveSample AudioStreamRenderer::getSample(int64 index) const
 	const auto rightBlockIndex = leftBlockIndex + 1;
 
 	lock();
+	// MIDIの読み込みが再生に追いつかなかった場合は、まだ描画されていないので無音にする
+	if (!m_writeBlocks.isAllocatedBlock(leftBlockIndex) || !m_writeBlocks.isAllocatedBlock(rightBlockIndex))
+	{
+		unlock();
+		return WaveSample(0, 0);
+	}
 	auto leftBlock = std::bit_cast<float*>(m_writeBlocks.getBlock(leftBlockIndex));
 	auto rightBlock = std::bit_cast<float*>(m_writeBlocks.getBlock(rightBlockIndex));
 	unlock();
@@ -0,0 +1,406 @@
+﻿#pragma once
+#include <Automation.hpp>
+#include <MIDILoader.hpp>
+
+namespace
+{
+	// GMの音量カーブ（CC7 は 100 を等倍とする）
+	float VolumeGain(float volume)
+	{
+		const float x = volume / 100.0f;
+		return x * x;
+	}
+
+	float ExpressionGain(float expression)
+	{
+		const float x = expression / 127.0f;
+		return x * x;
+	}
+
+	// 中央で両方とも等倍になるバランス
+	std::pair<float, float> PanGain(float pan)
+	{
+		const float x = Clamp((pan - 64.0f) / 63.0f, -1.0f, 1.0f);
+		return { x > 0 ? 1.0f - x : 1.0f, x < 0 ? 1.0f + x : 1.0f };
+	}
+}
+
+PlaybackTimeMap::PlaybackTimeMap(double rate) :
+	m_segments({ Segment{ 0, 0, rate } })
+{}
+
+void PlaybackTimeMap::setRate(int64 playPos, double rate, const AutomationSet& automation)
+{
+	playPos = Max(playPos, 0ll);
+
+	const auto it = std::lower_bound(m_segments.begin() + 1, m_segments.end(), playPos,
+		[](const Segment& segment, int64 value) { return segment.playPos < value; });
+	m_segments.erase(it, m_segments.end());
+
+	if (m_segments.back().playPos == playPos)
+	{
+		m_segments.back().rate = rate;
+		return;
+	}
+
+	if (m_segments.back().rate == rate)
+	{
+		return;
+	}
+
+	m_segments.push_back(Segment{ toSong(playPos), playPos, rate });
+	updateWarped(automation, m_segments.size() - 1);
+}
+
+void PlaybackTimeMap::updateWarped(const AutomationSet& automation)
+{
+	for (size_t i = 1; i < m_segments.size(); ++i)
+	{
+		updateWarped(automation, i);
+	}
+}
+
+void PlaybackTimeMap::updateWarped(const AutomationSet& automation, size_t index)
+{
+	// 前の区間で曲の位置で積んだ分を、再生時間に直して足す
+	const auto& prev = m_segments[index - 1];
+	auto& segment = m_segments[index];
+
+	for (uint8 channel = 0; channel < 16; ++channel)
+	{
+		const double songWarped = automation.warpedPosition(channel, segment.songPos) - automation.warpedPosition(channel, prev.songPos);
+		segment.warped[channel] = prev.warped[channel] + songWarped / prev.rate;
+	}
+}
+
+size_t PlaybackTimeMap::indexAt(int64 playPos) const
+{
+	const auto it = std::upper_bound(m_segments.begin() + 1, m_segments.end(), playPos,
+		[](int64 value, const Segment& segment) { return value < segment.playPos; });
+	return std::distance(m_segments.begin(), it) - 1;
+}
+
+int64 PlaybackTimeMap::toPlayback(int64 songPos) const
+{
+	const auto it = std::upper_bound(m_segments.begin() + 1, m_segments.end(), songPos,
+		[](int64 value, const Segment& segment) { return value < segment.songPos; });
+	const auto& segment = *(it - 1);
+
+	// 切り捨てで揃えて、区間の境目の前後で順序が入れ替わらないようにする
+	return segment.playPos + static_cast<int64>(std::floor(static_cast<double>(songPos - segment.songPos) / segment.rate));
+}
+
+int64 PlaybackTimeMap::toSong(int64 playPos) const
+{
+	const auto& segment = m_segments[indexAt(playPos)];
+	return segment.songPos + static_cast<int64>(std::floor(static_cast<double>(playPos - segment.playPos) * segment.rate));
+}
+
+AutomationLane::AutomationLane(float defaultValue) :
+	m_defaultValue(defaultValue)
+{
+	clear();
+}
+
+void AutomationLane::clear()
+{
+	m_timePos = { 0 };
+	m_values = { m_defaultValue };
+}
+
+void AutomationLane::add(int64 timePos, float value)
+{
+	if (m_values.back() == value)
+	{
+		return;
+	}
+
+	// 同じ位置の変化は後のもので置き換える
+	if (m_timePos.back() == timePos)
+	{
+		m_values.back() = value;
+		return;
+	}
+
+	assert(m_timePos.back() < timePos);
+	m_timePos.push_back(timePos);
+	m_values.push_back(value);
+}
+
+size_t AutomationLane::indexAt(int64 timePos) const
+{
+	const auto it = std::upper_bound(m_timePos.begin() + 1, m_timePos.end(), timePos);
+	return std::distance(m_timePos.begin(), it) - 1;
+}
+
+void AutomationSet::Channel::addPitch(int64 timePos, float ratio)
+{
+	const size_t last = pitch.size() - 1;
+	const double lastWarped = warped[last] + pitch.value(last) * static_cast<double>(timePos - pitch.timePos(last));
+
+	pitch.add(timePos, ratio);
+
+	if (pitch.size() - 1 != last)
+	{
+		warped.push_back(lastWarped);
+	}
+}
+
+size_t BlockAutomation::Channel::segmentIndexAt(int64 offset) const
+{
+	const auto it = std::upper_bound(segments.begin() + 1, segments.end(), offset,
+		[](int64 value, const AutomationSegment& segment) { return value < segment.begin; });
+	return std::distance(segments.begin(), it) - 1;
+}
+
+double BlockAutomation::Channel::warpedAt(int64 offset) const
+{
+	const auto& segment = segments[segmentIndexAt(offset)];
+	return segment.warpedBegin + segment.pitchRatio * static_cast<double>(offset - segment.begin);
+}
+
+double BlockAutomation::warpedPosition(uint8 channel, int64 timePos) const
+{
+	return automation->warpedPosition(channel, timePos, *timeMap);
+}
+
+AutomationSet::AutomationSet()
+{
+	clear();
+}
+
+void AutomationSet::clear()
+{
+	m_channels = {};
+	m_completedUntil = 0;
+}
+
+void AutomationSet::append(const Array<TrackData>& tracks, uint32 tickBegin, uint32 tickEnd, const TempoMap& tempoMap)
+{
+	// 同じ tick のイベントはトラック順に適用する
+	Array<std::pair<size_t, ChannelEvent>> events;
+	for (const auto& [trackIndex, track] : Indexed(tracks))
+	{
+		const auto& channelEvents = track.channelEvents();
+		const size_t end = channelEvents.countBefore(tickEnd);
+		for (size_t i = channelEvents.countBefore(tickBegin); i < end; ++i)
+		{
+			const auto event = channelEvents[i];
+			const uint8 kind = event.status & 0xF0;
+			if (kind == 0xB0 || kind == 0xE0)
+			{
+				events.emplace_back(trackIndex, event);
+			}
+		}
+	}
+
+	std::stable_sort(events.begin(), events.end(), [](const auto& a, const auto& b) { return a.second.tick < b.second.tick; });
+
+	auto cursor = tempoMap.cursor();
+	for (const auto& [trackIndex, event] : events)
+	{
+		const int64 timePos = static_cast<int64>(Math::Round(cursor.ticksToSeconds(event.tick) * Wave::DefaultSampleRate));
+		addEvent(timePos, event.status, event.data1, event.data2);
+	}
+
+	m_completedUntil = (tickEnd == UINT32_MAX)
+		? INT64_MAX
+		: Max(m_completedUntil, static_cast<int64>(Math::Round(cursor.ticksToSeconds(tickEnd) * Wave::DefaultSampleRate)));
+}
+
+void AutomationSet::addEvent(int64 timePos, uint8 status, uint8 data1, uint8 data2)
+{
+	auto& channel = m_channels[status & 0x0F];
+
+	if ((status & 0xF0) == 0xE0)
+	{
+		const double semitones = (((data2 << 7) | data1) - 8192) / 8192.0 * channel.bendRange;
+		channel.addPitch(timePos, static_cast<float>(std::exp2(semitones / 12.0)));
+		return;
+	}
+
+	switch (data1)
+	{
+	case 6:
+		// RPN 0（ピッチベンドの幅）のデータエントリー
+		if (channel.rpnMsb == 0 && channel.rpnLsb == 0)
+		{
+			channel.bendRange = data2;
+		}
+		break;
+	case 7:
+		channel.volume.add(timePos, data2);
+		break;
+	case 10:
+		channel.pan.add(timePos, data2);
+		break;
+	case 11:
+		channel.expression.add(timePos, data2);
+		break;
+	case 64:
+	{
+		auto& sustains = channel.sustains;
+		const bool isDown = !sustains.isEmpty() && sustains.back().second == INT64_MAX;
+		if (64 <= data2 && !isDown)
+		{
+			sustains.emplace_back(timePos, INT64_MAX);
+		}
+		else if (data2 < 64 && isDown)
+		{
+			sustains.back().second = timePos;
+		}
+		break;
+	}
+	case 100:
+		channel.rpnLsb = data2;
+		break;
+	case 101:
+		channel.rpnMsb = data2;
+		break;
+	case 121:
+		// リセットオールコントローラー
+		channel.expression.add(timePos, 127);
+		channel.addPitch(timePos, 1.0f);
+		addEvent(timePos, status, 64, 0);
+		break;
+	default:
+		break;
+	}
+}
+
+int64 AutomationSet::sustainedRelease(uint8 channel, int64 releaseTimePos) const
+{
+	if (m_completedUntil <= releaseTimePos)
+	{
+		return PendingRelease;
+	}
+
+	const auto& sustains = m_channels[channel & 0x0F].sustains;
+
+	// 離鍵より前に踏まれた最後のペダル
+	const auto it = std::lower_bound(sustains.begin(), sustains.end(), releaseTimePos,
+		[](const std::pair<int64, int64>& sustain, int64 value) { return sustain.first < value; });
+
+	if (it == sustains.begin())
+	{
+		return releaseTimePos;
+	}
+
+	const auto& sustain = *(it - 1);
+	if (sustain.second <= releaseTimePos)
+	{
+		return releaseTimePos;
+	}
+
+	// まだ離されていないペダルは、曲の最後まで読むまで分からない
+	return (sustain.second == INT64_MAX && m_completedUntil != INT64_MAX) ? PendingRelease : sustain.second;
+}
+
+double AutomationSet::warpedPosition(uint8 channel, int64 timePos) const
+{
+	const auto& target = m_channels[channel & 0x0F];
+	const size_t index = target.pitch.indexAt(timePos);
+	return target.warped[index] + target.pitch.value(index) * static_cast<double>(timePos - target.pitch.timePos(index));
+}
+
+double AutomationSet::warpedPosition(uint8 channel, int64 playPos, const PlaybackTimeMap& timeMap) const
+{
+	if (timeMap.isIdentity())
+	{
+		return warpedPosition(channel, playPos);
+	}
+
+	// 区間の先頭までは数えてあるので、区間の中で曲の位置で積んだ分を再生時間に直して足す
+	const auto& segment = timeMap.segment(timeMap.indexAt(playPos));
+	const double songWarped = warpedPosition(channel, timeMap.toSong(playPos)) - warpedPosition(channel, segment.songPos);
+	return segment.warped[channel & 0x0F] + songWarped / segment.rate;
+}
+
+void AutomationSet::prepareBlock(int64 startPos, int64 sampleCount, const PlaybackTimeMap& timeMap, BlockAutomation& block) const
+{
+	block.automation = this;
+	block.timeMap = &timeMap;
+
+	const int64 endPos = startPos + sampleCount;
+
+	for (auto [channelIndex, channel] : Indexed(m_channels))
+	{
+		auto& output = block.channels[channelIndex];
+		output.segments.clear();
+		output.hasPitchBend = false;
+		output.maxPitchRatio = 1.0f;
+
+		const std::array<const AutomationLane*, 4> lanes = { &channel.volume, &channel.pan, &channel.expression, &channel.pitch };
+
+		// ブロックに掛かる再生速度の区間ごとに、曲の位置でレーンを辿る
+		for (size_t mapIndex = timeMap.indexAt(startPos); mapIndex < timeMap.size(); ++mapIndex)
+		{
+			const auto& mapSegment = timeMap.segment(mapIndex);
+			const int64 pieceBegin = Max(startPos, mapSegment.playPos);
+			if (endPos <= pieceBegin)
+			{
+				break;
+			}
+
+			const bool isLastPiece = (mapIndex + 1 == timeMap.size() || endPos <= timeMap.segment(mapIndex + 1).playPos);
+			const int64 pieceEnd = isLastPiece ? endPos : timeMap.segment(mapIndex + 1).playPos;
+			const int64 songBegin = timeMap.toSong(pieceBegin);
+			const int64 songEnd = isLastPiece ? timeMap.toSong(pieceEnd) : timeMap.segment(mapIndex + 1).songPos;
+
+			// 区間の先頭の経過サンプル数（再生時間で数える）と、曲の位置で数えた値
+			const double warpedOrigin = mapSegment.warped[channelIndex];
+			const double songWarpedOrigin = warpedPosition(static_cast<uint8>(channelIndex), mapSegment.songPos);
+
+			// 4つのレーンの変化点をまとめて、ブロック内の区間に分ける
+			std::array<size_t, 4> indices;
+			for (size_t i = 0; i < lanes.size(); ++i)
+			{
+				indices[i] = lanes[i]->indexAt(songBegin);
+			}
+
+			int64 segmentBegin = songBegin;
+			while (true)
+			{
+				const float volume = VolumeGain(channel.volume.value(indices[0]));
+				const float expression = ExpressionGain(channel.expression.value(indices[2]));
+				const auto [panLeft, panRight] = PanGain(channel.pan.value(indices[1]));
+				const float pitchRatio = channel.pitch.value(indices[3]);
+
+				const size_t pitchIndex = indices[3];
+				const double songWarped = channel.warped[pitchIndex] + pitchRatio * static_cast<double>(segmentBegin - channel.pitch.timePos(pitchIndex));
+				const double warpedBegin = warpedOrigin + (songWarped - songWarpedOrigin) / mapSegment.rate;
+
+				const int64 playBegin = (segmentBegin == songBegin) ? pieceBegin : Clamp(timeMap.toPlayback(segmentBegin), pieceBegin, pieceEnd - 1);
+
+				output.segments.push_back(AutomationSegment{ playBegin - startPos, volume * expression * panLeft, volume * expression * panRight, pitchRatio, warpedBegin });
+				output.hasPitchBend |= (pitchRatio != 1.0f);
+				output.maxPitchRatio = Max(output.maxPitchRatio, pitchRatio);
+
+				// 次に値が変わる位置
+				int64 nextPos = songEnd;
+				for (size_t i = 0; i < lanes.size(); ++i)
+				{
+					if (indices[i] + 1 < lanes[i]->size())
+					{
+						nextPos = Min(nextPos, lanes[i]->timePos(indices[i] + 1));
+					}
+				}
+
+				if (songEnd <= nextPos)
+				{
+					break;
+				}
+
+				for (size_t i = 0; i < lanes.size(); ++i)
+				{
+					if (indices[i] + 1 < lanes[i]->size() && lanes[i]->timePos(indices[i] + 1) == nextPos)
+					{
+						++indices[i];
+					}
+				}
+
+				segmentBegin = nextPos;
+			}
+		}
+	}
+}
@@ -0,0 +1,698 @@
+﻿#pragma once
+#include <Benchmark.hpp>
+#include <SamplePlayer.hpp>
+#include <Program.hpp>
+#include <SampleSource.hpp>
+#include <WaveLoader.hpp>
+#include <TaskPool.hpp>
+#include <SFZLoader.hpp>
+#include <InstrumentCache.hpp>
+#include <MIDILoader.hpp>
+#include <NoteEventList.hpp>
+#include <Automation.hpp>
+
+namespace
+{
+	const FilePath BenchmarkDirectory = U"benchmark/";
+
+	template<class Func>
+	double MeasureMillisec(Func func)
+	{
+		Stopwatch watch(StartImmediately::Yes);
+		func();
+		return watch.msF();
+	}
+
+	// 重複排除でまとめられないように、seed ごとに長さと波形を変える
+	void WriteSyntheticWave(FilePathView path, size_t seed)
+	{
+		const size_t lengthSample = 2048 + seed % 509;
+
+		BinaryWriter writer(path);
+		WaveLoader::WriteCanonicalHeader(writer, Wave::DefaultSampleRate, lengthSample);
+
+		Array<Sample16bit2ch> samples(lengthSample);
+		for (auto [i, sample] : IndexedRef(samples))
+		{
+			sample.left = sample.right = static_cast<int16>(std::sin(i * (0.01 + seed * 1e-4)) * 8000);
+		}
+		writer.write(samples.data(), samples.size_bytes());
+	}
+
+	// instrumentCount 個の音源に regionCount 個ずつのリージョン（それぞれ別のwavファイル）を持つサウンドセットを作る
+	FilePath CreateSyntheticSoundSet(size_t instrumentCount, size_t regionCount)
+	{
+		const FilePath directory = BenchmarkDirectory + U"soundset_{}x{}/"_fmt(instrumentCount, regionCount);
+		const FilePath tomlPath = directory + U"soundset.toml";
+
+		if (FileSystem::IsFile(tomlPath))
+		{
+			return tomlPath;
+		}
+
+		const size_t velocityLayers = Max<size_t>(1, regionCount / 128);
+
+		TextWriter toml(tomlPath);
+		for (size_t instrument = 0; instrument < instrumentCount; ++instrument)
+		{
+			const FilePath sfzPath = directory + U"instrument{}.sfz"_fmt(instrument);
+
+			TextWriter sfz(sfzPath);
+			for (size_t region = 0; region < regionCount; ++region)
+			{
+				const FilePath samplePath = U"samples/{}_{}.wav"_fmt(instrument, region);
+				WriteSyntheticWave(directory + samplePath, instrument * regionCount + region);
+
+				const size_t key = region % 128;
+				const size_t layer = (region / 128) % velocityLayers;
+				const size_t lovel = 1 + layer * 127 / velocityLayers;
+				const size_t hivel = (layer + 1) * 127 / velocityLayers;
+
+				sfz.writeln(U"<region> sample={} key={} lovel={} hivel={}"_fmt(samplePath, key, lovel, hivel));
+			}
+
+			toml.writeln(U"[[Instrument]]");
+			toml.writeln(U"source = \"{}\""_fmt(sfzPath));
+			toml.writeln(U"type = \"melody\"");
+			toml.writeln(U"program = \"{}\""_fmt(instrument % 128 + 1));
+			toml.writeln(U"");
+		}
+
+		return tomlPath;
+	}
+
+	void BenchmarkSoundSetLoad(size_t instrumentCount, size_t regionCount)
+	{
+		const auto tomlPath = CreateSyntheticSoundSet(instrumentCount, regionCount);
+
+		SamplePlayer player;
+
+		// 起動時は索引を作るだけで、音源は組み立てない
+		const double indexTime = MeasureMillisec([&] { player.loadSoundSet(tomlPath); });
+
+		// すべての音源を使うMIDIを読み込んだ場合
+		ProgramUsage usage;
+		usage.melodies.fill(true);
+		usage.hasPercussion = true;
+
+		// 1回目はサンプルの登録とヘッダの読み込みを含み、2回目は組み立て済みの音源を再利用する
+		const double coldTime = MeasureMillisec([&] { player.loadSoundSet(tomlPath, usage); });
+		const double warmTime = MeasureMillisec([&] { player.loadSoundSet(tomlPath, usage); });
+
+		// 1つの音源だけ更新して読み直す
+		{
+			TextWriter sfz(FileSystem::ParentPath(tomlPath) + U"instrument0.sfz", OpenMode::Append);
+			sfz.writeln(U"// touched");
+		}
+		const double partialTime = MeasureMillisec([&] { player.loadSoundSet(tomlPath, usage); });
+
+		Console << U"[soundset load] {} instruments x {} regions, {} threads: index only {:.1f} ms, cold {:.1f} ms, reload {:.1f} ms, reload after 1 change {:.1f} ms"_fmt(
+			instrumentCount, regionCount, TaskPool::i().concurrency(), indexTime, coldTime, warmTime, partialTime);
+	}
+
+	// 1つのサンプルを共有する regionCount 個のリージョンを持つ大きなsfzを作る
+	FilePath CreateSyntheticSfz(size_t regionCount)
+	{
+		const FilePath directory = BenchmarkDirectory + U"sfz_{}/"_fmt(regionCount);
+		const FilePath sfzPath = directory + U"large.sfz";
+
+		if (FileSystem::IsFile(sfzPath))
+		{
+			return sfzPath;
+		}
+
+		WriteSyntheticWave(directory + U"samples/shared sample.wav", 0);
+
+		TextWriter sfz(sfzPath);
+		sfz.writeln(U"// synthetic instrument for parse benchmark");
+		sfz.writeln(U"<global> ampeg_release=0.3 ampeg_sustain=100");
+
+		for (size_t region = 0; region < regionCount; ++region)
+		{
+			if (region % 64 == 0)
+			{
+				sfz.writeln(U"<group> group={} off_by={} trigger=attack"_fmt(region / 64 + 1, region / 64 + 2));
+			}
+
+			const size_t key = region % 128;
+			const size_t layer = (region / 128) % 8;
+			sfz.writeln(U"<region> sample=samples/shared sample.wav lokey={} hikey={} pitch_keycenter={} lovel={} hivel={} tune={} volume=-{}.5 ampeg_attack=0.001"_fmt(
+				key, key, key, layer * 16 + 1, layer * 16 + 16, static_cast<int32>(region % 21) - 10, region % 6));
+		}
+
+		return sfzPath;
+	}
+
+	void BenchmarkSfzParse(size_t regionCount)
+	{
+		const auto sfzPath = CreateSyntheticSfz(regionCount);
+
+		size_t parsedCount = 0;
+		const double time = MeasureMillisec([&] { parsedCount = LoadSfz(sfzPath).data.size(); });
+
+		Console << U"[sfz parse] {} regions: {:.1f} ms ({:.0f} regions/s)"_fmt(
+			parsedCount, time, parsedCount / Max(time / 1000.0, 1e-9));
+	}
+
+	// 共通のグループ定義を #include する大きなsfzを作る
+	FilePath CreateSyntheticIncludeSfz(size_t regionCount)
+	{
+		const FilePath directory = BenchmarkDirectory + U"sfz_include_{}/"_fmt(regionCount);
+		const FilePath sfzPath = directory + U"include.sfz";
+
+		if (FileSystem::IsFile(sfzPath))
+		{
+			return sfzPath;
+		}
+
+		WriteSyntheticWave(directory + U"samples/shared sample.wav", 0);
+
+		{
+			TextWriter envelope(directory + U"envelope.sfz");
+			envelope.writeln(U"ampeg_attack=$ATTACK ampeg_decay=0.5 ampeg_sustain=80 ampeg_release=$RELEASE");
+		}
+
+		{
+			TextWriter common(directory + U"common.sfz");
+			common.writeln(U"<group> group=$GROUP off_by=$GROUP trigger=attack");
+			common.writeln(U"#include \"envelope.sfz\"");
+			common.writeln(U"volume=-3 tune=0 loop_mode=no_loop");
+		}
+
+		TextWriter sfz(sfzPath);
+		sfz.writeln(U"#define $ATTACK 0.001");
+		sfz.writeln(U"#define $RELEASE 0.3");
+
+		for (size_t region = 0; region < regionCount; ++region)
+		{
+			if (region % 128 == 0)
+			{
+				sfz.writeln(U"#define $GROUP {}"_fmt(region / 128 + 1));
+			}
+
+			const size_t key = region % 128;
+			sfz.writeln(U"#include \"common.sfz\"");
+			sfz.writeln(U"<region> sample=samples/shared sample.wav key={}"_fmt(key));
+		}
+
+		return sfzPath;
+	}
+
+	void BenchmarkSfzPreprocess(size_t regionCount)
+	{
+		const auto sfzPath = CreateSyntheticIncludeSfz(regionCount);
+
+		size_t parsedCount = 0;
+		const double time = MeasureMillisec([&] { parsedCount = LoadSfz(sfzPath).data.size(); });
+
+		Console << U"[sfz preprocess] {} regions with #include: {:.1f} ms ({:.0f} regions/s)"_fmt(
+			parsedCount, time, parsedCount / Max(time / 1000.0, 1e-9));
+	}
+
+	// sfzを解析してサンプルのヘッダを読む場合と、音源キャッシュから読む場合を比べる
+	void BenchmarkInstrumentCache(size_t regionCount)
+	{
+		const auto sfzPath = CreateSyntheticSfz(regionCount);
+
+		InstrumentCache::i().setup(BenchmarkDirectory + U"cache/instruments/");
+
+		CompiledInstrument compiled;
+		const double coldTime = MeasureMillisec([&]
+			{
+				compiled = CompileInstrument(sfzPath);
+				ResolveSampleInfos(compiled);
+			});
+
+		InstrumentCache::i().save(sfzPath, compiled);
+
+		Optional<CompiledInstrument> cached;
+		const double cachedTime = MeasureMillisec([&] { cached = InstrumentCache::i().load(sfzPath); });
+
+		Console << U"[instrument cache] {} regions: cold {:.1f} ms, cached {:.1f} ms{}"_fmt(
+			compiled.regions.size(), coldTime, cachedTime, cached ? U"" : U" (cache miss)");
+	}
+
+	// キースイッチ(24-27)で4種類の奏法を切り替えるオシレーター音源
+	FilePath CreateKeySwitchSfz()
+	{
+		const FilePath sfzPath = BenchmarkDirectory + U"keyswitch/keyswitch.sfz";
+
+		if (FileSystem::IsFile(sfzPath))
+		{
+			return sfzPath;
+		}
+
+		TextWriter sfz(sfzPath);
+		sfz.writeln(U"<global> sw_lokey=24 sw_hikey=27 sw_default=24 ampeg_release=0.1");
+
+		for (int32 articulation = 0; articulation < 4; ++articulation)
+		{
+			sfz.writeln(U"<group> sw_last={} group={}"_fmt(24 + articulation, articulation + 1));
+
+			for (int32 layer = 0; layer < 4; ++layer)
+			{
+				sfz.writeln(U"<region> sample=*sine lokey=36 hikey=96 pitch_keycenter=60 lovel={} hivel={}"_fmt(layer * 32 + 1, layer * 32 + 32));
+			}
+		}
+
+		return sfzPath;
+	}
+
+	void BenchmarkKeySwitchCompile(size_t noteCount)
+	{
+		const auto compiled = CompileInstrument(CreateKeySwitchSfz());
+
+		Program program;
+		program.loadProgram(compiled, 0.0f);
+
+		// 16ノートごとにキースイッチを切り替える
+		Array<MidiCode> codes;
+		for (size_t i = 0; i < noteCount; ++i)
+		{
+			const auto tick = static_cast<uint32>(i * 30);
+			const auto key = static_cast<uint8>(i % 16 == 0 ? 24 + (i / 16) % 4 : 36 + i % 61);
+			const auto velocity = static_cast<uint8>(1 + i % 127);
+			codes.push_back(MidiCode{ tick, EventType::MidiEvent, MidiEventData::NoteOn(0, key, velocity) });
+			codes.push_back(MidiCode{ tick + 20, EventType::MidiEvent, MidiEventData::NoteOff(0, key) });
+		}
+
+		const MidiData midiData({ TrackData(codes) }, 480);
+
+		size_t eventCount = 0;
+		const double time = MeasureMillisec([&]
+			{
+				program.clearEvent();
+				program.addKeyDownEvents(midiData.notes().front());
+				program.sortKeyDownEvents();
+				eventCount = program.compileEvents();
+				program.sortEvent();
+				program.deleteDuplicate();
+				program.calculateOffTime();
+				program.publishEvents();
+			});
+
+		Console << U"[event compile] {} keyswitched notes: {:.1f} ms"_fmt(eventCount, time);
+	}
+
+	// オープンハイハットをクローズ/ペダルで止めるドラム音源
+	FilePath CreateHiHatSfz()
+	{
+		const FilePath sfzPath = BenchmarkDirectory + U"hihat/hihat.sfz";
+
+		if (FileSystem::IsFile(sfzPath))
+		{
+			return sfzPath;
+		}
+
+		TextWriter sfz(sfzPath);
+		sfz.writeln(U"<group> group=1 off_by=2 ampeg_release=0.5");
+		sfz.writeln(U"<region> sample=*noise key=46");
+		sfz.writeln(U"<group> group=2 ampeg_release=0.1");
+		sfz.writeln(U"<region> sample=*noise key=42");
+		sfz.writeln(U"<region> sample=*noise key=44");
+
+		return sfzPath;
+	}
+
+	void BenchmarkChokeGroups(size_t noteCount)
+	{
+		const auto compiled = CompileInstrument(CreateHiHatSfz());
+
+		Program program;
+		program.loadProgram(compiled, 0.0f);
+
+		// 長いオープンハイハットの間に細かいクローズ/ペダルが入る
+		constexpr uint8 Keys[] = { 46, 42, 42, 44 };
+		Array<MidiCode> codes;
+		for (size_t i = 0; i < noteCount; ++i)
+		{
+			const auto tick = static_cast<uint32>(i * 15);
+			const auto key = Keys[i % 4];
+			const auto gate = static_cast<uint32>(key == 46 ? 960 : 10);
+			codes.push_back(MidiCode{ tick, EventType::MidiEvent, MidiEventData::NoteOn(9, key, 100) });
+			codes.push_back(MidiCode{ tick + gate, EventType::MidiEvent, MidiEventData::NoteOff(9, key) });
+		}
+		codes.sort_by([](const MidiCode& a, const MidiCode& b) { return a.tick < b.tick; });
+
+		const MidiData midiData({ TrackData(codes) }, 480);
+
+		program.clearEvent();
+		program.addKeyDownEvents(midiData.notes().front());
+		program.sortKeyDownEvents();
+		program.compileEvents();
+		program.sortEvent();
+		program.deleteDuplicate();
+
+		const double time = MeasureMillisec([&] { program.calculateOffTime(); });
+
+		Console << U"[off_by] {} hi-hat notes: {:.1f} ms"_fmt(midiData.notes().front().notes().size(), time);
+	}
+
+	// 100万ノートあたりのメモリ（MidiData と、登録したイベントのピーク）を、退避する場合としない場合で測る
+	void BenchmarkNoteMemory(size_t noteCount)
+	{
+		const auto compiled = CompileInstrument(CreateHiHatSfz());
+
+		constexpr uint8 Keys[] = { 46, 42, 42, 44 };
+		TrackData track;
+		track.reserveNotes(noteCount);
+		for (size_t i = 0; i < noteCount; ++i)
+		{
+			const auto tick = static_cast<uint32>(i * 15);
+			track.addChannelEvent(tick, 0x99, Keys[i % 4], 100);
+			track.addChannelEvent(tick + 10, 0x89, Keys[i % 4], 0);
+		}
+		track.finish(static_cast<uint32>(noteCount * 15));
+
+		Array<TrackData> tracks;
+		tracks.push_back(std::move(track));
+		const MidiData midiData(std::move(tracks), 480);
+
+		struct Result
+		{
+			size_t peakBytes = 0;
+			size_t residentBytes = 0;
+			size_t spilledBytes = 0;
+			double time = 0;
+		};
+
+		const auto compile = [&](uint64 budget)
+		{
+			NoteEventSpill::i().setup(BenchmarkDirectory + U"spill/", budget);
+
+			Program program;
+			program.loadProgram(compiled, 0.0f);
+
+			Result result;
+			result.time = MeasureMillisec([&]
+				{
+					const auto& notes = midiData.notes().front();
+					constexpr size_t WindowNotes = 65536;
+
+					program.clearEvent();
+					for (size_t begin = 0; begin < notes.notes().size(); begin += WindowNotes)
+					{
+						program.addKeyDownEvents(notes, begin, Min(begin + WindowNotes, notes.notes().size()));
+						program.sortKeyDownEvents();
+						program.compileEvents();
+						program.sortEvent();
+						program.deleteDuplicate();
+						program.calculateOffTime();
+						program.publishEvents();
+
+						result.peakBytes = Max(result.peakBytes, program.residentEventBytes());
+
+						if (budget < program.residentEventBytes())
+						{
+							NoteSpillWriter writer;
+							program.spillEvents(writer);
+							writer.finish();
+						}
+					}
+				});
+
+			result.residentBytes = program.residentEventBytes();
+			result.spilledBytes = program.spilledEventBytes();
+			return result;
+		};
+
+		const double perMillion = 1.0e6 / Max<size_t>(noteCount, 1) / (1024.0 * 1024.0);
+		const auto unlimited = compile(UINT64_MAX);
+		const auto budgeted = compile(16ull << 20);
+
+		Console << U"[note memory] {} notes (per 1M notes): midi {:.1f} MB, events {:.1f} MB peak ({:.1f} ms) / 16 MB budget: {:.1f} MB peak, {:.1f} MB resident, {:.1f} MB spilled ({:.1f} ms)"_fmt(
+			noteCount, midiData.memoryUsage() * perMillion,
+			unlimited.peakBytes * perMillion, unlimited.time,
+			budgeted.peakBytes * perMillion, budgeted.residentBytes * perMillion, budgeted.spilledBytes * perMillion, budgeted.time);
+	}
+
+	void WriteBigEndian(Array<uint8>& bytes, uint32 value, size_t size)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			bytes.push_back(static_cast<uint8>(value >> ((size - i - 1) * 8)));
+		}
+	}
+
+	void WriteVarint(Array<uint8>& bytes, uint32 value)
+	{
+		uint8 buffer[4];
+		size_t length = 0;
+		do
+		{
+			buffer[length++] = value & 0x7F;
+			value >>= 7;
+		} while (value != 0 && length < 4);
+
+		while (1 < length)
+		{
+			bytes.push_back(buffer[--length] | 0x80);
+		}
+		bytes.push_back(buffer[0]);
+	}
+
+	void WriteTrackChunk(BinaryWriter& writer, const Array<uint8>& events)
+	{
+		Array<uint8> header = { 'M', 'T', 'r', 'k' };
+		WriteBigEndian(header, static_cast<uint32>(events.size()), 4);
+		writer.write(header.data(), header.size());
+		writer.write(events.data(), events.size());
+	}
+
+	// コンダクタートラック + trackCount 本のトラックに noteCount 個ずつノートを持つSMFを作る
+	// ノートオン/オフはランニングステータスで書き、CCとピッチベンドも混ぜる
+	FilePath CreateSyntheticMidi(size_t trackCount, size_t noteCount)
+	{
+		const FilePath midiPath = BenchmarkDirectory + U"midi/tracks{}_notes{}.mid"_fmt(trackCount, noteCount);
+
+		if (FileSystem::IsFile(midiPath))
+		{
+			return midiPath;
+		}
+
+		BinaryWriter writer(midiPath);
+
+		Array<uint8> header = { 'M', 'T', 'h', 'd' };
+		WriteBigEndian(header, 6, 4);
+		WriteBigEndian(header, 1, 2);
+		WriteBigEndian(header, static_cast<uint32>(trackCount + 1), 2);
+		WriteBigEndian(header, 480, 2);
+		writer.write(header.data(), header.size());
+
+		{
+			Array<uint8> conductor;
+			for (uint32 i = 0; i < 64; ++i)
+			{
+				WriteVarint(conductor, i == 0 ? 0 : 480 * 16);
+				conductor.insert(conductor.end(), { 0xFF, 0x51, 0x03 });
+				WriteBigEndian(conductor, 400000 + i * 1000, 3);
+			}
+			WriteVarint(conductor, 0);
+			conductor.insert(conductor.end(), { 0xFF, 0x58, 0x04, 0x04, 0x02, 0x18, 0x08 });
+			WriteVarint(conductor, 0);
+			conductor.insert(conductor.end(), { 0xFF, 0x2F, 0x00 });
+			WriteTrackChunk(writer, conductor);
+		}
+
+		for (size_t track = 0; track < trackCount; ++track)
+		{
+			const auto ch = static_cast<uint8>(track % 16);
+
+			Array<uint8> events;
+			events.reserve(noteCount * 8);
+
+			WriteVarint(events, 0);
+			events.insert(events.end(), { 0xFF, 0x03, 0x05, 'T', 'r', 'a', 'c', 'k' });
+			WriteVarint(events, 0);
+			events.insert(events.end(), { static_cast<uint8>(0xC0 | ch), static_cast<uint8>(track % 128) });
+
+			for (size_t i = 0; i < noteCount; ++i)
+			{
+				const auto key = static_cast<uint8>(36 + (i * 7 + track) % 60);
+
+				if (i % 64 == 0)
+				{
+					WriteVarint(events, 0);
+					events.insert(events.end(), { static_cast<uint8>(0xB0 | ch), 11, static_cast<uint8>(i % 128) });
+					WriteVarint(events, 0);
+					events.insert(events.end(), { static_cast<uint8>(0xE0 | ch), 0x00, static_cast<uint8>(0x40 + i % 8) });
+				}
+
+				WriteVarint(events, i % 4 == 0 ? 240 : 0);
+				events.insert(events.end(), { static_cast<uint8>(0x90 | ch), key, static_cast<uint8>(64 + i % 63) });
+				WriteVarint(events, 120 + static_cast<uint32>(i % 3) * 200);
+				events.insert(events.end(), { key, 0 });
+			}
+
+			WriteVarint(events, 0);
+			events.insert(events.end(), { 0xFF, 0x2F, 0x00 });
+			WriteTrackChunk(writer, events);
+		}
+
+		return midiPath;
+	}
+
+	void BenchmarkMidiLoad(size_t trackCount, size_t noteCount)
+	{
+		const auto midiPath = CreateSyntheticMidi(trackCount, noteCount);
+		const double megaBytes = FileSystem::FileSize(midiPath) / (1024.0 * 1024.0);
+
+		Optional<MidiData> midiData;
+		const double time = MeasureMillisec([&] { midiData = LoadMidi(midiPath); });
+
+		const size_t loadedCount = midiData ? midiData->noteCount() : 0;
+		const size_t memoryUsage = midiData ? midiData->memoryUsage() : 0;
+
+		Console << U"[midi load] {} tracks, {:.1f} MB, {} notes, {} threads: {:.1f} ms ({:.1f} MB/s), {:.1f} bytes/note"_fmt(
+			trackCount, megaBytes, loadedCount, TaskPool::i().concurrency(), time, megaBytes / Max(time / 1000.0, 1e-9), memoryUsage / Max(1.0, 1.0 * loadedCount));
+	}
+
+	// 少しずつ読み込む場合に、最初の区間が揃うまでの時間を一度に読み込む場合と比べる
+	void BenchmarkMidiStream(size_t trackCount, size_t noteCount)
+	{
+		const auto midiPath = CreateSyntheticMidi(trackCount, noteCount);
+
+		size_t firstCount = 0;
+		const double firstTime = MeasureMillisec([&]
+			{
+				MidiStreamReader reader;
+				if (!reader.open(midiPath))
+				{
+					return;
+				}
+
+				if (const auto tracks = reader.readUntil(reader.tickAfter(2.0)))
+				{
+					for (const auto& track : tracks.value())
+					{
+						firstCount += track.notes().size();
+					}
+				}
+			});
+
+		Optional<MidiData> midiData;
+		const double fullTime = MeasureMillisec([&] { midiData = LoadMidi(midiPath); });
+
+		Console << U"[midi stream] first 2 s: {} notes, {:.2f} ms / full load: {} notes, {:.1f} ms"_fmt(
+			firstCount, firstTime, midiData ? midiData->noteCount() : 0, fullTime);
+	}
+
+	// テンポ変更の多い曲で、ノートの秒数計算と再生位置からのtick計算を測る
+	void BenchmarkTempoMap(size_t tempoCount, size_t noteCount)
+	{
+		Array<MidiCode> conductor;
+		for (size_t i = 0; i < tempoCount; ++i)
+		{
+			MidiCode code{ static_cast<uint32>(i * 120), EventType::MetaEvent, MetaEventData::SetTempo(100.0 + i % 60) };
+			conductor.push_back(code);
+		}
+
+		Array<MidiCode> codes;
+		for (size_t i = 0; i < noteCount; ++i)
+		{
+			const auto tick = static_cast<uint32>(i * tempoCount * 120 / noteCount);
+			const auto key = static_cast<uint8>(36 + i % 60);
+			codes.push_back(MidiCode{ tick, EventType::MidiEvent, MidiEventData::NoteOn(0, key, 100) });
+			codes.push_back(MidiCode{ tick + 240, EventType::MidiEvent, MidiEventData::NoteOff(0, key) });
+		}
+		codes.stable_sort_by([](const MidiCode& a, const MidiCode& b) { return a.tick < b.tick; });
+
+		Array<TrackData> tracks = { TrackData(conductor), TrackData(codes) };
+
+		Optional<MidiData> midiData;
+		const double initTime = MeasureMillisec([&] { midiData.emplace(std::move(tracks), 480); });
+
+		constexpr size_t FrameCount = 100000;
+		const double endSec = midiData->ticksToSeconds(midiData->endTick());
+		double tickSum = 0;
+		const double lookupTime = MeasureMillisec([&]
+			{
+				for (size_t i = 0; i < FrameCount; ++i)
+				{
+					tickSum += midiData->secondsToTicks2(endSec * i / FrameCount);
+				}
+			});
+
+		Console << U"[tempo map] {} tempos, {} notes: init {:.1f} ms, {} lookups {:.1f} ms (checksum {:.0f})"_fmt(
+			tempoCount, noteCount, initTime, FrameCount, lookupTime, tickSum);
+	}
+
+	// 16チャンネルにエクスプレッションとピッチベンドを流し込み、ブロックごとのパラメータを作る時間を計測する
+	void BenchmarkAutomation(size_t controllerCount)
+	{
+		Array<MidiCode> codes;
+		for (size_t i = 0; i < controllerCount; ++i)
+		{
+			const auto tick = static_cast<uint32>(i * 4);
+			const auto ch = static_cast<uint8>(i % 16);
+			codes.push_back(MidiCode{ tick, EventType::MidiEvent, MidiEventData::ControlChange(ch, 11, static_cast<uint8>(64 + i % 64)) });
+			codes.push_back(MidiCode{ tick, EventType::MidiEvent, MidiEventData::PitchBend(ch, static_cast<uint16>(8192 + (i % 512) * 8)) });
+			codes.push_back(MidiCode{ tick, EventType::MidiEvent, MidiEventData::ControlChange(ch, 64, (i / 16) % 2 ? 127 : 0) });
+		}
+
+		Array<TrackData> tracks = { TrackData(codes) };
+		MidiData midiData(std::move(tracks), 480);
+
+		AutomationSet automation;
+		const double appendTime = MeasureMillisec([&] { automation.append(midiData.notes(), 0, UINT32_MAX, midiData.tempoMap()); });
+
+		constexpr int64 BlockSampleCount = 1024;
+		const auto endPos = static_cast<int64>(midiData.ticksToSeconds(midiData.endTick()) * Wave::DefaultSampleRate);
+
+		BlockAutomation block;
+		size_t segmentCount = 0;
+		const PlaybackTimeMap identity;
+		const double prepareTime = MeasureMillisec([&]
+			{
+				for (int64 pos = 0; pos < endPos; pos += BlockSampleCount)
+				{
+					automation.prepareBlock(pos, BlockSampleCount, identity, block);
+					for (const auto& channel : block.channels)
+					{
+						segmentCount += channel.segments.size();
+					}
+				}
+			});
+
+		Console << U"[automation] {} controllers x3: append {:.1f} ms, {} blocks {:.1f} ms ({} segments)"_fmt(
+			controllerCount, appendTime, endPos / BlockSampleCount, prepareTime, segmentCount);
+
+		// 再生中に速度を何度も変えた場合（変えるたびに区間が1つ増える）
+		PlaybackTimeMap scaled;
+		constexpr size_t RateChangeCount = 64;
+		const double setRateTime = MeasureMillisec([&]
+			{
+				for (size_t i = 1; i <= RateChangeCount; ++i)
+				{
+					scaled.setRate(static_cast<int64>(endPos * i / (RateChangeCount + 1)), (i % 2) ? 0.75 : 1.5, automation);
+				}
+			});
+
+		const auto scaledEndPos = scaled.toPlayback(endPos);
+		const double scaledPrepareTime = MeasureMillisec([&]
+			{
+				for (int64 pos = 0; pos < scaledEndPos; pos += BlockSampleCount)
+				{
+					automation.prepareBlock(pos, BlockSampleCount, scaled, block);
+				}
+			});
+
+		Console << U"[automation] {} rate changes: setRate {:.3f} ms, {} blocks {:.1f} ms"_fmt(
+			RateChangeCount, setRateTime, scaledEndPos / BlockSampleCount, scaledPrepareTime);
+	}
+}
+
+void RunBenchmarks()
+{
+	BenchmarkMidiLoad(64, 100000);
+	BenchmarkMidiStream(64, 100000);
+	BenchmarkTempoMap(20000, 500000);
+	BenchmarkAutomation(200000);
+	BenchmarkSfzParse(50000);
+	BenchmarkSfzPreprocess(20000);
+	BenchmarkSoundSetLoad(16, 256);
+	BenchmarkKeySwitchCompile(100000);
+	BenchmarkChokeGroups(100000);
+	BenchmarkNoteMemory(1000000);
+	BenchmarkInstrumentCache(50000);
+}
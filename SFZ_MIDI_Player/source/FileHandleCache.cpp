@@ -0,0 +1,219 @@
+﻿#pragma once
+#include <FileHandleCache.hpp>
+
+#if SIV3D_PLATFORM(WINDOWS)
+#include <Siv3D/Windows/Windows.hpp>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+class FileHandleCache::Handle
+{
+public:
+
+	explicit Handle(FilePathView path)
+	{
+#if SIV3D_PLATFORM(WINDOWS)
+		m_handle = ::CreateFileW(path.toWstr().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_handle != INVALID_HANDLE_VALUE)
+		{
+			LARGE_INTEGER size;
+			if (::GetFileSizeEx(m_handle, &size))
+			{
+				m_size = size.QuadPart;
+			}
+		}
+#else
+		m_fd = ::open(path.toUTF8().c_str(), O_RDONLY);
+		if (m_fd != -1)
+		{
+			struct stat st;
+			if (::fstat(m_fd, &st) == 0)
+			{
+				m_size = st.st_size;
+			}
+		}
+#endif
+	}
+
+	~Handle()
+	{
+#if SIV3D_PLATFORM(WINDOWS)
+		if (m_handle != INVALID_HANDLE_VALUE)
+		{
+			::CloseHandle(m_handle);
+		}
+#else
+		if (m_fd != -1)
+		{
+			::close(m_fd);
+		}
+#endif
+	}
+
+	Handle(const Handle&) = delete;
+	Handle& operator=(const Handle&) = delete;
+
+	bool isOpen() const
+	{
+#if SIV3D_PLATFORM(WINDOWS)
+		return m_handle != INVALID_HANDLE_VALUE;
+#else
+		return m_fd != -1;
+#endif
+	}
+
+	int64 size() const { return m_size; }
+
+	int64 read(int64 offset, void* dst, int64 size) const
+	{
+		if (!isOpen() || m_size <= offset || size <= 0)
+		{
+			return 0;
+		}
+
+		size = Min(size, m_size - offset);
+
+		int64 totalReadBytes = 0;
+		auto ptr = static_cast<uint8*>(dst);
+
+		while (totalReadBytes < size)
+		{
+			const auto requestBytes = static_cast<uint32>(Min<int64>(size - totalReadBytes, 1 << 30));
+			const auto position = offset + totalReadBytes;
+
+#if SIV3D_PLATFORM(WINDOWS)
+			// OVERLAPPEDでオフセットを指定して読むと共有されたファイルポインタに依存しない
+			OVERLAPPED overlapped = {};
+			overlapped.Offset = static_cast<DWORD>(position & 0xFFFFFFFF);
+			overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+
+			DWORD readBytes = 0;
+			if (!::ReadFile(m_handle, ptr + totalReadBytes, requestBytes, &readBytes, &overlapped) || readBytes == 0)
+			{
+				break;
+			}
+#else
+			const auto readBytes = ::pread(m_fd, ptr + totalReadBytes, requestBytes, static_cast<off_t>(position));
+			if (readBytes <= 0)
+			{
+				break;
+			}
+#endif
+
+			totalReadBytes += readBytes;
+		}
+
+		return totalReadBytes;
+	}
+
+private:
+
+#if SIV3D_PLATFORM(WINDOWS)
+	HANDLE m_handle = INVALID_HANDLE_VALUE;
+#else
+	int m_fd = -1;
+#endif
+
+	int64 m_size = 0;
+};
+
+void FileHandleCache::setCapacity(size_t maxOpenFiles)
+{
+	std::lock_guard lock(m_mutex);
+	m_capacity = Max<size_t>(1, maxOpenFiles);
+	evict();
+}
+
+FileHandleCache::FileId FileHandleCache::registerFile(FilePathView path)
+{
+	std::lock_guard lock(m_mutex);
+
+	FilePath key(path);
+	if (auto it = m_ids.find(key); it != m_ids.end())
+	{
+		return it->second;
+	}
+
+	const auto id = static_cast<FileId>(m_entries.size());
+	m_entries.push_back(Entry{ .path = key, .handle = nullptr, .lruPos = m_lruList.end() });
+	m_ids.emplace(std::move(key), id);
+
+	return id;
+}
+
+int64 FileHandleCache::read(FileId id, int64 offset, void* dst, int64 size)
+{
+	const auto handle = acquire(id);
+	return handle ? handle->read(offset, dst, size) : 0;
+}
+
+int64 FileHandleCache::fileSize(FileId id)
+{
+	const auto handle = acquire(id);
+	return handle ? handle->size() : 0;
+}
+
+size_t FileHandleCache::openCount() const
+{
+	std::lock_guard lock(m_mutex);
+	return m_lruList.size();
+}
+
+std::shared_ptr<FileHandleCache::Handle> FileHandleCache::acquire(FileId id)
+{
+	FilePath path;
+
+	{
+		std::lock_guard lock(m_mutex);
+
+		auto& entry = m_entries[id];
+		if (entry.handle)
+		{
+			m_lruList.splice(m_lruList.begin(), m_lruList, entry.lruPos);
+			return entry.handle;
+		}
+
+		// パスをコピーするのは閉じられていたときだけ
+		path = entry.path;
+	}
+
+	// ファイルを開くのはロックの外で行う
+	auto handle = std::make_shared<Handle>(path);
+	if (!handle->isOpen())
+	{
+		Console << U"error: failed to open \"" << path << U"\"";
+		return nullptr;
+	}
+
+	std::lock_guard lock(m_mutex);
+
+	// 別のスレッドが先に開いていた場合はそちらを使う
+	auto& entry = m_entries[id];
+	if (entry.handle)
+	{
+		m_lruList.splice(m_lruList.begin(), m_lruList, entry.lruPos);
+		return entry.handle;
+	}
+
+	m_lruList.push_front(id);
+	entry.handle = handle;
+	entry.lruPos = m_lruList.begin();
+	evict();
+
+	return handle;
+}
+
+void FileHandleCache::evict()
+{
+	// 読み込み中のスレッドが持っているハンドルは、そのスレッドが手放したときに閉じられる
+	while (m_capacity < m_lruList.size())
+	{
+		auto& entry = m_entries[m_lruList.back()];
+		entry.handle.reset();
+		entry.lruPos = m_lruList.end();
+		m_lruList.pop_back();
+	}
+}
@@ -2,6 +2,8 @@
 #include <FlacLoader.hpp>
 #include <MemoryBlockList.hpp>
 #include <AudioLoadManager.hpp>
+#include <WaveLoader.hpp>
+#include <FileHandleCache.hpp>
 
 #define FLAC__NO_DLL
 #include <FLAC++/decoder.h>
@@ -13,8 +15,7 @@ public:
 
 	FlacDecoder(FilePathView path, size_t debugId) :
 		FLAC::Decoder::Stream(),
-		m_filePath(path),
-		m_fileReader(path),
+		m_fileId(FileHandleCache::i().registerFile(path)),
 		m_readBlocks(debugId, MemoryPool::ReadFile)
 	{}
 
@@ -33,20 +34,9 @@ public:
 	size_t m_loadSampleCount = 0;
 	size_t m_readPos = 0;
 
-	bool isOpen() const
+	void open()
 	{
-		return m_fileReader.isOpen();
-	}
-
-	void restore()
-	{
-		m_fileReader.open(m_filePath);
-		m_fileReader.setPos(m_readPos);
-	}
-
-	void close()
-	{
-		m_fileReader.close();
+		m_fileSize = FileHandleCache::i().fileSize(m_fileId);
 	}
 
 	WaveSample getSample(int64 index) const
@@ -114,11 +104,6 @@ public:
 					}
 				}
 
-				if (!isOpen())
-				{
-					restore();
-				}
-
 				if (auto state = static_cast<FLAC__StreamDecoderState>(get_state());
 					state == FLAC__STREAM_DECODER_SEARCH_FOR_METADATA || state == FLAC__STREAM_DECODER_READ_METADATA)
 				{
@@ -145,48 +130,48 @@ public:
 	}
 
 protected:
-	FilePath m_filePath;
-	BinaryReader m_fileReader;
+	// FileHandleCache に登録したファイル
+	FileHandleCache::FileId m_fileId;
+	int64 m_fileSize = 0;
 
 	size_t m_tempBeginSample = 0;
 
 	::FLAC__StreamDecoderReadStatus read_callback(FLAC__byte buffer[], size_t* bytes) override
 	{
-		if (m_fileReader.getPos() == m_fileReader.size())
+		if (static_cast<int64>(m_readPos) == m_fileSize)
 		{
 			*bytes = 0;
 			return FLAC__StreamDecoderReadStatus::FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
 		}
 
 		const size_t size = *bytes;
-		*bytes = m_fileReader.read(buffer, size);
-		m_readPos = m_fileReader.getPos();
+		*bytes = static_cast<size_t>(FileHandleCache::i().read(m_fileId, m_readPos, buffer, size));
+		m_readPos += *bytes;
 
 		return FLAC__StreamDecoderReadStatus::FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
 	}
 
 	::FLAC__StreamDecoderSeekStatus seek_callback(FLAC__uint64 absolute_byte_offset) override
 	{
-		m_fileReader.setPos(static_cast<int64>(absolute_byte_offset));
-		m_readPos = m_fileReader.getPos();
+		m_readPos = static_cast<size_t>(absolute_byte_offset);
 		return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
 	}
 
 	::FLAC__StreamDecoderTellStatus tell_callback(FLAC__uint64* absolute_byte_offset) override
 	{
-		*absolute_byte_offset = static_cast<FLAC__uint64>(m_fileReader.getPos());
+		*absolute_byte_offset = static_cast<FLAC__uint64>(m_readPos);
 		return FLAC__STREAM_DECODER_TELL_STATUS_OK;
 	}
 
 	::FLAC__StreamDecoderLengthStatus length_callback(FLAC__uint64* stream_length) override
 	{
-		*stream_length = static_cast<FLAC__uint64>(m_fileReader.size());
+		*stream_length = static_cast<FLAC__uint64>(m_fileSize);
 		return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
 	}
 
 	bool eof_callback() override
 	{
-		return m_fileReader.size() <= m_fileReader.getPos() + 1;
+		return m_fileSize <= static_cast<int64>(m_readPos) + 1;
 	}
 
 	::FLAC__StreamDecoderWriteStatus write_callback(const ::FLAC__Frame* frame, const FLAC__int32* const buffer[]) override
@@ -304,33 +289,84 @@ private:
 	FlacDecoder& operator=(const FlacDecoder&) = default;
 };
 
-FlacLoader::FlacLoader(FilePathView path, size_t debugId) :
-	m_flacDecoder(std::make_unique<FlacDecoder>(path, debugId))
+FlacLoader::FlacLoader(FilePathView path, size_t debugId, const Optional<SampleInfo>& preset) :
+	m_flacDecoder(std::make_unique<FlacDecoder>(path, debugId)),
+	m_preset(preset)
 {
-	init();
-	m_flacDecoder->close();
+	if (preset)
+	{
+		m_flacDecoder->m_lengthSample = preset->lengthSample;
+		m_flacDecoder->m_sampleRate = preset->sampleRate;
+		m_flacDecoder->m_channels = preset->channels;
+		m_flacDecoder->m_bitsPerSample = preset->bitsPerSample;
+		m_flacDecoder->m_dataSize = preset->dataSizeOfBytes;
+		m_flacDecoder->m_sampleRateInv = 1.f / preset->sampleRate;
+	}
 }
 
 size_t FlacLoader::size() const
 {
+	ensureHeader();
 	return m_flacDecoder->m_dataSize;
 }
 
 size_t FlacLoader::sampleRate() const
 {
+	ensureHeader();
 	return m_flacDecoder->m_sampleRate;
 }
 
 float FlacLoader::sampleRateInv() const
 {
+	ensureHeader();
 	return m_flacDecoder->m_sampleRateInv;
 }
 
 size_t FlacLoader::lengthSample() const
 {
+	ensureHeader();
 	return m_flacDecoder->m_lengthSample;
 }
 
+SampleInfo FlacLoader::sampleInfo() const
+{
+	ensureHeader();
+
+	SampleInfo info;
+	info.container = SampleContainer::Flac;
+	info.channels = static_cast<uint16>(m_flacDecoder->m_channels);
+	info.bitsPerSample = static_cast<uint16>(m_flacDecoder->m_bitsPerSample);
+	info.sampleRate = m_flacDecoder->m_sampleRate;
+	info.lengthSample = m_flacDecoder->m_lengthSample;
+	info.dataSizeOfBytes = m_flacDecoder->m_dataSize;
+	return info;
+}
+
+void FlacLoader::ensureHeader() const
+{
+	// デコーダーの初期化はデコードを始めるとき（use）まで遅らせる
+	if (!m_preset)
+	{
+		ensureInit();
+	}
+}
+
+void FlacLoader::probe() const
+{
+	ensureHeader();
+}
+
+void FlacLoader::ensureInit() const
+{
+	// ヘッダの値はどのスレッドから最初に触られても一度だけ読み込む
+	std::call_once(m_initFlag, [this]
+		{
+			auto& loader = const_cast<FlacLoader&>(*this);
+			loader.m_flacDecoder->open();
+			loader.init();
+		});
+}
+
 void FlacLoader::init()
 {
 	auto initResult = m_flacDecoder->init();
@@ -362,6 +398,7 @@ void FlacLoader::init()
 
 void FlacLoader::use(size_t beginSampleIndex, size_t sampleCount)
 {
+	ensureInit();
 	m_flacDecoder->readBlock(beginSampleIndex, sampleCount);
 }
 
@@ -381,3 +418,127 @@ WaveSample FlacLoader::getSample(int64 index) const
 	//AudioLoadManager::i().debugLog(U"s {}: {}"_fmt(index, sample.left));
 	return sample;
 }
+
+namespace
+{
+	class FlacTranscoder : public FLAC::Decoder::Stream
+	{
+	public:
+
+		FlacTranscoder(FilePathView flacPath, FilePathView wavePath) :
+			FLAC::Decoder::Stream(),
+			m_fileReader(flacPath),
+			m_waveWriter(wavePath)
+		{}
+
+		bool transcode()
+		{
+			if (!m_fileReader.isOpen() || !m_waveWriter.isOpen())
+			{
+				return false;
+			}
+
+			if (init() != FLAC__STREAM_DECODER_INIT_STATUS_OK)
+			{
+				return false;
+			}
+
+			if (!process_until_end_of_metadata() || m_lengthSample == 0 || (m_channels != 1 && m_channels != 2))
+			{
+				return false;
+			}
+
+			WaveLoader::WriteCanonicalHeader(m_waveWriter, m_sampleRate, m_lengthSample);
+
+			if (!process_until_end_of_stream() || m_failed)
+			{
+				return false;
+			}
+
+			// 途中のフレームが欠けていた場合も長さが合うように無音で埋める
+			if (m_writtenSample < m_lengthSample)
+			{
+				const Array<Sample16bit2ch> silence(m_lengthSample - m_writtenSample, Sample16bit2ch{ 0, 0 });
+				m_waveWriter.write(silence.data(), silence.size() * sizeof(Sample16bit2ch));
+			}
+
+			m_waveWriter.close();
+			return true;
+		}
+
+	protected:
+
+		::FLAC__StreamDecoderReadStatus read_callback(FLAC__byte buffer[], size_t* bytes) override
+		{
+			if (m_fileReader.getPos() == m_fileReader.size())
+			{
+				*bytes = 0;
+				return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+			}
+
+			*bytes = m_fileReader.read(buffer, *bytes);
+			return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+		}
+
+		::FLAC__StreamDecoderWriteStatus write_callback(const ::FLAC__Frame* frame, const FLAC__int32* const buffer[]) override
+		{
+			if (m_lengthSample <= m_writtenSample)
+			{
+				return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+			}
+
+			const size_t count = Min<size_t>(frame->header.blocksize, m_lengthSample - m_writtenSample);
+			m_frameBuffer.resize(count);
+
+			const auto left = buffer[0];
+			const auto right = m_channels == 1 ? buffer[0] : buffer[1];
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				m_frameBuffer[i].left = static_cast<int16>(left[i] * m_normalizeRead * 32767);
+				m_frameBuffer[i].right = static_cast<int16>(right[i] * m_normalizeRead * 32767);
+			}
+
+			m_waveWriter.write(m_frameBuffer.data(), count * sizeof(Sample16bit2ch));
+			m_writtenSample += count;
+
+			return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+		}
+
+		void metadata_callback(const ::FLAC__StreamMetadata* metadata) override
+		{
+			if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO)
+			{
+				m_lengthSample = metadata->data.stream_info.total_samples;
+				m_sampleRate = metadata->data.stream_info.sample_rate;
+				m_channels = metadata->data.stream_info.channels;
+				m_normalizeRead = 1.f / std::powf(2.0f, static_cast<float>(metadata->data.stream_info.bits_per_sample) - 1);
+			}
+		}
+
+		void error_callback(::FLAC__StreamDecoderErrorStatus status) override
+		{
+			Console << U"error: FlacTranscoder::error_callback >" << Unicode::Widen(FLAC__StreamDecoderErrorStatusString[status]);
+			m_failed = true;
+		}
+
+	private:
+
+		BinaryReader m_fileReader;
+		BinaryWriter m_waveWriter;
+		Array<Sample16bit2ch> m_frameBuffer;
+
+		FLAC__uint64 m_lengthSample = 0;
+		FLAC__uint64 m_writtenSample = 0;
+		uint32_t m_sampleRate = 0;
+		uint32_t m_channels = 0;
+		float m_normalizeRead = 0;
+		bool m_failed = false;
+	};
+}
+
+bool TranscodeFlacToWave(FilePathView flacPath, FilePathView wavePath)
+{
+	FlacTranscoder transcoder(flacPath, wavePath);
+	return transcoder.transcode();
+}
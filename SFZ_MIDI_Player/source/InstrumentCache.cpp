@@ -0,0 +1,368 @@
+﻿#pragma once
+#include <InstrumentCache.hpp>
+#include <AudioLoadManager.hpp>
+
+namespace
+{
+	constexpr char Magic[4] = { 'S', 'F', 'Z', 'I' };
+
+	// 書き出す内容を変えたら上げる
+	constexpr uint32 FormatVersion = 2;
+
+	// RegionSetting から文字列を除いたもの（そのまま書き出す）
+	struct RegionRecord
+	{
+		float off_time;
+		float volume;
+		float rt_decay;
+		float ampeg_attack;
+		float ampeg_decay;
+		float ampeg_sustain;
+		float ampeg_release;
+		int32 group;
+		int32 off_by;
+		uint32 offset;
+		int32 sampleIndex;
+		int16 tune;
+		uint8 lovel;
+		uint8 hivel;
+		uint8 lokey;
+		uint8 hikey;
+		Trigger trigger;
+		OffMode off_mode;
+		LoopMode loopMode;
+		int8 pitch_keycenter;
+		int8 sw_lokey;
+		int8 sw_hikey;
+		int8 sw_last;
+		int8 sw_default;
+	};
+	static_assert(std::is_trivially_copyable_v<RegionRecord>);
+	static_assert(std::is_trivially_copyable_v<SampleInfo>);
+
+	RegionRecord ToRecord(const RegionSetting& region, const Optional<uint32>& sampleIndex)
+	{
+		RegionRecord record = {};
+		record.off_time = region.off_time;
+		record.volume = region.volume;
+		record.rt_decay = region.rt_decay;
+		record.ampeg_attack = region.ampeg_attack;
+		record.ampeg_decay = region.ampeg_decay;
+		record.ampeg_sustain = region.ampeg_sustain;
+		record.ampeg_release = region.ampeg_release;
+		record.group = region.group;
+		record.off_by = region.off_by;
+		record.offset = region.offset;
+		record.sampleIndex = sampleIndex ? static_cast<int32>(sampleIndex.value()) : -1;
+		record.tune = region.tune;
+		record.lovel = region.lovel;
+		record.hivel = region.hivel;
+		record.lokey = region.lokey;
+		record.hikey = region.hikey;
+		record.trigger = region.trigger;
+		record.off_mode = region.off_mode;
+		record.loopMode = region.loopMode;
+		record.pitch_keycenter = region.pitch_keycenter;
+		record.sw_lokey = region.sw_lokey;
+		record.sw_hikey = region.sw_hikey;
+		record.sw_last = region.sw_last;
+		record.sw_default = region.sw_default;
+		return record;
+	}
+
+	RegionSetting FromRecord(const RegionRecord& record, String sample)
+	{
+		RegionSetting region;
+		region.sample = std::move(sample);
+		region.off_time = record.off_time;
+		region.volume = record.volume;
+		region.rt_decay = record.rt_decay;
+		region.ampeg_attack = record.ampeg_attack;
+		region.ampeg_decay = record.ampeg_decay;
+		region.ampeg_sustain = record.ampeg_sustain;
+		region.ampeg_release = record.ampeg_release;
+		region.group = record.group;
+		region.off_by = record.off_by;
+		region.offset = record.offset;
+		region.tune = record.tune;
+		region.lovel = record.lovel;
+		region.hivel = record.hivel;
+		region.lokey = record.lokey;
+		region.hikey = record.hikey;
+		region.trigger = record.trigger;
+		region.off_mode = record.off_mode;
+		region.loopMode = record.loopMode;
+		region.pitch_keycenter = record.pitch_keycenter;
+		region.sw_lokey = record.sw_lokey;
+		region.sw_hikey = record.sw_hikey;
+		region.sw_last = record.sw_last;
+		region.sw_default = record.sw_default;
+		return region;
+	}
+}
+
+Array<std::pair<FilePath, FileStamp>> CompiledInstrument::files() const
+{
+	Array<std::pair<FilePath, FileStamp>> result;
+	result.reserve(dependencies.size() + samples.size());
+
+	for (const auto& dependency : dependencies)
+	{
+		result.emplace_back(dependency.path, dependency.stamp);
+	}
+
+	for (const auto& sample : samples)
+	{
+		result.emplace_back(sample.path, sample.stamp);
+	}
+
+	return result;
+}
+
+CompiledInstrument CompileInstrument(FilePathView sfzPath)
+{
+	const auto sfzData = LoadSfz(sfzPath);
+
+	CompiledInstrument instrument;
+
+	Array<FilePath> dependencyPaths = { FilePath(sfzPath) };
+	dependencyPaths.append(sfzData.includes);
+
+	// 見つからなかった #include も記録しておき、後から作られたらキャッシュを無効にする
+	for (const auto& path : dependencyPaths)
+	{
+		instrument.dependencies.push_back(CompiledInstrument::Dependency{ path, GetFileStampOrMissing(path) });
+	}
+
+	HashTable<FilePath, uint32> sampleIndices;
+	HashSet<FilePath> missingSamples;
+
+	for (const auto& region : sfzData.data)
+	{
+		Optional<uint32> sampleIndex;
+
+		if (!region.sample.starts_with(U'*'))
+		{
+			const auto samplePath = sfzData.dir + region.sample;
+			const auto stamp = GetFileStamp(samplePath);
+			if (!stamp)
+			{
+#ifdef DEVELOPMENT
+				Console << U"error: file does not exist: \"" << samplePath << U"\"";
+#endif
+				// リージョンは飛ばすが、後からサンプルが置かれたら作り直せるように記録しておく
+				if (missingSamples.emplace(samplePath).second)
+				{
+					instrument.dependencies.push_back(CompiledInstrument::Dependency{ samplePath, MissingFileStamp });
+				}
+				continue;
+			}
+
+			auto [it, isNew] = sampleIndices.emplace(samplePath, static_cast<uint32>(instrument.samples.size()));
+			if (isNew)
+			{
+				instrument.samples.push_back(CompiledInstrument::Sample{ samplePath, stamp.value(), none });
+			}
+
+			sampleIndex = it->second;
+		}
+
+		const auto regionIndex = static_cast<uint32>(instrument.regions.size());
+		for (uint32 key = region.lokey; key <= region.hikey && key < instrument.keyRegions.size(); ++key)
+		{
+			instrument.keyRegions[key].push_back(regionIndex);
+		}
+
+		instrument.regions.push_back(region);
+		instrument.regionSamples.push_back(sampleIndex);
+	}
+
+	return instrument;
+}
+
+void ResolveSampleInfos(CompiledInstrument& instrument)
+{
+	for (auto& sample : instrument.samples)
+	{
+		const auto readerIndex = AudioLoadManager::i().load(sample.path, sample.info);
+		if (readerIndex != std::numeric_limits<size_t>::max())
+		{
+			sample.info = AudioLoadManager::i().reader(readerIndex).sampleInfo();
+		}
+	}
+}
+
+void InstrumentCache::setup(FilePathView directory)
+{
+	m_directory = FileSystem::FullPath(directory);
+	if (!m_directory.ends_with(U'/'))
+	{
+		m_directory += U'/';
+	}
+
+	if (!FileSystem::IsDirectory(m_directory) && !FileSystem::CreateDirectories(m_directory))
+	{
+		Console << U"error: 音源キャッシュのディレクトリを作成できません \"" << m_directory << U"\"";
+		return;
+	}
+
+	m_isEnabled = true;
+}
+
+FilePath InstrumentCache::cacheFilePath(FilePathView sfzPath) const
+{
+	return m_directory + U"{:016X}.bin"_fmt(FNV1a(NormalizePath(sfzPath)));
+}
+
+Optional<CompiledInstrument> InstrumentCache::load(FilePathView sfzPath) const
+{
+	if (!m_isEnabled)
+	{
+		return none;
+	}
+
+	const auto cachePath = cacheFilePath(sfzPath);
+	if (!FileSystem::IsFile(cachePath))
+	{
+		return none;
+	}
+
+	MemoryMappedFileView file(cachePath);
+	if (!file || file.size() == 0)
+	{
+		return none;
+	}
+
+	const auto memory = file.mapAll();
+	CacheReader reader(std::bit_cast<const uint8*>(memory.data), memory.size);
+
+	const auto magic = reader.read<std::array<char, 4>>();
+	if (std::memcmp(magic.data(), Magic, sizeof(Magic)) != 0 || reader.read<uint32>() != FormatVersion)
+	{
+		return none;
+	}
+
+	CompiledInstrument instrument;
+
+	const auto dependencyCount = reader.read<uint32>();
+	for (uint32 i = 0; i < dependencyCount && reader.isValid(); ++i)
+	{
+		auto path = reader.readString();
+		const auto stamp = reader.readStamp();
+		if (!reader.isValid() || !IsUpToDate(path, stamp))
+		{
+			return none;
+		}
+
+		instrument.dependencies.push_back(CompiledInstrument::Dependency{ std::move(path), stamp });
+	}
+
+	const auto sampleCount = reader.read<uint32>();
+	for (uint32 i = 0; i < sampleCount && reader.isValid(); ++i)
+	{
+		auto path = reader.readString();
+		const auto stamp = reader.readStamp();
+		const auto hasInfo = reader.read<uint8>();
+		const auto info = reader.read<SampleInfo>();
+		if (!reader.isValid() || !IsUpToDate(path, stamp))
+		{
+			return none;
+		}
+
+		instrument.samples.push_back(CompiledInstrument::Sample{ std::move(path), stamp, hasInfo ? Optional<SampleInfo>(info) : none });
+	}
+
+	const auto regionCount = reader.read<uint32>();
+	for (uint32 i = 0; i < regionCount && reader.isValid(); ++i)
+	{
+		const auto record = reader.read<RegionRecord>();
+		auto sample = reader.readString();
+
+		Optional<uint32> sampleIndex;
+		if (0 <= record.sampleIndex && static_cast<uint32>(record.sampleIndex) < sampleCount)
+		{
+			sampleIndex = static_cast<uint32>(record.sampleIndex);
+		}
+
+		instrument.regions.push_back(FromRecord(record, std::move(sample)));
+		instrument.regionSamples.push_back(sampleIndex);
+	}
+
+	for (auto& regionIndices : instrument.keyRegions)
+	{
+		const auto count = reader.read<uint32>();
+		for (uint32 i = 0; i < count && reader.isValid(); ++i)
+		{
+			const auto regionIndex = reader.read<uint32>();
+			if (regionCount <= regionIndex)
+			{
+				return none;
+			}
+			regionIndices.push_back(regionIndex);
+		}
+	}
+
+	if (!reader.isValid())
+	{
+		return none;
+	}
+
+	return instrument;
+}
+
+void InstrumentCache::save(FilePathView sfzPath, const CompiledInstrument& instrument) const
+{
+	if (!m_isEnabled)
+	{
+		return;
+	}
+
+	const auto cachePath = cacheFilePath(sfzPath);
+	const auto tempPath = cachePath + U".tmp";
+
+	{
+		BinaryWriter writer(tempPath);
+		if (!writer)
+		{
+			return;
+		}
+
+		writer.write(Magic, sizeof(Magic));
+		writer.write(FormatVersion);
+
+		writer.write(static_cast<uint32>(instrument.dependencies.size()));
+		for (const auto& dependency : instrument.dependencies)
+		{
+			WriteString(writer, dependency.path);
+			WriteStamp(writer, dependency.stamp);
+		}
+
+		writer.write(static_cast<uint32>(instrument.samples.size()));
+		for (const auto& sample : instrument.samples)
+		{
+			WriteString(writer, sample.path);
+			WriteStamp(writer, sample.stamp);
+			writer.write(static_cast<uint8>(sample.info.has_value()));
+			writer.write(sample.info.value_or(SampleInfo{}));
+		}
+
+		writer.write(static_cast<uint32>(instrument.regions.size()));
+		for (size_t i = 0; i < instrument.regions.size(); ++i)
+		{
+			writer.write(ToRecord(instrument.regions[i], instrument.regionSamples[i]));
+			WriteString(writer, instrument.regions[i].sample);
+		}
+
+		for (const auto& regionIndices : instrument.keyRegions)
+		{
+			writer.write(static_cast<uint32>(regionIndices.size()));
+			writer.write(regionIndices.data(), regionIndices.size_bytes());
+		}
+	}
+
+	FileSystem::Remove(cachePath);
+	if (!FileSystem::Rename(tempPath, cachePath))
+	{
+		FileSystem::Remove(tempPath);
+	}
+}
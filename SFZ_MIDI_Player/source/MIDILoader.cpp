@@ -1,5 +1,7 @@
 ﻿#pragma once
+#include <Config.hpp>
 #include <MIDILoader.hpp>
+#include <TaskPool.hpp>
 #include <Utility.hpp>
 
 MetaEventData MetaEventData::Error()
@@ -99,70 +101,408 @@ MidiEventData MidiEventData::ChannelPressure(uint8 ch, uint8 velocity)
 MidiEventData MidiEventData::PitchBend(uint8 ch, uint16 value)
 {
 	MidiEventData d;
-	d.type = MidiEventType::ChannelPressure;
+	d.type = MidiEventType::PitchBend;
 	d.channel = ch;
 	d.value = value;
 	return d;
 }
 
-void TrackData::init()
+size_t NoteList::pressNote(uint32 tick, uint8 key, uint8 velocity, uint8 ch)
+{
+	m_ticks.push_back(tick);
+	m_gates.push_back(UnreleasedGate);
+	m_keys.push_back(key);
+	m_velocities.push_back(velocity);
+	m_channels.push_back(ch);
+	m_beginSec.push_back(0.0);
+	m_endSec.push_back(0.0);
+	return m_ticks.size() - 1;
+}
+
+void NoteList::releaseNote(size_t index, uint32 tick)
+{
+	m_gates[index] = tick - m_ticks[index];
+}
+
+void NoteList::setSeconds(size_t index, double beginSec, double endSec)
+{
+	m_beginSec[index] = beginSec;
+	m_endSec[index] = endSec;
+}
+
+void NoteList::removeUnreleased()
+{
+	size_t writeIndex = 0;
+	for (size_t i = 0; i < m_ticks.size(); ++i)
+	{
+		if (m_gates[i] == UnreleasedGate)
+		{
+			continue;
+		}
+
+		if (writeIndex != i)
+		{
+			m_ticks[writeIndex] = m_ticks[i];
+			m_gates[writeIndex] = m_gates[i];
+			m_keys[writeIndex] = m_keys[i];
+			m_velocities[writeIndex] = m_velocities[i];
+			m_channels[writeIndex] = m_channels[i];
+			m_beginSec[writeIndex] = m_beginSec[i];
+			m_endSec[writeIndex] = m_endSec[i];
+		}
+		++writeIndex;
+	}
+
+	m_ticks.resize(writeIndex);
+	m_gates.resize(writeIndex);
+	m_keys.resize(writeIndex);
+	m_velocities.resize(writeIndex);
+	m_channels.resize(writeIndex);
+	m_beginSec.resize(writeIndex);
+	m_endSec.resize(writeIndex);
+}
+
+size_t NoteList::countBefore(uint32 tick) const
+{
+	return static_cast<size_t>(std::lower_bound(m_ticks.begin(), m_ticks.end(), tick) - m_ticks.begin());
+}
+
+NoteList NoteList::takeFront(size_t count)
+{
+	NoteList taken;
+
+	if (count == size())
+	{
+		std::swap(taken, *this);
+		return taken;
+	}
+
+	const auto move = [count](auto& from, auto& to)
+	{
+		to.assign(from.begin(), from.begin() + count);
+		from.erase(from.begin(), from.begin() + count);
+	};
+
+	move(m_ticks, taken.m_ticks);
+	move(m_gates, taken.m_gates);
+	move(m_keys, taken.m_keys);
+	move(m_velocities, taken.m_velocities);
+	move(m_channels, taken.m_channels);
+	move(m_beginSec, taken.m_beginSec);
+	move(m_endSec, taken.m_endSec);
+	return taken;
+}
+
+void NoteList::append(NoteList&& other)
+{
+	if (isEmpty())
+	{
+		*this = std::move(other);
+		return;
+	}
+
+	m_ticks.append(other.m_ticks);
+	m_gates.append(other.m_gates);
+	m_keys.append(other.m_keys);
+	m_velocities.append(other.m_velocities);
+	m_channels.append(other.m_channels);
+	m_beginSec.append(other.m_beginSec);
+	m_endSec.append(other.m_endSec);
+}
+
+void NoteList::reserve(size_t noteCount)
+{
+	m_ticks.reserve(noteCount);
+	m_gates.reserve(noteCount);
+	m_keys.reserve(noteCount);
+	m_velocities.reserve(noteCount);
+	m_channels.reserve(noteCount);
+	m_beginSec.reserve(noteCount);
+	m_endSec.reserve(noteCount);
+}
+
+void NoteList::shrinkToFit()
+{
+	m_ticks.shrink_to_fit();
+	m_gates.shrink_to_fit();
+	m_keys.shrink_to_fit();
+	m_velocities.shrink_to_fit();
+	m_channels.shrink_to_fit();
+	m_beginSec.shrink_to_fit();
+	m_endSec.shrink_to_fit();
+}
+
+size_t NoteList::memoryUsage() const
+{
+	return m_ticks.capacity() * sizeof(uint32)
+		+ m_gates.capacity() * sizeof(uint32)
+		+ m_keys.capacity() + m_velocities.capacity() + m_channels.capacity()
+		+ m_beginSec.capacity() * sizeof(double)
+		+ m_endSec.capacity() * sizeof(double);
+}
+
+MidiEventType ChannelEvent::type() const
+{
+	switch (status & 0xF0)
+	{
+	case 0x80: return MidiEventType::NoteOff;
+	case 0x90: return MidiEventType::NoteOn;
+	case 0xA0: return MidiEventType::PolyphonicKeyPressure;
+	case 0xB0: return MidiEventType::ControlChange;
+	case 0xC0: return MidiEventType::ProgramChange;
+	case 0xD0: return MidiEventType::ChannelPressure;
+	default: return MidiEventType::PitchBend;
+	}
+}
+
+size_t ChannelEventList::countBefore(uint32 tick) const
+{
+	return static_cast<size_t>(std::lower_bound(m_ticks.begin(), m_ticks.end(), tick) - m_ticks.begin());
+}
+
+ChannelEventList ChannelEventList::takeFront(size_t count)
+{
+	ChannelEventList taken;
+
+	if (count == size())
+	{
+		std::swap(taken, *this);
+		return taken;
+	}
+
+	const auto move = [count](auto& from, auto& to)
+	{
+		to.assign(from.begin(), from.begin() + count);
+		from.erase(from.begin(), from.begin() + count);
+	};
+
+	move(m_ticks, taken.m_ticks);
+	move(m_status, taken.m_status);
+	move(m_data1, taken.m_data1);
+	move(m_data2, taken.m_data2);
+	return taken;
+}
+
+void ChannelEventList::append(ChannelEventList&& other)
+{
+	if (isEmpty())
+	{
+		*this = std::move(other);
+		return;
+	}
+
+	m_ticks.append(other.m_ticks);
+	m_status.append(other.m_status);
+	m_data1.append(other.m_data1);
+	m_data2.append(other.m_data2);
+}
+
+void ChannelEventList::shrinkToFit()
+{
+	m_ticks.shrink_to_fit();
+	m_status.shrink_to_fit();
+	m_data1.shrink_to_fit();
+	m_data2.shrink_to_fit();
+}
+
+size_t ChannelEventList::memoryUsage() const
 {
-	HashTable<int, Note> onNotes;
+	return m_ticks.capacity() * sizeof(uint32) + m_status.capacity() + m_data1.capacity() + m_data2.capacity();
+}
+
+TrackData::TrackData(const Array<MidiCode>& operations)
+{
+	uint32 endTick = 0;
 
-	for (const auto& code : m_operations)
+	for (const auto& code : operations)
 	{
+		endTick = code.tick;
+
 		if (code.type == EventType::MidiEvent)
 		{
 			const auto& midiEvent = std::get<MidiEventData>(code.data);
+			const uint8 ch = midiEvent.channel & 0x0F;
 
 			switch (midiEvent.type)
 			{
 			case MidiEventType::NoteOff:
-			{
-				auto it = onNotes.find(midiEvent.key);
-				if (it != onNotes.end())
-				{
-					it->second.gate = code.tick - it->second.tick;
-					m_notes.push_back(it->second);
-					onNotes.erase(midiEvent.key);
-				}
+				addChannelEvent(code.tick, 0x80 | ch, midiEvent.key, 0);
 				break;
-			}
 			case MidiEventType::NoteOn:
-			{
-				auto it = onNotes.find(midiEvent.key);
-				if (it != onNotes.end())
-				{
-					it->second.gate = code.tick - it->second.tick;
-					m_notes.push_back(it->second);
-					onNotes.erase(midiEvent.key);
-				}
-				auto& newNote = onNotes[midiEvent.key];
-				newNote.tick = code.tick;
-				newNote.key = midiEvent.key;
-				newNote.velocity = midiEvent.velocity;
-				newNote.ch = midiEvent.channel;
+				addChannelEvent(code.tick, 0x90 | ch, midiEvent.key, midiEvent.velocity);
 				break;
-			}
 			case MidiEventType::PolyphonicKeyPressure:
+				addChannelEvent(code.tick, 0xA0 | ch, midiEvent.key, midiEvent.velocity);
 				break;
 			case MidiEventType::ControlChange:
+				addChannelEvent(code.tick, 0xB0 | ch, midiEvent.changeType, static_cast<uint8>(midiEvent.value));
 				break;
 			case MidiEventType::ProgramChange:
-			{
-				// TODO: 途中でProgramChangeイベントがある場合に対応してない
-				m_channel = midiEvent.channel;
-				m_program = midiEvent.changeType;
+				addChannelEvent(code.tick, 0xC0 | ch, midiEvent.changeType, 0);
 				break;
-			}
 			case MidiEventType::ChannelPressure:
+				addChannelEvent(code.tick, 0xD0 | ch, midiEvent.velocity, 0);
 				break;
 			case MidiEventType::PitchBend:
+				addChannelEvent(code.tick, 0xE0 | ch, midiEvent.value & 0x7F, (midiEvent.value >> 7) & 0x7F);
 				break;
 			default: break;
 			}
 		}
+		else if (code.type == EventType::MetaEvent)
+		{
+			const auto& metaEvent = std::get<MetaEventData>(code.data);
+			if (metaEvent.type == MetaEventType::Tempo)
+			{
+				addTempo(code.tick, metaEvent.tempo);
+			}
+			else if (metaEvent.type == MetaEventType::SetMetre)
+			{
+				addMetre(code.tick, metaEvent.eventData);
+			}
+		}
+	}
+
+	finish(endTick);
+}
+
+void TrackData::addChannelEvent(uint32 tick, uint8 status, uint8 data1, uint8 data2)
+{
+	const uint8 ch = status & 0x0F;
+
+	switch (status & 0xF0)
+	{
+	case 0x90:
+	{
+		if (data2 == 0)
+		{
+			// ベロシティ0のノートオンはノートオフ
+			releasePendingNote(ch, data1, tick);
+			return;
+		}
+
+		const uint8 key = data1 & 0x7F;
+		releasePendingNote(ch, key, tick);
+		m_pendingNotes[ch * 128 + key] = static_cast<uint32>(m_notes.pressNote(tick, key, data2, ch)) + 1;
+		return;
+	}
+	case 0x80:
+	{
+		releasePendingNote(ch, data1, tick);
+		return;
+	}
+	case 0xC0:
+	{
+		m_channel = ch;
+		m_program = data1;
+		break;
+	}
+	default: break;
+	}
+
+	m_channelEvents.push_back(ChannelEvent{ tick, status, data1, data2 });
+}
+
+void TrackData::releasePendingNote(uint8 ch, uint8 key, uint32 tick)
+{
+	auto& pending = m_pendingNotes[(ch & 0x0F) * 128 + (key & 0x7F)];
+	if (pending != 0)
+	{
+		m_notes.releaseNote(pending - 1, tick);
+		pending = 0;
+	}
+}
+
+void TrackData::addTempo(uint32 tick, double bpm)
+{
+	m_tempos.push_back(TempoEvent{ tick, bpm });
+}
+
+void TrackData::addMetre(uint32 tick, const MetreData& metre)
+{
+	m_metres.push_back(MetreEvent{ tick, metre });
+}
+
+void TrackData::finish(uint32 endTick)
+{
+	m_endTick = endTick;
+	m_isFinished = true;
+	m_pendingNotes.fill(0);
+
+	m_notes.removeUnreleased();
+	m_notes.shrinkToFit();
+	m_channelEvents.shrinkToFit();
+	m_tempos.shrink_to_fit();
+	m_metres.shrink_to_fit();
+}
+
+Optional<uint32> TrackData::firstPendingTick() const
+{
+	Optional<uint32> result;
+	for (const auto pending : m_pendingNotes)
+	{
+		if (pending != 0)
+		{
+			const auto tick = m_notes.tick(pending - 1);
+			result = result ? Min(result.value(), tick) : tick;
+		}
+	}
+	return result;
+}
+
+TrackData TrackData::takeBefore(uint32 tick)
+{
+	TrackData taken;
+
+	const size_t noteCount = m_notes.countBefore(tick);
+	taken.m_notes = m_notes.takeFront(noteCount);
+
+	// 押されたままのノートは tick 以降に始まっているので、番号を詰めるだけでよい
+	for (auto& pending : m_pendingNotes)
+	{
+		if (pending != 0)
+		{
+			pending -= static_cast<uint32>(noteCount);
+		}
 	}
+
+	taken.m_channelEvents = m_channelEvents.takeFront(m_channelEvents.countBefore(tick));
+
+	const auto tempoEnd = std::lower_bound(m_tempos.begin(), m_tempos.end(), tick, [](const TempoEvent& tempo, uint32 value) { return tempo.tick < value; });
+	taken.m_tempos.assign(m_tempos.begin(), tempoEnd);
+	m_tempos.erase(m_tempos.begin(), tempoEnd);
+
+	const auto metreEnd = std::lower_bound(m_metres.begin(), m_metres.end(), tick, [](const MetreEvent& metre, uint32 value) { return metre.tick < value; });
+	taken.m_metres.assign(m_metres.begin(), metreEnd);
+	m_metres.erase(m_metres.begin(), metreEnd);
+
+	const bool isAllTaken = m_isFinished && m_notes.isEmpty() && m_channelEvents.isEmpty() && m_tempos.isEmpty() && m_metres.isEmpty();
+	taken.m_endTick = isAllTaken ? m_endTick : Max(tick, 1u) - 1;
+	taken.m_isFinished = isAllTaken;
+	taken.m_channel = m_channel;
+	taken.m_program = m_program;
+	return taken;
+}
+
+void TrackData::append(TrackData&& other)
+{
+	m_notes.append(std::move(other.m_notes));
+	m_channelEvents.append(std::move(other.m_channelEvents));
+	m_tempos.append(other.m_tempos);
+	m_metres.append(other.m_metres);
+	m_endTick = Max(m_endTick, other.m_endTick);
+	m_isFinished = other.m_isFinished;
+	m_channel = other.m_channel;
+	m_program = other.m_program;
+}
+
+size_t TrackData::memoryUsage() const
+{
+	return sizeof(TrackData)
+		+ m_notes.memoryUsage()
+		+ m_channelEvents.memoryUsage()
+		+ m_tempos.capacity() * sizeof(TempoEvent)
+		+ m_metres.capacity() * sizeof(MetreEvent);
 }
 
 void TrackData::outputLog(TextWriter& writer) const
@@ -186,38 +526,51 @@ void Measure::outputLog(TextWriter& writer) const
 
 void MidiData::init()
 {
-	m_measures.clear();
+	updateMeasures();
 
-	for (const auto& track : m_tracks)
+	m_tempoMap = TempoMap(BPMSetEvents(), m_resolution);
+
+	TaskPool::i().parallelFor(m_tracks.size(), [&](size_t trackIndex)
+		{
+			m_tempoMap.assignSeconds(m_tracks[trackIndex].m_notes);
+		});
+}
+
+void MidiData::append(Array<TrackData>&& tracks)
+{
+	if (m_tracks.isEmpty())
+	{
+		m_tracks = std::move(tracks);
+	}
+	else
 	{
-		for (const auto& code : track.m_operations)
+		for (size_t i = 0; i < Min(m_tracks.size(), tracks.size()); ++i)
 		{
-			if (code.type == EventType::MetaEvent)
-			{
-				const auto& metaEvent = std::get<MetaEventData>(code.data);
-				if (metaEvent.type == MetaEventType::SetMetre)
-				{
-					MeasureInfo info;
-					info.metre = metaEvent.eventData;
-					info.globalTick = code.tick;
-					m_measures.push_back(info);
-				}
-			}
+			m_tracks[i].append(std::move(tracks[i]));
 		}
 	}
 
-	m_measures.sort_by([](const MeasureInfo& a, const MeasureInfo& b) { return a.globalTick < b.globalTick; });
+	updateMeasures();
+
+	m_tempoMap = TempoMap(BPMSetEvents(), m_resolution);
+}
 
-	m_bpmSetEvents = BPMSetEvents();
+void MidiData::updateMeasures()
+{
+	m_measures.clear();
 
-	for (auto& track : m_tracks)
+	for (const auto& track : m_tracks)
 	{
-		for (auto& note : track.m_notes)
+		for (const auto& metre : track.m_metres)
 		{
-			note.beginSec = ticksToSeconds(note.tick);
-			note.endSec = ticksToSeconds(note.tick + note.gate);
+			MeasureInfo info;
+			info.metre = metre.metre;
+			info.globalTick = metre.tick;
+			m_measures.push_back(info);
 		}
 	}
+
+	m_measures.sort_by([](const MeasureInfo& a, const MeasureInfo& b) { return a.globalTick < b.globalTick; });
 }
 
 Array<Measure> MidiData::getMeasures() const
@@ -271,7 +624,7 @@ uint32 MidiData::endTick() const
 	uint32 maxTick = 0;
 	for (const auto& track : m_tracks)
 	{
-		maxTick = Max(maxTick, track.m_operations.back().tick);
+		maxTick = Max(maxTick, track.m_endTick);
 	}
 	return maxTick;
 }
@@ -280,16 +633,9 @@ double MidiData::getBPM() const
 {
 	for (const auto& track : m_tracks)
 	{
-		for (const auto& code : track.m_operations)
+		if (!track.m_tempos.isEmpty())
 		{
-			if (code.type == EventType::MetaEvent)
-			{
-				const auto& metaEvent = std::get<MetaEventData>(code.data);
-				if (metaEvent.type == MetaEventType::Tempo)
-				{
-					return metaEvent.tempo;
-				}
-			}
+			return track.m_tempos.front().bpm;
 		}
 	}
 
@@ -298,75 +644,40 @@ double MidiData::getBPM() const
 
 double MidiData::ticksToSeconds(int64 currentTick) const
 {
-	const double resolution = m_resolution;
-	double sumOfTime = 0;
-	int64 lastBPMSetTick = 0;
-	double lastTickToSec = 60.0 / (resolution * 120.0);
-	for (const auto [tick, bpm] : m_bpmSetEvents)
-	{
-		if (currentTick <= tick)
-		{
-			return sumOfTime + lastTickToSec * (currentTick - lastBPMSetTick);
-		}
+	return m_tempoMap.ticksToSeconds(static_cast<double>(currentTick));
+}
 
-		sumOfTime += lastTickToSec * (tick - lastBPMSetTick);
-		lastBPMSetTick = tick;
-		lastTickToSec = 60.0 / (resolution * bpm);
-	}
+int64 MidiData::secondsToTicks(double seconds) const
+{
+	return static_cast<int64>(Math::Round(m_tempoMap.secondsToTicks(seconds)));
+}
 
-	return sumOfTime + lastTickToSec * (currentTick - lastBPMSetTick);
+double MidiData::secondsToTicks2(double seconds) const
+{
+	return m_tempoMap.secondsToTicks(seconds);
 }
 
-int64 MidiData::secondsToTicks(double seconds) const
+size_t MidiData::noteCount() const
 {
-	const double resolution = m_resolution;
-	double sumOfTime = 0;
-	int64 lastBPMSetTick = 0;
-	double lastBPM = 120;
-	//double lastTickToSec = (60.0 / (resolution * lastBPM));
-	for (const auto [tick, bpm] : m_bpmSetEvents)
+	size_t count = 0;
+	for (const auto& track : m_tracks)
 	{
-		const double nextSumOfTime = sumOfTime + (60.0 / (resolution * lastBPM)) * (tick - lastBPMSetTick);
-		if (sumOfTime <= seconds && seconds < nextSumOfTime)
-		{
-			const double secToTicks = (resolution * lastBPM) / 60.0;
-			return lastBPMSetTick + static_cast<int64>(Math::Round((seconds - sumOfTime) * secToTicks));
-		}
-
-		sumOfTime = nextSumOfTime;
-		lastBPMSetTick = tick;
-		lastBPM = bpm;
-		//lastTickToSec = 60.0 / (resolution * bpm);
+		count += track.m_notes.size();
 	}
-
-	const double secToTicks = (resolution * lastBPM) / 60.0;
-	return lastBPMSetTick + static_cast<int64>(Math::Round((seconds - sumOfTime) * secToTicks));
+	return count;
 }
 
-double MidiData::secondsToTicks2(double seconds) const
+size_t MidiData::memoryUsage() const
 {
-	const double resolution = m_resolution;
-	double sumOfTime = 0;
-	int64 lastBPMSetTick = 0;
-	double lastBPM = 120;
-	//double lastTickToSec = (60.0 / (resolution * lastBPM));
-	for (const auto [tick, bpm] : m_bpmSetEvents)
-	{
-		const double nextSumOfTime = sumOfTime + (60.0 / (resolution * lastBPM)) * (tick - lastBPMSetTick);
-		if (sumOfTime <= seconds && seconds < nextSumOfTime)
-		{
-			const double secToTicks = (resolution * lastBPM) / 60.0;
-			return lastBPMSetTick + (seconds - sumOfTime) * secToTicks;
-		}
+	size_t usage = sizeof(MidiData)
+		+ m_measures.capacity() * sizeof(MeasureInfo)
+		+ m_tempoMap.segments().capacity() * sizeof(TempoMap::Segment);
 
-		sumOfTime = nextSumOfTime;
-		lastBPMSetTick = tick;
-		lastBPM = bpm;
-		//lastTickToSec = 60.0 / (resolution * bpm);
+	for (const auto& track : m_tracks)
+	{
+		usage += track.memoryUsage();
 	}
-
-	const double secToTicks = (resolution * lastBPM) / 60.0;
-	return lastBPMSetTick + (seconds - sumOfTime) * secToTicks;
+	return usage;
 }
 
 // tick -> BPM
@@ -375,411 +686,873 @@ std::map<int64, double> MidiData::BPMSetEvents() const
 	std::map<int64, double> result;
 	for (const auto& track : m_tracks)
 	{
-		for (const auto& code : track.m_operations)
+		for (const auto& tempo : track.m_tempos)
 		{
-			if (code.type == EventType::MetaEvent)
-			{
-				const auto& metaEvent = std::get<MetaEventData>(code.data);
-				if (metaEvent.type == MetaEventType::Tempo)
-				{
-					result[code.tick] = metaEvent.tempo;
-				}
-			}
+			result[tempo.tick] = tempo.bpm;
 		}
 	}
 
 	return result;
 }
 
-bool MidiData::intersects(uint32 range0begin, uint32 range0end, uint32 range1begin, uint32 range1end) const
+TempoMap::TempoMap(const std::map<int64, double>& bpmSetEvents, uint16 resolution) :
+	m_ticksPerBeat(Max<uint16>(resolution, 1))
 {
-	const bool notIntersects = range0end < range1begin || range1end < range0begin;
-	return !notIntersects;
+	m_segments.reserve(bpmSetEvents.size() + 1);
+	m_segments.push_back(Segment{ 0, 0.0, 60.0 / (m_ticksPerBeat * 120.0) });
+
+	for (const auto& [tick, bpm] : bpmSetEvents)
+	{
+		append(tick, bpm);
+	}
 }
 
-namespace
+void TempoMap::append(int64 tick, double bpm)
 {
-	// https://sites.google.com/site/yyagisite/material/smfspec
-	// http://quelque.sakura.ne.jp/midi_meta.html
-	MetaEventData ReadMetaEvent(BinaryReader& reader, TextWriter& debugLog)
+	const auto& last = m_segments.back();
+	const double secondsPerTick = 60.0 / (m_ticksPerBeat * bpm);
+
+	if (tick <= last.tick)
 	{
-		const uint8 metaEventType = ReadBytes<uint8>(reader);
-		switch (metaEventType)
-		{
-		case 0x0:
-		{
-			debugLog << U"error: シーケンス番号（非対応フォーマット）";
-			return MetaEventData::Error();
-		}
-		case 0x1:
+		// 同じ tick のテンポ指定は後のもので置き換える（tick 0 なら初期テンポを置き換える）
+		m_segments.back().secondsPerTick = secondsPerTick;
+		return;
+	}
+
+	const double seconds = last.seconds + last.secondsPerTick * (tick - last.tick);
+	m_segments.push_back(Segment{ tick, seconds, secondsPerTick });
+}
+
+double TempoMap::ticksToSeconds(double tick) const
+{
+	const auto& segment = m_segments[findByTick(tick)];
+	return segment.seconds + segment.secondsPerTick * (tick - segment.tick);
+}
+
+double TempoMap::secondsToTicks(double seconds) const
+{
+	const auto& segment = m_segments[findBySeconds(seconds)];
+	return segment.tick + (seconds - segment.seconds) / segment.secondsPerTick;
+}
+
+void TempoMap::assignSeconds(NoteList& notes) const
+{
+	// ノートは大体 tick 順に並んでいるので、開始と終了それぞれのカーソルで前回の位置から探す
+	auto beginCursor = cursor();
+	auto endCursor = cursor();
+
+	for (size_t i = 0; i < notes.size(); ++i)
+	{
+		const double tick = notes.tick(i);
+		notes.setSeconds(i, beginCursor.ticksToSeconds(tick), endCursor.ticksToSeconds(tick + notes.gate(i)));
+	}
+}
+
+size_t TempoMap::findByTick(double tick) const
+{
+	// tick 以下で最後の区間（先頭より前なら先頭の区間で外挿する）
+	const auto it = std::upper_bound(m_segments.begin() + 1, m_segments.end(), tick,
+		[](double value, const Segment& segment) { return value < segment.tick; });
+	return static_cast<size_t>(it - m_segments.begin()) - 1;
+}
+
+size_t TempoMap::findBySeconds(double seconds) const
+{
+	const auto it = std::upper_bound(m_segments.begin() + 1, m_segments.end(), seconds,
+		[](double value, const Segment& segment) { return value < segment.seconds; });
+	return static_cast<size_t>(it - m_segments.begin()) - 1;
+}
+
+double TempoMap::Cursor::ticksToSeconds(double tick)
+{
+	const auto& segments = m_tempoMap->m_segments;
+
+	// 今の区間か次の区間に収まっていればそのまま使い、離れていれば探し直す
+	const auto contains = [&](size_t index) {
+		return (index == 0 || segments[index].tick <= tick)
+			&& (index + 1 == segments.size() || tick < segments[index + 1].tick);
+	};
+
+	if (!contains(m_index))
+	{
+		if (m_index + 1 < segments.size() && contains(m_index + 1))
 		{
-			debugLog << U"テキストイベント";
-			const auto text = ReadText(reader);
-			debugLog << Unicode::FromUTF8(text);
-			return MetaEventData();
+			++m_index;
 		}
-		case 0x2:
+		else
 		{
-			debugLog << U"著作権表示";
-			const uint8 length = ReadBytes<uint8>(reader);
-			Array<char> chars(length + 1ull, '\0');
-			reader.read(chars.data(), length);
-			debugLog << Unicode::FromUTF8(std::string(chars.data()));
-			return MetaEventData();
+			m_index = m_tempoMap->findByTick(tick);
 		}
-		case 0x3:
-		{
-			debugLog << U"シーケンス名/トラック名";
-			const auto text = ReadText(reader);
-			debugLog << Unicode::FromUTF8(text);
-			return MetaEventData();
-		}
-		case 0x4:
-		{
-			debugLog << U"楽器名";
-			const auto text = ReadText(reader);
-			debugLog << Unicode::FromUTF8(text);
-			return MetaEventData();
-		}
-		case 0x5:
-		{
-			debugLog << U"歌詞";
-			const auto text = ReadText(reader);
-			debugLog << Unicode::FromUTF8(text);
-			return MetaEventData();
-		}
-		case 0x6:
-		{
-			debugLog << U"マーカー";
-			const auto text = ReadText(reader);
-			debugLog << Unicode::FromUTF8(text);
-			return MetaEventData();
-		}
-		case 0x7:
-		{
-			debugLog << U"キューポイント";
-			const auto text = ReadText(reader);
-			debugLog << Unicode::FromUTF8(text);
-			return MetaEventData();
-		}
-		case 0x8:
-		{
-			debugLog << U"プログラム名";
-			const auto text = ReadText(reader);
-			debugLog << Unicode::FromUTF8(text);
-			return MetaEventData();
-		}
-		case 0x9:
-		{
-			debugLog << U"デバイス名";
-			const auto text = ReadText(reader);
-			debugLog << Unicode::FromUTF8(text);
-			return MetaEventData();
-		}
-		case 0x20:
-		{
-			debugLog << U"MIDIチャンネルプリフィクス";
-			ReadBytes<uint8>(reader);
-			/*const uint8 data =*/ ReadBytes<uint8>(reader);
-			return MetaEventData();
-		}
-		case 0x21:
-		{
-			debugLog << U"ポート指定";
-			ReadBytes<uint8>(reader);
-			/*const uint8 data =*/ ReadBytes<uint8>(reader);
-			return MetaEventData();
-		}
-		case 0x2f:
-		{
-			debugLog << U"end of track";
-			ReadBytes<uint8>(reader);
-			return MetaEventData::EndOfTrack();
-		}
-		case 0x51:
-		{
-			//debugLog << U"テンポ指定 at " << reader.getPos();
-			ReadBytes<uint8>(reader);//==3
+	}
 
-			const auto a = ReadBytes<uint8>(reader);
-			const auto b = ReadBytes<uint8>(reader);
-			const auto c = ReadBytes<uint8>(reader);
-			const auto microSecPerBeat = 1.0 * ((a << 16) + (b << 8) + c);
+	const auto& segment = segments[m_index];
+	return segment.seconds + segment.secondsPerTick * (tick - segment.tick);
+}
 
-			const double bpm = 1.e6 * 60.0 / microSecPerBeat;
-			debugLog << U"テンポ: " << bpm;
-			return MetaEventData::SetTempo(bpm);
-		}
-		case 0x54:
-		{
-			debugLog << U"SMPTEオフセット";
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			return MetaEventData();
-		}
-		case 0x58:
+double TempoMap::Cursor::secondsToTicks(double seconds)
+{
+	const auto& segments = m_tempoMap->m_segments;
+
+	const auto contains = [&](size_t index) {
+		return (index == 0 || segments[index].seconds <= seconds)
+			&& (index + 1 == segments.size() || seconds < segments[index + 1].seconds);
+	};
+
+	if (!contains(m_index))
+	{
+		if (m_index + 1 < segments.size() && contains(m_index + 1))
 		{
-			//https://nekonenene.hatenablog.com/entry/2017/02/26/001351
-			//debugLog << U"拍子設定";
-			ReadBytes<uint8>(reader);
-			const uint8 numerator = ReadBytes<uint8>(reader);
-			const uint8 denominator = ReadBytes<uint8>(reader);
-			debugLog << U"拍子: " << numerator << U"/" << (1 << denominator);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			return MetaEventData::SetMetre(numerator, (1 << denominator));
+			++m_index;
 		}
-		case 0x59:
+		else
 		{
-			debugLog << U"調号";
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			ReadBytes<uint8>(reader);
-			return MetaEventData();
+			m_index = m_tempoMap->findBySeconds(seconds);
 		}
-		case 0x7f:
+	}
+
+	const auto& segment = segments[m_index];
+	return segment.tick + (seconds - segment.seconds) / segment.secondsPerTick;
+}
+
+void ProgramTimeline::clear()
+{
+	for (auto& changes : m_changes)
+	{
+		changes.clear();
+	}
+}
+
+void ProgramTimeline::append(const Array<TrackData>& tracks, uint32 tickBegin, uint32 tickEnd)
+{
+	// 同じ tick のプログラムチェンジはトラック順に適用する
+	Array<ChannelEvent> events;
+	for (const auto& track : tracks)
+	{
+		const auto& channelEvents = track.channelEvents();
+		const size_t end = channelEvents.countBefore(tickEnd);
+		for (size_t i = channelEvents.countBefore(tickBegin); i < end; ++i)
 		{
-			debugLog << U"シーケンサ固有メタイベント";
-			const uint8 length = ReadBytes<uint8>(reader);
-			Array<uint8> data(length);
-			reader.read(data.data(), length);
-			return MetaEventData();
-		}
-		default:
-			debugLog << U" unknown metaEvent: " << metaEventType;
-			debugLog << U" テキストとして解釈します";
-			const auto text = ReadText(reader);
-			debugLog << Unicode::FromUTF8(text);
-			return MetaEventData();
+			const auto event = channelEvents[i];
+			if ((event.status & 0xF0) == 0xC0)
+			{
+				events.push_back(event);
+			}
 		}
 	}
+
+	std::stable_sort(events.begin(), events.end(), [](const ChannelEvent& a, const ChannelEvent& b) { return a.tick < b.tick; });
+
+	for (const auto& event : events)
+	{
+		m_changes[event.status & 0x0F].push_back(Change{ event.tick, static_cast<uint8>(event.data1 & 0x7F) });
+	}
 }
 
-Optional<MidiData> LoadMidi(FilePathView path)
+size_t ProgramTimeline::countUntil(uint8 channel, uint32 tick) const
 {
-	TextWriter debugLog(U"debug/debugLog.txt");
-	TextWriter debugLog2(U"debug/debugLog2.txt");
-	debugLog << U"open \"" << path << U"\"";
-	BinaryReader reader(path);
+	const auto& changes = m_changes[channel & 0x0F];
+	const auto it = std::upper_bound(changes.begin(), changes.end(), tick,
+		[](uint32 value, const Change& change) { return value < change.tick; });
+	return std::distance(changes.begin(), it);
+}
+
+uint8 ProgramTimeline::programAt(uint8 channel, uint32 tick) const
+{
+	const size_t count = countUntil(channel, tick);
+	return count == 0 ? 0 : m_changes[channel & 0x0F][count - 1].program;
+}
 
-	if (!reader.isOpen())
+uint8 ProgramTimeline::Cursor::programAt(uint8 channel, uint32 tick)
+{
+	const auto& changes = m_timeline->m_changes[channel & 0x0F];
+	auto& count = m_counts[channel & 0x0F];
+
+	// 前に戻ったときだけ探し直す
+	if (0 < count && tick < changes[count - 1].tick)
 	{
-		debugLog << U"couldn't open file";
-		return none;
+		count = m_timeline->countUntil(channel, tick);
 	}
 
-	char mthd[5] = {};
-	reader.read(mthd, 4);
-	if (std::string(mthd) != "MThd")
+	while (count < changes.size() && changes[count].tick <= tick)
 	{
-		debugLog << U"error: std::string(mthd) != \"MThd\"";
-		return none;
+		++count;
 	}
 
-	const uint32 headerLength = ReadBytes<uint32>(reader);
-	if (headerLength != 6)
+	return count == 0 ? 0 : changes[count - 1].program;
+}
+
+ProgramUsage ProgramTimeline::usage(const Array<TrackData>& tracks) const
+{
+	ProgramUsage result;
+	for (const auto& track : tracks)
 	{
-		debugLog << U"error: headerLength != 6";
-		return none;
+		auto programCursor = cursor();
+		for (const auto& note : track.notes())
+		{
+			if (note.ch == PercussionChannel)
+			{
+				result.hasPercussion = true;
+			}
+			else
+			{
+				result.melodies[programCursor.programAt(note.ch, note.tick)] = true;
+			}
+		}
 	}
+	return result;
+}
 
-	const uint16 format = ReadBytes<uint16>(reader);
-	if ((format != 0) && (format != 1))
+bool MidiData::intersects(uint32 range0begin, uint32 range0end, uint32 range1begin, uint32 range1end) const
+{
+	const bool notIntersects = range0end < range1begin || range1end < range0begin;
+	return !notIntersects;
+}
+
+namespace
+{
+#ifdef MIDI_DEBUG_LOG
+	TextWriter& MidiDebugLog()
 	{
-		debugLog << U"error: (format != 0) && (format != 1)";
-		return none;
+		static TextWriter writer(U"debug/debugLog.txt");
+		return writer;
 	}
-	debugLog << U"format: " << format;
 
-	uint16 trackCount = ReadBytes<uint16>(reader);
-	debugLog << U"tracks: " << trackCount;
+#define MIDI_LOG(...) (MidiDebugLog() << __VA_ARGS__)
+#else
+#define MIDI_LOG(...) ((void)0)
+#endif
 
-	const uint16 resolution = ReadBytes<uint16>(reader);
-	debugLog << U"resolution: " << resolution;
+	// SMFのバイト列をポインタで直接読む
+	// 範囲外を読もうとした時点で isValid() が false になり、以降は 0 を返す
+	class SmfReader
+	{
+	public:
 
-	Array<TrackData> tracks;
+		SmfReader(const uint8* begin, const uint8* end) :
+			m_pos(begin),
+			m_end(end)
+		{}
 
-	for (uint32 trackIndex = 0; trackIndex < trackCount; ++trackIndex)
-	{
-		char mtrk[5] = {};
-		reader.read(mtrk, 4);
-		if (std::string(mtrk) != "MTrk")
-		{
-			debugLog << U"error: std::string(str) != \"MTrk\"";
-			return none;
-		}
+		bool isValid() const { return m_isValid; }
 
-		uint32 trackBytesLength = ReadBytes<uint32>(reader);
-		debugLog << U"trackLength: " << trackBytesLength;
+		bool isEnd() const { return m_end <= m_pos; }
 
-		Array<MidiCode> trackData;
-		//debugLog2 << U"track " << trackIndex;
+		const uint8* pos() const { return m_pos; }
 
-		uint32 currentTick = 0;
-		uint8 prevOpCode = 0;
+		size_t remaining() const { return static_cast<size_t>(m_end - m_pos); }
 
-		const int64 trackEndPos = reader.getPos() + trackBytesLength;
+		uint8 peek() const { return m_pos < m_end ? *m_pos : 0; }
 
-		for (;;)
+		uint8 readByte()
 		{
-			MidiCode codeData;
+			if (m_pos < m_end)
+			{
+				return *m_pos++;
+			}
+			m_isValid = false;
+			return 0;
+		}
+
+		// ビッグエンディアン
+		template<class T>
+		T read()
+		{
+			if (remaining() < sizeof(T))
+			{
+				invalidate();
+				return 0;
+			}
+
+			T value = 0;
+			for (size_t i = 0; i < sizeof(T); ++i)
+			{
+				value = static_cast<T>((value << 8) | m_pos[i]);
+			}
+			m_pos += sizeof(T);
+			return value;
+		}
 
-			Array<uint8> nextTick;
-			for (;;)
+		// 可変長数値（最大4バイト）
+		uint32 readVarint()
+		{
+			uint32 value = 0;
+			for (int32 i = 0; i < 4 && m_pos < m_end; ++i)
 			{
-				uint8 byte = ReadBytes<uint8>(reader);
+				const uint8 byte = *m_pos++;
+				value = (value << 7) | (byte & 0x7F);
 				if (byte < 0x80)
 				{
-					nextTick.push_back(byte);
-					break;
-				}
-				else
-				{
-					nextTick.push_back(byte);
+					return value;
 				}
 			}
+			invalidate();
+			return 0;
+		}
 
-			if (5 <= nextTick.size())
+		std::string_view readBytes(size_t length)
+		{
+			if (remaining() < length)
 			{
-				debugLog << U"error: 5 <= nextTick.size()";
-				return none;
+				invalidate();
+				return {};
 			}
-			const uint32 step = GetTick(nextTick);
-			currentTick += step;
-			codeData.tick = currentTick;
-			//debugLog2 << U"measure: " << (tick / resolution + 1) << U", tick: " << tick % resolution << U" | " << tick;
 
-			uint8 opcode = ReadBytes<uint8>(reader);
+			const std::string_view bytes(std::bit_cast<const char*>(m_pos), length);
+			m_pos += length;
+			return bytes;
+		}
 
-			// ランニングステータス
-			if (opcode < 0x80)
-			{
-				opcode = prevOpCode;
-				reader.setPos(reader.getPos() - 1);
-			}
+		// 可変長数値の長さが先頭に付いたデータ
+		std::string_view readData()
+		{
+			const auto length = readVarint();
+			return readBytes(length);
+		}
 
-			prevOpCode = opcode;
+		// 先頭 length バイトを切り出して読み進める（足りない場合は残り全て）
+		SmfReader split(size_t length)
+		{
+			const auto end = m_pos + Min(length, remaining());
+			SmfReader sub(m_pos, end);
+			m_pos = end;
+			return sub;
+		}
 
-			//if (0xFF != opcode)
-			{
-				//debugLog2 << U"measure: " << (currentTick / resolution + 1) << U", tick: " << currentTick % resolution << U" | " << step;
-			}
+	private:
 
-			// https://sites.google.com/site/yyagisite/material/smfspec
-			if (0x80 <= opcode && opcode <= 0x8F)
+		void invalidate()
+		{
+			m_isValid = false;
+			m_pos = m_end;
+		}
+
+		const uint8* m_pos;
+		const uint8* m_end;
+		bool m_isValid = true;
+	};
+
+	// https://sites.google.com/site/yyagisite/material/smfspec
+	// http://quelque.sakura.ne.jp/midi_meta.html
+	MetaEventData ReadMetaEvent(SmfReader& reader)
+	{
+		const uint8 metaEventType = reader.readByte();
+		const auto data = reader.readData();
+		if (!reader.isValid())
+		{
+			MIDI_LOG(U"error: メタイベントが途中で終わっています");
+			return MetaEventData::Error();
+		}
+
+		switch (metaEventType)
+		{
+		case 0x0:
+		{
+			MIDI_LOG(U"error: シーケンス番号（非対応フォーマット）");
+			return MetaEventData::Error();
+		}
+		case 0x1:
+		case 0x2:
+		case 0x3:
+		case 0x4:
+		case 0x5:
+		case 0x6:
+		case 0x7:
+		case 0x8:
+		case 0x9:
+		{
+			// テキストイベント / 著作権表示 / シーケンス名・トラック名 / 楽器名 / 歌詞 / マーカー / キューポイント / プログラム名 / デバイス名
+			MIDI_LOG(U"テキスト(" << metaEventType << U"): " << Unicode::FromUTF8(data));
+			return MetaEventData();
+		}
+		case 0x2f:
+		{
+			MIDI_LOG(U"end of track");
+			return MetaEventData::EndOfTrack();
+		}
+		case 0x51:
+		{
+			if (data.size() < 3)
 			{
-				debugLog << U"ノートオフ";
-				const uint8 channelIndex = opcode - 0x80;
-				const uint8 key = ReadBytes<uint8>(reader);
-				ReadBytes<uint8>(reader);
-				codeData.type = EventType::MidiEvent;
-				codeData.data = MidiEventData::NoteOff(channelIndex, key);
+				return MetaEventData::Error();
 			}
-			else if (0x90 <= opcode && opcode <= 0x9F)
+
+			const auto a = static_cast<uint8>(data[0]);
+			const auto b = static_cast<uint8>(data[1]);
+			const auto c = static_cast<uint8>(data[2]);
+			const auto microSecPerBeat = 1.0 * ((a << 16) + (b << 8) + c);
+
+			const double bpm = 1.e6 * 60.0 / microSecPerBeat;
+			MIDI_LOG(U"テンポ: " << bpm);
+			return MetaEventData::SetTempo(bpm);
+		}
+		case 0x58:
+		{
+			//https://nekonenene.hatenablog.com/entry/2017/02/26/001351
+			if (data.size() < 2)
 			{
-				debugLog << U"ノートオン";
-				const uint8 channelIndex = opcode - 0x90;
-				const uint8 key = ReadBytes<uint8>(reader);
-				const uint8 velocity = ReadBytes<uint8>(reader);
-				codeData.type = EventType::MidiEvent;
-				codeData.data = MidiEventData::NoteOn(channelIndex, key, velocity);
+				return MetaEventData::Error();
 			}
-			else if (0xA0 <= opcode && opcode <= 0xAF)
+
+			const uint8 numerator = static_cast<uint8>(data[0]);
+			const uint8 denominator = static_cast<uint8>(data[1]);
+			MIDI_LOG(U"拍子: " << numerator << U"/" << (1 << denominator));
+			return MetaEventData::SetMetre(numerator, (1 << denominator));
+		}
+		default:
+			// MIDIチャンネルプリフィクス / ポート指定 / SMPTEオフセット / 調号 / シーケンサ固有メタイベント など
+			MIDI_LOG(U"metaEvent: " << metaEventType << U" (" << data.size() << U" bytes)");
+			return MetaEventData();
+		}
+	}
+
+	enum class DecodeResult
+	{
+		Paused,
+		Finished,
+		Error,
+	};
+
+	// トラックチャンクの中身を tickEnd の手前まで読む
+	// 途中で止めた場合は reader, currentTick, runningStatus から続きを読める
+	DecodeResult DecodeTrack(SmfReader& reader, uint32& currentTick, uint8& runningStatus, TrackData& trackData, uint32 tickEnd)
+	{
+		while (!reader.isEnd())
+		{
+			// tickEnd 以降のイベントは読まずに戻す
+			const SmfReader eventBegin = reader;
+			const uint32 eventTick = currentTick + reader.readVarint();
+			if (tickEnd <= eventTick)
 			{
-				debugLog << U"ポリフォニックキープレッシャー";
-				const uint8 channelIndex = opcode - 0xA0;
-				const uint8 key = ReadBytes<uint8>(reader);
-				const uint8 velocity = ReadBytes<uint8>(reader);
-				codeData.type = EventType::MidiEvent;
-				codeData.data = MidiEventData::PolyphonicKeyPressure(channelIndex, key, velocity);
+				reader = eventBegin;
+				return DecodeResult::Paused;
 			}
-			else if (0xB0 <= opcode && opcode <= 0xBF)
+			currentTick = eventTick;
+
+			uint8 opcode = reader.peek();
+
+			// ランニングステータス
+			if (opcode < 0x80)
 			{
-				const uint8 channelIndex = opcode - 0xB0;
-				const uint8 changeType = ReadBytes<uint8>(reader);
-				const uint8 controlChangeData = ReadBytes<uint8>(reader);
-				debugLog << U"コントロールチェンジ " << changeType;
-				codeData.type = EventType::MidiEvent;
-				codeData.data = MidiEventData::ControlChange(channelIndex, changeType, controlChangeData);
+				if (runningStatus == 0)
+				{
+					MIDI_LOG(U"error: ランニングステータスの前にステータスバイトがありません");
+					return DecodeResult::Error;
+				}
+				opcode = runningStatus;
 			}
-			else if (0xC0 <= opcode && opcode <= 0xCF)
+			else
 			{
-				debugLog << U"プログラムチェンジ";
-				const uint8 channelIndex = opcode - 0xC0;
-				const uint8 programNumber = ReadBytes<uint8>(reader);
-				codeData.type = EventType::MidiEvent;
-				codeData.data = MidiEventData::ProgramChange(channelIndex, programNumber);
+				reader.readByte();
 			}
-			else if (0xD0 <= opcode && opcode <= 0xDF)
+
+			if (!reader.isValid())
 			{
-				debugLog << U"チャンネルプレッシャー";
-				const uint8 channelIndex = opcode - 0xD0;
-				const uint8 velocity = ReadBytes<uint8>(reader);
-				codeData.type = EventType::MidiEvent;
-				codeData.data = MidiEventData::ChannelPressure(channelIndex, velocity);
+				return DecodeResult::Error;
 			}
-			else if (0xE0 <= opcode && opcode <= 0xEF)
+
+			// https://sites.google.com/site/yyagisite/material/smfspec
+			if (opcode < 0xF0)
 			{
-				debugLog << U"ピッチベンド";
-				const uint8 channelIndex = opcode - 0xE0;
-				const uint8 m = ReadBytes<uint8>(reader);
-				const uint8 l = ReadBytes<uint8>(reader);
-				const uint16 value = ((l & 0x7F) << 7) + (m & 0x7F);
-				codeData.type = EventType::MidiEvent;
-				codeData.data = MidiEventData::PitchBend(channelIndex, value);
+				runningStatus = opcode;
+
+				// プログラムチェンジとチャンネルプレッシャーだけデータが1バイト
+				const uint8 data1 = reader.readByte() & 0x7F;
+				const uint8 kind = opcode & 0xF0;
+				const uint8 data2 = (kind == 0xC0 || kind == 0xD0) ? 0 : (reader.readByte() & 0x7F);
+
+				trackData.addChannelEvent(currentTick, opcode, data1, data2);
+				MIDI_LOG(U"midiEvent: " << opcode << U" at " << currentTick);
 			}
 			else if (0xF0 == opcode)
 			{
-				debugLog << U"SysEx イベント";
-				codeData.type = EventType::SysExEvent;
-				while (ReadBytes<uint8>(reader) != 0xF7) {}
+				MIDI_LOG(U"SysEx イベント");
+				reader.readData();
 			}
 			else if (0xF7 == opcode)
 			{
-				debugLog << U"error: SysEx イベント（非対応フォーマット）";
-				return none;
+				MIDI_LOG(U"error: SysEx イベント（非対応フォーマット）");
+				return DecodeResult::Error;
 			}
 			else if (0xFF == opcode)
 			{
-				const auto result = ReadMetaEvent(reader, debugLog);
-				codeData.type = EventType::MetaEvent;
-				codeData.data = result;
+				const auto result = ReadMetaEvent(reader);
 
 				if (result.isEndOfTrack())
 				{
-					trackData.push_back(codeData);
-					reader.setPos(trackEndPos);
-					break;
+					trackData.finish(currentTick);
+					return DecodeResult::Finished;
 				}
 				else if (result.isError())
 				{
-					return none;
+					return DecodeResult::Error;
+				}
+				else if (result.type == MetaEventType::Tempo)
+				{
+					trackData.addTempo(currentTick, result.tempo);
+				}
+				else if (result.type == MetaEventType::SetMetre)
+				{
+					trackData.addMetre(currentTick, result.eventData);
 				}
 			}
 			else
 			{
-				debugLog << U" unknown opcode: " << opcode;
-				return none;
+				MIDI_LOG(U"error: unknown opcode: " << opcode);
+				return DecodeResult::Error;
+			}
+
+			if (!reader.isValid())
+			{
+				MIDI_LOG(U"error: トラックが途中で終わっています");
+				return DecodeResult::Error;
+			}
+		}
+
+		// end of track が無いまま終わったトラックもそのまま使う
+		if (!reader.isValid())
+		{
+			return DecodeResult::Error;
+		}
+		trackData.finish(currentTick);
+		return DecodeResult::Finished;
+	}
+}
+
+struct MidiStreamReader::State
+{
+	struct TrackState
+	{
+		explicit TrackState(SmfReader reader) :
+			reader(std::move(reader))
+		{}
+
+		SmfReader reader;
+		uint32 currentTick = 0;
+		uint8 runningStatus = 0;
+		bool isFinished = false;
+
+		// 読み込み途中のノートとイベント
+		TrackData data;
+
+		// data.tempos() のうちテンポマップに追加済みの数
+		size_t mergedTempoCount = 0;
+	};
+
+	MemoryMappedFileView file;
+	MemoryMappedFileView::MappedMemory memory;
+
+	uint16 resolution = 480;
+	Array<TrackState> tracks;
+	TempoMap tempoMap;
+
+	// ここより前のイベントは全トラック読み込み済み
+	uint32 decodedTick = 0;
+	uint32 emittedTick = 0;
+	bool isFinished = false;
+
+	bool allTracksFinished() const
+	{
+		return tracks.all([](const TrackState& track) { return track.isFinished; });
+	}
+
+	bool decode(uint32 tickEnd)
+	{
+		Array<uint8> succeeded(tracks.size(), 1);
+
+		const auto decodeTrack = [&](size_t trackIndex)
+		{
+			auto& track = tracks[trackIndex];
+			if (track.isFinished)
+			{
+				return;
 			}
 
-			trackData.push_back(codeData);
+			const auto result = DecodeTrack(track.reader, track.currentTick, track.runningStatus, track.data, tickEnd);
+			track.isFinished = (result == DecodeResult::Finished);
+			succeeded[trackIndex] = (result != DecodeResult::Error);
+		};
+
+#ifdef MIDI_DEBUG_LOG
+		// ログが混ざらないように順番に読む
+		for (size_t trackIndex = 0; trackIndex < tracks.size(); ++trackIndex)
+		{
+			decodeTrack(trackIndex);
+		}
+#else
+		TaskPool::i().parallelFor(tracks.size(), decodeTrack);
+#endif
+
+		if (succeeded.contains(0))
+		{
+			return false;
+		}
+
+		decodedTick = Max(decodedTick, tickEnd);
+
+		// 新しく読んだテンポ変更をテンポマップに追加する（同じ tick なら後ろのトラックが優先）
+		Array<TempoEvent> newTempos;
+		for (auto& track : tracks)
+		{
+			const auto& tempos = track.data.tempos();
+			newTempos.insert(newTempos.end(), tempos.begin() + track.mergedTempoCount, tempos.end());
+			track.mergedTempoCount = tempos.size();
 		}
 
-		tracks.emplace_back(trackData);
+		std::stable_sort(newTempos.begin(), newTempos.end(), [](const TempoEvent& a, const TempoEvent& b) { return a.tick < b.tick; });
+		for (const auto& tempo : newTempos)
+		{
+			tempoMap.append(tempo.tick, tempo.bpm);
+		}
+
+		return true;
+	}
+
+	// tickEnd より前に押されたノートが全て離されているか
+	bool isReleasedBefore(uint32 tickEnd) const
+	{
+		for (const auto& track : tracks)
+		{
+			const auto pendingTick = track.data.firstPendingTick();
+			if (pendingTick && pendingTick.value() < tickEnd)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+MidiStreamReader::MidiStreamReader() = default;
+
+MidiStreamReader::~MidiStreamReader() = default;
+
+bool MidiStreamReader::open(FilePathView path)
+{
+	MIDI_LOG(U"open \"" << path << U"\"");
+
+	m_state = std::make_unique<State>();
+	auto& state = *m_state;
+
+	// ファイル全体をマップしてポインタで読む
+	if (!state.file.open(path) || state.file.size() == 0)
+	{
+		MIDI_LOG(U"couldn't open file");
+		m_state.reset();
+		return false;
+	}
+
+	state.memory = state.file.mapAll();
+	const auto begin = std::bit_cast<const uint8*>(state.memory.data);
+	SmfReader reader(begin, begin + state.memory.size);
+
+	const auto fail = [&]
+	{
+		m_state.reset();
+		return false;
+	};
+
+	if (reader.readBytes(4) != "MThd")
+	{
+		MIDI_LOG(U"error: std::string(mthd) != \"MThd\"");
+		return fail();
 	}
 
-	for (const auto& [i, track] : Indexed(tracks))
+	const uint32 headerLength = reader.read<uint32>();
+	if (headerLength < 6)
+	{
+		MIDI_LOG(U"error: headerLength < 6");
+		return fail();
+	}
+
+	auto header = reader.split(headerLength);
+
+	const uint16 format = header.read<uint16>();
+	if ((format != 0) && (format != 1))
+	{
+		MIDI_LOG(U"error: (format != 0) && (format != 1)");
+		return fail();
+	}
+	MIDI_LOG(U"format: " << format);
+
+	const uint16 trackCount = header.read<uint16>();
+	MIDI_LOG(U"tracks: " << trackCount);
+
+	const uint16 resolution = header.read<uint16>();
+	MIDI_LOG(U"resolution: " << resolution);
+
+	if (!header.isValid())
+	{
+		return fail();
+	}
+
+	state.resolution = resolution;
+	state.tempoMap = TempoMap({}, resolution);
+
+	// 先にチャンクの境界だけを調べておき、トラックごとに独立して読む
+	state.tracks.reserve(trackCount);
+
+	while (state.tracks.size() < trackCount)
+	{
+		const auto chunkType = reader.readBytes(4);
+		const uint32 trackBytesLength = reader.read<uint32>();
+		if (!reader.isValid())
+		{
+			MIDI_LOG(U"error: トラック数がヘッダーより少ない");
+			return fail();
+		}
+
+		// MTrk 以外のチャンクは読み飛ばす
+		if (chunkType != "MTrk")
+		{
+			reader.split(trackBytesLength);
+			continue;
+		}
+
+		MIDI_LOG(U"trackLength: " << trackBytesLength);
+		state.tracks.emplace_back(reader.split(trackBytesLength));
+	}
+
+	state.isFinished = state.tracks.isEmpty();
+	return true;
+}
+
+uint16 MidiStreamReader::resolution() const
+{
+	return m_state ? m_state->resolution : 480;
+}
+
+bool MidiStreamReader::isFinished() const
+{
+	return !m_state || m_state->isFinished;
+}
+
+uint32 MidiStreamReader::emittedTick() const
+{
+	return m_state ? m_state->emittedTick : 0;
+}
+
+uint32 MidiStreamReader::tickAfter(double seconds) const
+{
+	if (isFinished())
+	{
+		return UINT32_MAX;
+	}
+
+	const auto& tempoMap = m_state->tempoMap;
+	const double tick = tempoMap.secondsToTicks(tempoMap.ticksToSeconds(m_state->emittedTick) + seconds);
+	return static_cast<uint32>(Clamp<double>(Math::Ceil(tick), m_state->emittedTick + 1.0, UINT32_MAX));
+}
+
+const TempoMap& MidiStreamReader::tempoMap() const
+{
+	assert(m_state);
+	return m_state->tempoMap;
+}
+
+Optional<Array<TrackData>> MidiStreamReader::readUntil(uint32 tickEnd)
+{
+	if (!m_state)
+	{
+		return none;
+	}
+
+	auto& state = *m_state;
+	Array<TrackData> chunks(state.tracks.size());
+
+	if (state.isFinished)
+	{
+		return chunks;
+	}
+
+	// 一度に全部読む場合は、ノートはオンとオフで6～8バイトなので長さからおおよその数を見積もっておく
+	if (state.emittedTick == 0 && tickEnd == UINT32_MAX)
+	{
+		for (auto& track : state.tracks)
+		{
+			track.data.reserveNotes(track.reader.remaining() / 8);
+		}
+	}
+
+	// tickEnd より前に押されたノートが離されるところまで、読む範囲を広げながら進める
+	uint32 decodeEnd = Max(tickEnd, state.decodedTick);
+	const uint32 growStep = Max<uint32>(decodeEnd - state.emittedTick, state.resolution * 4u);
+
+	while (true)
+	{
+		if (!state.decode(decodeEnd))
+		{
+			m_state.reset();
+			return none;
+		}
+
+		if (state.allTracksFinished() || state.isReleasedBefore(tickEnd) || decodeEnd == UINT32_MAX)
+		{
+			break;
+		}
+
+		decodeEnd = static_cast<uint32>(Min<uint64>(uint64(decodeEnd) + growStep, UINT32_MAX));
+	}
+
+	const bool isLast = state.allTracksFinished();
+	const uint32 emitEnd = isLast ? UINT32_MAX : tickEnd;
+
+	for (auto&& [trackIndex, track] : Indexed(state.tracks))
+	{
+		chunks[trackIndex] = track.data.takeBefore(emitEnd);
+		track.mergedTempoCount -= chunks[trackIndex].tempos().size();
+	}
+
+	TaskPool::i().parallelFor(chunks.size(), [&](size_t trackIndex)
+		{
+			state.tempoMap.assignSeconds(chunks[trackIndex].m_notes);
+		});
+
+	state.emittedTick = emitEnd;
+	state.isFinished = isLast;
+
+	if (isLast)
+	{
+		// マップを解放する
+		state.tracks.clear();
+		state.memory = {};
+		state.file.unmap();
+		state.file.close();
+	}
+
+	return chunks;
+}
+
+Optional<MidiData> LoadMidi(FilePathView path)
+{
+	MidiStreamReader reader;
+	if (!reader.open(path))
+	{
+		return none;
+	}
+
+	auto tracks = reader.readUntil(UINT32_MAX);
+	if (!tracks)
+	{
+		return none;
+	}
+
+#ifdef MIDI_DEBUG_LOG
+	TextWriter debugLog2(U"debug/debugLog2.txt");
+	for (const auto& [i, track] : Indexed(tracks.value()))
 	{
 		debugLog2 << U"-------------" << U" Track " << i << U" " << U"-------------";
 		track.outputLog(debugLog2);
 	}
+#endif
+
+	MidiData midiData(std::move(tracks.value()), reader.resolution());
+	MIDI_LOG(U"read succeeded");
 
-	MidiData midiData(tracks, resolution);
-	debugLog << U"read succeeded";
+#ifdef DEVELOPMENT
+	const size_t noteCount = midiData.noteCount();
+	Console << U"midi: {} notes, {:.1f} MB ({:.1f} bytes/note)"_fmt(
+		noteCount, midiData.memoryUsage() / (1024.0 * 1024.0), midiData.memoryUsage() / Max(1.0, 1.0 * noteCount));
+#endif
 
 	return midiData;
 }
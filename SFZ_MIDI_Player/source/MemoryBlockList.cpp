@@ -75,7 +75,7 @@ std::pair<uint8*, size_t> MemoryBlockList::getWriteBuffer(size_t beginDataPos, s
 	return std::make_pair(block.buffer + dataOffset, dataSize);
 }
 
-bool MemoryBlockList::isAllocatedBlock(uint32 blockIndex)
+bool MemoryBlockList::isAllocatedBlock(uint32 blockIndex) const
 {
 	//const size_t blockIndex = beginDataPos / MemoryPool::UnitBlockSizeOfBytes;
 
@@ -185,3 +185,25 @@ std::tuple<uint32, uint32, uint32> MemoryBlockList::freePreviousBlockIndex(uint3
 
 	return std::make_tuple(minBlockIndex, maxBlockIndex, eraseCount);
 }
+
+uint32 MemoryBlockList::freeFollowingBlockIndex(uint32 blockIndex)
+{
+	auto& memoryPool = MemoryPool::i(m_memoryType);
+
+	uint32 eraseCount = 0;
+	for (auto it = m_blocks.begin(); it != m_blocks.end();)
+	{
+		if (it->first < blockIndex)
+		{
+			++it;
+		}
+		else
+		{
+			memoryPool.deallocateBlock(it->second.poolId);
+			it = m_blocks.erase(it);
+			++eraseCount;
+		}
+	}
+
+	return eraseCount;
+}
@@ -0,0 +1,241 @@
+﻿#pragma once
+#include <NoteEventList.hpp>
+
+NoteSpillSegment::NoteSpillSegment(FilePathView path, bool isTemporary) :
+	m_path(path),
+	m_isTemporary(isTemporary)
+{
+	if (m_file.open(path))
+	{
+		m_memory = m_file.mapAll();
+	}
+}
+
+NoteSpillSegment::~NoteSpillSegment()
+{
+	m_file.unmap();
+	m_file.close();
+
+	if (m_isTemporary)
+	{
+		FileSystem::Remove(m_path);
+	}
+}
+
+void NoteEventList::push_back(const NoteEvent& noteEvent)
+{
+	const size_t chunkIndex = m_size >> ChunkShift;
+	if (m_chunks.size() <= chunkIndex)
+	{
+		m_chunks.emplace_back();
+		m_chunks.back().events.reserve(ChunkSize);
+	}
+
+	m_chunks[chunkIndex].events.push_back(noteEvent);
+	++m_size;
+}
+
+void NoteEventList::assignMapped(const NoteEvent* events, size_t count, const std::shared_ptr<const NoteSpillSegment>& segment)
+{
+	clear();
+
+	const size_t fullChunks = count >> ChunkShift;
+	m_chunks.resize(fullChunks);
+	for (auto [chunkIndex, chunk] : IndexedRef(m_chunks))
+	{
+		chunk.spilled = events + (chunkIndex << ChunkShift);
+		chunk.segment = segment;
+	}
+
+	m_size = fullChunks << ChunkShift;
+	m_spillCheckedChunks = fullChunks;
+
+	for (size_t i = m_size; i < count; ++i)
+	{
+		push_back(events[i]);
+	}
+}
+
+void NoteEventList::clear()
+{
+	m_chunks.clear();
+	m_size = 0;
+	m_spillCheckedChunks = 0;
+}
+
+size_t NoteEventList::upperBound(int64 pos) const
+{
+	// チャンクの先頭で絞ってから、チャンクの中を二分探索する（退避済みのチャンクに触るのは最小限にする）
+	const auto chunkIt = std::upper_bound(m_chunks.begin(), m_chunks.end(), pos,
+		[](int64 value, const Chunk& chunk) { return value < chunk.data()[0].pressTimePos; });
+
+	if (chunkIt == m_chunks.begin())
+	{
+		return 0;
+	}
+
+	const size_t chunkIndex = std::distance(m_chunks.begin(), chunkIt) - 1;
+	const size_t chunkBegin = chunkIndex << ChunkShift;
+	const size_t count = Min(ChunkSize, m_size - chunkBegin);
+	const NoteEvent* events = m_chunks[chunkIndex].data();
+
+	const auto it = std::upper_bound(events, events + count, pos,
+		[](int64 value, const NoteEvent& noteEvent) { return value < noteEvent.pressTimePos; });
+
+	return chunkBegin + std::distance(events, it);
+}
+
+void NoteEventList::spill(size_t frozenCount, int64 frozenBefore, NoteSpillWriter& writer)
+{
+	const size_t fullChunks = frozenCount >> ChunkShift;
+
+	bool isAllChecked = true;
+	for (size_t chunkIndex = m_spillCheckedChunks; chunkIndex < fullChunks; ++chunkIndex)
+	{
+		auto& chunk = m_chunks[chunkIndex];
+		if (chunk.spilled)
+		{
+			continue;
+		}
+
+		// まだ鳴っているノートは後から off_by で止められる可能性がある
+		const bool isFrozen = chunk.events.all([&](const NoteEvent& noteEvent) { return noteEvent.releaseTimePos < frozenBefore; });
+		if (!isFrozen)
+		{
+			if (isAllChecked)
+			{
+				m_spillCheckedChunks = chunkIndex;
+				isAllChecked = false;
+			}
+			continue;
+		}
+
+		writer.add(chunk);
+	}
+
+	if (isAllChecked)
+	{
+		m_spillCheckedChunks = Max(m_spillCheckedChunks, fullChunks);
+	}
+}
+
+size_t NoteEventList::residentBytes() const
+{
+	size_t result = m_chunks.capacity() * sizeof(Chunk);
+	for (const auto& chunk : m_chunks)
+	{
+		result += chunk.events.capacity() * sizeof(NoteEvent);
+	}
+	return result;
+}
+
+size_t NoteEventList::spilledBytes() const
+{
+	size_t result = 0;
+	for (const auto& chunk : m_chunks)
+	{
+		if (chunk.spilled)
+		{
+			result += ChunkSize * sizeof(NoteEvent);
+		}
+	}
+	return result;
+}
+
+NoteSpillWriter::NoteSpillWriter(std::mutex* swapMutex) :
+	m_swapMutex(swapMutex)
+{
+}
+
+NoteSpillWriter::~NoteSpillWriter()
+{
+	finish();
+}
+
+void NoteSpillWriter::add(NoteEventList::Chunk& chunk)
+{
+	if (!m_writer)
+	{
+		m_path = NoteEventSpill::i().nextFilePath();
+		if (!m_writer.open(m_path))
+		{
+			return;
+		}
+	}
+
+	m_writer.write(chunk.events.data(), chunk.events.size() * sizeof(NoteEvent));
+	m_chunks.emplace_back(&chunk, m_sizeOfBytes);
+	m_sizeOfBytes += chunk.events.size() * sizeof(NoteEvent);
+}
+
+size_t NoteSpillWriter::finish()
+{
+	if (!m_writer)
+	{
+		return 0;
+	}
+
+	m_writer.close();
+
+	const auto segment = std::make_shared<const NoteSpillSegment>(m_path);
+	if (!segment->isOpen())
+	{
+		Console << U"error: イベントの退避ファイルを開けません \"" << m_path << U"\"";
+		m_chunks.clear();
+		return 0;
+	}
+
+	// 書き出したチャンクをマップした内容に差し替えて、メモリ上のコピーを捨てる
+	{
+		std::unique_lock<std::mutex> lock;
+		if (m_swapMutex)
+		{
+			lock = std::unique_lock(*m_swapMutex);
+		}
+
+		for (auto& [chunk, offset] : m_chunks)
+		{
+			chunk->spilled = segment->data(offset);
+			chunk->segment = segment;
+			chunk->events = Array<NoteEvent>();
+		}
+	}
+
+	m_chunks.clear();
+
+	const size_t sizeOfBytes = m_sizeOfBytes;
+	m_sizeOfBytes = 0;
+	return sizeOfBytes;
+}
+
+void NoteEventSpill::setup(FilePathView directory, uint64 budgetOfBytes)
+{
+	m_directory = FileSystem::FullPath(directory);
+	if (!m_directory.ends_with(U'/'))
+	{
+		m_directory += U'/';
+	}
+
+	if (!FileSystem::IsDirectory(m_directory) && !FileSystem::CreateDirectories(m_directory))
+	{
+		Console << U"error: イベントの退避ディレクトリを作成できません \"" << m_directory << U"\"";
+		return;
+	}
+
+	// 前回の実行で残ったファイルは使わない
+	for (const auto& path : FileSystem::DirectoryContents(m_directory, Recursive::No))
+	{
+		if (FileSystem::Extension(path) == U"spill")
+		{
+			FileSystem::Remove(path);
+		}
+	}
+
+	m_budgetOfBytes = budgetOfBytes;
+	m_isEnabled = true;
+}
+
+FilePath NoteEventSpill::nextFilePath()
+{
+	return m_directory + U"{}.spill"_fmt(m_fileCount++);
+}
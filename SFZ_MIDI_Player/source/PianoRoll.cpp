@@ -61,7 +61,7 @@ void PianoRoll::drawVertical(int keyMin, int keyMax, const Optional<MidiData>& m
 	}
 
 	{
-		const auto tracks = midiData.notes();
+		const auto& tracks = midiData.notes();
 		for (const auto& [i, track] : Indexed(tracks))
 		{
 			const HSV hsv(360.0 * i / 16.0, 0.5, 0.53);
@@ -155,7 +155,7 @@ void PianoRoll::drawHorizontal(int keyMin, int keyMax, const Optional<MidiData>&
 	}
 
 	{
-		const auto tracks = midiData.notes();
+		const auto& tracks = midiData.notes();
 		for (const auto& [i, track] : Indexed(tracks))
 		{
 			const HSV hsv(360.0 * i / 16.0, 0.5, 0.53);
@@ -192,14 +192,16 @@ void PianoRoll::drawHorizontal(int keyMin, int keyMax, const Optional<MidiData>&
 	}
 }
 
-void PianoRoll::updateTick(const MidiData& midiData)
+void PianoRoll::updateTick(const MidiData& midiData, double songSeconds)
 {
-	m_currentTick = midiData.secondsToTicks2(m_watch.sF());
+	m_currentSeconds = songSeconds;
+	m_currentTick = midiData.secondsToTicks2(songSeconds);
 	m_lastTick = m_currentTick;
 }
 
 void PianoRoll::playRestart()
 {
+	m_currentSeconds = 0;
 	m_watch.restart();
 	mIsPlaying = true;
 }
@@ -6,51 +6,21 @@
 #include <SampleSource.hpp>
 #include <AudioLoadManager.hpp>
 #include <AudioStreamRenderer.hpp>
+#include <InstrumentCache.hpp>
+#include <Automation.hpp>
+#include <TaskPool.hpp>
 
 namespace
 {
-	// 戻り値：[beginIndex, endIndex)
-	Optional<std::pair<uint32, uint32>> GetRangeEventIndex(const Array<KeyDownEvent>& keyDownEvents, int64 rangeBegin, int64 rangeEnd)
-	{
-		// 同時刻も有効範囲に含めたいので-1のupper_boundを取る
-		KeyDownEvent e0(0, rangeBegin - 1, 0);
-		auto beginIt = std::upper_bound(keyDownEvents.begin(), keyDownEvents.end(), e0,
-			[](const KeyDownEvent& a, const KeyDownEvent& b) { return a.pressTimePos < b.pressTimePos; });
-
-		if (beginIt == keyDownEvents.end())
-		{
-			return none;
-		}
+	// イベントのサンプル位置は32bitで持つ（最後の2つの値は off_by とペダルの印に使う）
+	constexpr int64 MaxTimePos = NoteEvent::SustainedRelease - 1;
 
-		// todo: ノートオフ以降のoff_byは無視しているが、これで正しいのか？
-		KeyDownEvent e1(0, rangeEnd, 0);
-		auto nextEndIt = std::upper_bound(keyDownEvents.begin(), keyDownEvents.end(), e1,
-			[](const KeyDownEvent& a, const KeyDownEvent& b) { return a.pressTimePos < b.pressTimePos; });
-
-		if (nextEndIt == keyDownEvents.begin())
-		{
-			return none;
-		}
-
-		const auto index0 = static_cast<uint32>(std::distance(keyDownEvents.begin(), beginIt));
-		const auto index1 = static_cast<uint32>(std::distance(keyDownEvents.begin(), nextEndIt));
-
-		return std::make_pair(index0, index1);
-	}
+	// 組み立て中のイベントがこれより少なければ、キーごとの処理を並列にしない（タスクの受け渡しの方が重い）
+	constexpr size_t ParallelKeyEventCount = 4096;
 }
 
-void Program::loadProgram(const SfzData& sfzData, float masterVolume)
+std::shared_ptr<const Instrument> BuildInstrument(const CompiledInstrument& instrument, float masterVolume)
 {
-	if (m_audioKeys.size() != 255)
-	{
-		m_audioKeys = Array<AudioKey>(255);
-	}
-
-	for (auto [i, audioKey] : IndexedRef(m_audioKeys))
-	{
-		audioKey.init(static_cast<int8>(i - 127));
-	}
-
 	HashTable<String, OscillatorType> oscTypes;
 	oscTypes[U"*sine"] = OscillatorType::Sine;
 	oscTypes[U"*tri"] = OscillatorType::Tri;
@@ -60,26 +30,30 @@ void Program::loadProgram(const SfzData& sfzData, float masterVolume)
 	oscTypes[U"*noise"] = OscillatorType::Noise;
 	oscTypes[U"*silence"] = OscillatorType::Silence;
 
-	Window::SetTitle(U"音源読み込み中：0 %");
-	for (const auto& [i, data] : Indexed(sfzData.data))
+	// キャッシュから読み込んだ場合はヘッダ情報が分かっているので、サンプルのヘッダは読まない
+	Array<size_t> waveIndices(instrument.samples.size());
+	for (auto [i, sample] : Indexed(instrument.samples))
 	{
-		const auto progress = 1.0 * i / sfzData.data.size();
-		Window::SetTitle(Format(U"音源読み込み中：", Math::Round(progress * 100), U" %"));
+		waveIndices[i] = AudioLoadManager::i().load(sample.path, sample.info);
+	}
 
-		const auto samplePath = sfzData.dir + data.sample;
+	auto table = std::make_shared<Instrument>();
+
+	// CompiledInstrument のリージョン -> table->regions のインデックス
+	Array<Optional<uint32>> sourceIndices(instrument.regions.size());
+
+	const auto makeSource = [&](uint32 regionIndex) -> Optional<uint32>
+	{
+		const auto& data = instrument.regions[regionIndex];
 
 		Optional<size_t> waveIndexOpt;
-		if (!data.sample.starts_with(U"*"))
+		if (const auto sampleIndex = instrument.regionSamples[regionIndex])
 		{
-			if (!FileSystem::IsFile(samplePath))
+			waveIndexOpt = waveIndices[sampleIndex.value()];
+			if (waveIndexOpt == std::numeric_limits<size_t>::max())
 			{
-#ifdef DEVELOPMENT
-				Console << U"error: file does not exist: \"" << samplePath << U"\"";
-#endif
-				continue;
+				return none;
 			}
-
-			waveIndexOpt = AudioLoadManager::i().load(samplePath);
 		}
 
 		const Envelope envelope(data.ampeg_attack, data.ampeg_decay, data.ampeg_sustain / 100.0, data.ampeg_release);
@@ -87,52 +61,125 @@ void Program::loadProgram(const SfzData& sfzData, float masterVolume)
 		const float volume = data.volume + masterVolume;
 		const float amplitude = static_cast<float>(std::pow(10.0, volume / 20.0) * 0.5);
 
-		const int32 loIndex = data.lokey + 127;
-		const int32 hiIndex = data.hikey + 127;
+		AudioSource source(amplitude, envelope, data.lovel, data.hivel);
 
-		for (int32 index = loIndex; index <= hiIndex; ++index)
+		if (waveIndexOpt)
 		{
-			const int32 key = index - 127;
-			const int32 tune = (key - data.pitch_keycenter) * 100 + data.tune;
+			source.setWaveIndex(waveIndexOpt.value());
+		}
+		else
+		{
+			source.setOscillator(oscTypes.at(data.sample));
+		}
 
-			AudioSource source(amplitude, envelope, data.lovel, data.hivel, tune);
+		source.setLoopMode(data.loopMode);
+		source.setSwitch(data.sw_lokey, data.sw_hikey, data.sw_last, data.sw_default);
 
-			if (waveIndexOpt)
-			{
-				source.setWaveIndex(waveIndexOpt.value());
-			}
-			else
-			{
-				const auto frequency = static_cast<float>(440.0 * pow(2.0, (key - 69) / 12.0));
-				const auto oscType = oscTypes.at(data.sample);
-				source.setOscillator(oscType, frequency);
-			}
+		float offTime = 0.006f;
+		if (data.off_mode == OffMode::Time)
+		{
+			offTime = data.off_time;
+		}
+		else if (data.off_mode == OffMode::Normal)
+		{
+			offTime = data.ampeg_release;
+		}
+		source.setGroup(data.group, data.off_by, offTime);
+
+		if (data.trigger == Trigger::Attack)
+		{
+			source.registerSwitch(table->keySwitch);
+		}
+		else if (data.trigger == Trigger::Release)
+		{
+			source.setRtDecay(data.rt_decay);
+		}
 
-			source.setLoopMode(data.loopMode);
-			source.setSwitch(data.sw_lokey, data.sw_hikey, data.sw_last, data.sw_default);
+		table->regions.push_back(source);
+		return static_cast<uint32>(table->regions.size() - 1);
+	};
 
-			float offTime = 0.006f;
-			if (data.off_mode == OffMode::Time)
+	for (auto [keyIndex, regionIndices] : Indexed(instrument.keyRegions))
+	{
+		const int32 key = static_cast<int32>(keyIndex);
+
+		for (const auto regionIndex : regionIndices)
+		{
+			const auto& data = instrument.regions[regionIndex];
+			if (data.trigger != Trigger::Attack && data.trigger != Trigger::Release)
 			{
-				offTime = data.off_time;
+				continue;
 			}
-			else if (data.off_mode == OffMode::Normal)
+
+			if (!sourceIndices[regionIndex])
 			{
-				offTime = data.ampeg_release;
+				sourceIndices[regionIndex] = makeSource(regionIndex);
+				if (!sourceIndices[regionIndex])
+				{
+					continue;
+				}
 			}
-			source.setGroup(data.group, data.off_by, offTime);
+
+			const int32 tune = (key - data.pitch_keycenter) * 100 + data.tune;
+
+			KeyRegion keyRegion;
+			keyRegion.regionIndex = sourceIndices[regionIndex].value();
+			keyRegion.speed = static_cast<float>(std::exp2(tune / 1200.0));
+			keyRegion.frequency = static_cast<float>(440.0 * pow(2.0, (key - 69) / 12.0));
 
 			if (data.trigger == Trigger::Attack)
 			{
-				m_audioKeys[index].addAttackKey(source);
+				table->attackRegions[keyIndex].push_back(keyRegion);
 			}
-			else if (data.trigger == Trigger::Release)
+			else
 			{
-				source.setRtDecay(data.rt_decay);
-				m_audioKeys[index].addReleaseKey(source);
+				table->releaseRegions[keyIndex].push_back(keyRegion);
 			}
 		}
 	}
+
+	// 読み込みに失敗したリージョンは作らないので、それを参照するキーがなくても問題ない
+	table->regions.shrink_to_fit();
+
+	return table;
+}
+
+void Program::loadProgram(const CompiledInstrument& instrument, float masterVolume)
+{
+	loadProgram(BuildInstrument(instrument, masterVolume));
+}
+
+void Program::loadProgram(const std::shared_ptr<const Instrument>& instrument)
+{
+	m_instrument = instrument;
+	m_keySwitch = m_instrument->keySwitch;
+
+	if (m_audioKeys.size() != 255)
+	{
+		m_audioKeys = Array<AudioKey>(255);
+		m_stagedEvents = Array<Array<NoteEvent>>(255);
+	}
+
+	for (auto [i, audioKey] : IndexedRef(m_audioKeys))
+	{
+		audioKey.init(static_cast<int8>(i - 127), m_instrument.get());
+		audioKey.compile();
+	}
+}
+
+void Program::unloadProgram()
+{
+	*this = Program();
+}
+
+size_t Program::memoryUsage() const
+{
+	return m_instrument ? m_instrument->memoryUsage() : 0;
+}
+
+size_t Program::perKeyCopyMemoryUsage() const
+{
+	return m_instrument ? m_instrument->keyRegionCount() * sizeof(AudioSource) : 0;
 }
 
 void Program::clearEvent()
@@ -140,143 +187,352 @@ void Program::clearEvent()
 	for (uint8 index = 127; index < 255; ++index)
 	{
 		m_audioKeys[index].clearEvent();
+		m_stagedEvents[index].clear();
 	}
 
+	m_pendingDisables.clear();
 	m_keyDownEvents.clear();
+	m_keySwitch.reset();
+	m_activeVictims.clear();
+	m_pendingSustains.clear();
+	m_compiledUntil = 0;
 }
 
-void Program::addKeyDownEvents(const MidiData& midiData, const TrackData& trackData)
+void Program::addKeyDownEvents(const TrackData& trackData)
 {
-	for (const auto& note : trackData.notes())
+	addKeyDownEvents(trackData, 0, trackData.notes().size());
+}
+
+void Program::addKeyDownEvents(const TrackData& trackData, size_t beginIndex, size_t endIndex, const AutomationSet* automation)
+{
+	const auto& notes = trackData.notes();
+	for (size_t i = beginIndex; i < endIndex; ++i)
 	{
-		const int64 beginTick = note.tick;
-		const double beginSec = midiData.ticksToSeconds(beginTick);
-		const int64 pressTimePos = static_cast<int64>(Math::Round(beginSec * Wave::DefaultSampleRate));
+		addKeyDownEvent(notes[i], automation);
+	}
+}
+
+void Program::addKeyDownEvent(const Note& note, const AutomationSet* automation)
+{
+	// 秒への変換は読み込み時にテンポマップでまとめて済ませてある
+	const int64 pressTimePos = Min(static_cast<int64>(Math::Round(note.beginSec * Wave::DefaultSampleRate)), MaxTimePos);
+	int64 releaseTimePos = Min(static_cast<int64>(Math::Round(note.endSec * Wave::DefaultSampleRate)), MaxTimePos);
 
-		m_keyDownEvents.emplace_back(note.key, pressTimePos, note.velocity);
+	if (automation)
+	{
+		const int64 sustainedRelease = automation->sustainedRelease(note.ch, releaseTimePos);
+		if (sustainedRelease == AutomationSet::PendingRelease)
+		{
+			// ペダルが離されたら resolveSustain() で書き換える
+			m_pendingSustains.push_back(PendingSustain{ static_cast<uint8>(note.key + 127), note.ch, static_cast<uint32>(pressTimePos), static_cast<uint32>(releaseTimePos) });
+			releaseTimePos = NoteEvent::SustainedRelease;
+		}
+		else
+		{
+			releaseTimePos = Min(sustainedRelease, MaxTimePos);
+		}
 	}
+
+	m_keyDownEvents.emplace_back(note.key, pressTimePos, releaseTimePos, note.velocity, note.ch);
 }
 
-void Program::sortKeyDownEvents()
+void Program::resolveSustain(const AutomationSet& automation)
 {
-	m_keyDownEvents.sort_by([](const KeyDownEvent& a, const KeyDownEvent& b) { return a.pressTimePos < b.pressTimePos; });
+	m_pendingSustains.remove_if([&](const PendingSustain& pending)
+		{
+			const int64 sustainedRelease = automation.sustainedRelease(pending.channel, pending.releaseTimePos);
+			if (sustainedRelease == AutomationSet::PendingRelease)
+			{
+				return false;
+			}
+
+			// 同時刻に同じキーのノートがあれば、まだ書き換えていないものを選ぶ
+			auto& noteEvents = m_audioKeys[pending.keyIndex].noteEvents();
+			for (size_t i = noteEvents.upperBound(pending.pressTimePos); 0 < i && noteEvents[i - 1].pressTimePos == pending.pressTimePos; --i)
+			{
+				if (noteEvents[i - 1].releaseTimePos == NoteEvent::SustainedRelease)
+				{
+					noteEvents[i - 1].releaseTimePos = static_cast<uint32>(Min(sustainedRelease, MaxTimePos));
+					break;
+				}
+			}
+
+			return true;
+		});
 }
 
-Array<std::pair<uint8, NoteEvent>> Program::addEvents(const MidiData& midiData, const TrackData& trackData)
+void Program::sortKeyDownEvents()
 {
-	Array<std::pair<uint8, NoteEvent>> results;
+	// 同時刻のノートはトラック内の順序を保つ
+	m_keyDownEvents.stable_sort_by([](const KeyDownEvent& a, const KeyDownEvent& b) { return a.pressTimePos < b.pressTimePos; });
+}
 
-	for (const auto& note : trackData.notes())
+size_t Program::compileEvents()
+{
+	const size_t eventCount = m_keyDownEvents.size();
+	for (size_t begin = 0; begin < eventCount;)
 	{
-		const int64 beginTick = note.tick;
-		const int64 endTick = note.tick + note.gate;
+		// キースイッチは同時刻のノートには効かないので、同時刻のノートをまとめて処理してから状態を進める
+		const int64 pressTimePos = m_keyDownEvents[begin].pressTimePos;
+		size_t end = begin;
+		while (end < eventCount && m_keyDownEvents[end].pressTimePos == pressTimePos)
+		{
+			++end;
+		}
 
-		const double beginSec = midiData.ticksToSeconds(beginTick);
-		const double endSec = midiData.ticksToSeconds(endTick);
+		for (size_t i = begin; i < end; ++i)
+		{
+			auto& keyDown = m_keyDownEvents[i];
+			const auto keyIndex = keyDown.key + 127;
+			const auto& audioKey = m_audioKeys[keyIndex];
 
-		const int64 pressTimePos = static_cast<int64>(Math::Round(beginSec * Wave::DefaultSampleRate));
-		const int64 releaseTimePos = static_cast<int64>(Math::Round(endSec * Wave::DefaultSampleRate));
+			keyDown.attackIndex = static_cast<int16>(audioKey.getAttackIndex(keyDown.velocity, m_keySwitch));
 
-		const NoteEvent noteEvent = addEvent(note.key, note.velocity, pressTimePos, releaseTimePos, m_keyDownEvents);
-		results.push_back(std::make_pair(note.key, noteEvent));
+			m_stagedEvents[keyIndex].push_back(audioKey.makeEvent(keyDown.attackIndex, keyDown.velocity, keyDown.pressTimePos, keyDown.releaseTimePos, keyDown.channel));
+		}
+
+		for (size_t i = begin; i < end; ++i)
+		{
+			m_keySwitch.press(m_keyDownEvents[i].key);
+		}
+
+		begin = end;
 	}
 
-	return results;
+	return eventCount;
 }
 
 void Program::sortEvent()
 {
-	for (uint8 index = 127; index < 255; ++index)
-	{
-		if (m_audioKeys[index].hasAttackKey())
+	forEachCompilingKey([](AudioKey&, Array<NoteEvent>& events)
 		{
-			m_audioKeys[index].sortEvent();
-		}
-	}
+			std::sort(events.begin(), events.end(), [](const NoteEvent& a, const NoteEvent& b) { return a.pressTimePos < b.pressTimePos; });
+		});
 }
 
 void Program::deleteDuplicate()
 {
+	forEachCompilingKey([](AudioKey& audioKey, Array<NoteEvent>& events) { audioKey.deleteDuplicate(events); });
+}
+
+void Program::forEachCompilingKey(const std::function<void(AudioKey&, Array<NoteEvent>&)>& func)
+{
+	Array<uint8> keyIndices;
+	size_t pendingCount = 0;
 	for (uint8 index = 127; index < 255; ++index)
 	{
-		if (m_audioKeys[index].hasAttackKey())
+		if (m_audioKeys[index].hasAttackKey() && !m_stagedEvents[index].isEmpty())
 		{
-			m_audioKeys[index].deleteDuplicate();
+			keyIndices.push_back(index);
+			pendingCount += m_stagedEvents[index].size();
 		}
 	}
+
+	// キーごとのイベントは独立しているので、多いときは並列に処理する
+	if (pendingCount < ParallelKeyEventCount)
+	{
+		for (const auto index : keyIndices)
+		{
+			func(m_audioKeys[index], m_stagedEvents[index]);
+		}
+		return;
+	}
+
+	TaskPool::i().parallelFor(keyIndices.size(), [&](size_t i) { func(m_audioKeys[keyIndices[i]], m_stagedEvents[keyIndices[i]]); });
 }
 
 void Program::calculateOffTime()
 {
 	// off_byによるdisableTimeが決まるのは、sw_*などを考慮して各イベントに対応するAudioSourceが決まった後
+	Array<OffByVictim> victims;
 	for (uint8 index = 127; index < 255; ++index)
 	{
-		const auto key = index - 127;
-		if (m_audioKeys[index].hasAttackKey())
+		auto& audioKey = m_audioKeys[index];
+		if (!audioKey.hasAttackKey())
+		{
+			continue;
+		}
+
+		// 前の区間で確定したイベントは m_activeVictims に残っている
+		const size_t committedCount = audioKey.noteEvents().size();
+		const auto& stagedEvents = m_stagedEvents[index];
+		for (size_t stagedIndex = 0; stagedIndex < stagedEvents.size(); ++stagedIndex)
+		{
+			const auto& noteEvent = stagedEvents[stagedIndex];
+			const size_t eventIndex = committedCount + stagedIndex;
+			if (noteEvent.attackIndex == -1)
+			{
+				continue;
+			}
+
+			const auto off_by = audioKey.getAttackKey(noteEvent.attackIndex).offBy();
+			if (off_by != 0)
+			{
+				victims.push_back(OffByVictim{ index, static_cast<uint32>(eventIndex), static_cast<int8>(index - 127), off_by, noteEvent.pressTimePos });
+			}
+		}
+	}
+
+	victims.stable_sort_by([](const OffByVictim& a, const OffByVictim& b) { return a.pressTimePos < b.pressTimePos; });
+
+	auto& activeVictims = m_activeVictims;
+
+	size_t victimIndex = 0;
+	const size_t eventCount = m_keyDownEvents.size();
+	for (size_t begin = 0; begin < eventCount;)
+	{
+		const int64 pressTimePos = m_keyDownEvents[begin].pressTimePos;
+		size_t end = begin;
+		while (end < eventCount && m_keyDownEvents[end].pressTimePos == pressTimePos)
+		{
+			++end;
+		}
+
+		// 同時刻に始まるノートも止める対象に含める
+		for (; victimIndex < victims.size() && victims[victimIndex].pressTimePos <= pressTimePos; ++victimIndex)
 		{
-			//m_audioKeys[index].sortEvent();
-			auto& events = m_audioKeys[index].noteEvents();
+			activeVictims[victims[victimIndex].offBy].push_back(victims[victimIndex]);
+		}
+
+		for (size_t i = begin; i < end; ++i)
+		{
+			const auto& keyDown = m_keyDownEvents[i];
+			if (keyDown.attackIndex == -1)
+			{
+				continue;
+			}
 
-			for (auto& noteEvent : events)
+			const auto group = m_audioKeys[keyDown.key + 127].getAttackKey(keyDown.attackIndex).group();
+			auto it = activeVictims.find(group);
+			if (it == activeVictims.end())
 			{
-				if (noteEvent.attackIndex == -1)
+				continue;
+			}
+
+			auto& active = it->second;
+			size_t writeIndex = 0;
+			for (auto& victim : active)
+			{
+				// todo: ノートオフ以降のoff_byは無視しているが、これで正しいのか？
+				if (releaseTimePos(victim) < pressTimePos)
 				{
 					continue;
 				}
 
-				const auto& audioKey = m_audioKeys[key + 127];
-				const auto& attackKey = audioKey.getAttackKey(noteEvent.attackIndex);
-				const auto off_by = attackKey.offBy();
-				if (off_by == 0)
+				// 自分自身だったら無視
+				if (victim.key == keyDown.key && victim.pressTimePos == pressTimePos)
 				{
+					active[writeIndex++] = victim;
 					continue;
 				}
 
-				if (auto rangeOpt = GetRangeEventIndex(m_keyDownEvents, noteEvent.pressTimePos, noteEvent.releaseTimePos))
+				// 確定済みのイベントは描画スレッドが読んでいるので、publishEvents() で書き込む
+				const size_t committedCount = m_audioKeys[victim.keyIndex].noteEvents().size();
+				if (victim.eventIndex < committedCount)
 				{
-					const auto [beginIndex, endIndex] = rangeOpt.value();
-
-					for (uint32 i = beginIndex; i < endIndex; ++i)
-					{
-						const auto& followKeyDown = m_keyDownEvents[i];
-
-						// 自分自身だったら無視
-						if (key == followKeyDown.key && noteEvent.pressTimePos == followKeyDown.pressTimePos)
-						{
-							continue;
-						}
-
-						const auto& followAudioKey = m_audioKeys[followKeyDown.key + 127];
-						const auto followAttackIndex = followAudioKey.getAttackIndex(followKeyDown.velocity, followKeyDown.pressTimePos, m_keyDownEvents);
-						if (followAttackIndex != -1)
-						{
-							const auto& followAttackKey = followAudioKey.getAttackKey(followAttackIndex);
-
-							if (off_by == followAttackKey.group())
-							{
-								noteEvent.disableTimePos = followKeyDown.pressTimePos;
-								break;
-							}
-						}
-					}
+					m_pendingDisables.push_back(PendingDisable{ victim.keyIndex, victim.eventIndex, static_cast<uint32>(pressTimePos) });
+				}
+				else
+				{
+					m_stagedEvents[victim.keyIndex][victim.eventIndex - committedCount].disableTimePos = static_cast<uint32>(pressTimePos);
 				}
 			}
+			active.erase(active.begin() + writeIndex, active.end());
+		}
+
+		begin = end;
+	}
+
+	// まだ始まっていないノートは次の区間で追加する
+	for (; victimIndex < victims.size(); ++victimIndex)
+	{
+		activeVictims[victims[victimIndex].offBy].push_back(victims[victimIndex]);
+	}
+
+	// 次の区間のノートはこの区間の最後のノート以降に始まるので、それより前に離されたノートはもう止められない
+	if (!m_keyDownEvents.isEmpty())
+	{
+		const int64 lastPressTimePos = m_keyDownEvents.back().pressTimePos;
+		m_compiledUntil = lastPressTimePos;
+		for (auto& [group, active] : activeVictims)
+		{
+			active.remove_if([&](const OffByVictim& victim) { return releaseTimePos(victim) < lastPressTimePos; });
 		}
 	}
+
+	m_keyDownEvents.clear();
 }
 
-void Program::getSamples(float* left, float* right, int64 startPos, int64 sampleCount)
+void Program::publishEvents()
+{
+	for (const auto& disable : m_pendingDisables)
+	{
+		m_audioKeys[disable.keyIndex].noteEvents()[disable.eventIndex].disableTimePos = disable.disableTimePos;
+	}
+
+	m_pendingDisables.clear();
+
+	for (uint8 index = 127; index < 255; ++index)
+	{
+		if (!m_stagedEvents[index].isEmpty())
+		{
+			m_audioKeys[index].appendEvents(m_stagedEvents[index]);
+			m_stagedEvents[index].clear();
+		}
+	}
+}
+
+const NoteEvent& Program::eventAt(uint8 keyIndex, uint32 eventIndex) const
+{
+	const auto& noteEvents = m_audioKeys[keyIndex].noteEvents();
+	return eventIndex < noteEvents.size() ? noteEvents[eventIndex] : m_stagedEvents[keyIndex][eventIndex - noteEvents.size()];
+}
+
+int64 Program::releaseTimePos(const OffByVictim& victim) const
+{
+	return eventAt(victim.keyIndex, victim.eventIndex).releaseTimePos;
+}
+
+void Program::getSamples(float* left, float* right, int64 startPos, int64 sampleCount, const BlockAutomation& automation)
 {
 	for (uint8 index = 127; index < 255; ++index)
 	{
 		if (m_audioKeys[index].hasAttackKey())
 		{
-			m_audioKeys[index].getSamples(left, right, startPos, sampleCount);
+			m_audioKeys[index].getSamples(left, right, startPos, sampleCount, automation);
 		}
 	}
 }
 
-const NoteEvent& Program::addEvent(uint8 key, uint8 velocity, int64 pressTimePos, int64 releaseTimePos, const Array<KeyDownEvent>& history)
+void Program::spillEvents(NoteSpillWriter& writer)
 {
-	return m_audioKeys[key + 127].addEvent(velocity, pressTimePos, releaseTimePos, history);
+	for (uint8 index = 127; index < 255; ++index)
+	{
+		m_audioKeys[index].spillEvents(m_compiledUntil, writer);
+	}
+}
+
+void Program::loadKeyEvents(uint8 keyIndex, const NoteEvent* events, size_t count, const std::shared_ptr<const NoteSpillSegment>& segment)
+{
+	m_audioKeys[keyIndex].loadEvents(events, count, segment);
+}
+
+size_t Program::residentEventBytes() const
+{
+	size_t result = m_keyDownEvents.capacity() * sizeof(KeyDownEvent);
+	for (const auto& audioKey : m_audioKeys)
+	{
+		result += audioKey.noteEvents().residentBytes();
+	}
+	return result;
+}
+
+size_t Program::spilledEventBytes() const
+{
+	size_t result = 0;
+	for (const auto& audioKey : m_audioKeys)
+	{
+		result += audioKey.noteEvents().spilledBytes();
+	}
+	return result;
 }
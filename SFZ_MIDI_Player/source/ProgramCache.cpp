@@ -0,0 +1,107 @@
+﻿#pragma once
+#include <ProgramCache.hpp>
+#include <InstrumentCache.hpp>
+#include <SampleSource.hpp>
+
+void ProgramCache::setCapacity(size_t maxUnusedInstruments)
+{
+	std::lock_guard lock(m_mutex);
+	m_capacity = maxUnusedInstruments;
+}
+
+std::shared_ptr<const Instrument> ProgramCache::find(FilePathView sfzPath, float volume, Array<std::pair<FilePath, FileStamp>>* usedFiles)
+{
+	const auto key = MakeKey(sfzPath, volume);
+
+	std::shared_ptr<const Instrument> instrument;
+	Array<std::pair<FilePath, FileStamp>> files;
+	{
+		std::lock_guard lock(m_mutex);
+
+		auto it = m_entries.find(key);
+		if (it == m_entries.end())
+		{
+			return nullptr;
+		}
+
+		instrument = it->second.instrument;
+		files = it->second.files;
+	}
+
+	// ファイルの確認はロックの外で行う
+	for (const auto& [path, stamp] : files)
+	{
+		if (!IsUpToDate(path, stamp))
+		{
+			std::lock_guard lock(m_mutex);
+			if (auto it = m_entries.find(key); it != m_entries.end() && it->second.instrument == instrument)
+			{
+				m_entries.erase(it);
+			}
+			return nullptr;
+		}
+	}
+
+	if (usedFiles)
+	{
+		*usedFiles = std::move(files);
+	}
+
+	std::lock_guard lock(m_mutex);
+	if (auto it = m_entries.find(key); it != m_entries.end())
+	{
+		it->second.lastUsed = ++m_useCounter;
+	}
+
+	return instrument;
+}
+
+void ProgramCache::store(FilePathView sfzPath, float volume, const CompiledInstrument& compiled, const std::shared_ptr<const Instrument>& instrument)
+{
+	Entry entry;
+	entry.instrument = instrument;
+	entry.files = compiled.files();
+
+	std::lock_guard lock(m_mutex);
+	entry.lastUsed = ++m_useCounter;
+	m_entries[MakeKey(sfzPath, volume)] = std::move(entry);
+}
+
+void ProgramCache::trim()
+{
+	std::lock_guard lock(m_mutex);
+
+	// キャッシュ以外から参照されていなければ使われていない
+	Array<std::pair<uint64, String>> unused;
+	for (const auto& [key, entry] : m_entries)
+	{
+		if (entry.instrument.use_count() == 1)
+		{
+			unused.emplace_back(entry.lastUsed, key);
+		}
+	}
+
+	if (unused.size() <= m_capacity)
+	{
+		return;
+	}
+
+	unused.sort_by([](const auto& a, const auto& b) { return a.first < b.first; });
+
+	const size_t removeCount = unused.size() - m_capacity;
+	for (size_t i = 0; i < removeCount; ++i)
+	{
+		m_entries.erase(unused[i].second);
+	}
+}
+
+size_t ProgramCache::size() const
+{
+	std::lock_guard lock(m_mutex);
+	return m_entries.size();
+}
+
+String ProgramCache::MakeKey(FilePathView sfzPath, float volume)
+{
+	return U"{}|{}"_fmt(NormalizePath(sfzPath), std::bit_cast<uint32>(volume));
+}
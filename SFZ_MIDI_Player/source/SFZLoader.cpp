@@ -1,30 +1,31 @@
 ﻿#pragma once
 #include <Config.hpp>
 #include <SFZLoader.hpp>
+#include <Utility.hpp>
+#include <charconv>
 
 namespace
 {
-	Trigger ParseTrigger(StringView trigger)
+	Optional<Trigger> ParseTrigger(std::string_view trigger)
 	{
-		if (trigger == U"attack")
+		if (trigger == "attack")
 		{
 			return Trigger::Attack;
 		}
-		else if (trigger == U"release")
+		else if (trigger == "release")
 		{
 			return Trigger::Release;
 		}
-		else if (trigger == U"first")
+		else if (trigger == "first")
 		{
 			return Trigger::First;
 		}
-		else if (trigger == U"legato")
+		else if (trigger == "legato")
 		{
 			return Trigger::Legato;
 		}
 
-		assert(false);
-		return Trigger::Attack;
+		return none;
 	}
 
 	String TriggerToStr(Trigger trigger)
@@ -45,86 +46,748 @@ namespace
 		}
 	}
 
-	OffMode ParseOffMode(StringView trigger)
+	Optional<OffMode> ParseOffMode(std::string_view offMode)
 	{
-		if (trigger == U"fast")
+		if (offMode == "fast")
 		{
 			return OffMode::Fast;
 		}
-		else if (trigger == U"normal")
+		else if (offMode == "normal")
 		{
 			return OffMode::Normal;
 		}
-		else if (trigger == U"time")
+		else if (offMode == "time")
+		{
+			return OffMode::Time;
+		}
+
+		return none;
+	}
+
+	Optional<LoopMode> ParseLoopMode(std::string_view loopModeStr)
+	{
+		if (loopModeStr == "no_loop")
+		{
+			return LoopMode::NoLoop;
+		}
+		else if (loopModeStr == "one_shot")
+		{
+			return LoopMode::OneShot;
+		}
+		else if (loopModeStr == "loop_continuous")
+		{
+			return LoopMode::LoopContinuous;
+		}
+		else if (loopModeStr == "loop_sustain")
+		{
+			return LoopMode::LoopSustain;
+		}
+
+		return none;
+	}
+
+	template<class T>
+	Optional<T> ParseNumber(std::string_view str)
+	{
+		// from_chars は先頭の + を受け付けない
+		if (str.starts_with('+'))
+		{
+			str.remove_prefix(1);
+		}
+
+		T value{};
+		const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+		if (ec != std::errc{} || ptr != str.data() + str.size())
+		{
+			return none;
+		}
+
+		return value;
+	}
+
+	// ノート番号（60）または音名（c4, c#4, db4）を読む
+	Optional<uint8> ParseMidiKey(std::string_view str)
+	{
+		if (auto number = ParseNumber<int32>(str))
+		{
+			if (0 <= number.value() && number.value() <= 127)
+			{
+				return static_cast<uint8>(number.value());
+			}
+			return none;
+		}
+
+		// a, b, c, d, e, f, g の半音位置
+		static constexpr std::array<int8, 7> NoteOffsets = { 9, 11, 0, 2, 4, 5, 7 };
+
+		if (str.empty())
+		{
+			return none;
+		}
+
+		const char letter = static_cast<char>(str[0] | 0x20);
+		if (letter < 'a' || 'g' < letter)
+		{
+			return none;
+		}
+
+		int32 localKey = NoteOffsets[letter - 'a'];
+		str.remove_prefix(1);
+
+		if (str.starts_with('#'))
+		{
+			++localKey;
+			str.remove_prefix(1);
+		}
+		else if (str.starts_with('b'))
+		{
+			--localKey;
+			str.remove_prefix(1);
+		}
+
+		const auto octave = ParseNumber<int32>(str);
+		if (!octave || octave.value() < -1 || 9 < octave.value())
+		{
+			return none;
+		}
+
+		const int32 key = (octave.value() + 1) * 12 + localKey;
+		if (key < 0 || 127 < key)
+		{
+			return none;
+		}
+
+		return static_cast<uint8>(key);
+	}
+
+	enum CharClass : uint8
+	{
+		CharSpace = 1 << 0,
+		CharLineEnd = 1 << 1,
+		CharIdentifier = 1 << 2,
+	};
+
+	constexpr std::array<uint8, 256> MakeCharTable()
+	{
+		std::array<uint8, 256> table = {};
+
+		table[' '] = table['\t'] = CharSpace;
+		table['\r'] = table['\n'] = CharSpace | CharLineEnd;
+
+		for (int c = 'a'; c <= 'z'; ++c) { table[c] = CharIdentifier; }
+		for (int c = 'A'; c <= 'Z'; ++c) { table[c] = CharIdentifier; }
+		for (int c = '0'; c <= '9'; ++c) { table[c] = CharIdentifier; }
+		table['_'] = CharIdentifier;
+
+		return table;
+	}
+
+	constexpr std::array<uint8, 256> CharTable = MakeCharTable();
+
+	constexpr bool IsCharClass(char c, uint8 charClass)
+	{
+		return (CharTable[static_cast<uint8>(c)] & charClass) != 0;
+	}
+
+	enum class Opcode : uint8
+	{
+		Sample,
+		Lovel,
+		Hivel,
+		PitchKeycenter,
+		Key,
+		Lokey,
+		Hikey,
+		Offset,
+		Tune,
+		Volume,
+		Trigger,
+		AmpegAttack,
+		AmpegDecay,
+		AmpegSustain,
+		AmpegRelease,
+		RtDecay,
+		DefaultPath,
+		SwLokey,
+		SwHikey,
+		SwDefault,
+		SwLast,
+		Group,
+		OffBy,
+		OffMode,
+		OffTime,
+		LoopMode,
+		Unknown,
+	};
+
+	// switch の case ラベルが重複するとコンパイルエラーになるので、対応しているopcode同士のハッシュは衝突しない
+	// 未対応のopcodeとたまたま衝突した場合に備えて名前も比較する
+	Opcode ToOpcode(std::string_view name)
+	{
+		const auto match = [name](std::string_view expected, Opcode opcode)
+		{
+			return name == expected ? opcode : Opcode::Unknown;
+		};
+
+		switch (FNV1a(name))
+		{
+		case FNV1a("sample"): return match("sample", Opcode::Sample);
+		case FNV1a("lovel"): return match("lovel", Opcode::Lovel);
+		case FNV1a("hivel"): return match("hivel", Opcode::Hivel);
+		case FNV1a("pitch_keycenter"): return match("pitch_keycenter", Opcode::PitchKeycenter);
+		case FNV1a("key"): return match("key", Opcode::Key);
+		case FNV1a("lokey"): return match("lokey", Opcode::Lokey);
+		case FNV1a("hikey"): return match("hikey", Opcode::Hikey);
+		case FNV1a("offset"): return match("offset", Opcode::Offset);
+		case FNV1a("tune"): return match("tune", Opcode::Tune);
+		case FNV1a("volume"): return match("volume", Opcode::Volume);
+		case FNV1a("trigger"): return match("trigger", Opcode::Trigger);
+		case FNV1a("ampeg_attack"): return match("ampeg_attack", Opcode::AmpegAttack);
+		case FNV1a("ampeg_decay"): return match("ampeg_decay", Opcode::AmpegDecay);
+		case FNV1a("ampeg_sustain"): return match("ampeg_sustain", Opcode::AmpegSustain);
+		case FNV1a("ampeg_release"): return match("ampeg_release", Opcode::AmpegRelease);
+		case FNV1a("rt_decay"): return match("rt_decay", Opcode::RtDecay);
+		case FNV1a("default_path"): return match("default_path", Opcode::DefaultPath);
+		case FNV1a("sw_lokey"): return match("sw_lokey", Opcode::SwLokey);
+		case FNV1a("sw_hikey"): return match("sw_hikey", Opcode::SwHikey);
+		case FNV1a("sw_default"): return match("sw_default", Opcode::SwDefault);
+		case FNV1a("sw_last"): return match("sw_last", Opcode::SwLast);
+		case FNV1a("group"): return match("group", Opcode::Group);
+		case FNV1a("off_by"): return match("off_by", Opcode::OffBy);
+		case FNV1a("off_mode"): return match("off_mode", Opcode::OffMode);
+		case FNV1a("off_time"): return match("off_time", Opcode::OffTime);
+		case FNV1a("loop_mode"): return match("loop_mode", Opcode::LoopMode);
+		default: return Opcode::Unknown;
+		}
+	}
+
+	// 値に空白を含められるopcode（次の opcode= か < か行末までを値とする）
+	bool AllowsSpaceInValue(std::string_view name)
+	{
+		return name == "sample" || name == "default_path" || name.find("label") != std::string_view::npos;
+	}
+
+	struct SfzToken
+	{
+		enum class Type : uint8
+		{
+			Header,
+			Opcode,
+			Directive,
+			Unknown,
+		};
+
+		Type type = Type::Unknown;
+		std::string_view name;
+		std::string_view value;
+
+		// トークン全体（マクロの置換に使う）
+		std::string_view raw;
+	};
+
+	// UTF-8のテキストをコピーせずにトークンへ分ける
+	class SfzTokenizer
+	{
+	public:
+
+		explicit SfzTokenizer(std::string_view text) :
+			m_text(text)
+		{}
+
+		bool next(SfzToken& token)
+		{
+			for (;;)
+			{
+				skipSpaces(CharSpace);
+
+				if (m_text.size() <= m_pos)
+				{
+					return false;
+				}
+
+				// 行頭の / と // 以降はコメント
+				if (m_text[m_pos] == '/' && (m_pos == 0 || m_text[m_pos - 1] == '\n' || isCommentStart(m_pos)))
+				{
+					skipLine();
+					continue;
+				}
+
+				break;
+			}
+
+			const size_t begin = m_pos;
+
+			if (m_text[begin] == '<')
+			{
+				const size_t end = m_text.find('>', begin);
+				if (end != std::string_view::npos)
+				{
+					token.type = SfzToken::Type::Header;
+					token.name = m_text.substr(begin + 1, end - begin - 1);
+					token.value = {};
+					token.raw = m_text.substr(begin, end - begin + 1);
+					m_pos = end + 1;
+					return true;
+				}
+			}
+
+			// #include, #define の引数は readQuoted(), readWord() で読む
+			if (m_text[begin] == '#')
+			{
+				m_pos = identifierEnd(begin + 1);
+
+				token.type = SfzToken::Type::Directive;
+				token.name = m_text.substr(begin + 1, m_pos - begin - 1);
+				token.value = {};
+				token.raw = m_text.substr(begin, m_pos - begin);
+				return true;
+			}
+
+			const size_t end = wordEnd(begin);
+			m_pos = end;
+
+			const auto word = m_text.substr(begin, end - begin);
+			const size_t equalPos = word.find('=');
+
+			if (equalPos == std::string_view::npos)
+			{
+				token.type = SfzToken::Type::Unknown;
+				token.name = word;
+				token.value = {};
+				token.raw = word;
+				return true;
+			}
+
+			token.type = SfzToken::Type::Opcode;
+			token.name = word.substr(0, equalPos);
+
+			const size_t valueBegin = begin + equalPos + 1;
+			if (AllowsSpaceInValue(token.name))
+			{
+				extendValue();
+			}
+
+			token.value = m_text.substr(valueBegin, m_pos - valueBegin);
+			token.raw = m_text.substr(begin, m_pos - begin);
+			return true;
+		}
+
+		// 同じ行の次の空白区切りの単語を読む
+		std::string_view readWord()
+		{
+			skipInlineSpaces();
+
+			const size_t begin = m_pos;
+			m_pos = wordEnd(begin);
+			return m_text.substr(begin, m_pos - begin);
+		}
+
+		// 同じ行の "..." を読む
+		Optional<std::string_view> readQuoted()
+		{
+			skipInlineSpaces();
+
+			if (m_text.size() <= m_pos || m_text[m_pos] != '\"')
+			{
+				return none;
+			}
+
+			const size_t end = m_text.find_first_of("\"\n", m_pos + 1);
+			if (end == std::string_view::npos || m_text[end] != '\"')
+			{
+				return none;
+			}
+
+			const auto result = m_text.substr(m_pos + 1, end - m_pos - 1);
+			m_pos = end + 1;
+			return result;
+		}
+
+	private:
+
+		void skipSpaces(uint8 charClass)
+		{
+			while (m_pos < m_text.size() && IsCharClass(m_text[m_pos], charClass))
+			{
+				++m_pos;
+			}
+		}
+
+		void skipInlineSpaces()
+		{
+			while (m_pos < m_text.size() && (m_text[m_pos] == ' ' || m_text[m_pos] == '\t'))
+			{
+				++m_pos;
+			}
+		}
+
+		void skipLine()
+		{
+			const size_t lineEnd = m_text.find('\n', m_pos);
+			m_pos = (lineEnd == std::string_view::npos) ? m_text.size() : lineEnd;
+		}
+
+		// 空白の前で、または単語に続く // の前で止まる（sample=a.wav//comment の値は a.wav）
+		// "..." で囲まれた #include のパスは readQuoted() で読むので // を含んでいてもよい
+		size_t wordEnd(size_t pos) const
+		{
+			while (pos < m_text.size() && !IsCharClass(m_text[pos], CharSpace) && !isCommentStart(pos))
+			{
+				++pos;
+			}
+			return pos;
+		}
+
+		bool isCommentStart(size_t pos) const
+		{
+			return m_text.substr(pos).starts_with("//");
+		}
+
+		size_t identifierEnd(size_t pos) const
+		{
+			while (pos < m_text.size() && IsCharClass(m_text[pos], CharIdentifier))
+			{
+				++pos;
+			}
+			return pos;
+		}
+
+		// 同じ行の次の単語が opcode= か <header> で始まるまで値を伸ばす
+		void extendValue()
+		{
+			for (;;)
+			{
+				size_t pos = m_pos;
+				while (pos < m_text.size() && (m_text[pos] == ' ' || m_text[pos] == '\t'))
+				{
+					++pos;
+				}
+
+				if (m_text.size() <= pos || IsCharClass(m_text[pos], CharLineEnd) || m_text[pos] == '<' || isCommentStart(pos))
+				{
+					return;
+				}
+
+				const size_t nameEnd = identifierEnd(pos);
+				if (pos < nameEnd && nameEnd < m_text.size() && m_text[nameEnd] == '=')
+				{
+					return;
+				}
+
+				m_pos = wordEnd(pos);
+			}
+		}
+
+		std::string_view m_text;
+		size_t m_pos = 0;
+	};
+
+	// UTF-8のテキストファイルをメモリマップで開く（BOMは読み飛ばす）
+	class SfzSourceFile
+	{
+	public:
+
+		explicit SfzSourceFile(FilePathView path) :
+			m_file(path)
+		{
+			if (m_file && 0 < m_file.size())
+			{
+				const auto memory = m_file.mapAll();
+				m_text = std::string_view(std::bit_cast<const char*>(memory.data), memory.size);
+
+				if (m_text.starts_with("\xEF\xBB\xBF"))
+				{
+					m_text.remove_prefix(3);
+				}
+			}
+		}
+
+		std::string_view text() const { return m_text; }
+
+	private:
+
+		MemoryMappedFileView m_file;
+		std::string_view m_text;
+	};
+
+	// #include の展開と $マクロ の置換を行いながら、トークンを1つずつパーサーに渡す
+	// 同じファイルが同じマクロの状態で #include された場合は、前回の展開結果をそのまま流す
+	class SfzPreprocessor
+	{
+	public:
+
+		SfzPreprocessor(std::string_view text, const FilePath& currentDirectory) :
+			m_currentDirectory(currentDirectory)
+		{
+			m_frames.push_back(Frame{ SfzTokenizer(text) });
+		}
+
+		bool next(SfzToken& token)
+		{
+			while (!m_frames.isEmpty())
+			{
+				auto& frame = m_frames.back();
+
+				if (frame.replay)
+				{
+					if (frame.replayPos < frame.replay->tokens.size())
+					{
+						token = frame.replay->tokens[frame.replayPos++];
+						record(token);
+						return true;
+					}
+
+					m_frames.pop_back();
+					continue;
+				}
+
+				if (!frame.tokenizer.next(token))
+				{
+					finishFrame();
+					continue;
+				}
+
+				if (token.type == SfzToken::Type::Directive)
+				{
+					directive(token.name, frame.tokenizer);
+					continue;
+				}
+
+				if (frame.expandMacros && token.raw.find('$') != std::string_view::npos)
+				{
+					pushMacroExpansion(token.raw);
+					continue;
+				}
+
+				record(token);
+				return true;
+			}
+
+			return false;
+		}
+
+		const Array<FilePath>& includes() const { return m_includes; }
+
+	private:
+
+		static constexpr size_t MaxIncludeDepth = 32;
+
+		// #include 1回分の展開結果
+		struct IncludeResult
+		{
+			Array<SfzToken> tokens;
+
+			// 展開中に行われた #define（再生時にマクロの状態を合わせるため）
+			Array<std::pair<std::string_view, std::string_view>> defines;
+		};
+
+		struct Frame
+		{
+			explicit Frame(SfzTokenizer&& tokenizer) :
+				tokenizer(std::move(tokenizer))
+			{}
+
+			SfzTokenizer tokenizer;
+
+			bool expandMacros = true;
+
+			// キャッシュから再生する場合
+			const IncludeResult* replay = nullptr;
+			size_t replayPos = 0;
+
+			// 展開結果を記録している場合のキャッシュのキー
+			Optional<uint64> recordKey;
+		};
+
+		struct Macro
+		{
+			std::string_view name;
+			std::string_view value;
+		};
+
+		void directive(std::string_view name, SfzTokenizer& tokenizer)
+		{
+			if (name == "include")
+			{
+				const auto path = tokenizer.readQuoted();
+				if (!path)
+				{
+					Console << U"error: invalid #include";
+					return;
+				}
+
+				include(m_currentDirectory + Unicode::FromUTF8(path.value()));
+			}
+			else if (name == "define")
+			{
+				const auto macroName = tokenizer.readWord();
+				const auto value = tokenizer.readWord();
+
+				if (!macroName.starts_with('$'))
+				{
+					Console << U"error: invalid #define";
+					return;
+				}
+
+				define(store(macroName), store(value));
+			}
+#ifdef DEVELOPMENT
+			else
+			{
+				Console << U"unknown directive: \"#" << Unicode::FromUTF8(name) << U"\"";
+			}
+#endif
+		}
+
+		void include(const FilePath& includePath)
+		{
+			if (MaxIncludeDepth <= m_frames.size())
+			{
+				Console << U"error: #include is nested too deeply \"" << includePath << U"\"";
+				return;
+			}
+
+			if (!m_includes.contains(includePath))
+			{
+				m_includes.push_back(includePath);
+			}
+
+			const uint64 key = FNV1a(includePath, m_macroStateHash);
+
+			if (auto it = m_includeCache.find(key); it != m_includeCache.end())
+			{
+				for (const auto& [macroName, value] : it->second.defines)
+				{
+					define(macroName, value);
+				}
+
+				Frame frame{ SfzTokenizer({}) };
+				frame.replay = &it->second;
+				m_frames.push_back(frame);
+				return;
+			}
+
+			auto fileIt = m_files.find(includePath);
+			if (fileIt == m_files.end())
+			{
+				if (!FileSystem::IsFile(includePath))
+				{
+					Console << U"error: include file \"" << includePath << U"\" does not exist";
+					return;
+				}
+
+				fileIt = m_files.emplace(includePath, std::make_unique<SfzSourceFile>(includePath)).first;
+			}
+
+			Frame frame{ SfzTokenizer(fileIt->second->text()) };
+			frame.recordKey = key;
+			m_frames.push_back(frame);
+			m_recordings.emplace_back();
+		}
+
+		void define(std::string_view name, std::string_view value)
+		{
+			const uint64 nameHash = FNV1a(name);
+
+			// マクロの状態のハッシュは定義ごとのハッシュのXORで、再定義のときは古い値の分を取り除く
+			if (auto it = m_macros.find(nameHash); it != m_macros.end())
+			{
+				m_macroStateHash ^= FNV1a(it->second.value, nameHash);
+				it->second.value = value;
+			}
+			else
+			{
+				m_macros.emplace(nameHash, Macro{ name, value });
+			}
+			m_macroStateHash ^= FNV1a(value, nameHash);
+
+			for (auto& recording : m_recordings)
+			{
+				recording.defines.emplace_back(name, value);
+			}
+		}
+
+		void pushMacroExpansion(std::string_view raw)
 		{
-			return OffMode::Time;
-		}
+			std::string expanded;
+			expanded.reserve(raw.size());
 
-		assert(false);
-		return OffMode::Fast;
-	}
+			size_t pos = 0;
+			while (pos < raw.size())
+			{
+				const size_t macroBegin = raw.find('$', pos);
+				if (macroBegin == std::string_view::npos)
+				{
+					expanded += raw.substr(pos);
+					break;
+				}
 
-	LoopMode ParseLoopMode(StringView loopModeStr)
-	{
-		if (loopModeStr == U"no_loop")
-		{
-			return LoopMode::NoLoop;
+				expanded += raw.substr(pos, macroBegin - pos);
+
+				size_t macroEnd = macroBegin + 1;
+				while (macroEnd < raw.size() && IsCharClass(raw[macroEnd], CharIdentifier))
+				{
+					++macroEnd;
+				}
+
+				const auto macroName = raw.substr(macroBegin, macroEnd - macroBegin);
+				if (auto it = m_macros.find(FNV1a(macroName)); it != m_macros.end() && it->second.name == macroName)
+				{
+					expanded += it->second.value;
+				}
+				else
+				{
+					Console << U"error: (" << Unicode::FromUTF8(macroName) << U") not defined ";
+				}
+
+				pos = macroEnd;
+			}
+
+			// 置換後の文字列はもう一度トークンに分ける（値に含まれる $ は置換しない）
+			Frame frame{ SfzTokenizer(store(expanded)) };
+			frame.expandMacros = false;
+			m_frames.push_back(frame);
 		}
-		else if (loopModeStr == U"one_shot")
+
+		void record(const SfzToken& token)
 		{
-			return LoopMode::OneShot;
+			for (auto& recording : m_recordings)
+			{
+				recording.tokens.push_back(token);
+			}
 		}
-		else if (loopModeStr == U"loop_continuous")
+
+		void finishFrame()
 		{
-			return LoopMode::LoopContinuous;
+			if (const auto key = m_frames.back().recordKey)
+			{
+				m_includeCache.emplace(key.value(), std::move(m_recordings.back()));
+				m_recordings.pop_back();
+			}
+
+			m_frames.pop_back();
 		}
-		else if (loopModeStr == U"loop_sustain")
+
+		// トークンが参照する文字列をプリプロセッサが破棄されるまで保持する
+		std::string_view store(std::string_view str)
 		{
-			return LoopMode::LoopSustain;
+			return m_strings.emplace_back(str);
 		}
 
-		assert(false);
-		return LoopMode::Unspecified;
-	}
+		FilePath m_currentDirectory;
 
-	Optional<uint8> ParseMidiKey(StringView str)
-	{
-		std::map<String, uint8> keys;
-		keys[U"c"] = 0;
-		keys[U"c#"] = 1;
-		keys[U"db"] = 1;
-		keys[U"d"] = 2;
-		keys[U"d#"] = 3;
-		keys[U"eb"] = 3;
-		keys[U"e"] = 4;
-		keys[U"f"] = 5;
-		keys[U"f#"] = 6;
-		keys[U"gb"] = 6;
-		keys[U"g"] = 7;
-		keys[U"g#"] = 8;
-		keys[U"ab"] = 8;
-		keys[U"a"] = 9;
-		keys[U"a#"] = 10;
-		keys[U"bb"] = 10;
-		keys[U"b"] = 11;
-
-		const int8 octaveMin = -1;
-		const int8 octaveMax = 9;
-
-		for (const auto& [name, localKey] : keys)
-		{
-			if (str.starts_with(name))
-			{
-				const auto opt = ParseIntOpt<int8>(str.substr(name.length()));
-				if (opt && octaveMin <= opt.value() && opt.value() <= octaveMax)
-				{
-					return static_cast<uint8>((opt.value() + 1) * 12 + localKey);
-				}
-			}
-		}
+		Array<Frame> m_frames;
+		Array<IncludeResult> m_recordings;
 
-		return none;
-	}
+		HashTable<uint64, Macro> m_macros;
+		uint64 m_macroStateHash = 0;
+
+		HashTable<uint64, IncludeResult> m_includeCache;
+		HashTable<FilePath, std::unique_ptr<SfzSourceFile>> m_files;
+		std::deque<std::string> m_strings;
+
+		Array<FilePath> m_includes;
+	};
 
 	template<typename T>
 	const Optional<T>& CombineOpt(const Optional<T>& left, const Optional<T>& right)
@@ -272,184 +935,21 @@ void RegionSetting::debugPrint() const
 	Console << U"ampeg: " << Vec4(ampeg_attack, ampeg_decay, ampeg_sustain, ampeg_release);
 }
 
-String RemoveComment(const String& text)
-{
-	auto lines = text.split_lines();
-
-	for (auto& line : lines)
-	{
-		if (line.starts_with(U'/'))
-		{
-			line.clear();
-		}
-	}
-
-	return lines.join(U"\n", U"", U"");
-}
-
-std::pair<String, String> splitDefine(StringView defineLine, size_t& endPos)
-{
-	const String keyDefine = U"#define";
-
-	const size_t nameBegin = defineLine.indexOf(U'$');
-	const size_t nameEnd = defineLine.indexOfAny(U" \t", nameBegin);
-	const size_t valueBegin = defineLine.indexNotOfAny(U" \t", nameEnd);
-	const size_t valueEnd = Min(defineLine.indexOfAny(U" \t\n", valueBegin), defineLine.length());
-
-	const String name(defineLine.substr(nameBegin, nameEnd - nameBegin));
-	const String value(defineLine.substr(valueBegin, valueEnd - valueBegin));
-
-	endPos = valueEnd;
-
-	//Console << U"(" << defineLine << U") => {" << name << U": " << value << U"}";
-
-	return std::make_pair(name, value.ltrimmed());
-}
-
-String Preprocess(const String& text, const String& currentDirectory, HashTable<String, String>& macroDefinitions)
-{
-	const String keyInclude = U"#include";
-	const String keyDefine = U"#define";
-
-	String result;
-
-	size_t pos = 0;
-	for (;;)
-	{
-		size_t beginPos = text.indexOfAny(U"#$", pos);
-
-		if (beginPos == String::npos)
-		{
-			result += text.substrView(pos);
-			break;
-		}
-
-		result += text.substrView(pos, beginPos - pos);
-		pos = beginPos;
-
-		StringView token = text.substrView(beginPos);
-
-		if (text[beginPos] == U'#')
-		{
-			if (token.starts_with(keyInclude))
-			{
-				const size_t pathBegin = token.indexOf(U'\"', keyInclude.length());
-				const size_t pathEnd = token.indexOf(U'\"', pathBegin + 1);
-
-				const auto pathStr = token.substr(pathBegin + 1, pathEnd - pathBegin - 1);
-
-				const auto includePath = currentDirectory + pathStr;
-				//Console << U"include \"" << includePath << U"\"";
-
-				assert(FileSystem::Exists(includePath));
-				if (!FileSystem::Exists(includePath))
-				{
-					Console << U"error: include file \"" << includePath << U"\" does not exist";
-					return U"";
-				}
-
-				TextReader textReader(includePath);
-
-				result += Preprocess(RemoveComment(textReader.readAll()), currentDirectory, macroDefinitions);
-
-				pos += (pathEnd + 1);
-			}
-			else if (token.starts_with(keyDefine))
-			{
-				size_t endPos = 0;
-				const auto [name, value] = splitDefine(token, endPos);
-				pos += endPos;
-
-				//Console << U"define " << name << U"=>" << value;
-				macroDefinitions[name] = value;
-			}
-			else
-			{
-				result += U"#";
-				++pos;
-			}
-		}
-		else if (text[beginPos] == U'$')
-		{
-			const size_t nameBegin = 1;
-			const size_t nameEnd = Min(token.indexNotOfAny(U"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_", nameBegin), token.length());
-
-			StringView varName = token.substr(0, nameEnd);
-
-			if (!macroDefinitions.contains(varName))
-			{
-				Console << U"token: " << token;
-				Console << U"error: (" << varName << U") not defined ";
-				return U"";
-
-				result += Format(U"($", varName, U": not defined)");
-			}
-			else
-			{
-				result += macroDefinitions[varName];
-			}
-
-			pos += nameEnd;
-		}
-	}
-
-	return result;
-}
-
 SfzData LoadSfz(FilePathView sfzPath)
 {
 	assert(FileSystem::Exists(sfzPath));
 
 	assert(U"sfz" == FileSystem::Extension(sfzPath));
 
-	TextReader sfzReader(sfzPath);
-
-	const String keyRegionHeader = U"<region>";
-	const String keyGroupHeader = U"<group>";
-	//const String keyControlHeader = U"<control>";
-	const String keyGlobalHeader = U"<global>";
-	//const String keyCurveHeader = U"<curve>";
-	//const String keyEffectHeader = U"<effect>";
-	//const String keyMasterHeader = U"<master>";
-	//const String keyMidiHeader = U"<midi>";
-	//const String keySampleHeader = U"<sample>";
-
-	const String keySample = U"sample=";
-	const String keyLovel = U"lovel=";
-	const String keyHivel = U"hivel=";
-	const String keyPitchKeycenter = U"pitch_keycenter=";
-	const String keyKey = U"key=";
-	const String keyLokey = U"lokey=";
-	const String keyHikey = U"hikey=";
-	const String keyOffset = U"offset=";
-	const String keyTune = U"tune=";
-	const String keyVolume = U"volume=";
-	const String keyTrigger = U"trigger=";
-	const String keyAmpegAttack = U"ampeg_attack=";
-	const String keyAmpegDecay = U"ampeg_decay=";
-	const String keyAmpegSustain = U"ampeg_sustain=";
-	const String keyAmpegRelease = U"ampeg_release=";
-	const String keyRtDecay = U"rt_decay=";
-	const String keyDefaultPath = U"default_path=";
-	const String keySwLoKey = U"sw_lokey=";
-	const String keySwHiKey = U"sw_hikey=";
-	const String keySwDefault = U"sw_default=";
-	const String keySwLast = U"sw_last=";
-	const String keyGroup = U"group=";
-	const String keyOffBy = U"off_by=";
-	const String keyOffMode = U"off_mode=";
-	const String keyOffTime = U"off_time=";
-	const String keyLoopMode = U"loop_mode=";
-
 	const auto parentDirectory = FileSystem::ParentPath(sfzPath);
 	String defaultPath = parentDirectory;
 
-	HashTable<String, String> macroDefinitions;
-	const auto text = Preprocess(RemoveComment(sfzReader.readAll()), parentDirectory, macroDefinitions);
+	const SfzSourceFile sourceFile(sfzPath);
+	SfzPreprocessor preprocessor(sourceFile.text(), parentDirectory);
 
-#ifdef DEVELOPMENT
-	TextWriter writer(U"debug/preprocessed.txt");
-	writer << text;
+#ifdef SFZ_DEBUG_DUMP
+	// プリプロセス後のトークンを確認用に書き出す（複数の音源が並列に読み込まれるので音源ごとに書き出す）
+	std::string preprocessedText;
 #endif
 
 	SFZHeader header = SFZHeader::Global;
@@ -473,273 +973,225 @@ SfzData LoadSfz(FilePathView sfzPath)
 		return regionSetting.value();
 	};
 
+	const auto flushRegion = [&]()
+	{
+		if (regionSetting)
+		{
+			settings.push_back(regionSetting.value().value());
+			regionSetting = none;
+		}
+	};
+
 	HashSet<String> unsupportedOpcodes;
 
-	size_t pos = 0;
-	for (;;)
+	const auto reportInvalidValue = [&](const SfzToken& token)
 	{
-		size_t nextPos = text.indexOfAny(U" \t\n", pos);
-
-		StringView token = text.substrView(pos, nextPos == String::npos ? nextPos : nextPos - pos);
+		Console << U"error: invalid value \"" << Unicode::FromUTF8(token.value) << U"\" for " << Unicode::FromUTF8(token.name);
+	};
 
-		if (token.empty())
+	// 値の解析に失敗した場合はその opcode を無視する
+	const auto assign = [&](const auto& value, const SfzToken& token, auto member)
+	{
+		if (value)
 		{
+			(setting().*member) = value.value();
 		}
-		else if (token.starts_with(keyRegionHeader))
+		else
 		{
-			nextPos = pos + keyRegionHeader.length() - 1;
-			if (regionSetting)
-			{
-				settings.push_back(regionSetting.value().value());
-				regionSetting = none;
-			}
-
-			regionSetting = groupSetting.combined(globalSetting);
-			header = SFZHeader::Region;
+			reportInvalidValue(token);
 		}
-		else if (token.starts_with(keyGroupHeader))
+	};
+
+	SfzToken token;
+
+	while (preprocessor.next(token))
+	{
+#ifdef SFZ_DEBUG_DUMP
+		preprocessedText += (token.type == SfzToken::Type::Header) ? "\n" : " ";
+		preprocessedText += token.raw;
+#endif
+
+		if (token.type == SfzToken::Type::Header)
 		{
-			nextPos = pos + keyGroupHeader.length() - 1;
-			if (regionSetting)
+			if (token.name == "region")
 			{
-				settings.push_back(regionSetting.value().value());
-				regionSetting = none;
+				flushRegion();
+				regionSetting = groupSetting.combined(globalSetting);
+				header = SFZHeader::Region;
 			}
-
-			groupSetting = RegionSettingOpt();
-			header = SFZHeader::Group;
-		}
-		else if (token.starts_with(keyGlobalHeader))
-		{
-			nextPos = pos + keyGlobalHeader.length() - 1;
-			if (regionSetting)
+			else if (token.name == "group")
 			{
-				settings.push_back(regionSetting.value().value());
-				regionSetting = none;
+				flushRegion();
+				groupSetting = RegionSettingOpt();
+				header = SFZHeader::Group;
 			}
-
-			globalSetting = RegionSettingOpt();
-			header = SFZHeader::Global;
-		}
-		else if (token.starts_with(keySample))
-		{
-			token = token.substr(keySample.length());
-
-			if (token.starts_with(U"*"))
+			else if (token.name == "global")
 			{
-				setting().sample = token;
+				flushRegion();
+				globalSetting = RegionSettingOpt();
+				header = SFZHeader::Global;
 			}
+#ifdef DEVELOPMENT
 			else
 			{
-				if (!FileSystem::IsFile(defaultPath + token))
-				{
-					pos += keySample.length();
-					// sampleの場合は空白文字を含める
-					nextPos = text.indexOfAny(U"\t\n", pos);
-					token = text.substrView(pos, nextPos == String::npos ? nextPos : nextPos - pos);
-				}
-
-				if (FileSystem::IsFile(defaultPath + token))
-				{
-					setting().sample = token;
-				}
-				else
-				{
-					Console << U"warning: not found sample \"" << (defaultPath + token) << U"\"";
-					Console << U"this region is skipped";
-					regionSetting = none;
-				}
+				Console << U"unknown token: \"<" << Unicode::FromUTF8(token.name) << U">\"";
 			}
+#endif
+			continue;
 		}
-		else if (token.starts_with(keyGroup))
-		{
-			setting().group = ParseInt<int32>(token.substr(keyGroup.length()));
-		}
-		else if (token.starts_with(keyLoopMode))
-		{
-			setting().loopMode = ParseLoopMode(token.substr(keyLoopMode.length()));
-		}
-		else if (token.starts_with(keyOffBy))
-		{
-			setting().off_by = ParseInt<int32>(token.substr(keyOffBy.length()));
-		}
-		else if (token.starts_with(keyOffMode))
-		{
-			setting().off_mode = ParseOffMode(token.substr(keyOffMode.length()));
-		}
-		else if (token.starts_with(keyOffTime))
-		{
-			setting().off_time = ParseFloat<float>(token.substr(keyOffTime.length()));
-		}
-		else if (token.starts_with(keySwLoKey))
-		{
-			setting().sw_lokey = ParseInt<int8>(token.substr(keySwLoKey.length()));
-		}
-		else if (token.starts_with(keySwHiKey))
-		{
-			setting().sw_hikey = ParseInt<int8>(token.substr(keySwHiKey.length()));
-		}
-		else if (token.starts_with(keySwDefault))
-		{
-			setting().sw_default = ParseInt<int8>(token.substr(keySwDefault.length()));
-		}
-		else if (token.starts_with(keySwLast))
-		{
-			setting().sw_last = ParseInt<int8>(token.substr(keySwLast.length()));
-		}
-		else if (token.starts_with(keyLovel))
-		{
-			setting().lovel = ParseInt<uint8>(token.substr(keyLovel.length()));
-		}
-		else if (token.starts_with(keyHivel))
+
+		if (token.type == SfzToken::Type::Unknown)
 		{
-			setting().hivel = ParseInt<uint8>(token.substr(keyHivel.length()));
+#ifdef DEVELOPMENT
+			Console << U"unknown token: \"" << Unicode::FromUTF8(token.name) << U"\"";
+#endif
+			continue;
 		}
-		else if (token.starts_with(keyDefaultPath))
+
+		// <region> で sample が見つからなかった場合、そのリージョンの残りの opcode は読み飛ばす
+		if (header == SFZHeader::Region && !regionSetting)
 		{
-			defaultPath = parentDirectory + token.substr(keyDefaultPath.length());
+			continue;
 		}
-		else if (token.starts_with(keyKey))
+
+		switch (ToOpcode(token.name))
 		{
-			const auto keyStr = token.substr(keyKey.length());
-			if (auto optKey = ParseIntOpt<uint8>(keyStr))
-			{
-				setting().lokey = optKey.value();
-				setting().hikey = optKey.value();
-				setting().pitch_keycenter = optKey.value();
-			}
-			else if (auto optKeyName = ParseMidiKey(keyStr))
-			{
-				setting().lokey = optKeyName.value();
-				setting().hikey = optKeyName.value();
-				setting().pitch_keycenter = optKeyName.value();
-			}
-			else
-			{
-				assert(false);
-			}
-		}
-		else if (token.starts_with(keyLokey))
+		case Opcode::Sample:
 		{
-			const auto keyStr = token.substr(keyLokey.length());
-			if (auto optKey = ParseIntOpt<uint8>(keyStr))
+			const auto sample = Unicode::FromUTF8(token.value);
+
+			if (sample.starts_with(U'*'))
 			{
-				setting().lokey = optKey.value();
+				setting().sample = sample;
 			}
-			else if (auto optKeyName = ParseMidiKey(keyStr))
+			else if (FileSystem::IsFile(defaultPath + sample))
 			{
-				setting().lokey = optKeyName.value();
+				setting().sample = sample;
 			}
 			else
 			{
-				assert(false);
+				Console << U"warning: not found sample \"" << (defaultPath + sample) << U"\"";
+				Console << U"this region is skipped";
+				regionSetting = none;
 			}
+			break;
 		}
-		else if (token.starts_with(keyHikey))
-		{
-			const auto keyStr = token.substr(keyHikey.length());
-			if (auto optKey = ParseIntOpt<uint8>(keyStr))
-			{
-				setting().hikey = optKey.value();
-			}
-			else if (auto optKeyName = ParseMidiKey(keyStr))
+		case Opcode::Group:
+			assign(ParseNumber<int32>(token.value), token, &RegionSettingOpt::group);
+			break;
+		case Opcode::LoopMode:
+			assign(ParseLoopMode(token.value), token, &RegionSettingOpt::loopMode);
+			break;
+		case Opcode::OffBy:
+			assign(ParseNumber<int32>(token.value), token, &RegionSettingOpt::off_by);
+			break;
+		case Opcode::OffMode:
+			assign(ParseOffMode(token.value), token, &RegionSettingOpt::off_mode);
+			break;
+		case Opcode::OffTime:
+			assign(ParseNumber<float>(token.value), token, &RegionSettingOpt::off_time);
+			break;
+		case Opcode::SwLokey:
+			assign(ParseNumber<int8>(token.value), token, &RegionSettingOpt::sw_lokey);
+			break;
+		case Opcode::SwHikey:
+			assign(ParseNumber<int8>(token.value), token, &RegionSettingOpt::sw_hikey);
+			break;
+		case Opcode::SwDefault:
+			assign(ParseNumber<int8>(token.value), token, &RegionSettingOpt::sw_default);
+			break;
+		case Opcode::SwLast:
+			assign(ParseNumber<int8>(token.value), token, &RegionSettingOpt::sw_last);
+			break;
+		case Opcode::Lovel:
+			assign(ParseNumber<uint8>(token.value), token, &RegionSettingOpt::lovel);
+			break;
+		case Opcode::Hivel:
+			assign(ParseNumber<uint8>(token.value), token, &RegionSettingOpt::hivel);
+			break;
+		case Opcode::DefaultPath:
+			defaultPath = parentDirectory + Unicode::FromUTF8(token.value);
+			break;
+		case Opcode::Key:
+			if (const auto key = ParseMidiKey(token.value))
 			{
-				setting().hikey = optKeyName.value();
+				setting().lokey = key.value();
+				setting().hikey = key.value();
+				setting().pitch_keycenter = key.value();
 			}
 			else
 			{
-				assert(false);
-			}
-		}
-		else if (token.starts_with(keyPitchKeycenter))
-		{
-			const auto keyStr = token.substr(keyPitchKeycenter.length());
-			if (auto optKey = ParseIntOpt<uint8>(keyStr))
-			{
-				setting().pitch_keycenter = optKey.value();
+				reportInvalidValue(token);
 			}
-			else if (auto optKeyName = ParseMidiKey(keyStr))
+			break;
+		case Opcode::Lokey:
+			assign(ParseMidiKey(token.value), token, &RegionSettingOpt::lokey);
+			break;
+		case Opcode::Hikey:
+			assign(ParseMidiKey(token.value), token, &RegionSettingOpt::hikey);
+			break;
+		case Opcode::PitchKeycenter:
+			if (const auto key = ParseMidiKey(token.value))
 			{
-				setting().pitch_keycenter = optKeyName.value();
+				setting().pitch_keycenter = static_cast<int8>(key.value());
 			}
 			else
 			{
-				assert(false);
+				reportInvalidValue(token);
 			}
-		}
-		else if (token.starts_with(keyOffset))
-		{
-			setting().offset = ParseInt<uint32>(token.substr(keyOffset.length()));
-		}
-		else if (token.starts_with(keyTune))
-		{
-			setting().tune = ParseInt<int16>(token.substr(keyTune.length()));
-		}
-		else if (token.starts_with(keyVolume))
-		{
-			setting().volume = ParseFloat<float>(token.substr(keyVolume.length()));
-		}
-		else if (token.starts_with(keyRtDecay))
-		{
-			setting().rt_decay = ParseFloat<float>(token.substr(keyRtDecay.length()));
-		}
-		else if (token.starts_with(keyTrigger))
-		{
-			setting().trigger = ParseTrigger(token.substr(keyTrigger.length()));
-		}
-		else if (token.starts_with(keyAmpegAttack))
-		{
-			setting().ampeg_attack = ParseFloat<float>(token.substr(keyAmpegAttack.length()));
-		}
-		else if (token.starts_with(keyAmpegDecay))
-		{
-			setting().ampeg_decay = ParseFloat<float>(token.substr(keyAmpegDecay.length()));
-		}
-		else if (token.starts_with(keyAmpegSustain))
-		{
-			setting().ampeg_sustain = ParseFloat<float>(token.substr(keyAmpegSustain.length()));
-		}
-		else if (token.starts_with(keyAmpegRelease))
-		{
-			setting().ampeg_release = ParseFloat<float>(token.substr(keyAmpegRelease.length()));
-		}
-		else
-		{
+			break;
+		case Opcode::Offset:
+			assign(ParseNumber<uint32>(token.value), token, &RegionSettingOpt::offset);
+			break;
+		case Opcode::Tune:
+			assign(ParseNumber<int16>(token.value), token, &RegionSettingOpt::tune);
+			break;
+		case Opcode::Volume:
+			assign(ParseNumber<float>(token.value), token, &RegionSettingOpt::volume);
+			break;
+		case Opcode::RtDecay:
+			assign(ParseNumber<float>(token.value), token, &RegionSettingOpt::rt_decay);
+			break;
+		case Opcode::Trigger:
+			assign(ParseTrigger(token.value), token, &RegionSettingOpt::trigger);
+			break;
+		case Opcode::AmpegAttack:
+			assign(ParseNumber<float>(token.value), token, &RegionSettingOpt::ampeg_attack);
+			break;
+		case Opcode::AmpegDecay:
+			assign(ParseNumber<float>(token.value), token, &RegionSettingOpt::ampeg_decay);
+			break;
+		case Opcode::AmpegSustain:
+			assign(ParseNumber<float>(token.value), token, &RegionSettingOpt::ampeg_sustain);
+			break;
+		case Opcode::AmpegRelease:
+			assign(ParseNumber<float>(token.value), token, &RegionSettingOpt::ampeg_release);
+			break;
+		case Opcode::Unknown:
+		default:
 #ifdef DEVELOPMENT
-			if (!token.includes(U"label"))
+			if (token.name.find("label") == std::string_view::npos)
 			{
-				const auto equalPos = token.indexOf(U'=');
-				if (equalPos != String::npos)
+				const auto opcodeStr = Unicode::FromUTF8(token.name);
+				if (!unsupportedOpcodes.contains(opcodeStr))
 				{
-					const auto opcodeStr = token.substr(0, equalPos);
-					if (!unsupportedOpcodes.contains(opcodeStr))
-					{
-						unsupportedOpcodes.emplace(opcodeStr);
-						Console << U"(" << pos << U":" << nextPos << U") unsupported opcode: \"" << opcodeStr << U"\"";
-					}
-				}
-				else
-				{
-					Console << U"(" << pos << U":" << nextPos << U") unknown token: \"" << token << U"\"";
+					unsupportedOpcodes.emplace(opcodeStr);
+					Console << U"unsupported opcode: \"" << opcodeStr << U"\"";
 				}
 			}
 #endif
-		}
-
-		if (nextPos == String::npos)
-		{
-			if (regionSetting)
-			{
-				settings.push_back(regionSetting.value().value());
-				regionSetting = none;
-			}
-
 			break;
 		}
-
-		pos = nextPos + 1;
 	}
 
+	flushRegion();
+
+#ifdef SFZ_DEBUG_DUMP
+	// 別のフォルダにある同じ名前の音源で上書きしないように、フルパスのハッシュを付ける
+	TextWriter writer(U"debug/preprocessed/{}_{:016X}.txt"_fmt(FileSystem::BaseName(sfzPath), FNV1a(NormalizePath(sfzPath))));
+	writer << Unicode::FromUTF8(preprocessedText);
+#endif
+
 	//for (const auto& setting : settings)
 	//{
 	//	setting.debugPrint();
@@ -748,6 +1200,7 @@ SfzData LoadSfz(FilePathView sfzPath)
 	SfzData sfzData;
 	sfzData.dir = defaultPath;
 	sfzData.data = std::move(settings);
+	sfzData.includes = preprocessor.includes();
 
 	return sfzData;
 }
@@ -0,0 +1,283 @@
+﻿#pragma once
+#include <SampleCache.hpp>
+#include <FlacLoader.hpp>
+
+namespace
+{
+	String CacheFileName(FilePathView sourcePath)
+	{
+		return U"{:016X}.wav"_fmt(FNV1a(NormalizePath(sourcePath)));
+	}
+}
+
+SampleCache::~SampleCache()
+{
+	finish();
+}
+
+void SampleCache::setup(FilePathView directory, uint64 capacityOfBytes)
+{
+	finish();
+
+	m_directory = FileSystem::FullPath(directory);
+	if (!m_directory.ends_with(U'/'))
+	{
+		m_directory += U'/';
+	}
+
+	if (!FileSystem::IsDirectory(m_directory) && !FileSystem::CreateDirectories(m_directory))
+	{
+		Console << U"error: サンプルキャッシュのディレクトリを作成できません \"" << m_directory << U"\"";
+		return;
+	}
+
+	m_capacityOfBytes = capacityOfBytes;
+	m_isFinish = false;
+
+	loadIndex();
+	removeUnlistedFiles();
+
+	m_isEnabled = true;
+	m_worker = std::thread([this] { workerLoop(); });
+}
+
+void SampleCache::finish()
+{
+	if (!m_isEnabled)
+	{
+		return;
+	}
+
+	{
+		std::lock_guard lock(m_mutex);
+		m_isFinish = true;
+		m_queue.clear();
+		m_queuedFiles.clear();
+	}
+	m_condition.notify_all();
+
+	if (m_worker.joinable())
+	{
+		m_worker.join();
+	}
+
+	std::lock_guard lock(m_mutex);
+	saveIndex();
+	m_isEnabled = false;
+}
+
+Optional<FilePath> SampleCache::request(FilePathView sourcePath)
+{
+	if (!m_isEnabled)
+	{
+		return none;
+	}
+
+	const auto fileName = CacheFileName(sourcePath);
+	const auto stamp = GetFileStamp(sourcePath);
+	if (!stamp)
+	{
+		return none;
+	}
+
+	std::lock_guard lock(m_mutex);
+
+	if (auto it = m_entries.find(fileName); it != m_entries.end())
+	{
+		auto& entry = it->second;
+		if (entry.sourceStamp == stamp.value() && FileSystem::IsFile(cacheFilePath(fileName)))
+		{
+			entry.lastAccess = ++m_accessCount;
+			m_pinned.emplace(fileName);
+			return cacheFilePath(fileName);
+		}
+
+		// 元ファイルが更新されているので作り直す
+		removeEntry(fileName);
+	}
+
+	if (!m_queuedFiles.contains(fileName))
+	{
+		m_queuedFiles.emplace(fileName);
+		m_queue.emplace_back(sourcePath);
+		m_condition.notify_one();
+	}
+
+	return none;
+}
+
+uint64 SampleCache::totalSizeOfBytes() const
+{
+	std::lock_guard lock(m_mutex);
+
+	uint64 totalSize = 0;
+	for (const auto& [fileName, entry] : m_entries)
+	{
+		totalSize += entry.sizeOfBytes;
+	}
+
+	return totalSize;
+}
+
+FilePath SampleCache::cacheFilePath(StringView fileName) const
+{
+	return m_directory + fileName;
+}
+
+void SampleCache::loadIndex()
+{
+	m_entries.clear();
+	m_accessCount = 0;
+
+	TextReader reader(cacheFilePath(U"index.txt"));
+	if (!reader)
+	{
+		return;
+	}
+
+	// fileName, sourceSize, sourceWriteTime, sizeOfBytes, lastAccess, sourcePath
+	String line;
+	while (reader.readLine(line))
+	{
+		const auto columns = line.split(U'\t');
+		if (columns.size() != 6)
+		{
+			continue;
+		}
+
+		Entry entry;
+		entry.sourceStamp.size = ParseInt<int64>(columns[1]);
+		entry.sourceStamp.writeTime = ParseInt<int64>(columns[2]);
+		entry.sizeOfBytes = ParseInt<uint64>(columns[3]);
+		entry.lastAccess = ParseInt<uint64>(columns[4]);
+		entry.sourcePath = columns[5];
+
+		if (!FileSystem::IsFile(cacheFilePath(columns[0])))
+		{
+			continue;
+		}
+
+		m_accessCount = Max(m_accessCount, entry.lastAccess);
+		m_entries[columns[0]] = std::move(entry);
+	}
+}
+
+void SampleCache::removeUnlistedFiles()
+{
+	// 容量の上限はインデックスにあるファイルでしか数えないので、それ以外は残しておかない
+	for (const auto& path : FileSystem::DirectoryContents(m_directory, Recursive::No))
+	{
+		const auto fileName = FileSystem::FileName(path);
+		if (FileSystem::IsFile(path) && fileName != U"index.txt" && !m_entries.contains(fileName))
+		{
+			FileSystem::Remove(path);
+		}
+	}
+}
+
+void SampleCache::saveIndex() const
+{
+	TextWriter writer(cacheFilePath(U"index.txt"));
+	for (const auto& [fileName, entry] : m_entries)
+	{
+		writer << fileName << U'\t' << entry.sourceStamp.size << U'\t' << entry.sourceStamp.writeTime << U'\t'
+			<< entry.sizeOfBytes << U'\t' << entry.lastAccess << U'\t' << entry.sourcePath;
+	}
+}
+
+void SampleCache::workerLoop()
+{
+	for (;;)
+	{
+		FilePath sourcePath;
+
+		{
+			std::unique_lock lock(m_mutex);
+			m_condition.wait(lock, [this] { return m_isFinish || !m_queue.empty(); });
+
+			if (m_isFinish)
+			{
+				return;
+			}
+
+			sourcePath = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		transcode(sourcePath);
+	}
+}
+
+void SampleCache::transcode(const FilePath& sourcePath)
+{
+	const auto fileName = CacheFileName(sourcePath);
+	const auto stamp = GetFileStamp(sourcePath);
+	const auto cachePath = cacheFilePath(fileName);
+	const auto tempPath = cachePath + U".tmp";
+
+	const bool succeeded = stamp
+		&& TranscodeFlacToWave(sourcePath, tempPath)
+		&& FileSystem::Rename(tempPath, cachePath);
+
+	std::lock_guard lock(m_mutex);
+	m_queuedFiles.erase(fileName);
+
+	if (!succeeded)
+	{
+		FileSystem::Remove(tempPath);
+#ifdef DEVELOPMENT
+		Console << U"warning: サンプルキャッシュの作成に失敗しました \"" << sourcePath << U"\"";
+#endif
+		return;
+	}
+
+	Entry entry;
+	entry.sourcePath = sourcePath;
+	entry.sourceStamp = stamp.value();
+	entry.sizeOfBytes = static_cast<uint64>(FileSystem::FileSize(cachePath));
+	entry.lastAccess = ++m_accessCount;
+	m_entries[fileName] = std::move(entry);
+
+	evict();
+	saveIndex();
+}
+
+void SampleCache::evict()
+{
+	uint64 totalSize = 0;
+	Array<std::pair<uint64, String>> candidates;
+	for (const auto& [fileName, entry] : m_entries)
+	{
+		totalSize += entry.sizeOfBytes;
+		if (!m_pinned.contains(fileName))
+		{
+			candidates.emplace_back(entry.lastAccess, fileName);
+		}
+	}
+
+	if (totalSize <= m_capacityOfBytes)
+	{
+		return;
+	}
+
+	// 最後に使われたのが古い順に削除する
+	candidates.sort_by([](const auto& a, const auto& b) { return a.first < b.first; });
+
+	for (const auto& [lastAccess, fileName] : candidates)
+	{
+		if (totalSize <= m_capacityOfBytes)
+		{
+			break;
+		}
+
+		totalSize -= m_entries[fileName].sizeOfBytes;
+		removeEntry(fileName);
+	}
+}
+
+void SampleCache::removeEntry(const String& fileName)
+{
+	FileSystem::Remove(cacheFilePath(fileName));
+	m_entries.erase(fileName);
+	m_pinned.erase(fileName);
+}
@@ -9,6 +9,13 @@
 #include <AudioLoadManager.hpp>
 #include <AudioStreamRenderer.hpp>
 #include <Program.hpp>
+#include <TaskPool.hpp>
+#include <InstrumentCache.hpp>
+#include <ProgramCache.hpp>
+#include <NoteEventList.hpp>
+#include <Automation.hpp>
+#include <SongCache.hpp>
+#include <MemoryPool.hpp>
 
 namespace
 {
@@ -68,6 +75,34 @@ namespace
 
 		return programNumbers;
 	}
+
+	struct InstrumentEntry
+	{
+		String sourcePath;
+		float volume = 0.0f;
+		InstrumentType type = InstrumentType::Unknown;
+		Array<uint8> programNumbers;
+	};
+
+	// 完了するまでの間、進捗をウィンドウタイトルに表示する（タイトルの更新は一定間隔ごと）
+	void WaitWithProgress(std::future<void>& task, const std::function<double()>& progress)
+	{
+		const String title = Window::GetTitle();
+		Stopwatch updateTimer(StartImmediately::Yes);
+
+		Window::SetTitle(U"音源読み込み中：0 %");
+		while (task.wait_for(std::chrono::milliseconds(10)) != std::future_status::ready)
+		{
+			if (100 <= updateTimer.ms())
+			{
+				Window::SetTitle(Format(U"音源読み込み中：", Math::Round(progress() * 100), U" %"));
+				updateTimer.restart();
+			}
+		}
+
+		Window::SetTitle(title);
+		task.get();
+	}
 }
 
 namespace
@@ -89,90 +124,968 @@ namespace
 		const auto nextIndex = std::distance(times.begin(), it);
 		const auto prevIndex = nextIndex - 1;
 
-		const auto& prevKeyFrame = keyframes[prevIndex];
-		const auto& nextKeyFrame = keyframes[nextIndex];
+		const auto& prevKeyFrame = keyframes[prevIndex];
+		const auto& nextKeyFrame = keyframes[nextIndex];
+
+		const double t = Math::InvLerp(times[prevIndex], times[nextIndex], time);
+		const double v = prevKeyFrame.interpolate(t);
+
+		return Math::Lerp(prevKeyFrame.value, nextKeyFrame.value, v);
+	}
+}
+
+// 再生に使う音源一式（差し替えるときは丸ごと入れ替える）
+// TOMLに書かれた音源の一覧だけを先に作っておき、Program はMIDIで使うときに組み立てる
+struct SoundSet
+{
+	// melodies、drumKit と同じ順に並ぶ
+	Array<InstrumentEntry> melodyEntries;
+	Array<InstrumentEntry> drumEntries;
+
+	// 組み立てていない音源は空のまま（isLoaded() が false）
+	Array<Program> melodies;
+	Array<Program> drumKit;
+
+	// 音源ごとに、組み立てに使ったファイル（曲のキャッシュが古くなっていないかを調べる）
+	Array<Array<std::pair<FilePath, FileStamp>>> melodyFiles;
+	Array<Array<std::pair<FilePath, FileStamp>>> drumFiles;
+
+	// TOMLに書かれた音源の一覧から作る（曲のキャッシュのキーに使う）
+	uint64 fingerprint = 0;
+
+	// 音源ごとに、最後に使ったMIDIの番号（メモリが足りないときに古いものから捨てる）
+	Array<uint64> melodyLastUsed;
+	Array<uint64> drumLastUsed;
+
+	// MIDIを登録し直すたびに進める
+	uint64 midiGeneration = 0;
+
+	// プログラムチェンジ番号 -> melodies のインデックス
+	Array<uint8> programChangeNumberToIndex;
+
+	// チャンネルごとのプログラムチェンジ（ノートを鳴らす音源を引く）
+	ProgramTimeline programTimeline;
+
+	// チャンネルごとのコントローラー（イベントと同じく eventMutex で守る）
+	AutomationSet automation;
+
+	// 描画スレッドがブロックごとに作り直す
+	BlockAutomation blockAutomation;
+
+	// 再生中にイベントを追加するとき（MIDIを少しずつ読み込むとき）や、音源を組み立てて差し込むときに、描画スレッドと取り合う
+	std::mutex eventMutex;
+
+	// 組み立て済みの音源を melodies、drumKit の順に渡す
+	template<class Func>
+	void forEachProgram(Func func)
+	{
+		for (auto& program : melodies)
+		{
+			if (program.isLoaded())
+			{
+				func(program);
+			}
+		}
+
+		for (auto& program : drumKit)
+		{
+			if (program.isLoaded())
+			{
+				func(program);
+			}
+		}
+	}
+};
+
+// バックグラウンドで読み込み中のMIDI
+struct MidiStreamLoad
+{
+	MidiStreamReader reader;
+
+	std::atomic<bool> isCanceled = false;
+
+	// 読み込むタスクが終わるまではタスクだけが触る
+	bool isFailed = false;
+
+	// 読み込んでイベントを登録し終えた区間（メインスレッドが MidiData に追加する）
+	std::mutex chunkMutex;
+	Array<Array<TrackData>> chunks;
+};
+
+struct SoundSetLoadProgress
+{
+	std::atomic<size_t> entryCount = 0;
+	std::atomic<size_t> loadedCount = 0;
+	std::atomic<size_t> probedCount = 0;
+	std::atomic<size_t> probeTotal = 0;
+
+	// 読み込みが終わるまでは読み込むスレッドだけが触る
+	Array<String> errors;
+
+	double value() const
+	{
+		const double loadProgress = entryCount == 0 ? 1.0 : 1.0 * loadedCount / entryCount;
+		const double probeProgress = probeTotal == 0 ? 0.0 : 1.0 * probedCount / probeTotal;
+		return loadProgress * 0.5 + probeProgress * 0.5;
+	}
+};
+
+struct MidiReload
+{
+	// 読み込みに失敗したら none
+	Optional<MidiData> midiData;
+
+	Optional<int64> changedFrom;
+
+	SoundSetLoadProgress progress;
+};
+
+namespace
+{
+	// 一度に読み込んでイベントを登録する長さ
+	constexpr double MidiStreamWindowSeconds = 2.0;
+
+	// 読み込み済みのMIDIを登録するときに一度に登録する小節数（4/4拍子換算）
+	constexpr uint32 CompileWindowBars = 16;
+
+	// 組み立てた音源のメモリがこれを超えたら、今のMIDIで使わない音源を古いものから捨てる
+	constexpr size_t LoadedProgramBudget = 256ull << 20;
+
+	// チャンネルとプログラムから鳴らす音源を選び、melodies、drumKit の順に通した番号を返す（割り当てる音源が無ければ none）
+	Optional<size_t> ProgramSlot(const SoundSet& soundSet, uint8 channel, uint8 programNumber)
+	{
+		if (channel == ProgramTimeline::PercussionChannel)
+		{
+			if (soundSet.drumKit.empty())
+			{
+				return none;
+			}
+			return soundSet.melodies.size();
+		}
+
+		if (soundSet.melodies.empty())
+		{
+			return none;
+		}
+		return soundSet.programChangeNumberToIndex[programNumber];
+	}
+
+	Program& ProgramAt(SoundSet& soundSet, size_t slot)
+	{
+		return slot < soundSet.melodies.size() ? soundSet.melodies[slot] : soundSet.drumKit[slot - soundSet.melodies.size()];
+	}
+
+	Program* RefProgram(SoundSet& soundSet, uint8 channel, uint8 programNumber)
+	{
+		const auto slot = ProgramSlot(soundSet, channel, programNumber);
+		if (!slot)
+		{
+			return nullptr;
+		}
+
+		// 組み立てていない音源には登録しない（先に LoadUsedPrograms() で組み立てておく）
+		auto& program = ProgramAt(soundSet, slot.value());
+		return program.isLoaded() ? &program : nullptr;
+	}
+
+	ProgramUsage CollectProgramUsage(const MidiData& midiData)
+	{
+		ProgramTimeline timeline;
+		timeline.append(midiData.notes(), 0, UINT32_MAX);
+		return timeline.usage(midiData.notes());
+	}
+
+	void ClearMidi(SoundSet& soundSet)
+	{
+		soundSet.forEachProgram([](Program& program) { program.clearEvent(); });
+
+		soundSet.automation.clear();
+		soundSet.programTimeline.clear();
+		++soundSet.midiGeneration;
+	}
+
+	// プログラムチェンジとコントローラーを追加し、ペダルが離されるのを待っていたノートの離鍵位置を決める
+	void AppendChannelState(SoundSet& soundSet, const Array<TrackData>& tracks, uint32 tickBegin, uint32 tickEnd, const TempoMap& tempoMap)
+	{
+		soundSet.programTimeline.append(tracks, tickBegin, tickEnd);
+		soundSet.automation.append(tracks, tickBegin, tickEnd, tempoMap);
+
+		soundSet.forEachProgram([&](Program& program) { program.resolveSustain(soundSet.automation); });
+	}
+
+	// tracks[i] のノートのうち ranges[i] の範囲のイベントを組み立てる（描画に使われるのは PublishEvents() の後）
+	// 前回までに登録したノートより後に始まるノートだけを渡す（プログラムチェンジとコントローラーは先に AppendChannelState() で追加しておく）
+	// 組み立て中のイベントは描画スレッドが読まないので、eventMutex を取らずに呼ぶ（音源とコントローラーを書き換えるのは呼び出し元のスレッドだけ）
+	size_t CompileMidiWindow(SoundSet& soundSet, const Array<TrackData>& tracks, const Array<std::pair<size_t, size_t>>& ranges)
+	{
+		// ノートごとに、チャンネルとその時点のプログラムで音源を選ぶ
+		for (auto [i, track] : Indexed(tracks))
+		{
+			const auto& notes = track.notes();
+			auto programCursor = soundSet.programTimeline.cursor();
+			for (size_t noteIndex = ranges[i].first; noteIndex < ranges[i].second; ++noteIndex)
+			{
+				const auto note = notes[noteIndex];
+				if (auto programPtr = RefProgram(soundSet, note.ch, programCursor.programAt(note.ch, note.tick)))
+				{
+					programPtr->addKeyDownEvent(note, &soundSet.automation);
+				}
+			}
+		}
+
+		// キーダウンを振り分けた後は音源ごとに独立しているので、音源ごとに並列に処理する
+		Array<Program*> programs;
+		soundSet.forEachProgram([&](Program& program) { programs.push_back(&program); });
+
+		Array<size_t> eventCounts(programs.size(), 0);
+		TaskPool::i().parallelFor(programs.size(), [&](size_t i)
+			{
+				auto& program = *programs[i];
+				program.sortKeyDownEvents();
+				eventCounts[i] = program.compileEvents();
+				program.sortEvent();
+				program.deleteDuplicate();
+				program.calculateOffTime();
+			});
+
+		return std::accumulate(eventCounts.begin(), eventCounts.end(), size_t(0));
+	}
+
+	size_t CompileMidiWindow(SoundSet& soundSet, const Array<TrackData>& tracks)
+	{
+		return CompileMidiWindow(soundSet, tracks, tracks.map([](const TrackData& track) { return std::make_pair(size_t(0), track.notes().size()); }));
+	}
+
+	// CompileMidiWindow() で組み立てたイベントを描画に使えるようにする（eventMutex を取ってから呼ぶ）
+	void PublishEvents(SoundSet& soundSet)
+	{
+		soundSet.forEachProgram([](Program& program) { program.publishEvents(); });
+	}
+
+	// メモリ上のイベントが予算を超えたら、書き換えられなくなったものを退避ファイルに書き出す
+	// 書き出しの間は eventMutex を取らず、差し替えるときだけ取る（イベントを書き換えるスレッドから、ロックせずに呼ぶ）
+	void SpillEvents(SoundSet& soundSet)
+	{
+		auto& spill = NoteEventSpill::i();
+		if (!spill.isEnabled())
+		{
+			return;
+		}
+
+		size_t residentBytes = 0;
+		soundSet.forEachProgram([&](const Program& program) { residentBytes += program.residentEventBytes(); });
+
+		if (residentBytes <= spill.budget())
+		{
+			return;
+		}
+
+		NoteSpillWriter writer(&soundSet.eventMutex);
+		soundSet.forEachProgram([&](Program& program) { program.spillEvents(writer); });
+		writer.finish();
+	}
+
+	// 組み立てた音源のメモリが予算を超えていたら、今のMIDIで使わない音源を古いものから捨てる（eventMutex を取ってから呼ぶ）
+	void EvictPrograms(SoundSet& soundSet)
+	{
+		size_t loadedBytes = 0;
+		soundSet.forEachProgram([&](const Program& program) { loadedBytes += program.memoryUsage(); });
+
+		if (loadedBytes <= LoadedProgramBudget)
+		{
+			return;
+		}
+
+		// (最後に使ったMIDIの番号, 音源)
+		Array<std::pair<uint64, Program*>> candidates;
+		for (auto [i, program] : IndexedRef(soundSet.melodies))
+		{
+			if (program.isLoaded() && soundSet.melodyLastUsed[i] < soundSet.midiGeneration)
+			{
+				candidates.emplace_back(soundSet.melodyLastUsed[i], &program);
+			}
+		}
+		for (auto [i, program] : IndexedRef(soundSet.drumKit))
+		{
+			if (program.isLoaded() && soundSet.drumLastUsed[i] < soundSet.midiGeneration)
+			{
+				candidates.emplace_back(soundSet.drumLastUsed[i], &program);
+			}
+		}
+
+		candidates.sort_by([](const auto& a, const auto& b) { return a.first < b.first; });
+
+		for (const auto& [lastUsed, program] : candidates)
+		{
+			if (loadedBytes <= LoadedProgramBudget)
+			{
+				break;
+			}
+
+			loadedBytes -= program->memoryUsage();
+			program->unloadProgram();
+		}
+	}
+
+	struct LoadTarget
+	{
+		const InstrumentEntry* entry;
+		Program* program;
+
+		// 組み立てに使ったファイルを書き込む先
+		Array<std::pair<FilePath, FileStamp>>* files;
+	};
+
+	// targets の音源を組み立てて差し込む
+	void LoadPrograms(SoundSet& soundSet, const Array<LoadTarget>& targets, SoundSetLoadProgress& progress)
+	{
+		if (targets.isEmpty())
+		{
+			return;
+		}
+
+		// sfzの解析とリージョンの登録は音源ごとに独立しているので並列に行い、
+		// 登録されたサンプルのヘッダもまとめて並列に読み込んでおく
+		// 音源キャッシュが有効ならsfzの解析とヘッダの読み込みは省略される
+		// 前回までに組み立てた音源が更新されていなければ、そのまま共有する
+		Array<Program> programs(targets.size());
+		Array<CompiledInstrument> instruments(targets.size());
+		Array<uint8> isCompiled(targets.size(), false);
+		Array<Array<std::pair<FilePath, FileStamp>>> files(targets.size());
+		std::atomic<size_t> reusedCount = 0;
+		progress.entryCount = targets.size();
+
+		const size_t readerBegin = AudioLoadManager::i().readerCount();
+
+		TaskPool::i().parallelFor(targets.size(), [&](size_t i)
+			{
+				if (auto built = ProgramCache::i().find(targets[i].entry->sourcePath, targets[i].entry->volume, &files[i]))
+				{
+					programs[i].loadProgram(built);
+					++reusedCount;
+					++progress.loadedCount;
+					return;
+				}
+
+				if (auto cached = InstrumentCache::i().load(targets[i].entry->sourcePath))
+				{
+					instruments[i] = std::move(cached.value());
+				}
+				else
+				{
+					instruments[i] = CompileInstrument(targets[i].entry->sourcePath);
+					isCompiled[i] = true;
+				}
+
+				files[i] = instruments[i].files();
+
+				const auto built = BuildInstrument(instruments[i], targets[i].entry->volume);
+				ProgramCache::i().store(targets[i].entry->sourcePath, targets[i].entry->volume, instruments[i], built);
+				programs[i].loadProgram(built);
+				++progress.loadedCount;
+			});
+
+		progress.probeTotal = AudioLoadManager::i().readerCount() - readerBegin;
+		AudioLoadManager::i().probeHeaders(readerBegin, progress.probedCount);
+
+		if (InstrumentCache::i().isEnabled())
+		{
+			TaskPool::i().parallelFor(targets.size(), [&](size_t i)
+				{
+					if (isCompiled[i])
+					{
+						ResolveSampleInfos(instruments[i]);
+						InstrumentCache::i().save(targets[i].entry->sourcePath, instruments[i]);
+					}
+				});
+		}
+
+	#ifdef DEVELOPMENT
+		Console << U"組み立て済みの音源を再利用しました: {} / {}"_fmt(reusedCount.load(), targets.size());
+
+		if (const auto count = AudioLoadManager::i().deduplicatedCount())
+		{
+			Console << U"同じ内容のサンプルをまとめました: {} files, {:.1f} MB"_fmt(count, AudioLoadManager::i().deduplicatedBytes() / (1024.0 * 1024.0));
+		}
+
+		{
+			size_t tableBytes = 0;
+			size_t perKeyBytes = 0;
+			for (const auto& program : programs)
+			{
+				tableBytes += program.memoryUsage();
+				perKeyBytes += program.perKeyCopyMemoryUsage();
+			}
+			Console << U"リージョンのメモリ: {:.1f} KB（キーごとにコピーした場合: {:.1f} KB）"_fmt(tableBytes / 1024.0, perKeyBytes / 1024.0);
+		}
+	#endif
+
+		{
+			std::lock_guard lock(soundSet.eventMutex);
+
+			for (auto [i, target] : Indexed(targets))
+			{
+				*target.program = std::move(programs[i]);
+				*target.files = std::move(files[i]);
+			}
+
+			EvictPrograms(soundSet);
+		}
+
+		ProgramCache::i().trim();
+	}
+
+	// usage のノートを鳴らす音源のうち、まだ組み立てていないものを組み立てて差し込む
+	// 組み立てている間は eventMutex を取らないので、再生中のサウンドセットに対して呼んでもよい
+	void LoadUsedPrograms(SoundSet& soundSet, const ProgramUsage& usage, SoundSetLoadProgress& progress)
+	{
+		// 割り当ての無いプログラムは programChangeNumberToIndex で最初のメロディ音源になる
+		Array<uint8> isMelodyUsed(soundSet.melodies.size(), false);
+		if (!soundSet.melodies.empty())
+		{
+			for (size_t programNumber = 0; programNumber < 128; ++programNumber)
+			{
+				if (usage.melodies[programNumber])
+				{
+					isMelodyUsed[soundSet.programChangeNumberToIndex[programNumber]] = true;
+				}
+			}
+		}
+
+		Array<LoadTarget> targets;
+		for (auto [i, program] : IndexedRef(soundSet.melodies))
+		{
+			if (isMelodyUsed[i])
+			{
+				soundSet.melodyLastUsed[i] = soundSet.midiGeneration;
+				if (!program.isLoaded())
+				{
+					targets.push_back(LoadTarget{ &soundSet.melodyEntries[i], &program, &soundSet.melodyFiles[i] });
+				}
+			}
+		}
+
+		// ドラムは最初のドラム音源で鳴らす
+		if (usage.hasPercussion && !soundSet.drumKit.empty())
+		{
+			soundSet.drumLastUsed[0] = soundSet.midiGeneration;
+			if (!soundSet.drumKit[0].isLoaded())
+			{
+				targets.push_back(LoadTarget{ &soundSet.drumEntries[0], &soundSet.drumKit[0], &soundSet.drumFiles[0] });
+			}
+		}
+
+		LoadPrograms(soundSet, targets, progress);
+	}
+
+	// 曲のキャッシュのイベントを登録する（足りない音源は組み立てる）
+	// キャッシュが今のサウンドセットの音源の並びと合わなければ、何もせずに false を返す
+	bool ApplySongCache(SoundSet& soundSet, const SongCache::Timeline& timeline, SoundSetLoadProgress& progress)
+	{
+		for (const auto& record : timeline.programs)
+		{
+			if ((record.isDrum ? soundSet.drumKit.size() : soundSet.melodies.size()) <= record.index)
+			{
+				return false;
+			}
+		}
+
+		Array<LoadTarget> targets;
+		for (const auto& record : timeline.programs)
+		{
+			const size_t i = record.index;
+			if (record.isDrum)
+			{
+				soundSet.drumLastUsed[i] = soundSet.midiGeneration;
+				if (!soundSet.drumKit[i].isLoaded())
+				{
+					targets.push_back(LoadTarget{ &soundSet.drumEntries[i], &soundSet.drumKit[i], &soundSet.drumFiles[i] });
+				}
+			}
+			else
+			{
+				soundSet.melodyLastUsed[i] = soundSet.midiGeneration;
+				if (!soundSet.melodies[i].isLoaded())
+				{
+					targets.push_back(LoadTarget{ &soundSet.melodyEntries[i], &soundSet.melodies[i], &soundSet.melodyFiles[i] });
+				}
+			}
+		}
+
+		LoadPrograms(soundSet, targets, progress);
+
+		std::lock_guard lock(soundSet.eventMutex);
+
+		for (const auto& key : timeline.keys)
+		{
+			const auto& record = timeline.programs[key.programRecordIndex];
+			auto& program = record.isDrum ? soundSet.drumKit[record.index] : soundSet.melodies[record.index];
+			if (program.isLoaded())
+			{
+				program.loadKeyEvents(key.keyIndex, key.events, key.count, timeline.segment);
+			}
+		}
+
+		return true;
+	}
+
+	// 組み立て終えたイベントを曲のキャッシュに書き出す（イベントを書き換えるスレッドから呼ぶ）
+	void SaveSongCache(const SoundSet& soundSet, const SongCache::MidiKey& midiKey)
+	{
+		Array<SongCache::ProgramRecord> programs;
+		Array<SongCache::KeyEvents> keys;
+
+		const auto addProgram = [&](const Program& program, bool isDrum, size_t index, const Array<std::pair<FilePath, FileStamp>>& files)
+		{
+			if (!program.isLoaded())
+			{
+				return;
+			}
+
+			const auto recordIndex = static_cast<uint32>(programs.size());
+			const size_t keyBegin = keys.size();
+			for (uint8 keyIndex = 127; keyIndex < 255; ++keyIndex)
+			{
+				if (!program.keyEvents(keyIndex).empty())
+				{
+					keys.push_back(SongCache::KeyEvents{ recordIndex, keyIndex, &program.keyEvents(keyIndex) });
+				}
+			}
+
+			if (keyBegin != keys.size())
+			{
+				programs.push_back(SongCache::ProgramRecord{ isDrum, static_cast<uint32>(index), files });
+			}
+		};
+
+		for (auto [i, program] : Indexed(soundSet.melodies))
+		{
+			addProgram(program, false, i, soundSet.melodyFiles[i]);
+		}
+
+		for (auto [i, program] : Indexed(soundSet.drumKit))
+		{
+			addProgram(program, true, i, soundSet.drumFiles[i]);
+		}
+
+		SongCache::i().save(midiKey, soundSet.fingerprint, programs, keys);
+	}
+
+	// 音源ごとに、そこで鳴らすノートをトラック順に集める（番号は ProgramSlot() と同じ）
+	Array<Array<Note>> RouteNotes(const SoundSet& soundSet, const Array<TrackData>& tracks, const ProgramTimeline& timeline)
+	{
+		Array<Array<Note>> result(soundSet.melodies.size() + soundSet.drumKit.size());
+		for (const auto& track : tracks)
+		{
+			auto programCursor = timeline.cursor();
+			for (const auto& note : track.notes())
+			{
+				if (const auto slot = ProgramSlot(soundSet, note.ch, programCursor.programAt(note.ch, note.tick)))
+				{
+					result[slot.value()].push_back(note);
+				}
+			}
+		}
+		return result;
+	}
+
+	// 差分を調べるための、音源に登録するときと同じ位置に変換したノート
+	struct PlacedNote
+	{
+		int64 timePos;
+
+		// ペダルで延ばした離鍵位置
+		int64 releaseTimePos;
+
+		uint8 key;
+		uint8 velocity;
+		uint8 ch;
+
+		auto operator<=>(const PlacedNote&) const = default;
+	};
+
+	Array<PlacedNote> PlaceNotes(const Array<Note>& notes, const AutomationSet& automation)
+	{
+		Array<PlacedNote> result;
+		result.reserve(notes.size());
+		for (const auto& note : notes)
+		{
+			const int64 releaseTimePos = static_cast<int64>(Math::Round(note.endSec * Wave::DefaultSampleRate));
+			result.push_back(PlacedNote{ static_cast<int64>(Math::Round(note.beginSec * Wave::DefaultSampleRate)), automation.sustainedRelease(note.ch, releaseTimePos), note.key, note.velocity, note.ch });
+		}
+		result.sort();
+		return result;
+	}
+
+	// 描画に効くチャンネルイベント（コントローラーとピッチベンドは描画時に、プログラムチェンジはノートの振り分けに効く）
+	struct PlacedChannelEvent
+	{
+		int64 timePos;
+		uint8 status;
+		uint8 data1;
+		uint8 data2;
+
+		auto operator<=>(const PlacedChannelEvent&) const = default;
+	};
+
+	Array<PlacedChannelEvent> PlaceChannelEvents(const MidiData& midiData)
+	{
+		Array<PlacedChannelEvent> result;
+		for (const auto& track : midiData.notes())
+		{
+			for (const auto& event : track.channelEvents())
+			{
+				const auto timePos = static_cast<int64>(Math::Round(midiData.tempoMap().ticksToSeconds(event.tick) * Wave::DefaultSampleRate));
+				result.push_back(PlacedChannelEvent{ timePos, event.status, event.data1, event.data2 });
+			}
+		}
+		result.sort();
+		return result;
+	}
+
+	// 位置順に並べた2つの列が最初に食い違う位置（同じなら none）
+	template<class Placed>
+	Optional<int64> FirstDifference(const Array<Placed>& a, const Array<Placed>& b)
+	{
+		const size_t count = Min(a.size(), b.size());
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (a[i] != b[i])
+			{
+				return Min(a[i].timePos, b[i].timePos);
+			}
+		}
+
+		if (a.size() != b.size())
+		{
+			return (a.size() < b.size() ? b : a)[count].timePos;
+		}
+
+		return none;
+	}
+
+	// 組み立て済みの音源に midiData のイベントを登録する（ClearMidi() の後に呼ぶ）
+	size_t CompileMidiWindows(SoundSet& soundSet, const MidiData& midiData)
+	{
+		// 一度に全部登録するとキーダウンが全ノート分溜まるので、時間順に区切って登録しながら退避する
+		const auto& tracks = midiData.notes();
+		const uint32 windowTicks = midiData.resolution() * 4u * CompileWindowBars;
+
+		Array<std::pair<size_t, size_t>> ranges(tracks.size());
+		size_t eventCount = 0;
+
+		// ここまでのプログラムチェンジとコントローラーを追加済み（ノートの無い区間のものも漏らさない）
+		uint32 channelStateTick = 0;
+
+		while (true)
+		{
+			// 次のノートから区間を始める（ノートの無い区間は飛ばす）
+			Optional<uint32> nextTick;
+			for (auto [i, track] : Indexed(tracks))
+			{
+				if (ranges[i].first < track.notes().size())
+				{
+					const uint32 tick = track.notes().tick(ranges[i].first);
+					nextTick = nextTick ? Min(nextTick.value(), tick) : tick;
+				}
+			}
+
+			if (!nextTick)
+			{
+				break;
+			}
+
+			const uint32 tickEnd = static_cast<uint32>(Min<uint64>(uint64(nextTick.value()) + windowTicks, UINT32_MAX));
+			for (auto [i, track] : Indexed(tracks))
+			{
+				ranges[i].second = (tickEnd == UINT32_MAX) ? track.notes().size() : Max(ranges[i].first, track.notes().countBefore(tickEnd));
+			}
+
+			{
+				std::lock_guard lock(soundSet.eventMutex);
+				AppendChannelState(soundSet, tracks, channelStateTick, tickEnd, midiData.tempoMap());
+			}
+			channelStateTick = tickEnd;
+
+			eventCount += CompileMidiWindow(soundSet, tracks, ranges);
+			{
+				std::lock_guard lock(soundSet.eventMutex);
+				PublishEvents(soundSet);
+			}
+			SpillEvents(soundSet);
+
+			for (auto& range : ranges)
+			{
+				range.first = range.second;
+			}
+		}
+
+		// 最後のノートより後のペダルも反映する
+		if (channelStateTick != UINT32_MAX)
+		{
+			std::lock_guard lock(soundSet.eventMutex);
+			AppendChannelState(soundSet, tracks, channelStateTick, UINT32_MAX, midiData.tempoMap());
+		}
+
+		return eventCount;
+	}
+
+	// 鳴らす音源を組み立ててから、イベントを登録する
+	size_t CompileMidi(SoundSet& soundSet, const MidiData& midiData, SoundSetLoadProgress& progress)
+	{
+		{
+			std::lock_guard lock(soundSet.eventMutex);
+			ClearMidi(soundSet);
+		}
+
+		LoadUsedPrograms(soundSet, CollectProgramUsage(midiData), progress);
+
+		return CompileMidiWindows(soundSet, midiData);
+	}
+
+	// TOMLを読んで音源の一覧だけを作る（音源は MIDI で使うときに LoadUsedPrograms() で組み立てる）
+	// どのスレッドから呼ばれてもよい（エラーは progress.errors に積んで、呼び出し側が表示する）
+	std::shared_ptr<SoundSet> BuildSoundSet(FilePathView soundSetTomlPath, SoundSetLoadProgress& progress)
+	{
+		TOMLReader soundSetReader(soundSetTomlPath);
+		if (!soundSetReader)
+		{
+			progress.errors.push_back(U"TOMLファイルの読み込みに失敗しました: {}"_fmt(soundSetTomlPath));
+			return nullptr;
+		}
+
+		auto soundSet = std::make_shared<SoundSet>();
+		soundSet->programChangeNumberToIndex.resize(128, 0);
+
+		Array<InstrumentEntry> entries;
+
+		for (const auto& instrument : soundSetReader[U"Instrument"].tableArrayView())
+		{
+			const auto sourcePath = instrument[U"source"].getString();
+			if (!FileSystem::Exists(sourcePath))
+			{
+				progress.errors.push_back(U"\"{}\" ファイルが見つかりません。サウンドセットの読み込みに失敗しました: {}"_fmt(sourcePath, soundSetTomlPath));
+				continue;
+			}
+
+			if (U"sfz" != FileSystem::Extension(sourcePath))
+			{
+				progress.errors.push_back(U"\"{}\" sfzでないファイルが指定されました。サウンドセットの読み込みに失敗しました: {}"_fmt(sourcePath, soundSetTomlPath));
+				continue;
+			}
+
+			const auto volumeVal = instrument[U"volume"];
+			float volume = 0.0f;
+			if (!volumeVal.isEmpty())
+			{
+				if (auto opt = volumeVal.getOpt<float>())
+				{
+					volume = opt.value();
+				}
+			}
+
+			const auto typeStr = instrument[U"type"].getString();
+			const auto type = ParseInstrumentType(typeStr);
+
+			if (type == InstrumentType::Unknown)
+			{
+				progress.errors.push_back(U"\"{}\" 不明なインストゥルメントタイプです。サウンドセットの読み込みに失敗しました: {}"_fmt(typeStr, soundSetTomlPath));
+				continue;
+			}
+
+			Array<uint8> programNumbers;
+			if (type == InstrumentType::Melody)
+			{
+				programNumbers = ParseProgramNumber(instrument[U"program"].getString());
+			}
+
+			entries.push_back(InstrumentEntry{ sourcePath, volume, type, programNumbers });
+		}
+
+		for (const auto& entry : entries)
+		{
+			if (entry.type == InstrumentType::Melody)
+			{
+				const auto soundSetIndex = static_cast<uint8>(soundSet->melodies.size());
+				for (auto num : entry.programNumbers)
+				{
+					const auto programIndex = static_cast<int32>(num) - 1;
+					soundSet->programChangeNumberToIndex[programIndex] = soundSetIndex;
+				}
+
+				soundSet->melodyEntries.push_back(entry);
+				soundSet->melodies.emplace_back();
+			}
+			else
+			{
+				soundSet->drumEntries.push_back(entry);
+				soundSet->drumKit.emplace_back();
+			}
+		}
+
+		soundSet->melodyLastUsed.resize(soundSet->melodies.size(), 0);
+		soundSet->drumLastUsed.resize(soundSet->drumKit.size(), 0);
+		soundSet->melodyFiles.resize(soundSet->melodies.size());
+		soundSet->drumFiles.resize(soundSet->drumKit.size());
+
+		// 音源の並びとプログラムの割り当てが同じなら、同じ音源で同じイベントが組み立てられる
+		uint64 fingerprint = FNV1a(std::string_view("soundset"));
+		for (const auto& entry : entries)
+		{
+			fingerprint = FNV1a(NormalizePath(entry.sourcePath), fingerprint);
+			fingerprint = FNV1a(std::bit_cast<const uint8*>(&entry.volume), sizeof(entry.volume), fingerprint);
+			fingerprint = FNV1a(std::bit_cast<const uint8*>(&entry.type), sizeof(entry.type), fingerprint);
+			fingerprint = FNV1a(entry.programNumbers.data(), entry.programNumbers.size(), fingerprint);
+		}
+		soundSet->fingerprint = fingerprint;
+
+		return soundSet;
+	}
+}
 
-		const double t = Math::InvLerp(times[prevIndex], times[nextIndex], time);
-		const double v = prevKeyFrame.interpolate(t);
+SamplePlayer::~SamplePlayer()
+{
+	cancelMidiStream();
+	waitMidiReload();
 
-		return Math::Lerp(prevKeyFrame.value, nextKeyFrame.value, v);
+	if (m_loadingTask.valid())
+	{
+		m_loadingTask.wait();
 	}
 }
 
 void SamplePlayer::loadSoundSet(FilePathView soundSetTomlPath)
 {
-	TOMLReader soundSetReader(soundSetTomlPath);
-	if (!soundSetReader)
+	loadSoundSet(soundSetTomlPath, ProgramUsage{});
+}
+
+void SamplePlayer::loadSoundSet(FilePathView soundSetTomlPath, const ProgramUsage& usage)
+{
+	waitSoundSetLoading();
+
+	SoundSetLoadProgress progress;
+	std::shared_ptr<SoundSet> soundSet;
+
+	auto task = TaskPool::i().submit([&]
+		{
+			soundSet = BuildSoundSet(soundSetTomlPath, progress);
+			if (soundSet)
+			{
+				LoadUsedPrograms(*soundSet, usage, progress);
+			}
+		});
+	WaitWithProgress(task, [&] { return progress.value(); });
+
+	for (const auto& error : progress.errors)
 	{
-		Print << U"TOMLファイルの読み込みに失敗しました: " << soundSetTomlPath;
-		return;
+		Print << error;
 	}
 
-	m_programChangeNumberToSoundSetIndex.resize(128);
-	for (auto& soundSetIndex : m_programChangeNumberToSoundSetIndex)
+	if (soundSet)
 	{
-		soundSetIndex = 0;
+		std::lock_guard lock(m_swapMutex);
+		m_soundSet.store(std::move(soundSet));
 	}
+}
 
-	m_soundSet.clear();
-	m_drumKit.clear();
+void SamplePlayer::loadSoundSetAsync(FilePathView soundSetTomlPath, const Optional<MidiData>& midiData)
+{
+	waitSoundSetLoading();
 
-	for (const auto& instrument : soundSetReader[U"Instrument"].tableArrayView())
-	{
-		const auto sourcePath = instrument[U"source"].getString();
-		if (!FileSystem::Exists(sourcePath))
-		{
-			Print << U"\"{}\" ファイルが見つかりません。サウンドセットの読み込みに失敗しました: "_fmt(sourcePath) << soundSetTomlPath;
-			continue;
-		}
+	auto progress = std::make_shared<SoundSetLoadProgress>();
+	m_loadProgress = progress;
+	m_titleBeforeLoading = Window::GetTitle();
+	m_loadingTimer.restart();
 
-		if (U"sfz" != FileSystem::Extension(sourcePath))
+	// 再生中の音源はそのまま鳴らしておき、新しいサウンドセットにMIDIのイベントまで登録してから差し替えを待つ
+	m_loadingTask = TaskPool::i().submit([this, progress, path = FilePath(soundSetTomlPath), midiData]
 		{
-			Print << U"\"{}\" sfzでないファイルが指定されました。サウンドセットの読み込みに失敗しました: "_fmt(sourcePath) << soundSetTomlPath;
-			continue;
-		}
+			auto soundSet = BuildSoundSet(path, *progress);
+			if (!soundSet)
+			{
+				return;
+			}
 
-		const auto volumeVal = instrument[U"volume"];
-		float volume = 0.0f;
-		if (!volumeVal.isEmpty())
-		{
-			if (auto opt = volumeVal.getOpt<float>())
+			// MIDIで鳴らす音源だけを組み立てる
+			if (midiData)
 			{
-				volume = opt.value();
+				CompileMidi(*soundSet, midiData.value(), *progress);
 			}
-		}
 
-		Program soundProgram;
-		soundProgram.loadProgram(LoadSfz(sourcePath), volume);
+			m_pendingSoundSet.store(std::move(soundSet));
+		});
+}
 
-		const auto typeStr = instrument[U"type"].getString();
-		const auto type = ParseInstrumentType(typeStr);
+bool SamplePlayer::isLoadingSoundSet() const
+{
+	return m_loadingTask.valid();
+}
 
-		if (type == InstrumentType::Melody)
-		{
-			const auto soundSetIndex = static_cast<uint8>(m_soundSet.size());
-			const auto programStr = instrument[U"program"].getString();
-			const auto programNumberList = ParseProgramNumber(programStr);
-			for (auto num : programNumberList)
-			{
-				const auto programIndex = static_cast<int32>(num) - 1;
-				m_programChangeNumberToSoundSetIndex[programIndex] = soundSetIndex;
-			}
+void SamplePlayer::updateSoundSetLoading()
+{
+	if (!m_loadingTask.valid())
+	{
+		return;
+	}
 
-			m_soundSet.push_back(soundProgram);
-		}
-		else if (type == InstrumentType::Rhythm)
-		{
-			m_drumKit.push_back(soundProgram);
-		}
-		else
+	if (m_loadingTask.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+	{
+		if (100 <= m_loadingTimer.ms())
 		{
-			Print << U"\"{}\" 不明なインストゥルメントタイプです。サウンドセットの読み込みに失敗しました: "_fmt(typeStr) << soundSetTomlPath;
-			continue;
+			Window::SetTitle(Format(U"音源読み込み中：", Math::Round(m_loadProgress->value() * 100), U" %"));
+			m_loadingTimer.restart();
 		}
+		return;
+	}
+
+	finishSoundSetLoading();
+}
+
+bool SamplePlayer::applyPendingSoundSet()
+{
+	// MIDIを登録し直している間も、描画スレッドをロックで待たせない
+	if (!m_pendingSoundSet.load())
+	{
+		return false;
+	}
+
+	std::lock_guard lock(m_swapMutex);
+
+	auto pending = m_pendingSoundSet.exchange(nullptr);
+	if (!pending)
+	{
+		return false;
+	}
+
+	// 古いサウンドセットは、最後に参照しているスレッドが手放したときに解放される
+	m_soundSet.store(std::move(pending));
+	return true;
+}
+
+void SamplePlayer::waitSoundSetLoading()
+{
+	if (m_loadingTask.valid())
+	{
+		TaskPool::i().wait(m_loadingTask);
+		finishSoundSetLoading();
+	}
+}
+
+void SamplePlayer::finishSoundSetLoading()
+{
+	Window::SetTitle(m_titleBeforeLoading);
+
+	auto task = std::move(m_loadingTask);
+	task.get();
+
+	for (const auto& error : m_loadProgress->errors)
+	{
+		Print << error;
 	}
+	m_loadProgress.reset();
 }
 
+
 int SamplePlayer::octaveCount() const
 {
 	return m_octaveMax - m_octaveMin + 1;
@@ -424,97 +1337,483 @@ void SamplePlayer::drawHorizontal(const PianoRoll& pianoroll, const Optional<Mid
 	}
 }
 
-Array<std::pair<uint8, NoteEvent>> SamplePlayer::loadMidiData(const MidiData& midiData)
+size_t SamplePlayer::loadMidiData(const MidiData& midiData)
+{
+	cancelMidiStream();
+
+	// 読み込み中のサウンドセットは前のMIDIで組み立てているので、差し替えてから登録し直す
+	waitSoundSetLoading();
+	applyPendingSoundSet();
+
+	std::lock_guard lock(m_swapMutex);
+
+	auto soundSet = m_soundSet.load();
+	if (!soundSet)
+	{
+		return 0;
+	}
+
+	// 組み立てと登録はワーカーで行い、その間は進捗をタイトルに表示する
+	SoundSetLoadProgress progress;
+	size_t eventCount = 0;
+	auto task = TaskPool::i().submit([&] { eventCount = CompileMidi(*soundSet, midiData, progress); });
+	WaitWithProgress(task, [&] { return progress.value(); });
+
+	for (const auto& error : progress.errors)
+	{
+		Print << error;
+	}
+
+	return eventCount;
+}
+
+bool SamplePlayer::reloadMidiAsync(FilePathView midiPath, const MidiData& previous)
+{
+	// 読み込み中のサウンドセットは前のMIDIで組み立てているので、差し替えが終わってから比べる
+	if (isLoadingSoundSet() || isStreamingMidi() || isReloadingMidi())
+	{
+		return false;
+	}
+
+	applyPendingSoundSet();
+
+	auto reload = std::make_shared<MidiReload>();
+	m_midiReload = reload;
+
+	// 読み込みと組み立てはワーカーで行い、その間も再生と画面の更新を続ける
+	m_midiReloadTask = TaskPool::i().submit([this, reload, path = FilePath(midiPath), previous]
+		{
+			auto current = LoadMidi(path);
+			if (!current)
+			{
+				return;
+			}
+
+			reload->changedFrom = updateMidiData(previous, current.value(), reload->progress);
+			reload->midiData = std::move(current);
+		});
+
+	return true;
+}
+
+bool SamplePlayer::takeMidiReload(Optional<MidiData>& midiData, Optional<int64>& changedFrom)
+{
+	if (!m_midiReloadTask.valid() || m_midiReloadTask.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+	{
+		return false;
+	}
+
+	auto task = std::move(m_midiReloadTask);
+	task.get();
+
+	const auto reload = std::move(m_midiReload);
+	for (const auto& error : reload->progress.errors)
+	{
+		Print << error;
+	}
+
+	if (!reload->midiData)
+	{
+		return false;
+	}
+
+	midiData = std::move(reload->midiData);
+	changedFrom = reload->changedFrom;
+	return true;
+}
+
+void SamplePlayer::waitMidiReload()
+{
+	if (m_midiReloadTask.valid())
+	{
+		m_midiReloadTask.wait();
+	}
+}
+
+Optional<int64> SamplePlayer::updateMidiData(const MidiData& previous, const MidiData& current, SoundSetLoadProgress& progress)
 {
-	for (auto& program: m_soundSet)
+	// 組み立てている間もサウンドセットの差し替えを待たせないように、m_swapMutex は最後の差し替えのときだけ取る
+	auto soundSet = m_soundSet.load();
+	if (!soundSet)
+	{
+		return none;
+	}
+
+	ProgramTimeline previousTimeline;
+	previousTimeline.append(previous.notes(), 0, UINT32_MAX);
+	AutomationSet previousAutomation;
+	previousAutomation.append(previous.notes(), 0, UINT32_MAX, previous.tempoMap());
+
+	ProgramTimeline timeline;
+	timeline.append(current.notes(), 0, UINT32_MAX);
+	AutomationSet automation;
+	automation.append(current.notes(), 0, UINT32_MAX, current.tempoMap());
+
+	// 新しく鳴らす音源は先に組み立てておく
+	LoadUsedPrograms(*soundSet, timeline.usage(current.notes()), progress);
+
+	// コントローラーが変わったところからは、イベントが同じでも鳴り方が変わる
+	Optional<int64> changedFrom = FirstDifference(PlaceChannelEvents(previous), PlaceChannelEvents(current));
+
+	// ペダルで延びた離鍵位置まで同じノートが並んでいる音源は、同じイベントが組み立てられるのでそのまま使う
+	const auto previousNotes = RouteNotes(*soundSet, previous.notes(), previousTimeline);
+	const auto currentNotes = RouteNotes(*soundSet, current.notes(), timeline);
+
+	Array<size_t> changedSlots;
+	for (size_t slot = 0; slot < currentNotes.size(); ++slot)
 	{
-		program.clearEvent();
+		if (const auto difference = FirstDifference(PlaceNotes(previousNotes[slot], previousAutomation), PlaceNotes(currentNotes[slot], automation)))
+		{
+			changedSlots.push_back(slot);
+			changedFrom = Min(changedFrom.value_or(INT64_MAX), difference.value());
+		}
 	}
 
-	for (auto& program : m_drumKit)
+	// 変わった音源は描画中のものを残したまま、変わった音源だけを持つ別のサウンドセットに登録し直し、最後に差し替える
+	// キースイッチやチョークグループはキーをまたいで効くので、キー単位ではなく音源単位で登録し直す
+	// MIDIを読み込むときと同じく区間ごとに登録しながら退避するので、イベントのメモリの上限を超えない
+	// 音源を差し替えるのはこのスレッドだけなので、ロックせずに参照する
+	SoundSet rebuilt;
+	rebuilt.melodies.resize(soundSet->melodies.size());
+	rebuilt.drumKit.resize(soundSet->drumKit.size());
+	rebuilt.programChangeNumberToIndex = soundSet->programChangeNumberToIndex;
+
+	for (const auto slot : changedSlots)
 	{
-		program.clearEvent();
+		if (const auto& source = ProgramAt(*soundSet, slot); source.isLoaded())
+		{
+			ProgramAt(rebuilt, slot).loadProgram(source.instrument());
+		}
 	}
 
-	for (const auto& track : midiData.notes())
+	CompileMidiWindows(rebuilt, current);
+
 	{
-		if (auto programPtr = refProgram(track))
+		std::lock_guard lock(m_swapMutex);
+
+		// 組み立てている間にサウンドセットが差し替えられた場合は、新しいサウンドセットの読み込みで登録し直される
+		if (m_soundSet.load() != soundSet)
+		{
+			return none;
+		}
+
+		std::lock_guard eventLock(soundSet->eventMutex);
+
+		for (const auto slot : changedSlots)
 		{
-			programPtr->addKeyDownEvents(midiData, track);
+			if (auto& program = ProgramAt(rebuilt, slot); program.isLoaded())
+			{
+				ProgramAt(*soundSet, slot) = std::move(program);
+			}
 		}
+
+		soundSet->programTimeline = std::move(timeline);
+		soundSet->automation = std::move(automation);
+		updateTimeMapWarped(soundSet->automation);
+	}
+
+	SpillEvents(*soundSet);
+
+#ifdef DEVELOPMENT
+	Console << U"MIDIの変更を反映しました: {} / {} の音源を登録し直しました"_fmt(changedSlots.size(), currentNotes.size());
+#endif
+
+	if (changedFrom)
+	{
+		changedFrom = toPlaybackPos(changedFrom.value());
+	}
+
+	return changedFrom;
+}
+
+bool SamplePlayer::loadMidiStream(FilePathView midiPath)
+{
+	cancelMidiStream();
+
+	// 前のMIDIの読み込み直しは、終わるのを待って捨てる
+	waitMidiReload();
+	m_midiReloadTask = {};
+	m_midiReload.reset();
+
+	// 読み込み中のサウンドセットは前のMIDIで組み立てているので、差し替えてから登録する
+	waitSoundSetLoading();
+	applyPendingSoundSet();
+
+	auto stream = std::make_shared<MidiStreamLoad>();
+	if (!stream->reader.open(midiPath))
+	{
+		return false;
+	}
+
+	auto soundSet = m_soundSet.load();
+	if (soundSet)
+	{
+		std::lock_guard lock(soundSet->eventMutex);
+		ClearMidi(*soundSet);
 	}
 
-	for (auto& program : m_soundSet)
+	m_renderableUntil = 0;
+	m_midiStream = stream;
+	restartPlaybackTime();
+
+	// 再生位置より先の区間を順に読み込み、登録が済んだところまで描画できるようにする
+	// 読み込み中はサウンドセットを差し替えないので、最初のサウンドセットに登録し続ける
+	m_streamTask = TaskPool::i().submit([this, stream, soundSet, path = FilePath(midiPath)]
+		{
+			auto& reader = stream->reader;
+
+			// 同じMIDIを同じサウンドセットで組み立てたことがあれば、イベントはキャッシュをマップして使う
+			Optional<SongCache::MidiKey> midiKey;
+			bool isCached = false;
+			if (soundSet && SongCache::i().isEnabled())
+			{
+				midiKey = SongCache::HashMidiFile(path);
+			}
+
+			if (midiKey)
+			{
+				if (auto timeline = SongCache::i().load(midiKey.value(), soundSet->fingerprint))
+				{
+					SoundSetLoadProgress progress;
+					isCached = ApplySongCache(*soundSet, timeline.value(), progress);
+				}
+			}
+
+			while (!stream->isCanceled && !reader.isFinished())
+			{
+				auto tracks = reader.readUntil(reader.tickAfter(MidiStreamWindowSeconds));
+				if (!tracks)
+				{
+					stream->isFailed = true;
+					break;
+				}
+
+				if (soundSet)
+				{
+					std::lock_guard lock(soundSet->eventMutex);
+					AppendChannelState(*soundSet, tracks.value(), 0, reader.isFinished() ? UINT32_MAX : reader.emittedTick(), reader.tempoMap());
+
+					// 読み込みが追いつく前に速度を変えていた場合は、揃ったピッチベンドで数え直す
+					updateTimeMapWarped(soundSet->automation);
+				}
+
+				// キャッシュから読んだ場合は、コントローラーとプログラムチェンジだけを追加する
+				if (soundSet && !isCached)
+				{
+					// この区間で鳴る音源を組み立てる（タイムラインを書き換えるのはこのスレッドだけなので、ロックせずに参照する）
+					SoundSetLoadProgress progress;
+					LoadUsedPrograms(*soundSet, soundSet->programTimeline.usage(tracks.value()), progress);
+
+					// 組み立てはロックの外で行い、できたイベントを差し込むときだけ描画スレッドを待たせる
+					CompileMidiWindow(*soundSet, tracks.value());
+					{
+						std::lock_guard lock(soundSet->eventMutex);
+						PublishEvents(*soundSet);
+					}
+					SpillEvents(*soundSet);
+				}
+
+				if (!reader.isFinished())
+				{
+					m_renderableUntil = static_cast<int64>(reader.tempoMap().ticksToSeconds(reader.emittedTick()) * Wave::DefaultSampleRate);
+				}
+
+				std::lock_guard lock(stream->chunkMutex);
+				stream->chunks.push_back(std::move(tracks.value()));
+			}
+
+			// 中断した場合も、登録済みの区間より先は無音のまま描画を進める
+			m_renderableUntil = INT64_MAX;
+
+			if (midiKey && !isCached && !stream->isCanceled && !stream->isFailed)
+			{
+				SaveSongCache(*soundSet, midiKey.value());
+			}
+		});
+
+	return true;
+}
+
+bool SamplePlayer::isStreamingMidi() const
+{
+	return m_streamTask.valid() && m_streamTask.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+bool SamplePlayer::takeMidiChunks(Optional<MidiData>& midiData)
+{
+	if (!m_midiStream)
 	{
-		program.sortKeyDownEvents();
+		return false;
 	}
 
-	for (auto& program : m_drumKit)
+	// 終わったかどうかを先に調べておき、最後の区間を受け取ってから後始末する
+	const bool isDone = !isStreamingMidi();
+
+	Array<Array<TrackData>> chunks;
 	{
-		program.sortKeyDownEvents();
+		std::lock_guard lock(m_midiStream->chunkMutex);
+		chunks.swap(m_midiStream->chunks);
 	}
 
-	Array<std::pair<uint8, NoteEvent>> results;
+	for (auto& chunk : chunks)
+	{
+		if (!midiData)
+		{
+			midiData.emplace(m_midiStream->reader.resolution());
+		}
+
+		midiData->append(std::move(chunk));
+	}
 
-	for (const auto& track : midiData.notes())
+	if (isDone)
 	{
-		if (auto programPtr = refProgram(track))
+		m_streamTask.get();
+
+		if (m_midiStream->isFailed)
 		{
-			const auto eventsData = programPtr->addEvents(midiData, track);
-			results.append(eventsData);
+			Print << U"MIDIファイルの読み込みに失敗しました";
 		}
+
+		m_midiStream.reset();
 	}
 
-	for (auto& program : m_soundSet)
+	return !chunks.isEmpty();
+}
+
+void SamplePlayer::cancelMidiStream()
+{
+	if (!m_midiStream)
 	{
-		program.sortEvent();
-		program.deleteDuplicate();
-		program.calculateOffTime();
+		return;
 	}
 
-	for (auto& program : m_drumKit)
+	m_midiStream->isCanceled = true;
+	m_streamTask.get();
+	m_midiStream.reset();
+	m_renderableUntil = INT64_MAX;
+}
+
+void SamplePlayer::waitMidiStream()
+{
+	if (m_streamTask.valid())
 	{
-		program.sortEvent();
-		program.deleteDuplicate();
-		program.calculateOffTime();
+		m_streamTask.wait();
 	}
+}
 
-	return results;
+int64 SamplePlayer::renderableUntil() const
+{
+	const int64 songPos = m_renderableUntil;
+	return songPos == INT64_MAX ? INT64_MAX : toPlaybackPos(songPos);
 }
 
-void SamplePlayer::getSamples(float* left, float* right, int64 startPos, int64 sampleCount)
+void SamplePlayer::setPlaybackRate(double rate)
 {
-	for (int i = 0; i < sampleCount; ++i)
+	m_playbackRate = rate;
+}
+
+bool SamplePlayer::applyPendingPlaybackRate(int64 fromPos)
+{
+	if (timeMap()->rate() == m_playbackRate)
 	{
-		left[i] = right[i] = 0;
+		return false;
 	}
 
-	for (auto& program : m_soundSet)
+	// 区間の先頭の経過サンプル数をコントローラーから求めるので、イベントのロックを先に取る（updateTimeMapWarped() と同じ順）
+	static const AutomationSet emptyAutomation;
+	const auto soundSet = m_soundSet.load();
+	std::unique_lock<std::mutex> eventLock;
+	if (soundSet)
 	{
-		program.getSamples(left, right, startPos, sampleCount);
+		eventLock = std::unique_lock(soundSet->eventMutex);
 	}
 
-	for (auto& program : m_drumKit)
+	std::lock_guard lock(m_timeMapMutex);
+
+	const auto current = timeMap();
+	if (current->rate() == m_playbackRate)
 	{
-		program.getSamples(left, right, startPos, sampleCount);
+		return false;
 	}
+
+	// イベントは曲の位置のまま持つので、区間を1つ足すだけで済む（描画済みのブロックとつながるようにブロックの境目から変える）
+	const int64 changePos = (fromPos / MemoryPool::UnitBlockSampleLength + 1) * MemoryPool::UnitBlockSampleLength;
+
+	auto next = std::make_shared<PlaybackTimeMap>(*current);
+	next->setRate(changePos, m_playbackRate, soundSet ? soundSet->automation : emptyAutomation);
+	m_timeMap.store(std::move(next));
+
+	return true;
 }
 
-Program* SamplePlayer::refProgram(const TrackData& trackData)
+void SamplePlayer::updateTimeMapWarped(const AutomationSet& automation)
 {
-	if (trackData.isPercussionTrack())
+	std::lock_guard lock(m_timeMapMutex);
+
+	const auto current = timeMap();
+	if (current->size() <= 1)
 	{
-		if (!m_drumKit.empty())
-		{
-			return &m_drumKit[0];
-		}
+		return;
+	}
+
+	auto next = std::make_shared<PlaybackTimeMap>(*current);
+	next->updateWarped(automation);
+	m_timeMap.store(std::move(next));
+}
+
+void SamplePlayer::restartPlaybackTime()
+{
+	std::lock_guard lock(m_timeMapMutex);
+
+	m_timeMap.store(std::make_shared<const PlaybackTimeMap>(m_playbackRate));
+}
+
+double SamplePlayer::toSongSeconds(double playbackSeconds) const
+{
+	const auto playPos = static_cast<int64>(playbackSeconds * Wave::DefaultSampleRate);
+	return static_cast<double>(timeMap()->toSong(playPos)) / Wave::DefaultSampleRate;
+}
+
+std::shared_ptr<const PlaybackTimeMap> SamplePlayer::timeMap() const
+{
+	if (auto result = m_timeMap.load())
+	{
+		return result;
+	}
+
+	static const auto identity = std::make_shared<const PlaybackTimeMap>();
+	return identity;
+}
+
+int64 SamplePlayer::toPlaybackPos(int64 songPos) const
+{
+	return timeMap()->toPlayback(songPos);
+}
+
+void SamplePlayer::getSamples(float* left, float* right, int64 startPos, int64 sampleCount)
+{
+	for (int i = 0; i < sampleCount; ++i)
+	{
+		left[i] = right[i] = 0;
 	}
-	else
+
+	// このブロックを書き終えるまでは差し替えられても古いサウンドセットを使う
+	const auto soundSet = m_soundSet.load();
+	if (!soundSet)
 	{
-		const auto programNumer = trackData.program();
-		const auto soundSetIndex = m_programChangeNumberToSoundSetIndex[programNumer];
-		return &m_soundSet[soundSetIndex];
+		return;
 	}
 
-	return nullptr;
+	std::lock_guard lock(soundSet->eventMutex);
+
+	// ブロックの途中で速度が変わらないように、描画を始めたときの対応を使う
+	const auto currentTimeMap = timeMap();
+
+	auto& automation = soundSet->blockAutomation;
+	soundSet->automation.prepareBlock(startPos, sampleCount, *currentTimeMap, automation);
+
+	soundSet->forEachProgram([&](Program& program)
+		{
+			program.getSamples(left, right, startPos, sampleCount, automation);
+		});
 }
@@ -5,6 +5,7 @@
 #include <SamplePlayer.hpp>
 #include <AudioStreamRenderer.hpp>
 #include <Program.hpp>
+#include <Automation.hpp>
 
 double Envelope::level(double noteOnTime, double noteOffTime, double time) const
 {
@@ -48,19 +49,58 @@ double Envelope::level(double noteOnTime, double noteOffTime, double time) const
 	return m_sustainLevel;
 }
 
-AudioSource::AudioSource(float amplitude, const Envelope& envelope, uint8 lovel, uint8 hivel, int32 tune) :
+uint32 KeySwitchState::addRange(int8 lokey, int8 hikey, Optional<int8> defaultKey)
+{
+	const int8 defaultValue = defaultKey.value_or(-1);
+
+	for (auto [i, range] : Indexed(m_ranges))
+	{
+		if (range.lokey == lokey && range.hikey == hikey && range.defaultKey == defaultValue)
+		{
+			return static_cast<uint32>(i);
+		}
+	}
+
+	m_ranges.push_back(Range{ lokey, hikey, defaultValue });
+	m_current.push_back(defaultValue);
+	return static_cast<uint32>(m_ranges.size() - 1);
+}
+
+void KeySwitchState::clear()
+{
+	m_ranges.clear();
+	m_current.clear();
+}
+
+void KeySwitchState::reset()
+{
+	for (auto [i, range] : Indexed(m_ranges))
+	{
+		m_current[i] = range.defaultKey;
+	}
+}
+
+void KeySwitchState::press(int8 key)
+{
+	for (auto [i, range] : Indexed(m_ranges))
+	{
+		if (range.lokey <= key && key <= range.hikey)
+		{
+			m_current[i] = key;
+		}
+	}
+}
+
+AudioSource::AudioSource(float amplitude, const Envelope& envelope, uint8 lovel, uint8 hivel) :
 	m_amplitude(amplitude),
 	m_lovel(lovel),
 	m_hivel(hivel),
-	m_tune(tune),
-	m_speed(static_cast<float>(std::exp2(m_tune / 1200.0))),
 	m_envelope(envelope)
 {}
 
-void AudioSource::setOscillator(OscillatorType oscillatorType, float frequency)
+void AudioSource::setOscillator(OscillatorType oscillatorType)
 {
 	m_oscillatorType = oscillatorType;
-	m_frequency = frequency;
 }
 
 void AudioSource::setSwitch(int8 swLokey, int8 swHikey, int8 swLast, int8 swDefault)
@@ -86,34 +126,28 @@ void AudioSource::setLoopMode(LoopMode loopMode)
 	}
 }
 
-bool AudioSource::isValidSwLast(int64 pressTimePos, const Array<KeyDownEvent>& history) const
+Optional<uint32> AudioSource::registerSwitch(KeySwitchState& state)
 {
 	// 未設定の場合
 	if (!m_swLast || !m_swLokey || !m_swHikey)
 	{
-		return true;
+		m_swRange = none;
+		return none;
 	}
 
-	for (int64 i = static_cast<int64>(history.size()) - 1; 0 <= i; --i)
-	{
-		if (pressTimePos <= history[i].pressTimePos)
-		{
-			continue;
-		}
-
-		const auto key = history[i].key;
-		if (m_swLokey.value() <= key && key <= m_swHikey.value())
-		{
-			return m_swLast == key;
-		}
-	}
+	m_swRange = state.addRange(m_swLokey.value(), m_swHikey.value(), m_swDefault);
+	return m_swRange;
+}
 
-	if (m_swDefault)
+bool AudioSource::isValidSwitch(const KeySwitchState& state) const
+{
+	if (!m_swRange)
 	{
-		return m_swLast.value() == m_swDefault.value();
+		return true;
 	}
 
-	return false;
+	// 直前に押された範囲内のキー（なければsw_default）がsw_lastと一致すれば有効
+	return state.current(m_swRange.value()) == m_swLast.value();
 }
 
 void AudioSource::setRtDecay(float rtDecay)
@@ -133,7 +167,7 @@ size_t AudioSource::sampleRate() const
 	}
 }
 
-size_t AudioSource::lengthSample() const
+size_t AudioSource::lengthSample(const KeyRegion& keyRegion) const
 {
 	if (isOscillator())
 	{
@@ -142,7 +176,7 @@ size_t AudioSource::lengthSample() const
 
 	const auto& sourceWave = getReader();
 
-	const float scale = 1.0f / m_speed;
+	const float scale = 1.0f / keyRegion.speed;
 	const auto sampleCount = static_cast<size_t>(Math::Ceil(sourceWave.lengthSample() * scale));
 
 	return sampleCount;
@@ -191,87 +225,118 @@ inline float PowerOf10(float x)
 	return std::bit_cast<float>(static_cast<int32>(x * 27866352.6f + 1064866808.0f));
 }
 
-float AudioSource::getSpeed() const
+WaveSample AudioSource::getOscillatorSample(double index, const KeyRegion& keyRegion) const
 {
-	return m_speed;
-}
+	const double t = index / Wave::DefaultSampleRate;
+	const double x = t * keyRegion.frequency * 2_pi;
 
-WaveSample AudioSource::getSample(int64 index) const
-{
-	if (isOscillator())
+	switch (m_oscillatorType.value())
 	{
-		const double t = 1.0 * index / Wave::DefaultSampleRate;
-		const double x = t * m_frequency * 2_pi;
-
-		switch (m_oscillatorType.value())
-		{
-		case OscillatorType::Sine:
-		{
-			const float osc = static_cast<float>(sin(x) * m_amplitude);
-			return WaveSample(osc, osc);
-		}
-		case OscillatorType::Tri:
-		{
-			const float osc = static_cast<float>(TriangleWave(x, 20) * m_amplitude);
-			return WaveSample(osc, osc);
-		}
-		case OscillatorType::Saw:
-		{
-			const float osc = static_cast<float>(SawtoothWave(x, 20) * m_amplitude);
-			return WaveSample(osc, osc);
-		}
-		case OscillatorType::Square:
-		{
-			const float osc = static_cast<float>(SquareWave(x, 20) * m_amplitude);
-			return WaveSample(osc, osc);
-		}
-		case OscillatorType::Noise:
-		{
-			const float osc = Random(-1.f, 1.f) * m_amplitude;
-			return WaveSample(osc, osc);
-		}
-		default:
-			return WaveSample(0, 0);
-		}
+	case OscillatorType::Sine:
+	{
+		const float osc = static_cast<float>(sin(x) * m_amplitude);
+		return WaveSample(osc, osc);
 	}
+	case OscillatorType::Tri:
+	{
+		const float osc = static_cast<float>(TriangleWave(x, 20) * m_amplitude);
+		return WaveSample(osc, osc);
+	}
+	case OscillatorType::Saw:
+	{
+		const float osc = static_cast<float>(SawtoothWave(x, 20) * m_amplitude);
+		return WaveSample(osc, osc);
+	}
+	case OscillatorType::Square:
+	{
+		const float osc = static_cast<float>(SquareWave(x, 20) * m_amplitude);
+		return WaveSample(osc, osc);
+	}
+	case OscillatorType::Noise:
+	{
+		const float osc = Random(-1.f, 1.f) * m_amplitude;
+		return WaveSample(osc, osc);
+	}
+	default:
+		return WaveSample(0, 0);
+	}
+}
 
-	const auto& sourceWave = getReader();
-
+float AudioSource::decayedAmplitude(double index) const
+{
 	float amplitude = m_amplitude;
 	if (m_rtDecay)
 	{
-		const float seconds = static_cast<float>(index) * sourceWave.sampleRateInv();
+		const float seconds = static_cast<float>(index) * getReader().sampleRateInv();
 		const float currentVolume = -seconds * m_rtDecay.value();
 		const float scale = PowerOf10(currentVolume * 0.05f) * 0.5f;
 		amplitude *= scale;
 	}
 
-	if (m_tune == 0)
+	return amplitude;
+}
+
+WaveSample AudioSource::getSample(int64 index, const KeyRegion& keyRegion) const
+{
+	if (isOscillator())
+	{
+		return getOscillatorSample(static_cast<double>(index), keyRegion);
+	}
+
+	const auto& sourceWave = getReader();
+
+	const float amplitude = decayedAmplitude(static_cast<double>(index));
+
+	if (keyRegion.speed == 1.0f)
 	{
 		return sourceWave.getSample(index) * amplitude;
 	}
 
-	const float readIndex = index * m_speed;
+	const float readIndex = index * keyRegion.speed;
 	const auto prevIndex = static_cast<int64>(Floor(readIndex));
-	const auto nextIndex = Min(prevIndex + 1, static_cast<int64>(sourceWave.size() - 1));
+	const auto nextIndex = Min(prevIndex + 1, static_cast<int64>(sourceWave.lengthSample()) - 1);
 	const float t = readIndex - prevIndex;
 
 	return sourceWave.getSample(prevIndex).lerp(sourceWave.getSample(nextIndex), t) * amplitude;
 }
 
-void AudioSource::use(size_t beginSampleIndex, size_t sampleCount)
+WaveSample AudioSource::getSample(double index, const KeyRegion& keyRegion) const
+{
+	if (isOscillator())
+	{
+		return getOscillatorSample(index, keyRegion);
+	}
+
+	const auto& sourceWave = getReader();
+
+	// ピッチベンドで速く読むと終わりを越えることがあるので、読み込んだ範囲の外は無音にする
+	const double readIndex = index * keyRegion.speed;
+	const auto prevIndex = static_cast<int64>(Floor(readIndex));
+	const auto length = static_cast<int64>(sourceWave.lengthSample());
+	if (prevIndex < 0 || length <= prevIndex)
+	{
+		return WaveSample(0, 0);
+	}
+
+	const auto nextIndex = Min(prevIndex + 1, length - 1);
+	const float t = static_cast<float>(readIndex - prevIndex);
+
+	return sourceWave.getSample(prevIndex).lerp(sourceWave.getSample(nextIndex), t) * decayedAmplitude(index);
+}
+
+void AudioSource::use(size_t beginSampleIndex, size_t sampleCount) const
 {
 	if (!isOscillator())
 	{
-		getReader().use(beginSampleIndex, sampleCount);
+		AudioLoadManager::i().reader(m_index).use(beginSampleIndex, sampleCount);
 	}
 }
 
-double AudioSource::noteDuration(const NoteEvent& noteEvent) const
+double AudioSource::noteDuration(const NoteEvent& noteEvent, const KeyRegion& keyRegion) const
 {
 	if (m_loopMode && m_loopMode.value() == LoopMode::OneShot)
 	{
-		return 1.0 * lengthSample() / Wave::DefaultSampleRate;
+		return 1.0 * lengthSample(keyRegion) / Wave::DefaultSampleRate;
 	}
 	else
 	{
@@ -284,52 +349,168 @@ const AudioLoaderBase& AudioSource::getReader() const
 	return AudioLoadManager::i().reader(m_index);
 }
 
-AudioLoaderBase& AudioSource::getReader()
+size_t Instrument::keyRegionCount() const
 {
-	return AudioLoadManager::i().reader(m_index);
+	size_t count = 0;
+	for (size_t key = 0; key < 128; ++key)
+	{
+		count += attackRegions[key].size() + releaseRegions[key].size();
+	}
+	return count;
 }
 
-void AudioKey::init(int8 key)
+size_t Instrument::memoryUsage() const
+{
+	size_t bytes = sizeof(Instrument) + regions.capacity() * sizeof(AudioSource);
+	for (size_t key = 0; key < 128; ++key)
+	{
+		bytes += (attackRegions[key].capacity() + releaseRegions[key].capacity()) * sizeof(KeyRegion);
+	}
+	return bytes;
+}
+
+void AudioKey::init(int8 key, const Instrument* instrument)
 {
 	noteKey = key;
-	attackKeys.clear();
-	releaseKeys.clear();
+	m_instrument = instrument;
+	m_switchRanges.clear();
+	m_attackTables.clear();
+	m_releaseTable.fill(-1);
 }
 
-void AudioKey::addAttackKey(const AudioSource& source)
+const Array<KeyRegion>& AudioKey::attackKeys() const
 {
-	attackKeys.push_back(source);
+	static const Array<KeyRegion> Empty;
+	return (m_instrument && 0 <= noteKey) ? m_instrument->attackRegions[noteKey] : Empty;
 }
 
-void AudioKey::addReleaseKey(const AudioSource& source)
+const Array<KeyRegion>& AudioKey::releaseKeys() const
 {
-	releaseKeys.push_back(source);
+	static const Array<KeyRegion> Empty;
+	return (m_instrument && 0 <= noteKey) ? m_instrument->releaseRegions[noteKey] : Empty;
 }
 
 bool AudioKey::hasAttackKey() const
 {
-	return !attackKeys.empty();
+	return !attackKeys().empty();
+}
+
+void AudioKey::compile()
+{
+	m_switchRanges.clear();
+	m_attackTables.clear();
+
+	for (const auto& keyRegion : attackKeys())
+	{
+		if (const auto& rangeIndex = source(keyRegion).switchRange())
+		{
+			if (!m_switchRanges.contains(rangeIndex.value()))
+			{
+				m_switchRanges.push_back(rangeIndex.value());
+			}
+		}
+	}
+
+	// 先に定義されたリージョンが優先されるので後ろから埋める
+	const auto& releases = releaseKeys();
+	m_releaseTable.fill(-1);
+	for (int64 i = static_cast<int64>(releases.size()) - 1; 0 <= i; --i)
+	{
+		for (uint32 velocity = 0; velocity < 128; ++velocity)
+		{
+			if (source(releases[i]).isValidVelocity(static_cast<uint8>(velocity)))
+			{
+				m_releaseTable[velocity] = static_cast<int32>(i);
+			}
+		}
+	}
 }
 
-const NoteEvent& AudioKey::addEvent(uint8 velocity, int64 pressTimePos, int64 releaseTimePos, const Array<KeyDownEvent>& history)
+NoteEvent AudioKey::makeEvent(int64 attackIndex, uint8 velocity, int64 pressTimePos, int64 releaseTimePos, uint8 channel) const
 {
-	const auto attackIndex = getAttackIndex(velocity, pressTimePos, history);
+	// NoteEvent はリージョンの番号を16bitで持つ
+	assert(attackIndex < INT16_MAX);
+
 	const auto releaseIndex = getReleaseIndex(velocity);
-	NoteEvent note(attackIndex, releaseIndex, pressTimePos, releaseTimePos, velocity);
-	m_noteEvents.push_back(note);
-	return m_noteEvents.back();
+	return NoteEvent(attackIndex, releaseIndex, pressTimePos, releaseTimePos, velocity, channel);
+}
+
+void AudioKey::appendEvents(const Array<NoteEvent>& events)
+{
+	for (const auto& noteEvent : events)
+	{
+		m_noteEvents.push_back(noteEvent);
+	}
+
+	commitEvents();
 }
 
 void AudioKey::clearEvent()
 {
 	m_noteEvents.clear();
+	m_committedCount = 0;
 }
 
-int64 AudioKey::getAttackIndex(uint8 velocity, int64 pressTimePos, const Array<KeyDownEvent>& history) const
+int64 AudioKey::getAttackIndex(uint8 velocity, const KeySwitchState& state) const
 {
-	for (auto [i, key] : Indexed(attackKeys))
+	if (127 < velocity)
 	{
-		if (key.isValidVelocity(velocity) && key.isValidSwLast(pressTimePos, history))
+		return -1;
+	}
+
+	if (MaxTableSwitchRanges < m_switchRanges.size())
+	{
+		return findAttackIndex(velocity, state);
+	}
+
+	// このキーが参照するキースイッチの状態だけをキーにする
+	uint64 stateKey = 0;
+	for (const auto rangeIndex : m_switchRanges)
+	{
+		stateKey = (stateKey << 8) | static_cast<uint8>(state.current(rangeIndex));
+	}
+
+	auto it = m_attackTables.find(stateKey);
+	if (it == m_attackTables.end())
+	{
+		it = m_attackTables.emplace(stateKey, makeAttackTable(state)).first;
+	}
+
+	return it->second[velocity];
+}
+
+AudioKey::VelocityTable AudioKey::makeAttackTable(const KeySwitchState& state) const
+{
+	VelocityTable table;
+	table.fill(-1);
+
+	const auto& attacks = attackKeys();
+	for (int64 i = static_cast<int64>(attacks.size()) - 1; 0 <= i; --i)
+	{
+		const auto& attackSource = source(attacks[i]);
+		if (!attackSource.isValidSwitch(state))
+		{
+			continue;
+		}
+
+		for (uint32 velocity = 0; velocity < 128; ++velocity)
+		{
+			if (attackSource.isValidVelocity(static_cast<uint8>(velocity)))
+			{
+				table[velocity] = static_cast<int32>(i);
+			}
+		}
+	}
+
+	return table;
+}
+
+int64 AudioKey::findAttackIndex(uint8 velocity, const KeySwitchState& state) const
+{
+	for (auto [i, keyRegion] : Indexed(attackKeys()))
+	{
+		const auto& key = source(keyRegion);
+		if (key.isValidVelocity(velocity) && key.isValidSwitch(state))
 		{
 			return static_cast<int64>(i);
 		}
@@ -340,81 +521,131 @@ int64 AudioKey::getAttackIndex(uint8 velocity, int64 pressTimePos, const Array<K
 
 const AudioSource& AudioKey::getAttackKey(int64 attackIndex) const
 {
-	return attackKeys[attackIndex];
+	return source(attackKeys()[attackIndex]);
+}
+
+const KeyRegion& AudioKey::getAttackRegion(int64 attackIndex) const
+{
+	return attackKeys()[attackIndex];
 }
 
 int64 AudioKey::getReleaseIndex(uint8 velocity) const
 {
-	for (auto [i, key] : Indexed(releaseKeys))
+	if (127 < velocity)
 	{
-		if (key.isValidVelocity(velocity))
-		{
-			return static_cast<int64>(i);
-		}
+		return -1;
 	}
 
-	return -1;
+	return m_releaseTable[velocity];
 }
 
 void AudioKey::debugPrint() const
 {
 	Console << U"-----------------------------";
 	Console << U"key: " << noteKey;
-	Console << U"attack keys: " << attackKeys.size();
-	for (const auto& [i, source] : Indexed(attackKeys))
+	Console << U"attack keys: " << attackKeys().size();
+	for ([[maybe_unused]] const auto& [i, source] : Indexed(attackKeys()))
 	{
 		//Console << U"  " << i << U"->[" << source.lovel << U", " << source.hivel << U"]: " << source.filePath << U" " << source.semitone;
 	}
-	Console << U"release keys: " << releaseKeys.size();
-	for (const auto& [i, source] : Indexed(releaseKeys))
+	Console << U"release keys: " << releaseKeys().size();
+	for ([[maybe_unused]] const auto& [i, source] : Indexed(releaseKeys()))
 	{
 		//Console << U"  " << i << U"->[" << source.lovel << U", " << source.hivel << U"]: " << source.filePath << U" " << source.semitone;
 	}
 }
 
-void AudioKey::sortEvent()
-{
-	m_noteEvents.sort_by([](const NoteEvent& a, const NoteEvent& b) { return a.pressTimePos < b.pressTimePos; });
-}
-
-void AudioKey::deleteDuplicate()
+void AudioKey::deleteDuplicate(Array<NoteEvent>& events) const
 {
 	// 直前のノートオンからサンプル数がdeleteRange以内で始まるノートを削除する
 	const int64 deleteRange = 50;
-	int64 prevPos = -deleteRange;
-	for (int64 i = 0; i < static_cast<int64>(m_noteEvents.size());)
+	int64 prevPos = m_noteEvents.empty() ? -deleteRange : m_noteEvents.back().pressTimePos;
+	size_t writeIndex = 0;
+	for (size_t i = 0; i < events.size(); ++i)
 	{
-		const int64 currentPos = m_noteEvents[i].pressTimePos;
+		const int64 currentPos = events[i].pressTimePos;
 		if (currentPos - prevPos < deleteRange)
 		{
-			m_noteEvents.erase(m_noteEvents.begin() + i);
+			continue;
 		}
-		else
+
+		prevPos = currentPos;
+		if (writeIndex != i)
 		{
-			prevPos = currentPos;
-			++i;
+			events[writeIndex] = events[i];
 		}
+		++writeIndex;
 	}
+
+	events.erase(events.begin() + writeIndex, events.end());
 }
 
-void AudioKey::getSamples(float* left, float* right, int64 startPos, int64 sampleCount)
+NoteEvent AudioKey::event(int64 noteIndex) const
 {
+	auto result = m_noteEvents[noteIndex];
+	if (!m_timeMap)
 	{
-		NoteEvent note0(0, 0, 0, 0, 0);
-		note0.pressTimePos = startPos;
-		auto itNextStart = std::upper_bound(m_noteEvents.begin(), m_noteEvents.end(), note0, [](const NoteEvent& a, const NoteEvent& b) { return a.pressTimePos < b.pressTimePos; });
-		const int64 nextStartIndex = std::distance(m_noteEvents.begin(), itNextStart);
-		int64 startIndex = nextStartIndex - 1;
+		return result;
+	}
+
+	// 離鍵待ちなどの印はそのまま残す
+	const auto toPlayback = [&](uint32 timePos)
+	{
+		return static_cast<uint32>(Clamp(m_timeMap->toPlayback(timePos), 0ll, static_cast<int64>(NoteEvent::SustainedRelease) - 1));
+	};
+
+	result.pressTimePos = toPlayback(result.pressTimePos);
+
+	if (result.releaseTimePos != NoteEvent::SustainedRelease)
+	{
+		result.releaseTimePos = toPlayback(result.releaseTimePos);
+	}
+
+	if (result.isDisabled())
+	{
+		result.disableTimePos = toPlayback(result.disableTimePos);
+	}
+
+	return result;
+}
+
+size_t AudioKey::upperBound(int64 timePos) const
+{
+	if (!m_timeMap)
+	{
+		return m_noteEvents.upperBound(timePos);
+	}
+
+	// 曲の位置で探してから、丸めでずれた分を再生位置で合わせる
+	size_t index = m_noteEvents.upperBound(m_timeMap->toSong(timePos));
+
+	while (0 < index && timePos < event(index - 1).pressTimePos)
+	{
+		--index;
+	}
 
+	while (index < m_noteEvents.size() && event(index).pressTimePos <= timePos)
+	{
+		++index;
+	}
+
+	return index;
+}
+
+void AudioKey::getSamples(float* left, float* right, int64 startPos, int64 sampleCount, const BlockAutomation& automation)
+{
+	m_timeMap = (automation.timeMap && !automation.timeMap->isIdentity()) ? automation.timeMap : nullptr;
+
+	{
 		if (m_noteEvents.empty())
 		{
 			return;
 		}
 
-		NoteEvent note1(0, 0, 0, 0, 0);
-		note1.pressTimePos = startPos + sampleCount;
-		auto itNextEnd = std::upper_bound(m_noteEvents.begin(), m_noteEvents.end(), note1, [](const NoteEvent& a, const NoteEvent& b) { return a.pressTimePos < b.pressTimePos; });
-		const int64 nextEndIndex = std::distance(m_noteEvents.begin(), itNextEnd);
+		const int64 nextStartIndex = upperBound(startPos);
+		int64 startIndex = nextStartIndex - 1;
+
+		const int64 nextEndIndex = upperBound(startPos + sampleCount);
 
 		if (startIndex < 0)
 		{
@@ -423,32 +654,21 @@ void AudioKey::getSamples(float* left, float* right, int64 startPos, int64 sampl
 
 		for (int64 noteIndex = startIndex; noteIndex < nextEndIndex; ++noteIndex)
 		{
-			render(left, right, startPos, sampleCount, noteIndex);
+			render(left, right, startPos, sampleCount, noteIndex, automation);
 		}
 	}
 
-	if (!releaseKeys.empty())
+	if (const auto& releases = releaseKeys(); !releases.empty())
 	{
-		auto maxReleaseTimeIt = std::max_element(releaseKeys.begin(), releaseKeys.end(),
-			[](const AudioSource& a, const AudioSource& b) { return a.envelope().releaseTime() < b.envelope().releaseTime(); });
+		auto maxReleaseTimeIt = std::max_element(releases.begin(), releases.end(),
+			[&](const KeyRegion& a, const KeyRegion& b) { return source(a).envelope().releaseTime() < source(b).envelope().releaseTime(); });
 
-		const auto maxReleaseCount = static_cast<int64>(maxReleaseTimeIt->envelope().releaseTime() * Wave::DefaultSampleRate);
+		const auto maxReleaseCount = static_cast<int64>(source(*maxReleaseTimeIt).envelope().releaseTime() * Wave::DefaultSampleRate);
 
-		NoteEvent note0(0, 0, 0, 0, 0);
-		note0.pressTimePos = startPos - maxReleaseCount;
-		auto itNextStart = std::upper_bound(m_noteEvents.begin(), m_noteEvents.end(), note0, [](const NoteEvent& a, const NoteEvent& b) { return a.pressTimePos < b.pressTimePos; });
-		const int64 nextStartIndex = std::distance(m_noteEvents.begin(), itNextStart);
+		const int64 nextStartIndex = upperBound(startPos - maxReleaseCount);
 		int64 startIndex = nextStartIndex - 1;
 
-		if (m_noteEvents.empty())
-		{
-			return;
-		}
-
-		NoteEvent note1(0, 0, 0, 0, 0);
-		note1.pressTimePos = startPos + sampleCount;
-		auto itNextEnd = std::upper_bound(m_noteEvents.begin(), m_noteEvents.end(), note1, [](const NoteEvent& a, const NoteEvent& b) { return a.pressTimePos < b.pressTimePos; });
-		const int64 nextEndIndex = std::distance(m_noteEvents.begin(), itNextEnd);
+		const int64 nextEndIndex = upperBound(startPos + sampleCount);
 
 		if (startIndex < 0)
 		{
@@ -457,21 +677,22 @@ void AudioKey::getSamples(float* left, float* right, int64 startPos, int64 sampl
 
 		for (int64 noteIndex = startIndex; noteIndex < nextEndIndex; ++noteIndex)
 		{
-			renderRelease(left, right, startPos, sampleCount, noteIndex);
+			renderRelease(left, right, startPos, sampleCount, noteIndex, automation);
 		}
 	}
 }
 
-void AudioKey::render(float* left, float* right, int64 startPos, int64 sampleCount, int64 noteIndex)
+void AudioKey::render(float* left, float* right, int64 startPos, int64 sampleCount, int64 noteIndex, const BlockAutomation& automation)
 {
-	const auto& targetEvent = m_noteEvents[noteIndex];
+	const auto targetEvent = event(noteIndex);
 
 	if (targetEvent.attackIndex == -1)
 	{
 		return;
 	}
 
-	auto& attackKey = attackKeys[targetEvent.attackIndex];
+	const auto& attackRegion = attackKeys()[targetEvent.attackIndex];
+	const auto& attackKey = source(attackRegion);
 
 	const auto& envelope = attackKey.envelope();
 
@@ -483,6 +704,32 @@ void AudioKey::render(float* left, float* right, int64 startPos, int64 sampleCou
 	const double currentVolume = targetEvent.velocity / 127.0;
 	const int64 prevWriteCount = writeIndexHead - prevWriteIndexHead;
 
+	// ノートのチャンネルの音量・パン・ピッチベンド
+	const auto& channelAutomation = automation.channels[targetEvent.channel & 0x0F];
+	const auto& segments = channelAutomation.segments;
+	const bool isBent = channelAutomation.hasPitchBend;
+	const double warpedPress = isBent ? automation.warpedPosition(targetEvent.channel, targetEvent.pressTimePos) : 0.0;
+	size_t segmentIndex = channelAutomation.segmentIndexAt(writeIndexHead + Max(0ll, -writeIndexHead));
+
+	// ピッチベンドがかかっているときは、ベンドを積分した位置を読む
+	const auto warpedIndex = [&](const AutomationSegment& segment, int64 writeIndex)
+	{
+		return segment.warpedBegin + segment.pitchRatio * static_cast<double>(writeIndex - segment.begin) - warpedPress;
+	};
+
+	const auto readAttack = [&](int64 readIndex, const AutomationSegment& segment, int64 writeIndex)
+	{
+		if (!isBent)
+		{
+			return attackKey.getSample(readIndex, attackRegion);
+		}
+
+		return attackKey.getSample(warpedIndex(segment, writeIndex), attackRegion);
+	};
+
+	// sampleReadCount はベンドしていない長さなので、ベンドで速く読む場合はサンプルの終わりで止める
+	const auto attackLength = static_cast<double>(attackKey.lengthSample(attackRegion));
+
 #ifdef DEVELOPMENT
 	Stopwatch watch(StartImmediately::Yes);
 #endif
@@ -490,25 +737,26 @@ void AudioKey::render(float* left, float* right, int64 startPos, int64 sampleCou
 	if (Max(0ll, -writeIndexHead) < sampleReadCount)
 	{
 		const double startTime = 1.0 * startPos / attackKey.sampleRate();
-		if (startTime < 1.0 * targetEvent.pressTimePos / attackKey.sampleRate() + attackKey.noteDuration(targetEvent))
+		if (startTime < 1.0 * targetEvent.pressTimePos / attackKey.sampleRate() + attackKey.noteDuration(targetEvent, attackRegion))
 		{
-			const auto speed = attackKey.getSpeed();
-			const auto samples = static_cast<size_t>((sampleCount + 10) * speed);
-			const auto sampleBegin = static_cast<size_t>(Max(0ll, -writeIndexHead) * speed);
+			const auto speed = attackRegion.speed;
+			const int64 firstWriteIndex = writeIndexHead + Max(0ll, -writeIndexHead);
+			const double readBegin = isBent ? Max(0.0, channelAutomation.warpedAt(firstWriteIndex) - warpedPress) : static_cast<double>(Max(0ll, -writeIndexHead));
+			const auto samples = static_cast<size_t>((sampleCount + 10) * speed * channelAutomation.maxPitchRatio);
+			const auto sampleBegin = static_cast<size_t>(readBegin * speed);
 			attackKey.use(sampleBegin, samples);
 
 			const auto blendIndex = startPos - targetEvent.pressTimePos;
 			if (1 <= noteIndex && blendIndex < BlendSampleCount)
 			{
-				const auto& prevEvent = m_noteEvents[noteIndex - 1];
-				auto& prevAttackKey = attackKeys[prevEvent.attackIndex];
+				const auto prevEvent = event(noteIndex - 1);
+				const auto& prevAttackRegion = attackKeys()[prevEvent.attackIndex];
+				const auto& prevAttackKey = source(prevAttackRegion);
 
-				if (startTime < 1.0 * prevEvent.pressTimePos / attackKey.sampleRate() + prevAttackKey.noteDuration(prevEvent))
+				if (startTime < 1.0 * prevEvent.pressTimePos / attackKey.sampleRate() + prevAttackKey.noteDuration(prevEvent, prevAttackRegion))
 				{
-					const auto [prevReadCount, prevEmptyCount] = readEmptyCount(startPos, sampleCount, noteIndex - 1);
-
 					{
-						const auto prevSpeed = prevAttackKey.getSpeed();
+						const auto prevSpeed = prevAttackRegion.speed;
 						const auto prevSamples = static_cast<size_t>((BlendSampleCount + 10) * prevSpeed);
 						const auto prevSampleBegin = static_cast<size_t>(Max(0ll, prevWriteCount - writeIndexHead) * prevSpeed);
 						prevAttackKey.use(prevSampleBegin, prevSamples);
@@ -529,11 +777,22 @@ void AudioKey::render(float* left, float* right, int64 startPos, int64 sampleCou
 		const int64 writeIndex = writeIndexHead + i;
 		const double time = 1.0 * (startPos + writeIndex) / attackKey.sampleRate();
 
+		while (segmentIndex + 1 < segments.size() && segments[segmentIndex + 1].begin <= writeIndex)
+		{
+			++segmentIndex;
+		}
+		const auto& segment = segments[segmentIndex];
+
+		if (isBent && attackLength <= warpedIndex(segment, writeIndex))
+		{
+			break;
+		}
+
 		double disableCoeff = 1.0;
-		if (targetEvent.disableTimePos)
+		if (targetEvent.isDisabled())
 		{
 			const auto currentTimePos = startPos + writeIndex;
-			const auto disableTimePos = targetEvent.disableTimePos.value();
+			const int64 disableTimePos = targetEvent.disableTimePos;
 			if (disableTimePos < currentTimePos)
 			{
 				const auto disableTime = 1.0 * (currentTimePos - disableTimePos) / attackKey.sampleRate();
@@ -545,7 +804,7 @@ void AudioKey::render(float* left, float* right, int64 startPos, int64 sampleCou
 			? currentVolume * disableCoeff
 			: currentVolume * disableCoeff * envelope.level(targetEvent, time);
 
-		if (1.0 * targetEvent.pressTimePos / attackKey.sampleRate() + attackKey.noteDuration(targetEvent) < time)
+		if (1.0 * targetEvent.pressTimePos / attackKey.sampleRate() + attackKey.noteDuration(targetEvent, attackRegion) < time)
 		{
 			break;
 		}
@@ -555,24 +814,23 @@ void AudioKey::render(float* left, float* right, int64 startPos, int64 sampleCou
 		const auto blendIndex = (startPos + writeIndex) - targetEvent.pressTimePos;
 		if (1 <= noteIndex && blendIndex < BlendSampleCount)
 		{
-			const auto& prevEvent = m_noteEvents[noteIndex - 1];
-			auto& prevAttackKey = attackKeys[prevEvent.attackIndex];
+			const auto prevEvent = event(noteIndex - 1);
+			const auto& prevAttackRegion = attackKeys()[prevEvent.attackIndex];
+			const auto& prevAttackKey = source(prevAttackRegion);
 
-			if (time < 1.0 * prevEvent.pressTimePos / attackKey.sampleRate() + prevAttackKey.noteDuration(prevEvent))
+			if (time < 1.0 * prevEvent.pressTimePos / attackKey.sampleRate() + prevAttackKey.noteDuration(prevEvent, prevAttackRegion))
 			{
-				const auto [prevReadCount, prevEmptyCount] = readEmptyCount(startPos, sampleCount, noteIndex - 1);
-
 				const double prevVolume = prevEvent.velocity / 127.0;
 				const double prevLevel = envelope.level(prevEvent, time) * prevVolume;
 				const int64 prevReadIndex = prevWriteCount + i;
-				if (prevReadIndex < static_cast<int64>(prevAttackKey.lengthSample()))
+				if (prevReadIndex < static_cast<int64>(prevAttackKey.lengthSample(prevAttackRegion)))
 				{
-					const auto sample0 = prevAttackKey.getSample(prevReadIndex) * static_cast<float>(prevLevel);
-					const auto sample1 = attackKey.getSample(readIndex) * static_cast<float>(currentLevel);
+					const auto sample0 = prevAttackKey.getSample(prevReadIndex, prevAttackRegion) * static_cast<float>(prevLevel);
+					const auto sample1 = readAttack(readIndex, segment, writeIndex) * static_cast<float>(currentLevel);
 					const double t = 1.0 * blendIndex / BlendSampleCount;
 					const auto blendSample = sample0.lerp(sample1, t);
-					left[writeIndex] += blendSample.left;
-					right[writeIndex] += blendSample.right;
+					left[writeIndex] += blendSample.left * segment.gainLeft;
+					right[writeIndex] += blendSample.right * segment.gainRight;
 					isBlendSample = true;
 				}
 			}
@@ -580,9 +838,9 @@ void AudioKey::render(float* left, float* right, int64 startPos, int64 sampleCou
 
 		if (!isBlendSample)
 		{
-			const auto sample1 = attackKey.getSample(readIndex) * static_cast<float>(currentLevel);
-			left[writeIndex] += sample1.left;
-			right[writeIndex] += sample1.right;
+			const auto sample1 = readAttack(readIndex, segment, writeIndex) * static_cast<float>(currentLevel);
+			left[writeIndex] += sample1.left * segment.gainLeft;
+			right[writeIndex] += sample1.right * segment.gainRight;
 		}
 	}
 
@@ -591,9 +849,9 @@ void AudioKey::render(float* left, float* right, int64 startPos, int64 sampleCou
 #endif
 }
 
-void AudioKey::renderRelease(float* left, float* right, int64 startPos, int64 sampleCount, int64 noteIndex)
+void AudioKey::renderRelease(float* left, float* right, int64 startPos, int64 sampleCount, int64 noteIndex, const BlockAutomation& automation)
 {
-	const auto& targetEvent = m_noteEvents[noteIndex];
+	const auto targetEvent = event(noteIndex);
 
 	if (targetEvent.releaseIndex == -1)
 	{
@@ -604,16 +862,28 @@ void AudioKey::renderRelease(float* left, float* right, int64 startPos, int64 sa
 	Stopwatch watch(StartImmediately::Yes);
 #endif
 
-	auto& releaseKey = releaseKeys[targetEvent.releaseIndex];
+	const auto& releaseRegion = releaseKeys()[targetEvent.releaseIndex];
+	const auto& releaseKey = source(releaseRegion);
 
 	const int64 writeIndexHead = getWriteIndexHeadRelease(startPos, noteIndex);
 	const int64 sampleReadCount = readCountRelease(startPos, sampleCount, noteIndex);
 
+	const auto& channelAutomation = automation.channels[targetEvent.channel & 0x0F];
+	const auto& segments = channelAutomation.segments;
+	const bool isBent = channelAutomation.hasPitchBend;
+	const double warpedRelease = isBent ? automation.warpedPosition(targetEvent.channel, targetEvent.releaseTimePos) : 0.0;
+	size_t segmentIndex = channelAutomation.segmentIndexAt(writeIndexHead + Max(0ll, -writeIndexHead));
+
+	// ベンドで速く読む場合はサンプルの終わりで止める
+	const auto releaseLength = static_cast<double>(releaseKey.lengthSample(releaseRegion));
+
 	if (Max(0ll, -writeIndexHead) < sampleReadCount)
 	{
-		const auto speed = releaseKey.getSpeed();
-		const auto samples = static_cast<size_t>((sampleCount + 10) * speed);
-		const auto sampleBegin = static_cast<size_t>(Max(0ll, -writeIndexHead) * speed);
+		const auto speed = releaseRegion.speed;
+		const int64 firstWriteIndex = writeIndexHead + Max(0ll, -writeIndexHead);
+		const double readBegin = isBent ? Max(0.0, channelAutomation.warpedAt(firstWriteIndex) - warpedRelease) : static_cast<double>(Max(0ll, -writeIndexHead));
+		const auto samples = static_cast<size_t>((sampleCount + 10) * speed * channelAutomation.maxPitchRatio);
+		const auto sampleBegin = static_cast<size_t>(readBegin * speed);
 		releaseKey.use(sampleBegin, samples);
 	}
 
@@ -627,9 +897,23 @@ void AudioKey::renderRelease(float* left, float* right, int64 startPos, int64 sa
 		const int64 readIndex = i;
 		const int64 writeIndex = writeIndexHead + i;
 
-		const auto sample1 = releaseKey.getSample(readIndex);
-		left[writeIndex] += sample1.left;
-		right[writeIndex] += sample1.right;
+		while (segmentIndex + 1 < segments.size() && segments[segmentIndex + 1].begin <= writeIndex)
+		{
+			++segmentIndex;
+		}
+		const auto& segment = segments[segmentIndex];
+
+		const double warpedIndex = segment.warpedBegin + segment.pitchRatio * static_cast<double>(writeIndex - segment.begin) - warpedRelease;
+		if (isBent && releaseLength <= warpedIndex)
+		{
+			break;
+		}
+
+		const auto sample1 = isBent
+			? releaseKey.getSample(warpedIndex, releaseRegion)
+			: releaseKey.getSample(readIndex, releaseRegion);
+		left[writeIndex] += sample1.left * segment.gainLeft;
+		right[writeIndex] += sample1.right * segment.gainRight;
 	}
 
 #ifdef DEVELOPMENT
@@ -644,18 +928,18 @@ int64 AudioKey::getWriteIndexHead(int64 startPos, int64 noteIndex) const
 		return 0;
 	}
 
-	const auto& targetEvent = m_noteEvents[noteIndex];
-	return targetEvent.pressTimePos - startPos;
+	return static_cast<int64>(event(noteIndex).pressTimePos) - startPos;
 }
 
 std::pair<int64, int64> AudioKey::readEmptyCount(int64 startPos, int64 sampleCount, int64 noteIndex) const
 {
-	const auto& targetEvent = m_noteEvents[noteIndex];
-	const auto& attackKey = attackKeys[targetEvent.attackIndex];
+	const auto targetEvent = event(noteIndex);
+	const auto& attackRegion = attackKeys()[targetEvent.attackIndex];
+	const auto& attackKey = source(attackRegion);
 	const auto maxGateSamples = noteIndex + 1 < static_cast<int64>(m_noteEvents.size())
-		? m_noteEvents[noteIndex + 1].pressTimePos - m_noteEvents[noteIndex].pressTimePos
-		: static_cast<int64>(attackKey.lengthSample());
-	const auto maxReadCount = Min(static_cast<int64>(attackKey.lengthSample()), maxGateSamples);
+		? static_cast<int64>(event(noteIndex + 1).pressTimePos) - targetEvent.pressTimePos
+		: static_cast<int64>(attackKey.lengthSample(attackRegion));
+	const auto maxReadCount = Min(static_cast<int64>(attackKey.lengthSample(attackRegion)), maxGateSamples);
 	const int64 writeIndexHead = getWriteIndexHead(startPos, noteIndex);
 
 	const auto maxWriteCount = sampleCount - writeIndexHead;
@@ -672,15 +956,13 @@ int64 AudioKey::getWriteIndexHeadRelease(int64 startPos, int64 noteIndex) const
 		return 0;
 	}
 
-	const auto& targetEvent = m_noteEvents[noteIndex];
-	return targetEvent.releaseTimePos - startPos;
+	return static_cast<int64>(event(noteIndex).releaseTimePos) - startPos;
 }
 
 int64 AudioKey::readCountRelease(int64 startPos, int64 sampleCount, int64 noteIndex) const
 {
-	const auto& targetEvent = m_noteEvents[noteIndex];
-	const auto& releaseKey = releaseKeys[targetEvent.releaseIndex];
-	const auto maxReadCount = static_cast<int64>(releaseKey.lengthSample());
+	const auto& releaseRegion = releaseKeys()[m_noteEvents[noteIndex].releaseIndex];
+	const auto maxReadCount = static_cast<int64>(source(releaseRegion).lengthSample(releaseRegion));
 	const int64 writeIndexHead = getWriteIndexHeadRelease(startPos, noteIndex);
 
 	const auto maxWriteCount = sampleCount - writeIndexHead;
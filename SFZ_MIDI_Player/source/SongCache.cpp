@@ -0,0 +1,231 @@
+﻿#pragma once
+#include <SongCache.hpp>
+
+namespace
+{
+	constexpr char Magic[4] = { 'S', 'F', 'Z', 'T' };
+
+	// 書き出す内容やイベントの組み立て方を変えたら上げる
+	constexpr uint32 FormatVersion = 2;
+
+	// キー1つ分の見出し（イベントはファイル先頭からのオフセットに並ぶ）
+	struct KeyRecord
+	{
+		uint32 programRecordIndex;
+		uint32 keyIndex;
+		uint64 count;
+		uint64 offsetOfBytes;
+	};
+
+	static_assert(std::is_trivially_copyable_v<KeyRecord>);
+}
+
+void SongCache::setup(FilePathView directory)
+{
+	m_directory = FileSystem::FullPath(directory);
+	if (!m_directory.ends_with(U'/'))
+	{
+		m_directory += U'/';
+	}
+
+	if (!FileSystem::IsDirectory(m_directory) && !FileSystem::CreateDirectories(m_directory))
+	{
+		Console << U"error: 曲のキャッシュのディレクトリを作成できません \"" << m_directory << U"\"";
+		return;
+	}
+
+	m_isEnabled = true;
+}
+
+Optional<SongCache::MidiKey> SongCache::HashMidiFile(FilePathView midiPath)
+{
+	const auto stamp = GetFileStamp(midiPath);
+	if (!stamp)
+	{
+		return none;
+	}
+
+	MidiKey key;
+	key.pathHash = FNV1a(NormalizePath(midiPath));
+	key.fileHash = FNV1a(std::bit_cast<const uint8*>(&stamp.value()), sizeof(FileStamp), key.pathHash);
+	return key;
+}
+
+FilePath SongCache::cacheFilePath(const MidiKey& midiKey) const
+{
+	return m_directory + U"{:016X}_{:016X}.song"_fmt(midiKey.pathHash, midiKey.fileHash);
+}
+
+void SongCache::removeOutdatedFiles(const MidiKey& midiKey) const
+{
+	// MIDIを書き出し直すたびにファイル名が変わるので、同じパスの前のキャッシュが残り続けないようにする
+	const auto prefix = U"{:016X}_"_fmt(midiKey.pathHash);
+	const auto current = FileSystem::FileName(cacheFilePath(midiKey));
+
+	for (const auto& path : FileSystem::DirectoryContents(m_directory, Recursive::No))
+	{
+		const auto fileName = FileSystem::FileName(path);
+		if (fileName.starts_with(prefix) && fileName.ends_with(U".song") && fileName != current)
+		{
+			FileSystem::Remove(path);
+		}
+	}
+}
+
+Optional<SongCache::Timeline> SongCache::load(const MidiKey& midiKey, uint64 soundSetFingerprint) const
+{
+	if (!m_isEnabled)
+	{
+		return none;
+	}
+
+	const auto cachePath = cacheFilePath(midiKey);
+	if (!FileSystem::IsFile(cachePath))
+	{
+		return none;
+	}
+
+	// イベントは読み込まずにマップしたまま使う
+	Timeline timeline;
+	timeline.segment = std::make_shared<const NoteSpillSegment>(cachePath, false);
+	if (!timeline.segment->isOpen())
+	{
+		return none;
+	}
+
+	const auto& segment = *timeline.segment;
+	CacheReader reader(segment.bytes(), segment.size());
+
+	const auto magic = reader.read<std::array<char, 4>>();
+	if (std::memcmp(magic.data(), Magic, sizeof(Magic)) != 0
+		|| reader.read<uint32>() != FormatVersion
+		|| reader.read<uint32>() != sizeof(NoteEvent)
+		|| reader.read<uint32>() != Wave::DefaultSampleRate
+		|| reader.read<uint64>() != midiKey.fileHash
+		|| reader.read<uint64>() != soundSetFingerprint)
+	{
+		return none;
+	}
+
+	const auto programCount = reader.read<uint32>();
+	for (uint32 i = 0; i < programCount && reader.isValid(); ++i)
+	{
+		ProgramRecord program;
+		program.isDrum = reader.read<uint8>() != 0;
+		program.index = reader.read<uint32>();
+
+		const auto fileCount = reader.read<uint32>();
+		for (uint32 fileIndex = 0; fileIndex < fileCount && reader.isValid(); ++fileIndex)
+		{
+			auto path = reader.readString();
+			const auto stamp = reader.readStamp();
+			if (!reader.isValid() || !IsUpToDate(path, stamp))
+			{
+				return none;
+			}
+
+			program.files.emplace_back(std::move(path), stamp);
+		}
+
+		timeline.programs.push_back(std::move(program));
+	}
+
+	const auto keyCount = reader.read<uint32>();
+	for (uint32 i = 0; i < keyCount && reader.isValid(); ++i)
+	{
+		const auto record = reader.read<KeyRecord>();
+		if (!reader.isValid()
+			|| programCount <= record.programRecordIndex
+			|| record.keyIndex < 127 || 255 <= record.keyIndex
+			|| record.offsetOfBytes % alignof(NoteEvent) != 0
+			|| segment.size() < record.offsetOfBytes
+			|| (segment.size() - record.offsetOfBytes) / sizeof(NoteEvent) < record.count)
+		{
+			return none;
+		}
+
+		timeline.keys.push_back(MappedKeyEvents{ record.programRecordIndex, static_cast<uint8>(record.keyIndex), segment.data(record.offsetOfBytes), record.count });
+	}
+
+	if (!reader.isValid())
+	{
+		return none;
+	}
+
+	return timeline;
+}
+
+void SongCache::save(const MidiKey& midiKey, uint64 soundSetFingerprint, const Array<ProgramRecord>& programs, const Array<KeyEvents>& keys) const
+{
+	if (!m_isEnabled)
+	{
+		return;
+	}
+
+	// 前のキャッシュを読んでいる途中で壊さないように、書き終えてから差し替える
+	const auto cachePath = cacheFilePath(midiKey);
+	const auto tempPath = cachePath + U".tmp";
+
+	{
+		BinaryWriter writer(tempPath);
+		if (!writer)
+		{
+			return;
+		}
+
+		writer.write(Magic, sizeof(Magic));
+		writer.write(FormatVersion);
+		writer.write(static_cast<uint32>(sizeof(NoteEvent)));
+		writer.write(static_cast<uint32>(Wave::DefaultSampleRate));
+		writer.write(midiKey.fileHash);
+		writer.write(soundSetFingerprint);
+
+		writer.write(static_cast<uint32>(programs.size()));
+		for (const auto& program : programs)
+		{
+			writer.write(static_cast<uint8>(program.isDrum));
+			writer.write(program.index);
+
+			writer.write(static_cast<uint32>(program.files.size()));
+			for (const auto& [path, stamp] : program.files)
+			{
+				WriteString(writer, path);
+				WriteStamp(writer, stamp);
+			}
+		}
+
+		// 見出しの後ろからイベントを並べる（マップしたまま読めるように揃えておく）
+		const uint64 tableEnd = writer.getPos() + sizeof(uint32) + keys.size() * sizeof(KeyRecord);
+		const uint64 eventsBegin = (tableEnd + alignof(uint64) - 1) / alignof(uint64) * alignof(uint64);
+
+		uint64 offsetOfBytes = eventsBegin;
+
+		writer.write(static_cast<uint32>(keys.size()));
+		for (const auto& key : keys)
+		{
+			writer.write(KeyRecord{ key.programRecordIndex, key.keyIndex, key.events->size(), offsetOfBytes });
+			offsetOfBytes += key.events->size() * sizeof(NoteEvent);
+		}
+
+		const uint64 padding = 0;
+		writer.write(&padding, eventsBegin - tableEnd);
+
+		for (const auto& key : keys)
+		{
+			key.events->forEachSpan([&](const NoteEvent* events, size_t count)
+				{
+					writer.write(events, count * sizeof(NoteEvent));
+				});
+		}
+	}
+
+	FileSystem::Remove(cachePath);
+	if (!FileSystem::Rename(tempPath, cachePath))
+	{
+		FileSystem::Remove(tempPath);
+		Console << U"warning: 曲のキャッシュを保存できません \"" << cachePath << U"\"";
+		return;
+	}
+
+	removeOutdatedFiles(midiKey);
+}
@@ -0,0 +1,124 @@
+﻿#pragma once
+#include <TaskPool.hpp>
+
+TaskPool::TaskPool()
+{
+	const size_t threadCount = Max(1u, std::thread::hardware_concurrency());
+	for (size_t i = 0; i < threadCount; ++i)
+	{
+		m_workers.emplace_back([this] { workerLoop(); });
+	}
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		std::lock_guard lock(m_mutex);
+		m_isFinish = true;
+	}
+	m_condition.notify_all();
+
+	for (auto& worker : m_workers)
+	{
+		worker.join();
+	}
+}
+
+void TaskPool::parallelFor(size_t count, const std::function<void(size_t)>& func)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	std::atomic<size_t> nextIndex = 0;
+	const auto process = [&]()
+	{
+		for (size_t index = nextIndex++; index < count; index = nextIndex++)
+		{
+			func(index);
+		}
+	};
+
+	const size_t helperCount = Min(count, concurrency()) - 1;
+
+	Array<std::future<void>> helpers;
+	for (size_t i = 0; i < helperCount; ++i)
+	{
+		helpers.push_back(submit(process));
+	}
+
+	// ヘルパーがローカル変数を参照しているため、例外が出ても全員の終了を待ってから投げ直す
+	std::exception_ptr exception;
+	try
+	{
+		process();
+	}
+	catch (...)
+	{
+		exception = std::current_exception();
+		nextIndex = count;
+	}
+
+	for (auto& helper : helpers)
+	{
+		try
+		{
+			wait(helper);
+		}
+		catch (...)
+		{
+			if (!exception)
+			{
+				exception = std::current_exception();
+			}
+		}
+	}
+
+	if (exception)
+	{
+		std::rethrow_exception(exception);
+	}
+}
+
+bool TaskPool::runPendingTask()
+{
+	std::function<void()> task;
+
+	{
+		std::lock_guard lock(m_mutex);
+		if (m_tasks.empty())
+		{
+			return false;
+		}
+
+		task = std::move(m_tasks.front());
+		m_tasks.pop_front();
+	}
+
+	task();
+	return true;
+}
+
+void TaskPool::workerLoop()
+{
+	for (;;)
+	{
+		std::function<void()> task;
+
+		{
+			std::unique_lock lock(m_mutex);
+			m_condition.wait(lock, [this] { return m_isFinish || !m_tasks.empty(); });
+
+			if (m_isFinish && m_tasks.empty())
+			{
+				return;
+			}
+
+			task = std::move(m_tasks.front());
+			m_tasks.pop_front();
+		}
+
+		task();
+	}
+}
@@ -1,5 +1,6 @@
 ﻿#pragma once
 #include <WaveLoader.hpp>
+#include <FileHandleCache.hpp>
 
 struct ChunkHead
 {
@@ -13,19 +14,105 @@ struct RiffChunk
 	char format[4];
 };
 
-WaveLoader::WaveLoader(FilePathView path, size_t debugId) :
-	m_waveReader(path),
-	m_filePath(path),
+const int64 WaveLoader::CanonicalDataOffset = 4096;
+
+void WaveLoader::WriteCanonicalHeader(BinaryWriter& writer, uint32 sampleRate, uint64 lengthSample)
+{
+	const uint32 dataSize = static_cast<uint32>(lengthSample * sizeof(Sample16bit2ch));
+
+	const WaveFileFormat format = {
+		.audioFormat = 1,
+		.channels = 2,
+		.samplePerSecond = sampleRate,
+		.bytesPerSecond = sampleRate * static_cast<uint32>(sizeof(Sample16bit2ch)),
+		.blockAlign = static_cast<uint16>(sizeof(Sample16bit2ch)),
+		.bitsPerSample = 16,
+	};
+
+	const int64 headerSize = sizeof(RiffChunk) + sizeof(ChunkHead) + sizeof(WaveFileFormat) + sizeof(ChunkHead) + sizeof(ChunkHead);
+	const auto junkSize = static_cast<uint32>(CanonicalDataOffset - headerSize);
+
+	RiffChunk riffChunk = { { { 'R', 'I', 'F', 'F' }, static_cast<uint32>(CanonicalDataOffset - sizeof(ChunkHead) + dataSize) }, { 'W', 'A', 'V', 'E' } };
+	writer.write(riffChunk);
+
+	const ChunkHead fmtChunk = { { 'f', 'm', 't', ' ' }, static_cast<uint32>(sizeof(WaveFileFormat)) };
+	writer.write(fmtChunk);
+	writer.write(format);
+
+	const ChunkHead junkChunk = { { 'J', 'U', 'N', 'K' }, junkSize };
+	writer.write(junkChunk);
+	const Array<uint8> padding(junkSize, 0);
+	writer.write(padding.data(), padding.size());
+
+	const ChunkHead dataChunk = { { 'd', 'a', 't', 'a' }, dataSize };
+	writer.write(dataChunk);
+
+	assert(writer.getPos() == CanonicalDataOffset);
+}
+
+WaveLoader::WaveLoader(FilePathView path, size_t debugId, const Optional<SampleInfo>& preset) :
+	m_fileId(FileHandleCache::i().registerFile(path)),
 	m_readBlocks(debugId, MemoryPool::ReadFile)
 {
-	init();
-	m_waveReader.close();
+	if (preset)
+	{
+		applyInfo(preset.value());
+		std::call_once(m_initFlag, [] {});
+	}
+}
+
+SampleInfo WaveLoader::sampleInfo() const
+{
+	ensureInit();
+
+	SampleInfo info;
+	info.container = SampleContainer::Wave;
+	info.channels = m_format.channels;
+	info.bitsPerSample = m_format.bitsPerSample;
+	info.sampleRate = static_cast<uint32>(m_sampleRate);
+	info.lengthSample = m_lengthSample;
+	info.dataSizeOfBytes = m_dataSizeOfBytes;
+	info.dataOffset = m_dataBeginPos;
+	return info;
+}
+
+void WaveLoader::applyInfo(const SampleInfo& info)
+{
+	m_format.audioFormat = 1;
+	m_format.channels = info.channels;
+	m_format.bitsPerSample = info.bitsPerSample;
+	m_format.samplePerSecond = info.sampleRate;
+	m_format.blockAlign = static_cast<uint16>(info.channels * info.bitsPerSample / 8);
+	m_format.bytesPerSecond = info.sampleRate * m_format.blockAlign;
+	m_readFormat = true;
+
+	m_dataBeginPos = info.dataOffset;
+	m_dataSizeOfBytes = static_cast<size_t>(info.dataSizeOfBytes);
+	m_lengthSample = static_cast<size_t>(info.lengthSample);
+	m_sampleRate = info.sampleRate;
+	m_sampleRateInv = 1.f / m_sampleRate;
+	m_normalize = 1.f / 32767.0f;
+}
+
+void WaveLoader::ensureInit() const
+{
+	// ヘッダの値はどのスレッドから最初に触られても一度だけ読み込む
+	std::call_once(m_initFlag, [this] { const_cast<WaveLoader*>(this)->init(); });
 }
 
 void WaveLoader::init()
 {
-	RiffChunk riffChunk;
-	m_waveReader.read(riffChunk);
+	auto& files = FileHandleCache::i();
+	const auto fileSize = files.fileSize(m_fileId);
+
+	int64 readPos = 0;
+	const auto read = [&](auto& value)
+	{
+		readPos += files.read(m_fileId, readPos, &value, sizeof(value));
+	};
+
+	RiffChunk riffChunk = {};
+	read(riffChunk);
 
 	if (strncmp(riffChunk.head.id, "RIFF", 4) != 0)
 	{
@@ -39,14 +126,14 @@ void WaveLoader::init()
 		return;
 	}
 
-	while (m_waveReader.getPos() < m_waveReader.size())
+	while (readPos < fileSize)
 	{
-		ChunkHead chunk;
-		m_waveReader.read(chunk);
+		ChunkHead chunk = {};
+		read(chunk);
 
 		if (strncmp(chunk.id, "fmt ", 4) == 0)
 		{
-			m_waveReader.read(m_format);
+			read(m_format);
 
 			if (m_format.channels != 1 && m_format.channels != 2)
 			{
@@ -67,12 +154,12 @@ void WaveLoader::init()
 			}
 			else if (chunk.size < sizeof(WaveFileFormat))
 			{
-				m_waveReader.skip(chunk.size - sizeof(WaveFileFormat));
+				readPos += chunk.size - sizeof(WaveFileFormat);
 			}
 		}
 		else if (strncmp(chunk.id, "data", 4) == 0)
 		{
-			m_dataBeginPos = m_waveReader.getPos();
+			m_dataBeginPos = readPos;
 			m_dataSizeOfBytes = chunk.size;
 
 			if (m_readFormat)
@@ -81,12 +168,12 @@ void WaveLoader::init()
 			}
 			else
 			{
-				m_waveReader.skip(chunk.size);
+				readPos += chunk.size;
 			}
 		}
 		else
 		{
-			m_waveReader.skip(chunk.size);
+			readPos += chunk.size;
 		}
 	}
 
@@ -98,10 +185,7 @@ void WaveLoader::init()
 
 void WaveLoader::use(size_t beginSampleIndex, size_t sampleCount)
 {
-	if (!m_waveReader.isOpen())
-	{
-		m_waveReader.open(m_filePath);
-	}
+	ensureInit();
 
 	readBlock(beginSampleIndex, sampleCount);
 }
@@ -212,13 +296,8 @@ void WaveLoader::readBlock(size_t beginSample, size_t sampleCount)
 
 					auto ptr = m_readBlocks.getBlock(blockIndex);
 
-					if (m_waveReader.getPos() != m_dataBeginPos + currentReadPos)
-					{
-						m_waveReader.setPos(m_dataBeginPos + currentReadPos);
-					}
-
 					const auto readBytes = Min(MemoryPool::UnitBlockSizeOfBytes, m_dataSizeOfBytes - currentReadPos);
-					m_waveReader.read(ptr, readBytes);
+					FileHandleCache::i().read(m_fileId, m_dataBeginPos + currentReadPos, ptr, readBytes);
 				}
 			}
 		}